@@ -0,0 +1,53 @@
+#
+# Writes incompressible data with --compress, which is stored as-is behind its
+# header, and checks that it reads back whole with the same size. Data that
+# does not fit in the index along with its header must be refused up front.
+#
+# Run with -DTPMTOOL=<path to tpmtool> -DWORK_DIR=<scratch directory>.
+#
+
+set(TPM_STATE "${WORK_DIR}/compress.bin")
+set(TPM_TRANSPORT "emulator:file=${TPM_STATE},nvbuffer=256")
+set(ENV{TPMTOOL_CACHE} "${WORK_DIR}/compress.cache")
+file(REMOVE "${TPM_STATE}" "${WORK_DIR}/compress.cache")
+
+function(run_tpmtool EXPECTED)
+    execute_process(COMMAND "${TPMTOOL}" --quiet --transport "${TPM_TRANSPORT}" ${ARGN}
+                    RESULT_VARIABLE result
+                    ERROR_VARIABLE output
+                    OUTPUT_QUIET)
+    if((EXPECTED STREQUAL "SUCCESS" AND NOT result EQUAL 0) OR
+       (EXPECTED STREQUAL "FAILURE" AND result EQUAL 0))
+        message(FATAL_ERROR "tpmtool ${ARGN} returned ${result}:\n${output}")
+    endif()
+    set(TPMTOOL_OUTPUT "${output}" PARENT_SCOPE)
+endfunction()
+
+#
+# Letters drawn at random don't repeat enough for the codec to make use of
+#
+string(RANDOM LENGTH 500 RANDOM_SEED 1 input)
+file(WRITE "${WORK_DIR}/compress.in" "${input}")
+
+#
+# An index with exactly enough room for the header and the data
+#
+run_tpmtool(SUCCESS 0x1500200 -c RW NA 0 508)
+run_tpmtool(SUCCESS --compress -i "${WORK_DIR}/compress.in" 0x1500200 -w 0 500)
+if(NOT TPMTOOL_OUTPUT MATCHES "Stored 0x01f4 bytes in 0x01fc bytes")
+    message(FATAL_ERROR "Data was not stored as-is:\n${TPMTOOL_OUTPUT}")
+endif()
+run_tpmtool(SUCCESS --compress -o "${WORK_DIR}/compress.out" 0x1500200 -r 0 500)
+file(READ "${WORK_DIR}/compress.out" output)
+if(NOT output STREQUAL input)
+    message(FATAL_ERROR "Data read back does not match what was written")
+endif()
+
+#
+# An index the size of the data alone can't hold it
+#
+run_tpmtool(SUCCESS 0x1500201 -c RW NA 0 500)
+run_tpmtool(FAILURE --compress -i "${WORK_DIR}/compress.in" 0x1500201 -w 0 500)
+if(NOT TPMTOOL_OUTPUT MATCHES "does not fit .*needs 0x01fc bytes")
+    message(FATAL_ERROR "Data that does not fit was not refused:\n${TPMTOOL_OUTPUT}")
+endif()
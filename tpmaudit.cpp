@@ -0,0 +1,643 @@
+/*++
+
+Copyright (c) Alex Ionescu.  All rights reserved.
+
+Module Name:
+
+    tpmaudit.cpp
+
+Abstract:
+
+    This module implements audit logs, which append events to a local file and
+    chain them into an extend NV index. Events are hashed in software as they
+    are logged, and each batch of them is extended into the index with a single
+    NV_Extend, so that thousands of events cost one TPM command. The file keeps
+    every event, which allows the chain to be recomputed and compared with the
+    index to prove that none of them were changed or removed.
+
+Author:
+
+    Alex Ionescu (@aionescu) 16-Oct-2026 - Initial version
+
+Environment:
+
+    Portable to any environment.
+
+--*/
+
+#ifdef _MSC_VER
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include "tpmtool.hpp"
+#include "tpmcmd.hpp"
+
+//
+// Audit logs start with this header, which binds them to their index,
+// followed by the records. All fields are little-endian.
+//
+#define TPM_AUDIT_MAGIC             0x54445541
+#define TPM_AUDIT_VERSION           1
+#define TPM_AUDIT_BUFFER_SIZE       (64 * 1024)
+
+#pragma pack(push, 1)
+typedef struct _TPM_AUDIT_FILE_HEADER
+{
+    uint32_t Magic;
+    uint32_t Version;
+    uint32_t Index;
+} TPM_AUDIT_FILE_HEADER, *PTPM_AUDIT_FILE_HEADER;
+
+//
+// Event records are followed by Size bytes of event data. Batch records close
+// the last Size events, and are followed by the digest of their records which
+// was extended into the index.
+//
+typedef enum _TPM_AUDIT_RECORD_TYPE : uint32_t
+{
+    TpmAuditEvent = 1,
+    TpmAuditBatch = 2
+} TPM_AUDIT_RECORD_TYPE;
+
+typedef struct _TPM_AUDIT_RECORD
+{
+    TPM_AUDIT_RECORD_TYPE Type;
+    uint32_t Size;
+} TPM_AUDIT_RECORD, *PTPM_AUDIT_RECORD;
+#pragma pack(pop)
+
+//
+// State of the chain, which is the value that the index should have once all
+// of the batches were extended into it, along with the digest of the events
+// that are still pending.
+//
+typedef struct _TPM_AUDIT_STATE
+{
+    uint8_t Chain[TPM_SHA256_DIGEST_SIZE];
+    TPM_SHA256_CONTEXT Batch;
+    TPM_AUDIT_STATISTICS Statistics;
+} TPM_AUDIT_STATE, *PTPM_AUDIT_STATE;
+
+//
+// Audit Log Context, followed by the authorization data of the index
+//
+typedef struct _TPM_AUDIT_CONTEXT
+{
+    uintptr_t TpmHandle;
+    TPM_NV_INDEX Index;
+    uint16_t AuthorizationSize;
+    uint8_t* AuthorizationData;
+    FILE* Log;
+    uint32_t WindowEvents;
+    uint32_t WindowMilliseconds;
+    uint64_t WindowStart;
+    TPM_AUDIT_STATE State;
+} TPM_AUDIT_CONTEXT, *PTPM_AUDIT_CONTEXT;
+
+uint64_t
+TpmpAuditTime (
+    void
+    )
+{
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+void
+TpmpAuditSeal (
+    PTPM_AUDIT_STATE State,
+    const uint8_t* Digest
+    )
+{
+    TPM_SHA256_CONTEXT hashContext;
+
+    //
+    // Extend the batch into the chain, the same way that the TPM does it
+    //
+    TpmSha256Init(&hashContext);
+    TpmSha256Update(&hashContext, State->Chain, sizeof(State->Chain));
+    TpmSha256Update(&hashContext, Digest, TPM_SHA256_DIGEST_SIZE);
+    TpmSha256Final(&hashContext, State->Chain);
+
+    //
+    // And start the next batch
+    //
+    TpmSha256Init(&State->Batch);
+    State->Statistics.BatchCount++;
+    State->Statistics.PendingCount = 0;
+}
+
+void
+TpmpAuditPendingDigest (
+    const TPM_AUDIT_STATE* State,
+    uint8_t* Digest
+    )
+{
+    TPM_SHA256_CONTEXT hashContext;
+
+    //
+    // Finish a copy of the batch, so that more events can still be added to it
+    //
+    hashContext = State->Batch;
+    TpmSha256Final(&hashContext, Digest);
+}
+
+TPM_RC
+TpmpAuditScan (
+    FILE* Log,
+    uint32_t Index,
+    PTPM_AUDIT_STATE State
+    )
+{
+    TPM_AUDIT_FILE_HEADER header;
+    TPM_AUDIT_RECORD record;
+    uint8_t buffer[4096];
+    uint8_t digest[TPM_SHA256_DIGEST_SIZE];
+    uint8_t expected[TPM_SHA256_DIGEST_SIZE];
+    uint32_t remaining;
+    uint32_t chunkSize;
+    size_t readSize;
+
+    //
+    // Check that the log belongs to this index
+    //
+    if ((fseek(Log, 0, SEEK_SET) != 0) ||
+        (fread(&header, sizeof(header), 1, Log) != 1) ||
+        (header.Magic != TPM_AUDIT_MAGIC) ||
+        (header.Version != TPM_AUDIT_VERSION) ||
+        (header.Index != Index))
+    {
+        return TPM_RC_INTEGRITY;
+    }
+
+    //
+    // Replay every record, hashing events into their batch and each batch
+    // into the chain. Records that were cut short, or batches whose digest
+    // does not match their events, mean the log was damaged or modified.
+    //
+    for (;;)
+    {
+        readSize = fread(&record, 1, sizeof(record), Log);
+        if (readSize == 0)
+        {
+            break;
+        }
+        if (readSize != sizeof(record))
+        {
+            return TPM_RC_INTEGRITY;
+        }
+
+        if (record.Type == TpmAuditEvent)
+        {
+            TpmSha256Update(&State->Batch,
+                            reinterpret_cast<uint8_t*>(&record),
+                            sizeof(record));
+            for (remaining = record.Size; remaining != 0; remaining -= chunkSize)
+            {
+                chunkSize = (remaining < sizeof(buffer)) ?
+                            remaining : static_cast<uint32_t>(sizeof(buffer));
+                if (fread(buffer, 1, chunkSize, Log) != chunkSize)
+                {
+                    return TPM_RC_INTEGRITY;
+                }
+                TpmSha256Update(&State->Batch, buffer, chunkSize);
+            }
+            State->Statistics.EventCount++;
+            State->Statistics.PendingCount++;
+        }
+        else if (record.Type == TpmAuditBatch)
+        {
+            if ((record.Size != State->Statistics.PendingCount) ||
+                (fread(digest, sizeof(digest), 1, Log) != 1))
+            {
+                return TPM_RC_INTEGRITY;
+            }
+            TpmpAuditPendingDigest(State, expected);
+            if (memcmp(digest, expected, sizeof(digest)) != 0)
+            {
+                return TPM_RC_INTEGRITY;
+            }
+            TpmpAuditSeal(State, digest);
+        }
+        else
+        {
+            return TPM_RC_INTEGRITY;
+        }
+    }
+
+    //
+    // The log ends cleanly unless it could not be read
+    //
+    return ferror(Log) ? TPM_RC_FAILURE : TPM_RC_SUCCESS;
+}
+
+TPM_RC
+TpmpAuditReconcile (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX HandleIndex,
+    uint16_t AuthorizationSize,
+    uint8_t* AuthorizationData,
+    const TPM_AUDIT_STATE* State,
+    bool* Unrecorded,
+    uint8_t* Digest
+    )
+{
+    TPM_AUDIT_STATE pendingState;
+    uint8_t value[TPM_SHA256_DIGEST_SIZE];
+    TPM_RC tpmResult;
+
+    //
+    // Read the index, which holds zeroes until the first batch is extended
+    //
+    *Unrecorded = false;
+    tpmResult = TpmNvRead2(TpmHandle,
+                           HandleIndex,
+                           AuthorizationSize,
+                           AuthorizationData,
+                           0,
+                           sizeof(value),
+                           value);
+    if (tpmResult == TPM_RC_NV_UNINITIALIZED)
+    {
+        memset(value, 0, sizeof(value));
+    }
+    else if (tpmResult != TPM_RC_SUCCESS)
+    {
+        return tpmResult;
+    }
+
+    //
+    // The index should match the chain of the log
+    //
+    if (memcmp(value, State->Chain, sizeof(value)) == 0)
+    {
+        return TPM_RC_SUCCESS;
+    }
+
+    //
+    // Unless the pending events were extended into the index, but the batch
+    // record that follows the extend never made it to the log.
+    //
+    if (State->Statistics.PendingCount != 0)
+    {
+        pendingState = *State;
+        TpmpAuditPendingDigest(&pendingState, Digest);
+        TpmpAuditSeal(&pendingState, Digest);
+        if (memcmp(value, pendingState.Chain, sizeof(value)) == 0)
+        {
+            *Unrecorded = true;
+            return TPM_RC_SUCCESS;
+        }
+    }
+    return TPM_RC_INTEGRITY;
+}
+
+TPM_RC
+TpmpAuditRecordBatch (
+    PTPM_AUDIT_CONTEXT Context,
+    const uint8_t* Digest
+    )
+{
+    TPM_AUDIT_RECORD record;
+    bool result;
+
+    //
+    // Write the batch record after its events, and update the chain to match
+    // the index even if the record could not be written, as the next open
+    // recovers it.
+    //
+    record.Type = TpmAuditBatch;
+    record.Size = Context->State.Statistics.PendingCount;
+    result = (fwrite(&record, sizeof(record), 1, Context->Log) == 1) &&
+             (fwrite(Digest, TPM_SHA256_DIGEST_SIZE, 1, Context->Log) == 1) &&
+             (fflush(Context->Log) == 0);
+    TpmpAuditSeal(&Context->State, Digest);
+    return result ? TPM_RC_SUCCESS : TPM_RC_FAILURE;
+}
+
+TPM_RC
+TpmAuditOpen (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX HandleIndex,
+    uint16_t AuthorizationSize,
+    uint8_t* AuthorizationData,
+    const char* Path,
+    uint32_t WindowEvents,
+    uint32_t WindowMilliseconds,
+    uintptr_t* AuditHandle
+    )
+{
+    PTPM_AUDIT_CONTEXT context;
+    TPM_AUDIT_FILE_HEADER header;
+    uint8_t digest[TPM_SHA256_DIGEST_SIZE];
+    bool unrecorded;
+    TPM_RC tpmResult;
+
+    //
+    // Initialize for failure
+    //
+    *AuditHandle = 0;
+    tpmResult = TPM_RC_FAILURE;
+
+    //
+    // Allocate the context, with room for a copy of the authorization data
+    //
+    context = static_cast<PTPM_AUDIT_CONTEXT>(malloc(sizeof(*context) +
+                                                     AuthorizationSize));
+    if (context == nullptr)
+    {
+        return TPM_RC_FAILURE;
+    }
+    memset(context, 0, sizeof(*context));
+    context->TpmHandle = TpmHandle;
+    context->Index = HandleIndex;
+    context->AuthorizationSize = AuthorizationSize;
+    context->AuthorizationData = reinterpret_cast<uint8_t*>(context + 1);
+    if (AuthorizationSize != 0)
+    {
+        memcpy(context->AuthorizationData, AuthorizationData, AuthorizationSize);
+    }
+    context->WindowEvents = (WindowEvents != 0) ? WindowEvents : 1;
+    context->WindowMilliseconds = WindowMilliseconds;
+    TpmSha256Init(&context->State.Batch);
+
+    //
+    // Open the log for appending, with a large buffer so that logging does not
+    // add a system call to every event.
+    //
+    context->Log = fopen(Path, "a+b");
+    if (context->Log == nullptr)
+    {
+        goto Exit;
+    }
+    setvbuf(context->Log, nullptr, _IOFBF, TPM_AUDIT_BUFFER_SIZE);
+
+    //
+    // Start new logs with their header, and replay existing ones to find the
+    // chain and the events which were not extended into the index yet.
+    //
+    if ((fseek(context->Log, 0, SEEK_END) != 0) || (ftell(context->Log) < 0))
+    {
+        goto Exit;
+    }
+    if (ftell(context->Log) == 0)
+    {
+        header.Magic = TPM_AUDIT_MAGIC;
+        header.Version = TPM_AUDIT_VERSION;
+        header.Index = HandleIndex.Value;
+        if ((fwrite(&header, sizeof(header), 1, context->Log) != 1) ||
+            (fflush(context->Log) != 0))
+        {
+            goto Exit;
+        }
+    }
+    else
+    {
+        tpmResult = TpmpAuditScan(context->Log, HandleIndex.Value, &context->State);
+        if (tpmResult != TPM_RC_SUCCESS)
+        {
+            goto Exit;
+        }
+    }
+
+    //
+    // Only append to a log which matches its index, and write the batch record
+    // that a previous run may have lost after extending it.
+    //
+    tpmResult = TpmpAuditReconcile(TpmHandle,
+                                   HandleIndex,
+                                   AuthorizationSize,
+                                   AuthorizationData,
+                                   &context->State,
+                                   &unrecorded,
+                                   digest);
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        goto Exit;
+    }
+    if (fseek(context->Log, 0, SEEK_END) != 0)
+    {
+        tpmResult = TPM_RC_FAILURE;
+        goto Exit;
+    }
+    if (unrecorded)
+    {
+        tpmResult = TpmpAuditRecordBatch(context, digest);
+        if (tpmResult != TPM_RC_SUCCESS)
+        {
+            goto Exit;
+        }
+    }
+
+    //
+    // Pending events were logged before we opened, so start their window now
+    //
+    context->WindowStart = TpmpAuditTime();
+    *AuditHandle = reinterpret_cast<uintptr_t>(context);
+    context = nullptr;
+    tpmResult = TPM_RC_SUCCESS;
+
+Exit:
+    if (context != nullptr)
+    {
+        if (context->Log != nullptr)
+        {
+            fclose(context->Log);
+        }
+        free(context);
+    }
+    return tpmResult;
+}
+
+TPM_RC
+TpmAuditAppend (
+    uintptr_t AuditHandle,
+    const uint8_t* Event,
+    uint32_t EventSize
+    )
+{
+    PTPM_AUDIT_CONTEXT context;
+    TPM_AUDIT_RECORD record;
+
+    context = reinterpret_cast<PTPM_AUDIT_CONTEXT>(AuditHandle);
+
+    //
+    // The first event of a batch opens its window
+    //
+    if (context->State.Statistics.PendingCount == 0)
+    {
+        context->WindowStart = TpmpAuditTime();
+    }
+
+    //
+    // Write the event to the log, and hash the exact bytes that were written
+    // into the batch.
+    //
+    record.Type = TpmAuditEvent;
+    record.Size = EventSize;
+    if ((fwrite(&record, sizeof(record), 1, context->Log) != 1) ||
+        (fwrite(Event, 1, EventSize, context->Log) != EventSize))
+    {
+        return TPM_RC_FAILURE;
+    }
+    TpmSha256Update(&context->State.Batch,
+                    reinterpret_cast<uint8_t*>(&record),
+                    sizeof(record));
+    TpmSha256Update(&context->State.Batch, Event, EventSize);
+    context->State.Statistics.EventCount++;
+    context->State.Statistics.PendingCount++;
+
+    //
+    // Extend the batch once its window is full or has been open long enough.
+    // Windows only close as events come in, so idle logs are left pending
+    // until the next event, flush or close.
+    //
+    if ((context->State.Statistics.PendingCount >= context->WindowEvents) ||
+        ((context->WindowMilliseconds != 0) &&
+         ((TpmpAuditTime() - context->WindowStart) >= context->WindowMilliseconds)))
+    {
+        return TpmAuditFlush(AuditHandle);
+    }
+    return TPM_RC_SUCCESS;
+}
+
+TPM_RC
+TpmAuditFlush (
+    uintptr_t AuditHandle
+    )
+{
+    PTPM_AUDIT_CONTEXT context;
+    uint8_t digest[TPM_SHA256_DIGEST_SIZE];
+    TPM_RC tpmResult;
+
+    //
+    // Nothing to do if all the events are already in the index
+    //
+    context = reinterpret_cast<PTPM_AUDIT_CONTEXT>(AuditHandle);
+    if (context->State.Statistics.PendingCount == 0)
+    {
+        return TPM_RC_SUCCESS;
+    }
+
+    //
+    // The events must be in the log before their batch is extended, otherwise
+    // the index could end up with a batch that can never be verified.
+    //
+    if (fflush(context->Log) != 0)
+    {
+        return TPM_RC_FAILURE;
+    }
+
+    //
+    // Extend the digest of the batch into the index. On failure, the batch is
+    // left pending and will be extended along with the next events.
+    //
+    TpmpAuditPendingDigest(&context->State, digest);
+    tpmResult = TpmNvExtend2(context->TpmHandle,
+                             context->Index,
+                             context->AuthorizationSize,
+                             context->AuthorizationData,
+                             sizeof(digest),
+                             digest);
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        return tpmResult;
+    }
+
+    //
+    // Close the batch in the log
+    //
+    return TpmpAuditRecordBatch(context, digest);
+}
+
+TPM_RC
+TpmAuditClose (
+    uintptr_t AuditHandle,
+    PTPM_AUDIT_STATISTICS Statistics
+    )
+{
+    PTPM_AUDIT_CONTEXT context;
+    TPM_RC tpmResult;
+
+    //
+    // Extend the last batch, even if its window is not over yet
+    //
+    context = reinterpret_cast<PTPM_AUDIT_CONTEXT>(AuditHandle);
+    tpmResult = TpmAuditFlush(AuditHandle);
+
+    //
+    // Return the state of the whole log and free the context
+    //
+    if (Statistics != nullptr)
+    {
+        *Statistics = context->State.Statistics;
+    }
+    if ((fclose(context->Log) != 0) && (tpmResult == TPM_RC_SUCCESS))
+    {
+        tpmResult = TPM_RC_FAILURE;
+    }
+    free(context);
+    return tpmResult;
+}
+
+TPM_RC
+TpmAuditVerify (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX HandleIndex,
+    uint16_t AuthorizationSize,
+    uint8_t* AuthorizationData,
+    const char* Path,
+    PTPM_AUDIT_STATISTICS Statistics
+    )
+{
+    TPM_AUDIT_STATE state;
+    uint8_t digest[TPM_SHA256_DIGEST_SIZE];
+    bool unrecorded;
+    FILE* log;
+    TPM_RC tpmResult;
+
+    //
+    // Replay the log to recompute the chain
+    //
+    memset(&state, 0, sizeof(state));
+    TpmSha256Init(&state.Batch);
+    log = fopen(Path, "rb");
+    if (log == nullptr)
+    {
+        return TPM_RC_FAILURE;
+    }
+    setvbuf(log, nullptr, _IOFBF, TPM_AUDIT_BUFFER_SIZE);
+    tpmResult = TpmpAuditScan(log, HandleIndex.Value, &state);
+    fclose(log);
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        goto Exit;
+    }
+
+    //
+    // And compare it with the index. Events after the last batch were never
+    // extended and can't be verified, unless their batch record was lost.
+    //
+    tpmResult = TpmpAuditReconcile(TpmHandle,
+                                   HandleIndex,
+                                   AuthorizationSize,
+                                   AuthorizationData,
+                                   &state,
+                                   &unrecorded,
+                                   digest);
+    if ((tpmResult == TPM_RC_SUCCESS) && (unrecorded))
+    {
+        TpmpAuditSeal(&state, digest);
+    }
+
+Exit:
+    if (Statistics != nullptr)
+    {
+        *Statistics = state.Statistics;
+    }
+    return tpmResult;
+}
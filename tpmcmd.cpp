@@ -24,132 +24,112 @@ Environment:
 #include "tpmtool.hpp"
 #include "tpmcmd.hpp"
 
-void
-TpmpFillCommandHeader (
-    PTPM_CMD_HEADER CommandHeader,
-    TPM_CC CommandCode,
-    TPM_ST SessionTag,
-    uint32_t Size
-    )
-{
-    //
-    // Fill out the TPM Command Header
-    //
-    CommandHeader->SessionTag = static_cast<TPM_ST>(OsSwap16(SessionTag));
-    CommandHeader->Size = OsSwap32(Size);
-    CommandHeader->CommandCode = static_cast<TPM_CC>(OsSwap32(CommandCode));
-}
-
-void
-TpmpFillAuthSession (
-    TPMS_AUTH_COMMAND_NO_NONCE* AuthSession,
-    uint16_t AuthorizationSize,
-    uint8_t* AuthorizationData,
-    uint8_t** CommandFooter
+TPM_RC
+TpmpIssueSegments (
+    uintptr_t TpmHandle,
+    const TPM_COMMAND_SEGMENT* Segments,
+    uint32_t SegmentCount
     )
 {
-    uint32_t authSessionSize;
-    int32_t i;
+    PTPM_CONTEXT context;
+    bool osResult;
 
     //
-    // Compute the size of the auth session, which contains the password but
-    // not the size of the session itself.
+    // No segments means the command did not fit in the arena
     //
-    authSessionSize = offsetof(TPMS_AUTH_COMMAND_NO_NONCE, Password) +
-                      AuthorizationSize -
-                      sizeof(AuthSession->SessionSize);
+    if (SegmentCount == 0)
+    {
+        return TPM_RC_COMMAND_SIZE;
+    }
 
     //
-    // Build a password authorization session. If there's no password this will
-    // simply use the empty password and authenticate as owner.
+    // Call the OS function with the segments and the arena's response buffer
     //
-    AuthSession->SessionSize = OsSwap32(authSessionSize);
-    AuthSession->SessionHandle.Value = OsSwap32(TPM_RS_PW.Value);
-    AuthSession->NonceSize = OsSwap16(0);
-    AuthSession->SessionAttributes.Value = 0;
-    AuthSession->PasswordSize = OsSwap16(AuthorizationSize);
-    for (i = 0; i < AuthorizationSize; i++)
+    context = reinterpret_cast<PTPM_CONTEXT>(TpmHandle);
+    osResult = TpmOsIssueCommandV(TpmHandle,
+                                  Segments,
+                                  SegmentCount,
+                                  context->ResponseBuffer,
+                                  context->ResponseBufferSize,
+                                  nullptr);
+    if (osResult == false)
     {
-        AuthSession->Password[i] = AuthorizationData[i];
+        return TPM_RC_FAILURE;
     }
 
     //
-    // Return a pointer to the command footer following the session
+    // Return the TPM response code
     //
-    if (CommandFooter != nullptr)
-    {
-        *CommandFooter = &AuthSession->Password[i];
-    }
+    return TpmReadResponseCode(context->ResponseBuffer);
 }
 
 TPM_RC
-TpmUndefineSpace2 (
+TpmpIssueCommand (
     uintptr_t TpmHandle,
-    TPM_NV_INDEX HandleIndex
+    uint32_t CommandSize
     )
 {
-    TPM_NV_UNDEFINE_SPACE_CMD_HEADER* commandHeader;
-    TPM_NV_UNDEFINE_SPACE_REPLY* reply;
-    uint32_t commandSize;
-    uint32_t replySize;
-    bool osResult;
-
-    //
-    // Allocate the command
-    //
-    commandSize = TpmEmptyCmdSize(commandHeader, 0);
-    commandHeader = TpmpAllocateCommand(commandHeader, commandSize);
-
-    //
-    // Fill out the TPM Command Header
-    //
-    TpmpFillCommandHeader(&commandHeader->Header,
-                          TPM_CC_NV_UndefineSpace,
-                          TPM_ST_SESSIONS,
-                          commandSize);
-
-    //
-    // Use our owner handle
-    //
-    commandHeader->AuthHandle.Value = OsSwap32(TPM_RH_OWNER.Value);
+    TPM_COMMAND_SEGMENT segment;
 
     //
-    // Fill in the index being deleted
+    // The whole command was built in the arena's command buffer
     //
-    commandHeader->NvIndex.Value = OsSwap32(HandleIndex.Value);
+    segment.Buffer = reinterpret_cast<PTPM_CONTEXT>(TpmHandle)->CommandBuffer;
+    segment.Length = CommandSize;
+    return TpmpIssueSegments(TpmHandle, &segment, (CommandSize != 0) ? 1 : 0);
+}
 
+TPM_RC
+TpmpNvCompleted (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX HandleIndex,
+    bool Modified,
+    TPM_RC Result
+    )
+{
     //
-    // Fill out an empty authorization session
+    // Our own changes to the index make its cached public area stale, and so
+    // do errors which show that it changed behind our back, such as the index
+    // being locked, not being written, being smaller, or being gone.
     //
-    TpmpFillAuthSession(&commandHeader->AuthSession,
-                        0,
-                        nullptr,
-                        nullptr);
+    if ((Modified != false) ||
+        (Result == TPM_RC_NV_LOCKED) ||
+        (Result == TPM_RC_NV_UNINITIALIZED) ||
+        (Result == TPM_RC_NV_RANGE) ||
+        ((Result & ~TPM_RC_N_MASK) == TPM_RC_HANDLE))
+    {
+        TpmPropForgetNv(reinterpret_cast<PTPM_CONTEXT>(TpmHandle), HandleIndex.Value);
+    }
+    return Result;
+}
 
-    //
-    // Make space for the response
-    //
-    replySize = TpmFixedResponseSize(reply);
-    reply = TpmpAllocateResponse(reply, replySize);
+TPM_RC
+TpmUndefineSpace2 (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX HandleIndex
+    )
+{
+    PTPM_CONTEXT context;
+    uint32_t commandSize;
 
     //
-    // Call the OS function
+    // Build the command, using our owner handle and an empty password, with
+    // the index being deleted.
     //
-    osResult = TpmOsIssueCommand(TpmHandle,
-                                 reinterpret_cast<uint8_t*>(commandHeader),
-                                 commandSize,
-                                 reinterpret_cast<uint8_t*>(reply),
-                                 replySize,
-                                 nullptr);
-    if (osResult == false)
-    {
-        return TPM_RC_FAILURE;
-    }
+    context = reinterpret_cast<PTPM_CONTEXT>(TpmHandle);
+    commandSize = TpmNvUndefineSpaceCommand::Marshal(context->CommandBuffer,
+                                                     context->CommandBufferSize,
+                                                     TpmConstant,
+                                                     HandleIndex.Value,
+                                                     TPM_MARSHAL_BYTES{});
 
     //
     // Return the TPM response code -- no data is returned
     //
-    return TpmReadResponseCode(reply);
+    return TpmpNvCompleted(TpmHandle,
+                           HandleIndex,
+                           true,
+                           TpmpIssueCommand(TpmHandle, commandSize));
 }
 
 TPM_RC
@@ -157,69 +137,17 @@ TpmDefineSpace2 (
     uintptr_t TpmHandle,
     TPM_NV_INDEX HandleIndex,
     uint16_t SpaceSize,
-    uint8_t Attributes,
+    uint16_t Attributes,
     uint8_t OwnerRights,
     uint8_t AuthRights,
     uint16_t AuthorizationSize,
     uint8_t* AuthorizationData
     )
 {
-    TPM_NV_DEFINE_SPACE_CMD_HEADER* commandHeader;
-    TPM_NV_DEFINE_SPACE_CMD_BODY* commandData;
-    TPM_NV_DEFINE_SPACE_CMD_FOOTER* commandFooter;
-    TPM_NV_DEFINE_SPACE_REPLY* reply;
+    PTPM_CONTEXT context;
     uint32_t nvAttributes;
-    uint32_t replySize;
-    bool osResult;
-    int32_t i;
     uint32_t commandSize;
 
-    //
-    // Allocate the command
-    //
-    commandSize = TpmVariableCmdSize(commandHeader, 0, commandData, AuthorizationSize, commandFooter);
-    commandHeader = TpmpAllocateCommand(commandHeader, commandSize);
-
-    //
-    // Fill out the TPM Command Header
-    //
-    TpmpFillCommandHeader(&commandHeader->Header,
-                          TPM_CC_NV_DefineSpace,
-                          TPM_ST_SESSIONS,
-                          commandSize);
-
-    //
-    // Use our owner handle
-    //
-    commandHeader->AuthHandle.Value = OsSwap32(TPM_RH_OWNER.Value);
-
-    //
-    // Fill out an empty authorization session
-    //
-    TpmpFillAuthSession(&commandHeader->AuthSession,
-                        0,
-                        nullptr,
-                        reinterpret_cast<uint8_t**>(&commandData));
-
-    //
-    // Configure the password (if any) as the authorization data
-    //
-    commandData->AuthSize = OsSwap16(AuthorizationSize);
-    for (i = 0; i < AuthorizationSize; i++)
-    {
-        commandData->Data[i] = AuthorizationData[i];
-    }
-
-    //
-    // Finish up with the footer, which contains the NV_PUBLIC data
-    //
-    commandFooter = reinterpret_cast<decltype(commandFooter)>(&commandData->Data[i]);
-    commandFooter->NvPublicSize = OsSwap16(sizeof(*commandFooter) - sizeof(commandFooter->NvPublicSize));
-    commandFooter->NvIndex.Value = OsSwap32(HandleIndex.Value);
-    commandFooter->NameAlg = static_cast<TPMI_ALG_HASH>(OsSwap16(TPM_ALG_SHA256));
-    commandFooter->DataSize = OsSwap16(SpaceSize);
-    commandFooter->AuthPolicySize = 0;
-
     //
     // Write the attributes by converting both the Owner/Auth rights as well as
     // the attributes the tool lets you set. Note that the read-only R/WLOCKED
@@ -249,340 +177,889 @@ TpmDefineSpace2 (
                         TpmToolVolatileDirtyFlag) * TPMA_NV_CLEAR_STCLEAR) |
                      (((Attributes & TpmToolPermanent) ==
                         TpmToolPermanent) * TPMA_NV_POLICY_DELETE));
-    commandFooter->Attributes = static_cast<TPMA_NV>(OsSwap32(nvAttributes));
 
     //
-    // Make space for the response
+    // Then the type of the index, which is ordinary unless asked otherwise
     //
-    replySize = TpmFixedResponseSize(reply);
-    reply = TpmpAllocateResponse(reply, replySize);
+    if (Attributes & TpmToolCounter)
+    {
+        nvAttributes |= TPMA_NV_COUNTER;
+    }
+    else if (Attributes & TpmToolBits)
+    {
+        nvAttributes |= TPMA_NV_BITS;
+    }
+    else if (Attributes & TpmToolExtend)
+    {
+        nvAttributes |= TPMA_NV_EXTEND;
+    }
 
     //
-    // Call the OS function
+    // Build the command, using our owner handle and an empty password, with
+    // the password (if any) as the authorization data of the new index.
     //
-    osResult = TpmOsIssueCommand(TpmHandle,
-                                 reinterpret_cast<uint8_t*>(commandHeader),
-                                 commandSize,
-                                 reinterpret_cast<uint8_t*>(reply),
-                                 replySize,
-                                 nullptr);
-    if (osResult == false)
-    {
-        return TPM_RC_FAILURE;
-    }
+    context = reinterpret_cast<PTPM_CONTEXT>(TpmHandle);
+    commandSize = TpmNvDefineSpaceCommand::Marshal(context->CommandBuffer,
+                                                   context->CommandBufferSize,
+                                                   TpmConstant,
+                                                   TPM_MARSHAL_BYTES{},
+                                                   TPM_MARSHAL_BYTES{ AuthorizationData,
+                                                                      AuthorizationSize },
+                                                   TpmConstant,
+                                                   HandleIndex.Value,
+                                                   TpmConstant,
+                                                   nvAttributes,
+                                                   TpmConstant,
+                                                   SpaceSize);
 
     //
     // Return the TPM response code -- no data is returned
     //
-    return TpmReadResponseCode(reply);
+    return TpmpNvCompleted(TpmHandle,
+                           HandleIndex,
+                           true,
+                           TpmpIssueCommand(TpmHandle, commandSize));
+}
+
+static inline
+uint32_t
+TpmpNvAuthHandle (
+    TPM_NV_INDEX HandleIndex,
+    uint16_t AuthorizationSize
+    )
+{
+    //
+    // Without a password we use the owner pseudo-handle, while for session
+    // authentication we authenticate against the index itself.
+    //
+    return (AuthorizationSize == 0) ? TpmpHandleValue(TPM_RH_OWNER) : HandleIndex.Value;
 }
 
 TPM_RC
-TpmNvRead2 (
+TpmNvReadView (
     uintptr_t TpmHandle,
     TPM_NV_INDEX HandleIndex,
     uint16_t AuthorizationSize,
     uint8_t* AuthorizationData,
     uint16_t Offset,
     uint16_t DataSize,
-    uint8_t* Data
+    const uint8_t** Data
     )
 {
-    TPM_NV_READ_CMD_FOOTER* commandFooter;
-    TPM_NV_READ_CMD_HEADER* command;
-    TPM_NV_READ_REPLY* reply;
+    PTPM_CONTEXT context;
+    TPM_MARSHAL_BYTES data;
     uint32_t commandSize;
-    uint32_t replySize;
-    bool osResult;
     TPM_RC tpmResult;
 
     //
-    // Allocate the command
-    //
-    commandSize = TpmFixedCmdSize(command, AuthorizationSize, commandFooter);
-    command = TpmpAllocateCommand(command, commandSize);
-
-    //
-    // Fill out the TPM Command Header
-    //
-    TpmpFillCommandHeader(&command->Header,
-                          TPM_CC_NV_Read,
-                          TPM_ST_SESSIONS,
-                          commandSize);
-
-    //
-    // Fill in the rest of the command header
+    // Build the command with the authorization session and range to read
     //
-    command->NvIndex.Value = OsSwap32(HandleIndex.Value);
+    context = reinterpret_cast<PTPM_CONTEXT>(TpmHandle);
+    commandSize = TpmNvReadCommand::Marshal(context->CommandBuffer,
+                                            context->CommandBufferSize,
+                                            TpmpNvAuthHandle(HandleIndex, AuthorizationSize),
+                                            HandleIndex.Value,
+                                            TPM_MARSHAL_BYTES{ AuthorizationData,
+                                                               AuthorizationSize },
+                                            DataSize,
+                                            Offset);
 
     //
-    // Check if we're doing owner or session authorization
+    // Send it, keep going only if we got success
     //
-    if (AuthorizationSize == 0)
-    {
-        //
-        // Pass in the owner pseudo-handle
-        //
-        command->AuthHandle.Value = OsSwap32(TPM_RH_OWNER.Value);
-    }
-    else
+    tpmResult = TpmpNvCompleted(TpmHandle,
+                                HandleIndex,
+                                false,
+                                TpmpIssueCommand(TpmHandle, commandSize));
+    if (tpmResult != TPM_RC_SUCCESS)
     {
-        //
-        // For session authentication, we authenticate against the index itself
-        //
-        command->AuthHandle.Value = OsSwap32(HandleIndex.Value);
+        return tpmResult;
     }
 
     //
-    // Fill out the authorization session
-    //
-    TpmpFillAuthSession(&command->AuthSession,
-                        AuthorizationSize,
-                        AuthorizationData,
-                        reinterpret_cast<uint8_t**>(&commandFooter));
-
-    //
-    // Now fill in the command footer
-    //
-    commandFooter->Offset = OsSwap16(Offset);
-    commandFooter->Size = OsSwap16(DataSize);
-
-    //
-    // Make space for the response
+    // Decode the response, which was checked to fit in the response buffer,
+    // and return a pointer to the data inside of it. This remains valid only
+    // until the next command is issued on this handle.
     //
-    replySize = TpmVariableResponseSize(reply, DataSize);
-    reply = TpmpAllocateResponse(reply, replySize);
-
-    //
-    // Call the OS function
-    //
-    osResult = TpmOsIssueCommand(TpmHandle,
-                                 reinterpret_cast<uint8_t*>(command),
-                                 commandSize,
-                                 reinterpret_cast<uint8_t*>(reply),
-                                 replySize,
-                                 nullptr);
-    if (osResult == false)
+    if ((TpmNvReadResponse::Unmarshal(context->ResponseBuffer,
+                                      context->ResponseBufferSize,
+                                      &data) == false) ||
+        (data.Size != DataSize))
     {
         return TPM_RC_FAILURE;
     }
+    *Data = data.Data;
+    return tpmResult;
+}
+
+uint16_t
+TpmpNvChunkSize (
+    PTPM_CONTEXT Context
+    )
+{
+    uint32_t chunkSize;
 
     //
-    // Read the response code, and copy the result back to the caller
+    // Each chunk is limited by the TPM's NV buffer, and must also fit in our
+    // response buffer along with the rest of the response.
     //
-    tpmResult = TpmReadResponseCode(reply);
-    if (tpmResult == TPM_RC_SUCCESS)
+    chunkSize = Context->ResponseBufferSize -
+                TpmNvReadResponse::FixedSize -
+                TpmPasswordSession::FixedSize;
+    if (Context->NvBufferMax < chunkSize)
     {
-        for (int i = 0; i < DataSize; i++)
-        {
-            Data[i] = reply->Data[i];
-        }
+        chunkSize = Context->NvBufferMax;
     }
-    return tpmResult;
+    return static_cast<uint16_t>((chunkSize < UINT16_MAX) ? chunkSize : UINT16_MAX);
 }
 
 TPM_RC
-TpmNvWrite2 (
+TpmpNvReadStream (
     uintptr_t TpmHandle,
     TPM_NV_INDEX HandleIndex,
     uint16_t AuthorizationSize,
     uint8_t* AuthorizationData,
     uint16_t Offset,
     uint16_t DataSize,
-    uint8_t* Data
+    PTPM_NV_READ_CALLBACK Callback,
+    void* CallbackContext
     )
 {
-    TPM_NV_WRITE_CMD_FOOTER* commandFooter;
-    TPM_NV_WRITE_CMD_BODY* commandData;
-    TPM_NV_WRITE_CMD_HEADER* command;
-    TPM_NV_WRITE_REPLY* reply;
-    uint32_t commandSize;
-    uint32_t replySize;
-    int32_t i;
-    bool osResult;
-
-    //
-    // Allocate the command
-    //
-    commandSize = TpmVariableCmdSize(command, AuthorizationSize, commandData, DataSize, commandFooter);
-    command = TpmpAllocateCommand(command, commandSize);
-
-    //
-    // Fill out the TPM Command Header
-    //
-    TpmpFillCommandHeader(&command->Header,
-                          TPM_CC_NV_Write,
-                          TPM_ST_SESSIONS,
-                          commandSize);
+    TPM_COMMAND_SEGMENT segments[2];
+    uint8_t* commands[2];
+    PTPM_CONTEXT context;
+    TPM_MARSHAL_BYTES data;
+    uint32_t bufferSize;
+    uint32_t position;
+    uint16_t chunkSize;
+    uint16_t readSize;
+    uint16_t nextSize;
+    uint32_t current;
+    TPM_RC tpmResult;
 
     //
-    // Fill in the rest of the command header
-    //
-    command->NvIndex.Value = OsSwap32(HandleIndex.Value);
+    // Each chunk is marshalled in its own half of the command buffer, so that
+    // the next one can be built while the previous one is still in flight.
+    //
+    context = reinterpret_cast<PTPM_CONTEXT>(TpmHandle);
+    chunkSize = TpmpNvChunkSize(context);
+    bufferSize = context->CommandBufferSize / 2;
+    commands[0] = context->CommandBuffer;
+    commands[1] = context->CommandBuffer + bufferSize;
+    segments[0].Buffer = commands[0];
+    segments[1].Buffer = commands[1];
+
+    //
+    // Build and send the first chunk
+    //
+    position = 0;
+    current = 0;
+    readSize = (DataSize < chunkSize) ? DataSize : chunkSize;
+    segments[current].Length = TpmNvReadCommand::Marshal(commands[current],
+                                                         bufferSize,
+                                                         TpmpNvAuthHandle(HandleIndex,
+                                                                          AuthorizationSize),
+                                                         HandleIndex.Value,
+                                                         TPM_MARSHAL_BYTES{ AuthorizationData,
+                                                                            AuthorizationSize },
+                                                         readSize,
+                                                         Offset);
+    if (segments[current].Length == 0)
+    {
+        return TPM_RC_COMMAND_SIZE;
+    }
+    if (TpmOsSubmitCommand(TpmHandle, &segments[current], 1, nullptr) == false)
+    {
+        return TPM_RC_FAILURE;
+    }
 
-    //
-    // Check if we're doing owner or session authorization
-    //
-    if (AuthorizationSize == 0)
+    for (;;)
     {
         //
-        // Pass in the owner pseudo-handle
+        // While the TPM is busy, build the command for the next chunk, if any
         //
-        command->AuthHandle.Value = OsSwap32(TPM_RH_OWNER.Value);
-    }
-    else
-    {
+        nextSize = static_cast<uint16_t>(((DataSize - position - readSize) < chunkSize) ?
+                                         (DataSize - position - readSize) : chunkSize);
+        if (nextSize != 0)
+        {
+            segments[current ^ 1].Length =
+                TpmNvReadCommand::Marshal(commands[current ^ 1],
+                                          bufferSize,
+                                          TpmpNvAuthHandle(HandleIndex, AuthorizationSize),
+                                          HandleIndex.Value,
+                                          TPM_MARSHAL_BYTES{ AuthorizationData,
+                                                             AuthorizationSize },
+                                          nextSize,
+                                          static_cast<uint16_t>(Offset + position + readSize));
+        }
+
         //
-        // For session authentication, we authenticate against the index itself
+        // Get the current chunk, keep going only if we got success
         //
-        command->AuthHandle.Value = OsSwap32(HandleIndex.Value);
-    }
+        if (TpmOsReceiveResponse(TpmHandle,
+                                 context->ResponseBuffer,
+                                 context->ResponseBufferSize,
+                                 nullptr) == false)
+        {
+            return TPM_RC_FAILURE;
+        }
+        tpmResult = TpmReadResponseCode(context->ResponseBuffer);
+        if (tpmResult != TPM_RC_SUCCESS)
+        {
+            return tpmResult;
+        }
+        if ((TpmNvReadResponse::Unmarshal(context->ResponseBuffer,
+                                          context->ResponseBufferSize,
+                                          &data) == false) ||
+            (data.Size != readSize))
+        {
+            return TPM_RC_FAILURE;
+        }
 
-    //
-    // Fill out the authorization session
-    //
-    TpmpFillAuthSession(&command->AuthSession,
-                        AuthorizationSize,
-                        AuthorizationData,
-                        reinterpret_cast<uint8_t**>(&commandData));
+        //
+        // Send the next chunk before handing out this one, which stays in the
+        // response buffer until the next response is received.
+        //
+        if (nextSize != 0)
+        {
+            current ^= 1;
+            if (TpmOsSubmitCommand(TpmHandle, &segments[current], 1, nullptr) == false)
+            {
+                return TPM_RC_FAILURE;
+            }
+        }
+        if (Callback(CallbackContext, data.Data, data.Size) == false)
+        {
+            //
+            // Don't leave the next chunk in flight
+            //
+            if (nextSize != 0)
+            {
+                TpmOsReceiveResponse(TpmHandle,
+                                     context->ResponseBuffer,
+                                     context->ResponseBufferSize,
+                                     nullptr);
+            }
+            return TPM_RC_CANCELED;
+        }
 
-    //
-    // Fill out the command data
-    //
-    commandData->Size = OsSwap16(DataSize);
-    for (i = 0; i < DataSize; i++)
-    {
-        commandData->Data[i] = Data[i];
+        //
+        // Move on to the next chunk, unless this was the last one
+        //
+        position += readSize;
+        readSize = nextSize;
+        if (readSize == 0)
+        {
+            break;
+        }
     }
+    return TPM_RC_SUCCESS;
+}
 
+TPM_RC
+TpmNvReadStream (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX HandleIndex,
+    uint16_t AuthorizationSize,
+    uint8_t* AuthorizationData,
+    uint16_t Offset,
+    uint16_t DataSize,
+    PTPM_NV_READ_CALLBACK Callback,
+    void* CallbackContext
+    )
+{
     //
-    // Finish up with the footer
-    //
-    commandFooter = reinterpret_cast<decltype(commandFooter)>(&commandData->Data[i]);
-    commandFooter->Offset = OsSwap16(Offset);
-
-    //
-    // Make space for the response
-    //
-    replySize = TpmFixedResponseSize(reply);
-    reply = TpmpAllocateResponse(reply, replySize);
+    // Read all the chunks, then check what the result says about the index
+    //
+    return TpmpNvCompleted(TpmHandle,
+                           HandleIndex,
+                           false,
+                           TpmpNvReadStream(TpmHandle,
+                                            HandleIndex,
+                                            AuthorizationSize,
+                                            AuthorizationData,
+                                            Offset,
+                                            DataSize,
+                                            Callback,
+                                            CallbackContext));
+}
 
-    //
-    // Call the OS function
-    //
-    osResult = TpmOsIssueCommand(TpmHandle,
-                                 reinterpret_cast<uint8_t*>(command),
-                                 commandSize,
-                                 (uint8_t*)reply,
-                                 replySize,
-                                 nullptr);
-    if (osResult == false)
-    {
-        return TPM_RC_FAILURE;
-    }
+bool
+TpmpNvReadCopy (
+    void* Context,
+    const uint8_t* Data,
+    uint16_t DataSize
+    )
+{
+    uint8_t** position;
 
     //
-    // Return the TPM response code -- no data is returned
+    // Append the chunk to the caller's buffer
     //
-    return TpmReadResponseCode(reply);
+    position = static_cast<uint8_t**>(Context);
+    memcpy(*position, Data, DataSize);
+    *position += DataSize;
+    return true;
 }
 
 TPM_RC
-TpmpLock2 (
+TpmNvRead2 (
     uintptr_t TpmHandle,
     TPM_NV_INDEX HandleIndex,
-    bool WriteLock,
     uint16_t AuthorizationSize,
-    uint8_t* AuthorizationData
+    uint8_t* AuthorizationData,
+    uint16_t Offset,
+    uint16_t DataSize,
+    uint8_t* Data
     )
 {
-    TPM_NV_READ_LOCK_CMD_HEADER* command;
-    TPM_NV_READ_LOCK_REPLY* reply;
-    uint32_t commandSize;
-    uint32_t replySize;
-    bool osResult;
-
-    //
-    // Allocate the command
-    //
-    commandSize = TpmEmptyCmdSize(command, AuthorizationSize);
-    command = TpmpAllocateCommand(command, commandSize);
+    uint8_t* position;
 
     //
-    // Fill out the TPM Command Header
+    // Read the data in as many chunks as needed, copying each one back
     //
-    TpmpFillCommandHeader(&command->Header,
-                          WriteLock ? TPM_CC_NV_WriteLock : TPM_CC_NV_ReadLock,
-                          TPM_ST_SESSIONS,
-                          commandSize);
+    position = Data;
+    return TpmNvReadStream(TpmHandle,
+                           HandleIndex,
+                           AuthorizationSize,
+                           AuthorizationData,
+                           Offset,
+                           DataSize,
+                           TpmpNvReadCopy,
+                           &position);
+}
 
-    //
-    // Fill in the index being locked
-    //
-    command->NvIndex.Value = OsSwap32(HandleIndex.Value);
+bool
+TpmpNvBatchNext (
+    uint32_t IndexCount,
+    const uint16_t* DataSizes,
+    uint16_t ChunkSize,
+    uint32_t* Position,
+    uint16_t* Offset,
+    uint16_t* Size
+    )
+{
+    uint32_t offset;
 
     //
-    // Check if we're doing owner or session authorization
+    // Move past the chunk that was just read, and on to the next index with
+    // any data once the current one is done.
     //
-    if (AuthorizationSize == 0)
+    offset = *Offset + *Size;
+    while ((*Position < IndexCount) && (offset >= DataSizes[*Position]))
     {
-        //
-        // Pass in the owner pseudo-handle
-        //
-        command->AuthHandle.Value = OsSwap32(TPM_RH_OWNER.Value);
+        (*Position)++;
+        offset = 0;
     }
-    else
+    if (*Position == IndexCount)
     {
-        //
-        // For session authentication, we authenticate against the index itself
-        //
-        command->AuthHandle.Value = OsSwap32(HandleIndex.Value);
+        return false;
     }
 
     //
-    // Fill out the authorization session
+    // Read as much of it as fits in a chunk
     //
-    TpmpFillAuthSession(&command->AuthSession,
-                        AuthorizationSize,
-                        AuthorizationData,
-                        nullptr);
+    *Offset = static_cast<uint16_t>(offset);
+    *Size = static_cast<uint16_t>(((DataSizes[*Position] - offset) < ChunkSize) ?
+                                  (DataSizes[*Position] - offset) : ChunkSize);
+    return true;
+}
 
-    //
-    // Make space for the response
-    //
-    replySize = TpmFixedResponseSize(reply);
-    reply = TpmpAllocateResponse(reply, replySize);
+TPM_RC
+TpmNvReadBatch (
+    uintptr_t TpmHandle,
+    uint32_t IndexCount,
+    const TPM_NV_INDEX* IndexArray,
+    const uint16_t* DataSizes,
+    PTPM_NV_READ_BATCH_CALLBACK Callback,
+    void* CallbackContext
+    )
+{
+    TPM_COMMAND_SEGMENT segments[2];
+    uint8_t* commands[2];
+    uint32_t positions[2];
+    uint16_t offsets[2];
+    uint16_t sizes[2];
+    PTPM_CONTEXT context;
+    TPM_MARSHAL_BYTES data;
+    uint32_t bufferSize;
+    uint16_t chunkSize;
+    uint32_t current;
+    uint32_t next;
+    bool more;
+    TPM_RC tpmResult;
 
     //
-    // Call the OS function
-    //
-    osResult = TpmOsIssueCommand(TpmHandle,
-                                 reinterpret_cast<uint8_t*>(command),
-                                 commandSize,
-                                 reinterpret_cast<uint8_t*>(reply),
-                                 replySize,
-                                 nullptr);
-    if (osResult == false)
+    // Each chunk is marshalled in its own half of the command buffer, so that
+    // the next one can be built while the previous one is still in flight.
+    // Chunks of consecutive indices are sent back to back in the same way, so
+    // the TPM is kept busy across the whole batch, not only within an index.
+    //
+    context = reinterpret_cast<PTPM_CONTEXT>(TpmHandle);
+    chunkSize = TpmpNvChunkSize(context);
+    bufferSize = context->CommandBufferSize / 2;
+    commands[0] = context->CommandBuffer;
+    commands[1] = context->CommandBuffer + bufferSize;
+    segments[0].Buffer = commands[0];
+    segments[1].Buffer = commands[1];
+
+    //
+    // Find the first chunk, if any index has data at all, and send it. Every
+    // read uses our owner handle and an empty password.
+    //
+    current = 0;
+    positions[current] = 0;
+    offsets[current] = 0;
+    sizes[current] = 0;
+    if (TpmpNvBatchNext(IndexCount,
+                        DataSizes,
+                        chunkSize,
+                        &positions[current],
+                        &offsets[current],
+                        &sizes[current]) == false)
+    {
+        return TPM_RC_SUCCESS;
+    }
+    segments[current].Length = TpmNvReadCommand::Marshal(commands[current],
+                                                         bufferSize,
+                                                         TpmpHandleValue(TPM_RH_OWNER),
+                                                         IndexArray[positions[current]].Value,
+                                                         TPM_MARSHAL_BYTES{},
+                                                         sizes[current],
+                                                         offsets[current]);
+    if (segments[current].Length == 0)
+    {
+        return TPM_RC_COMMAND_SIZE;
+    }
+    if (TpmOsSubmitCommand(TpmHandle, &segments[current], 1, nullptr) == false)
     {
         return TPM_RC_FAILURE;
     }
 
-    //
-    // Return the TPM response code -- no data is returned
-    //
-    return TpmReadResponseCode(reply);
-}
+    for (;;)
+    {
+        //
+        // While the TPM is busy, build the command for the next chunk, if any
+        //
+        next = current ^ 1;
+        positions[next] = positions[current];
+        offsets[next] = offsets[current];
+        sizes[next] = sizes[current];
+        more = TpmpNvBatchNext(IndexCount,
+                               DataSizes,
+                               chunkSize,
+                               &positions[next],
+                               &offsets[next],
+                               &sizes[next]);
+        if (more)
+        {
+            segments[next].Length = TpmNvReadCommand::Marshal(commands[next],
+                                                              bufferSize,
+                                                              TpmpHandleValue(TPM_RH_OWNER),
+                                                              IndexArray[positions[next]].Value,
+                                                              TPM_MARSHAL_BYTES{},
+                                                              sizes[next],
+                                                              offsets[next]);
+        }
 
-TPM_RC
-TpmWriteLock2 (
-    uintptr_t TpmHandle,
-    TPM_NV_INDEX HandleIndex,
-    uint16_t AuthorizationSize,
-    uint8_t* AuthorizationData
-    )
-{
-    //
-    // Call the helper with the write parameter
+        //
+        // Get the current chunk
+        //
+        if (TpmOsReceiveResponse(TpmHandle,
+                                 context->ResponseBuffer,
+                                 context->ResponseBufferSize,
+                                 nullptr) == false)
+        {
+            return TPM_RC_FAILURE;
+        }
+        tpmResult = TpmpNvCompleted(TpmHandle,
+                                    IndexArray[positions[current]],
+                                    false,
+                                    TpmReadResponseCode(context->ResponseBuffer));
+        data.Data = nullptr;
+        data.Size = 0;
+        if (tpmResult == TPM_RC_SUCCESS)
+        {
+            if ((TpmNvReadResponse::Unmarshal(context->ResponseBuffer,
+                                              context->ResponseBufferSize,
+                                              &data) == false) ||
+                (data.Size != sizes[current]))
+            {
+                return TPM_RC_FAILURE;
+            }
+        }
+        else if ((more) && (positions[next] == positions[current]))
+        {
+            //
+            // The index can't be read, so skip the rest of it, and build the
+            // command for the index after it instead.
+            //
+            offsets[next] = DataSizes[positions[next]];
+            sizes[next] = 0;
+            more = TpmpNvBatchNext(IndexCount,
+                                   DataSizes,
+                                   chunkSize,
+                                   &positions[next],
+                                   &offsets[next],
+                                   &sizes[next]);
+            if (more)
+            {
+                segments[next].Length =
+                    TpmNvReadCommand::Marshal(commands[next],
+                                              bufferSize,
+                                              TpmpHandleValue(TPM_RH_OWNER),
+                                              IndexArray[positions[next]].Value,
+                                              TPM_MARSHAL_BYTES{},
+                                              sizes[next],
+                                              offsets[next]);
+            }
+        }
+
+        //
+        // Send the next chunk before handing out this one, which stays in the
+        // response buffer until the next response is received.
+        //
+        if (more)
+        {
+            if (TpmOsSubmitCommand(TpmHandle, &segments[next], 1, nullptr) == false)
+            {
+                return TPM_RC_FAILURE;
+            }
+        }
+        if (Callback(CallbackContext,
+                     positions[current],
+                     tpmResult,
+                     offsets[current],
+                     data.Data,
+                     data.Size) == false)
+        {
+            //
+            // Don't leave the next chunk in flight
+            //
+            if (more)
+            {
+                TpmOsReceiveResponse(TpmHandle,
+                                     context->ResponseBuffer,
+                                     context->ResponseBufferSize,
+                                     nullptr);
+            }
+            return TPM_RC_CANCELED;
+        }
+
+        //
+        // Move on to the next chunk, unless this was the last one
+        //
+        if (more == false)
+        {
+            break;
+        }
+        current = next;
+    }
+    return TPM_RC_SUCCESS;
+}
+
+uint16_t
+TpmNvWriteChunkSize (
+    uintptr_t TpmHandle,
+    uint16_t AuthorizationSize
+    )
+{
+    PTPM_CONTEXT context;
+    uint32_t chunkSize;
+
+    //
+    // Each chunk is limited by the TPM's NV buffer, and the whole command must
+    // also fit in one half of our command buffer, in case it must be gathered.
+    //
+    context = reinterpret_cast<PTPM_CONTEXT>(TpmHandle);
+    chunkSize = context->CommandBufferSize / 2;
+    if (chunkSize <= (TpmNvWriteCommand::FixedSize + AuthorizationSize))
+    {
+        return 0;
+    }
+    chunkSize -= TpmNvWriteCommand::FixedSize + AuthorizationSize;
+    if (context->NvBufferMax < chunkSize)
+    {
+        chunkSize = context->NvBufferMax;
+    }
+    return static_cast<uint16_t>((chunkSize < UINT16_MAX) ? chunkSize : UINT16_MAX);
+}
+
+TPM_RC
+TpmpNvWriteStream (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX HandleIndex,
+    uint16_t AuthorizationSize,
+    uint8_t* AuthorizationData,
+    uint16_t Offset,
+    uint16_t DataSize,
+    PTPM_NV_WRITE_CALLBACK Callback,
+    void* CallbackContext
+    )
+{
+    TPM_COMMAND_SEGMENT segments[2][TpmNvWriteCommand::MaximumSegments];
+    uint32_t segmentCount[2];
+    uint8_t* commands[2];
+    const uint8_t* data;
+    PTPM_CONTEXT context;
+    uint32_t bufferSize;
+    uint32_t position;
+    uint16_t chunkSize;
+    uint16_t writeSize;
+    uint16_t nextSize;
+    uint32_t current;
+    TPM_RC tpmResult;
+
+    //
+    // Each chunk is marshalled in its own half of the command buffer, so that
+    // the next one can be built while the previous one is still in flight.
+    //
+    context = reinterpret_cast<PTPM_CONTEXT>(TpmHandle);
+    chunkSize = TpmNvWriteChunkSize(TpmHandle, AuthorizationSize);
+    if (chunkSize == 0)
+    {
+        return TPM_RC_COMMAND_SIZE;
+    }
+    bufferSize = context->CommandBufferSize / 2;
+    commands[0] = context->CommandBuffer;
+    commands[1] = context->CommandBuffer + bufferSize;
+
+    //
+    // Get the data for the first chunk, then build and send it
+    //
+    position = 0;
+    current = 0;
+    writeSize = (DataSize < chunkSize) ? DataSize : chunkSize;
+    if (Callback(CallbackContext, writeSize, &data) == false)
+    {
+        return TPM_RC_CANCELED;
+    }
+    segmentCount[current] =
+        TpmNvWriteCommand::MarshalSegments(commands[current],
+                                           bufferSize,
+                                           segments[current],
+                                           TpmpNvAuthHandle(HandleIndex, AuthorizationSize),
+                                           HandleIndex.Value,
+                                           TPM_MARSHAL_BYTES{ AuthorizationData,
+                                                              AuthorizationSize },
+                                           TPM_MARSHAL_BYTES{ data, writeSize },
+                                           Offset);
+    if (segmentCount[current] == 0)
+    {
+        return TPM_RC_COMMAND_SIZE;
+    }
+    if (TpmOsSubmitCommand(TpmHandle,
+                           segments[current],
+                           segmentCount[current],
+                           nullptr) == false)
+    {
+        return TPM_RC_FAILURE;
+    }
+
+    for (;;)
+    {
+        //
+        // While the TPM is busy, get the data for the next chunk, if any, and
+        // build its command.
+        //
+        nextSize = static_cast<uint16_t>(((DataSize - position - writeSize) < chunkSize) ?
+                                         (DataSize - position - writeSize) : chunkSize);
+        if (nextSize != 0)
+        {
+            if (Callback(CallbackContext, nextSize, &data) == false)
+            {
+                //
+                // Don't leave the current chunk in flight
+                //
+                TpmOsReceiveResponse(TpmHandle,
+                                     context->ResponseBuffer,
+                                     context->ResponseBufferSize,
+                                     nullptr);
+                return TPM_RC_CANCELED;
+            }
+            segmentCount[current ^ 1] =
+                TpmNvWriteCommand::MarshalSegments(commands[current ^ 1],
+                                                   bufferSize,
+                                                   segments[current ^ 1],
+                                                   TpmpNvAuthHandle(HandleIndex,
+                                                                    AuthorizationSize),
+                                                   HandleIndex.Value,
+                                                   TPM_MARSHAL_BYTES{ AuthorizationData,
+                                                                      AuthorizationSize },
+                                                   TPM_MARSHAL_BYTES{ data, nextSize },
+                                                   static_cast<uint16_t>(Offset +
+                                                                         position +
+                                                                         writeSize));
+        }
+
+        //
+        // Wait for the current chunk, keep going only if we got success
+        //
+        if (TpmOsReceiveResponse(TpmHandle,
+                                 context->ResponseBuffer,
+                                 context->ResponseBufferSize,
+                                 nullptr) == false)
+        {
+            return TPM_RC_FAILURE;
+        }
+        tpmResult = TpmReadResponseCode(context->ResponseBuffer);
+        if (tpmResult != TPM_RC_SUCCESS)
+        {
+            return tpmResult;
+        }
+
+        //
+        // Move on to the next chunk, unless this was the last one
+        //
+        position += writeSize;
+        writeSize = nextSize;
+        if (writeSize == 0)
+        {
+            break;
+        }
+        current ^= 1;
+        if (TpmOsSubmitCommand(TpmHandle,
+                               segments[current],
+                               segmentCount[current],
+                               nullptr) == false)
+        {
+            return TPM_RC_FAILURE;
+        }
+    }
+    return TPM_RC_SUCCESS;
+}
+
+TPM_RC
+TpmNvWriteStream (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX HandleIndex,
+    uint16_t AuthorizationSize,
+    uint8_t* AuthorizationData,
+    uint16_t Offset,
+    uint16_t DataSize,
+    PTPM_NV_WRITE_CALLBACK Callback,
+    void* CallbackContext
+    )
+{
+    //
+    // Write all the chunks. Even if only some of them made it, the index has
+    // now been written.
+    //
+    return TpmpNvCompleted(TpmHandle,
+                           HandleIndex,
+                           true,
+                           TpmpNvWriteStream(TpmHandle,
+                                             HandleIndex,
+                                             AuthorizationSize,
+                                             AuthorizationData,
+                                             Offset,
+                                             DataSize,
+                                             Callback,
+                                             CallbackContext));
+}
+
+bool
+TpmpNvWriteReference (
+    void* Context,
+    uint16_t DataSize,
+    const uint8_t** Data
+    )
+{
+    const uint8_t** position;
+
+    //
+    // Send each chunk straight from the caller's buffer
+    //
+    position = static_cast<const uint8_t**>(Context);
+    *Data = *position;
+    *position += DataSize;
+    return true;
+}
+
+TPM_RC
+TpmNvWrite2 (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX HandleIndex,
+    uint16_t AuthorizationSize,
+    uint8_t* AuthorizationData,
+    uint16_t Offset,
+    uint16_t DataSize,
+    const uint8_t* Data
+    )
+{
+    const uint8_t* position;
+
+    //
+    // Write the data in as many chunks as needed, leaving it in the caller's
+    // buffer, from where each chunk is sent as-is.
+    //
+    position = Data;
+    return TpmNvWriteStream(TpmHandle,
+                            HandleIndex,
+                            AuthorizationSize,
+                            AuthorizationData,
+                            Offset,
+                            DataSize,
+                            TpmpNvWriteReference,
+                            &position);
+}
+
+TPM_RC
+TpmpLock2 (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX HandleIndex,
+    bool WriteLock,
+    uint16_t AuthorizationSize,
+    uint8_t* AuthorizationData
+    )
+{
+    PTPM_CONTEXT context;
+    uint32_t commandSize;
+
+    //
+    // Both lock commands take the same handles and authorization session
+    //
+    context = reinterpret_cast<PTPM_CONTEXT>(TpmHandle);
+    if (WriteLock)
+    {
+        commandSize = TpmNvWriteLockCommand::Marshal(context->CommandBuffer,
+                                                     context->CommandBufferSize,
+                                                     TpmpNvAuthHandle(HandleIndex,
+                                                                      AuthorizationSize),
+                                                     HandleIndex.Value,
+                                                     TPM_MARSHAL_BYTES{ AuthorizationData,
+                                                                        AuthorizationSize });
+    }
+    else
+    {
+        commandSize = TpmNvReadLockCommand::Marshal(context->CommandBuffer,
+                                                    context->CommandBufferSize,
+                                                    TpmpNvAuthHandle(HandleIndex,
+                                                                     AuthorizationSize),
+                                                    HandleIndex.Value,
+                                                    TPM_MARSHAL_BYTES{ AuthorizationData,
+                                                                       AuthorizationSize });
+    }
+
+    //
+    // Return the TPM response code -- no data is returned
+    //
+    return TpmpNvCompleted(TpmHandle,
+                           HandleIndex,
+                           true,
+                           TpmpIssueCommand(TpmHandle, commandSize));
+}
+
+TPM_RC
+TpmWriteLock2 (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX HandleIndex,
+    uint16_t AuthorizationSize,
+    uint8_t* AuthorizationData
+    )
+{
+    //
+    // Call the helper with the write parameter
     //
     return TpmpLock2(TpmHandle,
                      HandleIndex,
@@ -610,225 +1087,1257 @@ TpmReadLock2 (
 }
 
 TPM_RC
-TpmReadPublic2 (
+TpmNvIncrement2 (
     uintptr_t TpmHandle,
     TPM_NV_INDEX HandleIndex,
-    uint16_t* Attributes,
-    uint8_t* OwnerRights,
-    uint8_t* AuthRights,
-    uint16_t* DataSize
+    uint16_t AuthorizationSize,
+    uint8_t* AuthorizationData
     )
 {
-    TPM_NV_READ_PUBLIC_CMD_HEADER* command;
-    TPM_NV_READ_PUBLIC_REPLY* reply;
+    PTPM_CONTEXT context;
+    uint32_t commandSize;
+
+    //
+    // Don't bother sending the command if the TPM is known not to have it
+    //
+    context = reinterpret_cast<PTPM_CONTEXT>(TpmHandle);
+    if (TpmPropHasCommand(context, TPM_CC_NV_Increment) == false)
+    {
+        return TPM_RC_COMMAND_CODE;
+    }
+
+    //
+    // Build the command, which only needs the index and its authorization
+    //
+    commandSize = TpmNvIncrementCommand::Marshal(context->CommandBuffer,
+                                                 context->CommandBufferSize,
+                                                 TpmpNvAuthHandle(HandleIndex,
+                                                                  AuthorizationSize),
+                                                 HandleIndex.Value,
+                                                 TPM_MARSHAL_BYTES{ AuthorizationData,
+                                                                    AuthorizationSize });
+
+    //
+    // Return the TPM response code -- no data is returned
+    //
+    return TpmpNvCompleted(TpmHandle,
+                           HandleIndex,
+                           true,
+                           TpmpIssueCommand(TpmHandle, commandSize));
+}
+
+TPM_RC
+TpmNvSetBits2 (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX HandleIndex,
+    uint16_t AuthorizationSize,
+    uint8_t* AuthorizationData,
+    uint64_t Bits
+    )
+{
+    PTPM_CONTEXT context;
+    uint32_t commandSize;
+
+    //
+    // Don't bother sending the command if the TPM is known not to have it
+    //
+    context = reinterpret_cast<PTPM_CONTEXT>(TpmHandle);
+    if (TpmPropHasCommand(context, TPM_CC_NV_SetBits) == false)
+    {
+        return TPM_RC_COMMAND_CODE;
+    }
+
+    //
+    // Build the command with the bits to set in the index
+    //
+    commandSize = TpmNvSetBitsCommand::Marshal(context->CommandBuffer,
+                                               context->CommandBufferSize,
+                                               TpmpNvAuthHandle(HandleIndex,
+                                                                AuthorizationSize),
+                                               HandleIndex.Value,
+                                               TPM_MARSHAL_BYTES{ AuthorizationData,
+                                                                  AuthorizationSize },
+                                               Bits);
+
+    //
+    // Return the TPM response code -- no data is returned
+    //
+    return TpmpNvCompleted(TpmHandle,
+                           HandleIndex,
+                           true,
+                           TpmpIssueCommand(TpmHandle, commandSize));
+}
+
+TPM_RC
+TpmNvExtend2 (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX HandleIndex,
+    uint16_t AuthorizationSize,
+    uint8_t* AuthorizationData,
+    uint16_t DataSize,
+    uint8_t* Data
+    )
+{
+    PTPM_CONTEXT context;
+    uint32_t commandSize;
+
+    //
+    // Don't bother sending the command if the TPM is known not to have it
+    //
+    context = reinterpret_cast<PTPM_CONTEXT>(TpmHandle);
+    if (TpmPropHasCommand(context, TPM_CC_NV_Extend) == false)
+    {
+        return TPM_RC_COMMAND_CODE;
+    }
+
+    //
+    // Build the command with the data to hash into the index. The TPM hashes
+    // it along with the current value, so any size that fits is accepted.
+    //
+    commandSize = TpmNvExtendCommand::Marshal(context->CommandBuffer,
+                                              context->CommandBufferSize,
+                                              TpmpNvAuthHandle(HandleIndex,
+                                                               AuthorizationSize),
+                                              HandleIndex.Value,
+                                              TPM_MARSHAL_BYTES{ AuthorizationData,
+                                                                 AuthorizationSize },
+                                              TPM_MARSHAL_BYTES{ Data, DataSize });
+
+    //
+    // Return the TPM response code -- no data is returned
+    //
+    return TpmpNvCompleted(TpmHandle,
+                           HandleIndex,
+                           true,
+                           TpmpIssueCommand(TpmHandle, commandSize));
+}
+
+TPM_RC
+TpmpNvDecodePublic (
+    PTPM_CONTEXT Context,
+    const uint8_t* Response,
+    uint32_t ResponseSize,
+    TPM_NV_INDEX HandleIndex,
+    PTPM_NV_CACHE_ENTRY Entry
+    )
+{
+    TPM_MARSHAL_BYTES authPolicy;
+    TPM_MARSHAL_BYTES name;
+    const uint8_t* publicArea;
+    uint16_t publicSize;
+    uint32_t nvIndex;
+    uint16_t nameAlg;
+    TPM_RC tpmResult;
+
+    //
+    // Keep going only if we got success
+    //
+    tpmResult = TpmReadResponseCode(Response);
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        return TpmpNvCompleted(reinterpret_cast<uintptr_t>(Context),
+                               HandleIndex,
+                               false,
+                               tpmResult);
+    }
+
+    //
+    // Decode the public area, which has the size and attributes of the index,
+    // and must be made up of exactly these fields.
+    //
+    if ((TpmNvReadPublicResponse::Unmarshal(Response,
+                                            ResponseSize,
+                                            &publicSize,
+                                            &nvIndex,
+                                            &nameAlg,
+                                            &Entry->Attributes,
+                                            &authPolicy,
+                                            &Entry->DataSize,
+                                            &name) == false) ||
+        (nvIndex != HandleIndex.Value) ||
+        (publicSize != (sizeof(nvIndex) + sizeof(nameAlg) + sizeof(Entry->Attributes) +
+                        sizeof(uint16_t) + authPolicy.Size + sizeof(Entry->DataSize))))
+    {
+        return TPM_RC_FAILURE;
+    }
+
+    //
+    // Compute the name of the index ourselves, which is the digest of the
+    // public area. Only cache it if it matches what the TPM says, which means
+    // that we understood the public area correctly.
+    //
+    Entry->Index = nvIndex;
+    memset(Entry->Name, 0, sizeof(Entry->Name));
+    if (nameAlg != TPM_ALG_SHA256)
+    {
+        return tpmResult;
+    }
+    publicArea = Response + TpmNvReadPublicResponse::ParameterOffset + sizeof(publicSize);
+    TpmInteger<uint16_t>::Encode(Entry->Name, nameAlg);
+    TpmSha256(publicArea, publicSize, &Entry->Name[sizeof(nameAlg)]);
+    if ((name.Size == sizeof(Entry->Name)) &&
+        (memcmp(name.Data, Entry->Name, sizeof(Entry->Name)) == 0))
+    {
+        TpmPropCacheNv(Context, Entry);
+    }
+    return tpmResult;
+}
+
+TPM_RC
+TpmpNvReadPublic (
+    PTPM_CONTEXT Context,
+    TPM_NV_INDEX HandleIndex,
+    bool Cached,
+    PTPM_NV_CACHE_ENTRY Entry
+    )
+{
+    PTPM_NV_CACHE_ENTRY entry;
     uint32_t commandSize;
-    uint32_t replySize;
-    uint32_t nvAtributes;
-    bool osResult;
     TPM_RC tpmResult;
 
     //
-    // Allocate the command
+    // Use the public area that was cached, if any, when the caller only needs
+    // what the index was defined with. Its written and lock flags, and even
+    // whether it still exists, can change behind our back, so they always
+    // come from the TPM.
     //
-    commandSize = sizeof(*command);
-    command = TpmpAllocateCommand(command, commandSize);
+    entry = (Cached != false) ? TpmPropLookupNv(Context, HandleIndex.Value) : nullptr;
+    if (entry != nullptr)
+    {
+        *Entry = *entry;
+        return TPM_RC_SUCCESS;
+    }
 
     //
-    // Fill out the TPM Command Header
+    // Otherwise, build the command with the index being read
     //
-    TpmpFillCommandHeader(&command->Header,
-                          TPM_CC_NV_ReadPublic,
-                          TPM_ST_NO_SESSIONS,
-                          commandSize);
+    commandSize = TpmNvReadPublicCommand::Marshal(Context->CommandBuffer,
+                                                  Context->CommandBufferSize,
+                                                  HandleIndex.Value);
 
     //
-    // Fill in the index being read
+    // Send it, keep going only if we got success. An index that is gone must
+    // not stay in the cache either.
     //
-    command->NvIndex.Value = OsSwap32(HandleIndex.Value);
+    tpmResult = TpmpIssueCommand(reinterpret_cast<uintptr_t>(Context), commandSize);
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        return TpmpNvCompleted(reinterpret_cast<uintptr_t>(Context),
+                               HandleIndex,
+                               false,
+                               tpmResult);
+    }
+
+    //
+    // Decode the public area that was returned
+    //
+    return TpmpNvDecodePublic(Context,
+                              Context->ResponseBuffer,
+                              Context->ResponseBufferSize,
+                              HandleIndex,
+                              Entry);
+}
+
+void
+TpmpNvConvertPublic (
+    const TPM_NV_CACHE_ENTRY* Entry,
+    uint16_t* Attributes,
+    uint8_t* OwnerRights,
+    uint8_t* AuthRights,
+    uint16_t* DataSize
+    )
+{
+    uint32_t nvAtributes;
+
+    //
+    // The data size is returned as-is
+    //
+    nvAtributes = Entry->Attributes;
+    *DataSize = Entry->DataSize;
+
+    //
+    // Convert the owner rights into our format
+    //
+    *OwnerRights = ((((nvAtributes & TPMA_NV_OWNERREAD) ==
+                       TPMA_NV_OWNERREAD) * TpmToolReadAccess) |
+                    (((nvAtributes & TPMA_NV_OWNERWRITE) ==
+                       TPMA_NV_OWNERWRITE) * TpmToolWriteAccess));
+
+    //
+    // Convert the auth rights into our format
+    //
+    *AuthRights = ((((nvAtributes & TPMA_NV_AUTHREAD) ==
+                      TPMA_NV_AUTHREAD) * TpmToolReadAccess) |
+                   (((nvAtributes & TPMA_NV_AUTHWRITE) ==
+                      TPMA_NV_AUTHWRITE) * TpmToolWriteAccess));
+
+    //
+    // Finally, convert the rest of the attributes
+    //
+    *Attributes = ((((nvAtributes & TPMA_NV_READ_STCLEAR) ==
+                      TPMA_NV_READ_STCLEAR) * TpmToolReadLockable) |
+                   (((nvAtributes & TPMA_NV_WRITE_STCLEAR) ==
+                      TPMA_NV_WRITE_STCLEAR) * TpmToolWriteLockable) |
+                   (((nvAtributes & TPMA_NV_WRITEDEFINE) ==
+                      TPMA_NV_WRITEDEFINE) * TpmToolWriteOnce) |
+                   (((nvAtributes & TPMA_NV_WRITEALL) ==
+                       TPMA_NV_WRITEALL) * TpmToolWriteAll) |
+                   (((nvAtributes & TPMA_NV_NO_DA) ==
+                      TPMA_NV_NO_DA) * TpmToolNonProtected) |
+                   (((nvAtributes & TPMA_NV_ORDERLY) ==
+                      TPMA_NV_ORDERLY) * TpmToolCached) |
+                   (((nvAtributes & TPMA_NV_CLEAR_STCLEAR) ==
+                      TPMA_NV_CLEAR_STCLEAR) * TpmToolVolatileDirtyFlag) |
+                   (((nvAtributes & TPMA_NV_POLICY_DELETE) ==
+                      TPMA_NV_POLICY_DELETE) * TpmToolPermanent) |
+                   (((nvAtributes & TPMA_NV_READLOCKED) ==
+                      TPMA_NV_READLOCKED) * TpmToolReadLocked) |
+                   (((nvAtributes & TPMA_NV_WRITELOCKED) ==
+                      TPMA_NV_WRITELOCKED) * TpmToolWriteLocked) |
+                   (((nvAtributes & TPMA_NV_WRITTEN) ==
+                      TPMA_NV_WRITTEN) * TpmToolWritten) |
+                   (((nvAtributes & TPMA_NV_PLATFORMCREATE) ==
+                      TPMA_NV_PLATFORMCREATE) * TpmToolPlatformOwned) |
+                   (((nvAtributes & TPMA_NV_TYPE) ==
+                      TPMA_NV_COUNTER) * TpmToolCounter) |
+                   (((nvAtributes & TPMA_NV_TYPE) ==
+                      TPMA_NV_BITS) * TpmToolBits) |
+                   (((nvAtributes & TPMA_NV_TYPE) ==
+                      TPMA_NV_EXTEND) * TpmToolExtend));
+}
+
+TPM_RC
+TpmReadPublic2 (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX HandleIndex,
+    uint16_t* Attributes,
+    uint8_t* OwnerRights,
+    uint8_t* AuthRights,
+    uint16_t* DataSize
+    )
+{
+    TPM_NV_CACHE_ENTRY entry;
+    TPM_RC tpmResult;
+
+    //
+    // Get the current public area from the TPM, which also refreshes the cache
+    //
+    tpmResult = TpmpNvReadPublic(reinterpret_cast<PTPM_CONTEXT>(TpmHandle),
+                                 HandleIndex,
+                                 false,
+                                 &entry);
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        return tpmResult;
+    }
+
+    //
+    // Convert it into our format
+    //
+    TpmpNvConvertPublic(&entry, Attributes, OwnerRights, AuthRights, DataSize);
+    return tpmResult;
+}
+
+TPM_RC
+TpmReadPublicCached (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX HandleIndex,
+    uint16_t* Attributes,
+    uint8_t* OwnerRights,
+    uint8_t* AuthRights,
+    uint16_t* DataSize
+    )
+{
+    TPM_NV_CACHE_ENTRY entry;
+    TPM_RC tpmResult;
+
+    //
+    // Get the public area, either from the cache or from the TPM. Only the
+    // size, type and defined attributes can be relied on.
+    //
+    tpmResult = TpmpNvReadPublic(reinterpret_cast<PTPM_CONTEXT>(TpmHandle),
+                                 HandleIndex,
+                                 true,
+                                 &entry);
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        return tpmResult;
+    }
+
+    //
+    // Convert it into our format
+    //
+    TpmpNvConvertPublic(&entry, Attributes, OwnerRights, AuthRights, DataSize);
+    return tpmResult;
+}
+
+TPM_RC
+TpmReadPublicBatch (
+    uintptr_t TpmHandle,
+    uint32_t IndexCount,
+    const TPM_NV_INDEX* IndexArray,
+    PTPM_READ_PUBLIC_CALLBACK Callback,
+    void* CallbackContext
+    )
+{
+    PTPM_CONTEXT context;
+    PTPM_CONTEXT contexts[TPM_BATCH_CONTEXTS];
+    uint32_t positions[TPM_BATCH_CONTEXTS];
+    bool busy[TPM_BATCH_CONTEXTS];
+    TPM_NV_CACHE_ENTRY entry;
+    TPM_COMMAND_SEGMENT segment;
+    uint8_t* commands;
+    uint32_t contextCount;
+    uint32_t inFlight;
+    uint32_t current;
+    uint32_t next;
+    uint32_t position;
+    uint32_t i;
+    uint16_t attributes;
+    uint8_t ownerRights;
+    uint8_t authRights;
+    uint16_t dataSize;
+    bool stop;
+    TPM_RC result;
+    TPM_RC tpmResult;
+
+    //
+    // Allocate room for all of the commands. Cached public areas are never
+    // used, as the callers rely on the written and lock flags, which can
+    // change behind our back, but the cache is refreshed with the results.
+    //
+    context = reinterpret_cast<PTPM_CONTEXT>(TpmHandle);
+    if (IndexCount == 0)
+    {
+        return TPM_RC_SUCCESS;
+    }
+    commands = static_cast<uint8_t*>(malloc(IndexCount * TpmNvReadPublicCommand::FixedSize));
+    if (commands == nullptr)
+    {
+        return TPM_RC_FAILURE;
+    }
+
+    //
+    // Build all the commands up front, so that each one can be sent as soon
+    // as the TPM is done with the previous one.
+    //
+    tpmResult = TPM_RC_SUCCESS;
+    stop = false;
+    for (i = 0; i < IndexCount; i++)
+    {
+        TpmNvReadPublicCommand::Marshal(&commands[i * TpmNvReadPublicCommand::FixedSize],
+                                        TpmNvReadPublicCommand::FixedSize,
+                                        IndexArray[i].Value);
+    }
+
+    //
+    // Transports that can queue commands may also allow more than one handle
+    // to do so, each of which keeps one more command queued to the TPM. A
+    // capture must see all the commands, so only its own handle is used then.
+    //
+    contexts[0] = context;
+    contextCount = 1;
+    if ((context->Transport->Submit != nullptr) && (context->Recorder == 0))
+    {
+        while ((contextCount < context->Transport->MaximumContexts) &&
+               (contextCount < TPM_BATCH_CONTEXTS) &&
+               (contextCount < IndexCount))
+        {
+            if (TpmOsOpenSibling(context,
+                                 reinterpret_cast<uintptr_t*>(&contexts[contextCount])) == false)
+            {
+                break;
+            }
+            contextCount++;
+        }
+    }
+
+    //
+    // Start with one command on each handle. Once a submission fails, the
+    // remaining handles are still marked idle, so that only the commands that
+    // were sent are waited for.
+    //
+    next = 0;
+    inFlight = 0;
+    segment.Length = TpmNvReadPublicCommand::FixedSize;
+    for (i = 0; i < contextCount; i++)
+    {
+        busy[i] = false;
+        if ((next < IndexCount) && (stop == false))
+        {
+            segment.Buffer = &commands[next * TpmNvReadPublicCommand::FixedSize];
+            if (TpmOsSubmitCommand(reinterpret_cast<uintptr_t>(contexts[i]),
+                                   &segment,
+                                   1,
+                                   nullptr) == false)
+            {
+                tpmResult = TPM_RC_FAILURE;
+                stop = true;
+                continue;
+            }
+            positions[i] = next++;
+            busy[i] = true;
+            inFlight++;
+        }
+    }
+
+    //
+    // Collect the responses in the order the commands were sent, sending the
+    // next command on each handle before decoding the response it just got,
+    // which stays in its response buffer until the next one is received.
+    //
+    current = 0;
+    while (inFlight != 0)
+    {
+        if (busy[current] == false)
+        {
+            current = (current + 1) % contextCount;
+            continue;
+        }
+        position = positions[current];
+        busy[current] = false;
+        inFlight--;
+        if (TpmOsReceiveResponse(reinterpret_cast<uintptr_t>(contexts[current]),
+                                 contexts[current]->ResponseBuffer,
+                                 contexts[current]->ResponseBufferSize,
+                                 nullptr) == false)
+        {
+            tpmResult = TPM_RC_FAILURE;
+            stop = true;
+            current = (current + 1) % contextCount;
+            continue;
+        }
+        if ((next < IndexCount) && (stop == false))
+        {
+            segment.Buffer = &commands[next * TpmNvReadPublicCommand::FixedSize];
+            if (TpmOsSubmitCommand(reinterpret_cast<uintptr_t>(contexts[current]),
+                                   &segment,
+                                   1,
+                                   nullptr) != false)
+            {
+                positions[current] = next++;
+                busy[current] = true;
+                inFlight++;
+            }
+            else
+            {
+                tpmResult = TPM_RC_FAILURE;
+                stop = true;
+            }
+        }
+
+        //
+        // Decode the public area, caching it on our own handle, and hand it out
+        //
+        result = TpmpNvDecodePublic(context,
+                                    contexts[current]->ResponseBuffer,
+                                    contexts[current]->ResponseBufferSize,
+                                    IndexArray[position],
+                                    &entry);
+        attributes = 0;
+        ownerRights = 0;
+        authRights = 0;
+        dataSize = 0;
+        if (result == TPM_RC_SUCCESS)
+        {
+            TpmpNvConvertPublic(&entry, &attributes, &ownerRights, &authRights, &dataSize);
+        }
+        if ((stop == false) &&
+            (Callback(CallbackContext,
+                      position,
+                      result,
+                      attributes,
+                      ownerRights,
+                      authRights,
+                      dataSize) == false))
+        {
+            tpmResult = TPM_RC_CANCELED;
+            stop = true;
+        }
+        current = (current + 1) % contextCount;
+    }
+
+    //
+    // Close the other handles that were opened
+    //
+    for (i = 1; i < contextCount; i++)
+    {
+        TpmOsClose(reinterpret_cast<uintptr_t>(contexts[i]));
+    }
+    free(commands);
+    return tpmResult;
+}
+
+uint32_t
+TpmpNvNextDifference (
+    const uint8_t* Current,
+    const uint8_t* Data,
+    uint32_t Position,
+    uint32_t DataSize
+    )
+{
+    //
+    // Skip over whole blocks that did not change, which the C library compares
+    // with vector instructions, and then find the byte that did.
+    //
+    while (((Position + TPM_NV_DIFF_BLOCK) <= DataSize) &&
+           (memcmp(&Current[Position], &Data[Position], TPM_NV_DIFF_BLOCK) == 0))
+    {
+        Position += TPM_NV_DIFF_BLOCK;
+    }
+    while ((Position < DataSize) && (Current[Position] == Data[Position]))
+    {
+        Position++;
+    }
+    return Position;
+}
+
+uint32_t
+TpmpNvRunEnd (
+    const uint8_t* Current,
+    const uint8_t* Data,
+    uint32_t Position,
+    uint32_t DataSize
+    )
+{
+    uint32_t next;
+
+    for (;;)
+    {
+        //
+        // Find the end of the bytes that changed
+        //
+        while ((Position < DataSize) && (Current[Position] != Data[Position]))
+        {
+            Position++;
+        }
+        if (Position == DataSize)
+        {
+            return Position;
+        }
+
+        //
+        // Keep going if more bytes change soon enough, as rewriting the few
+        // bytes in between costs less than another write command.
+        //
+        next = TpmpNvNextDifference(Current, Data, Position, DataSize);
+        if ((next == DataSize) || ((next - Position) >= TPM_NV_DIFF_GAP))
+        {
+            return Position;
+        }
+        Position = next;
+    }
+}
+
+TPM_RC
+TpmNvWriteChanges (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX HandleIndex,
+    uint16_t AuthorizationSize,
+    uint8_t* AuthorizationData,
+    uint16_t Offset,
+    uint16_t DataSize,
+    const uint8_t* Current,
+    const uint8_t* Data,
+    PTPM_NV_WRITE_STATISTICS Statistics
+    )
+{
+    uint16_t chunkSize;
+    uint32_t position;
+    uint32_t end;
+    TPM_RC tpmResult;
+
+    //
+    // Every write is split in chunks of the same size, which is what the full
+    // write would have been.
+    //
+    memset(Statistics, 0, sizeof(*Statistics));
+    chunkSize = TpmNvWriteChunkSize(TpmHandle, AuthorizationSize);
+    if ((chunkSize == 0) || (DataSize == 0))
+    {
+        return TPM_RC_COMMAND_SIZE;
+    }
+    Statistics->WritesAvoided = (DataSize + chunkSize - 1) / chunkSize;
+
+    //
+    // Write each run of bytes that changed, merging the ones that are close
+    //
+    tpmResult = TPM_RC_SUCCESS;
+    position = TpmpNvNextDifference(Current, Data, 0, DataSize);
+    while (position < DataSize)
+    {
+        end = TpmpNvRunEnd(Current, Data, position, DataSize);
+        tpmResult = TpmNvWrite2(TpmHandle,
+                                HandleIndex,
+                                AuthorizationSize,
+                                AuthorizationData,
+                                static_cast<uint16_t>(Offset + position),
+                                static_cast<uint16_t>(end - position),
+                                &Data[position]);
+        if (tpmResult != TPM_RC_SUCCESS)
+        {
+            break;
+        }
+        Statistics->BytesWritten += static_cast<uint16_t>(end - position);
+        Statistics->WritesIssued += (end - position + chunkSize - 1) / chunkSize;
+        position = TpmpNvNextDifference(Current, Data, end, DataSize);
+    }
+
+    //
+    // Return how much was saved compared to a full write
+    //
+    Statistics->BytesSkipped = DataSize - Statistics->BytesWritten;
+    Statistics->WritesAvoided -= (Statistics->WritesIssued < Statistics->WritesAvoided) ?
+                                 Statistics->WritesIssued : Statistics->WritesAvoided;
+    return tpmResult;
+}
+
+TPM_RC
+TpmNvWriteDifferential (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX HandleIndex,
+    uint16_t AuthorizationSize,
+    uint8_t* AuthorizationData,
+    uint16_t Offset,
+    uint16_t DataSize,
+    const uint8_t* Data,
+    PTPM_NV_WRITE_STATISTICS Statistics
+    )
+{
+    TPM_NV_CACHE_ENTRY entry;
+    uint8_t* current;
+    uint16_t chunkSize;
+    TPM_RC tpmResult;
+
+    //
+    // Every write is split in chunks of the same size, which is what the full
+    // write would have been.
+    //
+    memset(Statistics, 0, sizeof(*Statistics));
+    chunkSize = TpmNvWriteChunkSize(TpmHandle, AuthorizationSize);
+    if ((chunkSize == 0) || (DataSize == 0))
+    {
+        return TPM_RC_COMMAND_SIZE;
+    }
+    Statistics->WritesAvoided = (DataSize + chunkSize - 1) / chunkSize;
+
+    //
+    // Indices that must be written all at once, or that were never written,
+    // can only get a full write. So does one whose contents can't be read back.
+    //
+    current = nullptr;
+    tpmResult = TpmpNvReadPublic(reinterpret_cast<PTPM_CONTEXT>(TpmHandle),
+                                 HandleIndex,
+                                 false,
+                                 &entry);
+    if ((tpmResult != TPM_RC_SUCCESS) ||
+        ((entry.Attributes & TPMA_NV_WRITEALL) != 0) ||
+        ((entry.Attributes & TPMA_NV_WRITTEN) == 0))
+    {
+        goto FullWrite;
+    }
+    current = static_cast<uint8_t*>(malloc(DataSize));
+    if ((current == nullptr) ||
+        (TpmNvRead2(TpmHandle,
+                    HandleIndex,
+                    AuthorizationSize,
+                    AuthorizationData,
+                    Offset,
+                    DataSize,
+                    current) != TPM_RC_SUCCESS))
+    {
+        goto FullWrite;
+    }
+
+    //
+    // Only write the runs of bytes that changed
+    //
+    tpmResult = TpmNvWriteChanges(TpmHandle,
+                                  HandleIndex,
+                                  AuthorizationSize,
+                                  AuthorizationData,
+                                  Offset,
+                                  DataSize,
+                                  current,
+                                  Data,
+                                  Statistics);
+    free(current);
+    return tpmResult;
+
+FullWrite:
+    //
+    // Write everything, as a regular write would
+    //
+    tpmResult = TpmNvWrite2(TpmHandle,
+                            HandleIndex,
+                            AuthorizationSize,
+                            AuthorizationData,
+                            Offset,
+                            DataSize,
+                            Data);
+    if (tpmResult == TPM_RC_SUCCESS)
+    {
+        Statistics->BytesWritten = DataSize;
+        Statistics->WritesIssued = Statistics->WritesAvoided;
+    }
+
+    //
+    // Return how much was saved compared to a full write
+    //
+    Statistics->BytesSkipped = DataSize - Statistics->BytesWritten;
+    Statistics->WritesAvoided -= (Statistics->WritesIssued < Statistics->WritesAvoided) ?
+                                 Statistics->WritesIssued : Statistics->WritesAvoided;
+    free(current);
+    return tpmResult;
+}
+
+TPM_RC
+TpmNvWriteCompressed (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX HandleIndex,
+    uint16_t AuthorizationSize,
+    uint8_t* AuthorizationData,
+    uint16_t Offset,
+    uint16_t DataSize,
+    const uint8_t* Data,
+    uint16_t* StoredSize
+    )
+{
+    TPM_NV_COMPRESSED_HEADER header;
+    TPM_NV_CACHE_ENTRY entry;
+    uint8_t* buffer;
+    uint32_t compressedSize;
+    TPM_RC tpmResult;
+
+    //
+    // The size of the index is needed to know whether the data will fit
+    //
+    *StoredSize = 0;
+    tpmResult = TpmpNvReadPublic(reinterpret_cast<PTPM_CONTEXT>(TpmHandle),
+                                 HandleIndex,
+                                 true,
+                                 &entry);
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        return tpmResult;
+    }
+
+    //
+    // Build the header and the data in one buffer, so it's written together
+    //
+    if (DataSize > (UINT16_MAX - sizeof(header)))
+    {
+        return TPM_RC_SIZE;
+    }
+    buffer = static_cast<uint8_t*>(malloc(sizeof(header) + DataSize));
+    if (buffer == nullptr)
+    {
+        return TPM_RC_FAILURE;
+    }
+
+    //
+    // Only keep the compressed data if it is smaller, otherwise store it as-is
+    //
+    header.Signature = TPM_NV_COMPRESSED_SIGNATURE;
+    header.Reserved = 0;
+    header.DataSize = DataSize;
+    if (TpmLzCompress(Data,
+                      DataSize,
+                      buffer + sizeof(header),
+                      DataSize,
+                      &compressedSize) &&
+        (compressedSize < DataSize))
+    {
+        header.Codec = TpmNvCodecLz;
+        header.StoredSize = static_cast<uint16_t>(compressedSize);
+    }
+    else
+    {
+        header.Codec = TpmNvCodecNone;
+        header.StoredSize = DataSize;
+        memcpy(buffer + sizeof(header), Data, DataSize);
+    }
+    memcpy(buffer, &header, sizeof(header));
 
     //
-    // Make space for the response
+    // Fail before writing anything if the header and the data don't fit in
+    // the index, returning how much room they need.
     //
-    replySize = TpmFixedResponseSize(reply);
-    reply = TpmpAllocateResponse(reply, replySize);
+    *StoredSize = static_cast<uint16_t>(sizeof(header) + header.StoredSize);
+    if ((static_cast<uint32_t>(Offset) + *StoredSize) > entry.DataSize)
+    {
+        free(buffer);
+        return TPM_RC_NV_RANGE;
+    }
 
     //
-    // Call the OS function
+    // Write it all, which needs fewer chunks than the original data did
     //
-    osResult = TpmOsIssueCommand(TpmHandle,
-                                 reinterpret_cast<uint8_t*>(command),
-                                 commandSize,
-                                 reinterpret_cast<uint8_t*>(reply),
-                                 replySize,
-                                 nullptr);
-    if (osResult == false)
-    {
-        return TPM_RC_FAILURE;
-    }
+    tpmResult = TpmNvWrite2(TpmHandle,
+                            HandleIndex,
+                            AuthorizationSize,
+                            AuthorizationData,
+                            Offset,
+                            *StoredSize,
+                            buffer);
+    free(buffer);
+    return tpmResult;
+}
+
+TPM_RC
+TpmNvReadCompressed (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX HandleIndex,
+    uint16_t AuthorizationSize,
+    uint8_t* AuthorizationData,
+    uint16_t Offset,
+    uint16_t MaximumSize,
+    uint16_t* DataSize,
+    uint8_t* Data,
+    uint16_t* StoredSize
+    )
+{
+    TPM_NV_COMPRESSED_HEADER header;
+    TPM_NV_CACHE_ENTRY entry;
+    uint8_t* buffer;
+    uint16_t readSize;
+    uint32_t rangeSize;
+    uint32_t storedSize;
+    uint32_t decompressedSize;
+    TPM_RC tpmResult;
 
     //
-    // Read the response code, keep going only if we got success
+    // The range holds the header along with up to the maximum size of stored
+    // data, and never goes past the end of the index.
     //
-    tpmResult = TpmReadResponseCode(reply);
+    *StoredSize = 0;
+    tpmResult = TpmpNvReadPublic(reinterpret_cast<PTPM_CONTEXT>(TpmHandle),
+                                 HandleIndex,
+                                 true,
+                                 &entry);
     if (tpmResult != TPM_RC_SUCCESS)
     {
         return tpmResult;
     }
+    if ((static_cast<uint32_t>(Offset) + sizeof(header)) > entry.DataSize)
+    {
+        return TPM_RC_NV_RANGE;
+    }
+    rangeSize = static_cast<uint32_t>(sizeof(header)) + MaximumSize;
+    if (rangeSize > (static_cast<uint32_t>(entry.DataSize) - Offset))
+    {
+        rangeSize = entry.DataSize - Offset;
+    }
 
     //
-    // Read the size of the variable back
-    //
-    *DataSize = OsSwap16(reply->NvPublic.DataSize);
-
-    //
-    // Read the attributes back
+    // Read as much of the range as fits in a single NV_Read, which is all of
+    // it for most compressed data.
     //
-    nvAtributes = OsSwap32(reply->NvPublic.Attributes);
+    buffer = static_cast<uint8_t*>(malloc(rangeSize));
+    if (buffer == nullptr)
+    {
+        return TPM_RC_FAILURE;
+    }
+    readSize = TpmpNvChunkSize(reinterpret_cast<PTPM_CONTEXT>(TpmHandle));
+    readSize = (rangeSize < readSize) ? static_cast<uint16_t>(rangeSize) : readSize;
+    tpmResult = TpmNvRead2(TpmHandle,
+                           HandleIndex,
+                           AuthorizationSize,
+                           AuthorizationData,
+                           Offset,
+                           readSize,
+                           buffer);
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        goto Exit;
+    }
 
     //
-    // Convert the owner rights into our format
+    // Make sure this is compressed data, which fits in the range
     //
-    *OwnerRights = ((((nvAtributes & TPMA_NV_OWNERREAD) ==
-                       TPMA_NV_OWNERREAD) * TpmToolReadAccess) |
-                    (((nvAtributes & TPMA_NV_OWNERWRITE) ==
-                       TPMA_NV_OWNERWRITE) * TpmToolWriteAccess));
+    tpmResult = TPM_RC_INTEGRITY;
+    memcpy(&header, buffer, sizeof(header));
+    storedSize = sizeof(header) + header.StoredSize;
+    if ((header.Signature != TPM_NV_COMPRESSED_SIGNATURE) || (storedSize > rangeSize))
+    {
+        goto Exit;
+    }
+    *StoredSize = static_cast<uint16_t>(storedSize);
 
     //
-    // Convert the auth rights into our format
+    // Then read the rest of it, if any
     //
-    *AuthRights = ((((nvAtributes & TPMA_NV_AUTHREAD) ==
-                      TPMA_NV_AUTHREAD) * TpmToolReadAccess) |
-                   (((nvAtributes & TPMA_NV_AUTHWRITE) ==
-                      TPMA_NV_AUTHWRITE) * TpmToolWriteAccess));
+    if (storedSize > readSize)
+    {
+        tpmResult = TpmNvRead2(TpmHandle,
+                               HandleIndex,
+                               AuthorizationSize,
+                               AuthorizationData,
+                               Offset + readSize,
+                               static_cast<uint16_t>(storedSize - readSize),
+                               buffer + readSize);
+        if (tpmResult != TPM_RC_SUCCESS)
+        {
+            goto Exit;
+        }
+        tpmResult = TPM_RC_INTEGRITY;
+    }
 
     //
-    // Finally, convert the rest of the attributes
+    // Return the original data if it fits, or its size if it doesn't
     //
-    *Attributes = ((((nvAtributes & TPMA_NV_READ_STCLEAR) ==
-                      TPMA_NV_READ_STCLEAR) * TpmToolReadLockable) |
-                   (((nvAtributes & TPMA_NV_WRITE_STCLEAR) ==
-                      TPMA_NV_WRITE_STCLEAR) * TpmToolWriteLockable) |
-                   (((nvAtributes & TPMA_NV_WRITEDEFINE) ==
-                      TPMA_NV_WRITEDEFINE) * TpmToolWriteOnce) |
-                   (((nvAtributes & TPMA_NV_WRITEALL) ==
-                       TPMA_NV_WRITEALL) * TpmToolWriteAll) |
-                   (((nvAtributes & TPMA_NV_NO_DA) ==
-                      TPMA_NV_NO_DA) * TpmToolNonProtected) |
-                   (((nvAtributes & TPMA_NV_ORDERLY) ==
-                      TPMA_NV_ORDERLY) * TpmToolCached) |
-                   (((nvAtributes & TPMA_NV_CLEAR_STCLEAR) ==
-                      TPMA_NV_CLEAR_STCLEAR) * TpmToolVolatileDirtyFlag) |
-                   (((nvAtributes & TPMA_NV_POLICY_DELETE) ==
-                      TPMA_NV_POLICY_DELETE) * TpmToolPermanent) |
-                   (((nvAtributes & TPMA_NV_READLOCKED) ==
-                      TPMA_NV_READLOCKED) * TpmToolReadLocked) |
-                   (((nvAtributes & TPMA_NV_WRITELOCKED) ==
-                      TPMA_NV_WRITELOCKED) * TpmToolWriteLocked) |
-                   (((nvAtributes & TPMA_NV_WRITTEN) ==
-                      TPMA_NV_WRITTEN) * TpmToolWritten) |
-                   (((nvAtributes & TPMA_NV_PLATFORMCREATE) ==
-                      TPMA_NV_PLATFORMCREATE) * TpmToolPlatformOwned));
+    if (header.DataSize > *DataSize)
+    {
+        *DataSize = header.DataSize;
+        tpmResult = TPM_RC_SIZE;
+        goto Exit;
+    }
+    if ((header.Codec == TpmNvCodecNone) && (header.StoredSize == header.DataSize))
+    {
+        memcpy(Data, buffer + sizeof(header), header.DataSize);
+    }
+    else if ((header.Codec != TpmNvCodecLz) ||
+             (TpmLzDecompress(buffer + sizeof(header),
+                              header.StoredSize,
+                              Data,
+                              header.DataSize,
+                              &decompressedSize) == false) ||
+             (decompressedSize != header.DataSize))
+    {
+        goto Exit;
+    }
+    *DataSize = header.DataSize;
+    tpmResult = TPM_RC_SUCCESS;
 
-    //
-    // Finally, return the TPM response code
-    //
+Exit:
+    free(buffer);
     return tpmResult;
 }
 
 TPM_RC
-TpmNvEnumerate2 (
+TpmEnumerateHandles (
     uintptr_t TpmHandle,
-    uint32_t* IndexCount,
-    TPM_NV_INDEX* IndexArray
+    TPM_HT HandleType,
+    PTPM_HANDLE_CALLBACK Callback,
+    void* CallbackContext
     )
 {
-    TPM_GET_CAPABILITY_CMD_HEADER* command;
-    TPM_GET_CAPABILITY_REPLY* reply;
+    PTPM_CONTEXT context;
+    TPM_MARSHAL_LIST handles;
+    uint32_t* pageHandles;
+    uint32_t pageSize;
     uint32_t commandSize;
-    uint32_t replySize;
-    bool osResult;
-    uint32_t i;
+    uint32_t capability;
+    uint32_t property;
+    uint32_t handle;
     uint32_t handleCount;
+    uint32_t i;
+    uint8_t moreData;
     TPM_RC tpmResult;
 
     //
-    // Allocate the command
+    // Ask for as many handles at a time as the TPM can return, which depends
+    // on its capability buffer, and as our response buffer can hold.
     //
-    commandSize = sizeof(*command);
-    command = TpmpAllocateCommand(command, commandSize);
+    context = reinterpret_cast<PTPM_CONTEXT>(TpmHandle);
+    pageSize = MAX_CAP_HANDLES;
+    if (TpmPropGet(context, TPM_PT_MAX_CAP_BUFFER) > (sizeof(TPM_CAP) + sizeof(uint32_t)))
+    {
+        pageSize = (TpmPropGet(context, TPM_PT_MAX_CAP_BUFFER) -
+                    sizeof(TPM_CAP) -
+                    sizeof(uint32_t)) / sizeof(TPM_HANDLE);
+    }
+    if (pageSize > ((context->ResponseBufferSize -
+                     TpmGetCapabilityResponse<TPM_HANDLE>::FixedSize) / sizeof(TPM_HANDLE)))
+    {
+        pageSize = (context->ResponseBufferSize -
+                    TpmGetCapabilityResponse<TPM_HANDLE>::FixedSize) / sizeof(TPM_HANDLE);
+    }
 
     //
-    // Fill out the TPM Command Header
+    // The handles of each page are copied out of the response buffer, so that
+    // the callback is free to issue its own commands.
     //
-    TpmpFillCommandHeader(&command->Header,
-                          TPM_CC_GetCapability,
-                          TPM_ST_NO_SESSIONS,
-                          commandSize);
+    pageHandles = static_cast<uint32_t*>(malloc(pageSize * sizeof(*pageHandles)));
+    if (pageHandles == nullptr)
+    {
+        return TPM_RC_FAILURE;
+    }
 
     //
-    // Fill in the property query request
+    // Walk the range of the handle type, one page at a time, for as long as
+    // the TPM says that there are more handles.
     //
-    handleCount = sizeof(reply->Data.Data.Handles.Handle) /
-                  sizeof(reply->Data.Data.Handles.Handle[0]);
-    command->Capability = static_cast<TPM_CAP>(OsSwap32(TPM_CAP_HANDLES));
-    command->Property = static_cast<TPM_PT>(OsSwap32(HR_NV_INDEX));
-    command->PropertyCount = OsSwap32(handleCount);
+    property = static_cast<uint32_t>(HandleType) << HR_SHIFT;
+    do
+    {
+        commandSize = TpmGetCapabilityCommand::Marshal(context->CommandBuffer,
+                                                       context->CommandBufferSize,
+                                                       TPM_CAP_HANDLES,
+                                                       property,
+                                                       pageSize);
+        tpmResult = TpmpIssueCommand(TpmHandle, commandSize);
+        if (tpmResult != TPM_RC_SUCCESS)
+        {
+            goto Exit;
+        }
+        if ((TpmGetCapabilityResponse<TPM_HANDLE>::Unmarshal(context->ResponseBuffer,
+                                                             context->ResponseBufferSize,
+                                                             &moreData,
+                                                             &capability,
+                                                             &handles) == false) ||
+            (capability != TPM_CAP_HANDLES) ||
+            (handles.Count > pageSize))
+        {
+            tpmResult = TPM_RC_FAILURE;
+            goto Exit;
+        }
+        handleCount = handles.Count;
+        for (i = 0; i < handleCount; i++)
+        {
+            pageHandles[i] = TpmDecodeInteger<uint32_t>(&handles.Data[i * sizeof(TPM_HANDLE)]);
+        }
 
-    //
-    // Make space for the response
-    //
-    replySize = TpmFixedResponseSize(reply);
-    reply = TpmpAllocateResponse(reply, replySize);
+        //
+        // Hand out each handle. The next page starts right after the last one,
+        // staying within the range that was asked for, as some types (such as
+        // loaded sessions) return handles of more than one type.
+        //
+        for (i = 0; i < handleCount; i++)
+        {
+            handle = pageHandles[i];
+            if ((handle & HR_HANDLE_MASK) < (property & HR_HANDLE_MASK))
+            {
+                tpmResult = TPM_RC_FAILURE;
+                goto Exit;
+            }
+            if (Callback(CallbackContext, handle) == false)
+            {
+                tpmResult = TPM_RC_CANCELED;
+                goto Exit;
+            }
+            property = (property & HR_RANGE_MASK) | ((handle + 1) & HR_HANDLE_MASK);
+        }
+    } while ((moreData != 0) &&
+             (handleCount != 0) &&
+             ((property & HR_HANDLE_MASK) != 0));
+    tpmResult = TPM_RC_SUCCESS;
+
+Exit:
+    free(pageHandles);
+    return tpmResult;
+}
+
+bool
+TpmpNvEnumerateCopy (
+    void* Context,
+    uint32_t Handle
+    )
+{
+    PTPM_NV_ENUMERATE_CONTEXT context;
 
     //
-    // Call the OS function
+    // Store the index if there's still room for it, but count it regardless
     //
-    osResult = TpmOsIssueCommand(TpmHandle,
-                                 reinterpret_cast<uint8_t*>(command),
-                                 commandSize,
-                                 reinterpret_cast<uint8_t*>(reply),
-                                 replySize,
-                                 nullptr);
-    if (osResult == false)
+    context = static_cast<PTPM_NV_ENUMERATE_CONTEXT>(Context);
+    if (context->Count < context->Capacity)
     {
-        return TPM_RC_FAILURE;
+        context->Array[context->Count].Value = Handle;
     }
+    context->Count++;
+    return true;
+}
+
+TPM_RC
+TpmNvEnumerate2 (
+    uintptr_t TpmHandle,
+    uint32_t* IndexCount,
+    TPM_NV_INDEX* IndexArray
+    )
+{
+    TPM_NV_ENUMERATE_CONTEXT context;
+    TPM_RC tpmResult;
 
     //
-    // Read the response code, keep going only if we got success
+    // Enumerate all the NV handles, returning as many as the caller has room
+    // for, along with how many there really are.
     //
-    tpmResult = TpmReadResponseCode(reply);
-    if (tpmResult != TPM_RC_SUCCESS)
+    context.Array = IndexArray;
+    context.Capacity = (IndexArray != nullptr) ? *IndexCount : 0;
+    context.Count = 0;
+    tpmResult = TpmEnumerateHandles(TpmHandle,
+                                    TPM_HT_NV_INDEX,
+                                    TpmpNvEnumerateCopy,
+                                    &context);
+    if (tpmResult == TPM_RC_SUCCESS)
     {
-        return tpmResult;
+        *IndexCount = context.Count;
     }
+    return tpmResult;
+}
+
+bool
+TpmpNvEnumerateGrow (
+    void* Context,
+    uint32_t Handle
+    )
+{
+    PTPM_NV_ENUMERATE_CONTEXT context;
+    TPM_NV_INDEX* array;
 
     //
-    // Now we know how many NV handles exist. Did the caller specify a smaller
-    // number?
+    // Grow the array as needed, and add the index to it
     //
-    handleCount = OsSwap32(reply->Data.Data.Handles.Count);
-    if (*IndexCount < handleCount)
+    context = static_cast<PTPM_NV_ENUMERATE_CONTEXT>(Context);
+    if (context->Count == context->Capacity)
     {
-        //
-        // In this case, use the caller's number, and also let them know what
-        // the true count is.
-        //
-        handleCount = *IndexCount;
-        *IndexCount = OsSwap32(reply->Data.Data.Handles.Count);
+        array = static_cast<TPM_NV_INDEX*>(
+            realloc(context->Array,
+                    (context->Capacity + MAX_CAP_HANDLES) * sizeof(*array)));
+        if (array == nullptr)
+        {
+            return false;
+        }
+        context->Array = array;
+        context->Capacity += MAX_CAP_HANDLES;
     }
+    context->Array[context->Count++].Value = Handle;
+    return true;
+}
+
+TPM_RC
+TpmNvEnumerateAll (
+    uintptr_t TpmHandle,
+    uint32_t* IndexCount,
+    TPM_NV_INDEX** IndexArray
+    )
+{
+    TPM_NV_ENUMERATE_CONTEXT context;
+    TPM_RC tpmResult;
 
     //
-    // Enumerate either all the handles, or as few as the caller asked for
+    // Enumerate all the NV handles into an array that grows to hold them, and
+    // which the caller frees.
     //
-    for (i = 0; i < handleCount; i++)
+    context.Array = nullptr;
+    context.Capacity = 0;
+    context.Count = 0;
+    tpmResult = TpmEnumerateHandles(TpmHandle,
+                                    TPM_HT_NV_INDEX,
+                                    TpmpNvEnumerateGrow,
+                                    &context);
+    if (tpmResult != TPM_RC_SUCCESS)
     {
-        IndexArray[i].Value = OsSwap32(reply->Data.Data.Handles.Handle[i].Value);
+        free(context.Array);
+        context.Array = nullptr;
+        context.Count = 0;
+        if (tpmResult == TPM_RC_CANCELED)
+        {
+            tpmResult = TPM_RC_FAILURE;
+        }
     }
-
-    //
-    // Finally, return the TPM response code
-    //
+    *IndexCount = context.Count;
+    *IndexArray = context.Array;
     return tpmResult;
 }
 
@@ -839,57 +2348,72 @@ TpmGetRandom (
     uint8_t* RandomBytes
     )
 {
-    TPM_GET_RANDOM_CMD_HEADER* command;
-    TPM_GET_RANDOM_REPLY* reply;
+    PTPM_CONTEXT context;
+    TPM_MARSHAL_BYTES randomBytes;
     uint32_t commandSize;
-    uint32_t replySize;
-    uint16_t bytesReturned;
-    bool osResult;
     TPM_RC tpmResult;
 
     //
-    // Allocate the command
+    // Build the command with the number of bytes requested
     //
-    commandSize = sizeof(*command);
-    command = TpmpAllocateCommand(command, commandSize);
+    context = reinterpret_cast<PTPM_CONTEXT>(TpmHandle);
+    commandSize = TpmGetRandomCommand::Marshal(context->CommandBuffer,
+                                               context->CommandBufferSize,
+                                               *BytesRequested);
 
     //
-    // Fill out the TPM Command Header
+    // Send it, keep going only if we got success
     //
-    TpmpFillCommandHeader(&command->Header,
-                          TPM_CC_GetRandom,
-                          TPM_ST_NO_SESSIONS,
-                          commandSize);
+    tpmResult = TpmpIssueCommand(TpmHandle, commandSize);
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        return tpmResult;
+    }
 
     //
-    // Fill in the get random query request
+    // Read and return the response data, which may be less than requested
     //
-    command->BytesRequested = OsSwap16(*BytesRequested);
+    if ((TpmGetRandomResponse::Unmarshal(context->ResponseBuffer,
+                                         context->ResponseBufferSize,
+                                         &randomBytes) == false) ||
+        (randomBytes.Size > *BytesRequested))
+    {
+        return TPM_RC_FAILURE;
+    }
+    memcpy(RandomBytes, randomBytes.Data, randomBytes.Size);
+    *BytesRequested = randomBytes.Size;
 
     //
-    // Make space for the response
+    // Finally, return the TPM response code
     //
-    replySize = TpmFixedResponseSize(reply);
-    reply = TpmpAllocateResponse(reply, replySize);
+    return tpmResult;
+}
+
+TPM_RC
+TpmReadClock (
+    uintptr_t TpmHandle,
+    uint64_t* Time,
+    uint64_t* Clock,
+    uint32_t* ResetCount,
+    uint32_t* RestartCount,
+    TPMI_YES_NO* IsSafe
+    )
+{
+    PTPM_CONTEXT context;
+    uint32_t commandSize;
+    TPM_RC tpmResult;
 
     //
-    // Call the OS function
+    // Build the command, which has no parameters
     //
-    osResult = TpmOsIssueCommand(TpmHandle,
-                                 reinterpret_cast<uint8_t*>(command),
-                                 commandSize,
-                                 reinterpret_cast<uint8_t*>(reply),
-                                 replySize,
-                                 nullptr);
-    if (osResult == false)
-    {
-        return TPM_RC_FAILURE;
-    }
+    context = reinterpret_cast<PTPM_CONTEXT>(TpmHandle);
+    commandSize = TpmReadClockCommand::Marshal(context->CommandBuffer,
+                                               context->CommandBufferSize);
 
     //
-    // Read the response code, keep going only if we got success
+    // Send it, keep going only if we got success
     //
-    tpmResult = TpmReadResponseCode(reply);
+    tpmResult = TpmpIssueCommand(TpmHandle, commandSize);
     if (tpmResult != TPM_RC_SUCCESS)
     {
         return tpmResult;
@@ -898,12 +2422,16 @@ TpmGetRandom (
     //
     // Read and return the response data
     //
-    bytesReturned = OsSwap16(reply->RandomBytes.BufferSize);
-    for (int i = 0; i < bytesReturned; i++)
+    if (TpmReadClockResponse::Unmarshal(context->ResponseBuffer,
+                                        context->ResponseBufferSize,
+                                        Time,
+                                        Clock,
+                                        ResetCount,
+                                        RestartCount,
+                                        IsSafe) == false)
     {
-        RandomBytes[i] = reply->RandomBytes.Buffer.Digest.Sha256[i - 2];
+        return TPM_RC_FAILURE;
     }
-    *BytesRequested = bytesReturned;
 
     //
     // Finally, return the TPM response code
@@ -912,165 +2440,283 @@ TpmGetRandom (
 }
 
 TPM_RC
-TpmReadClock (
+TpmpHashSequence (
     uintptr_t TpmHandle,
-    uint64_t* Time,
-    uint64_t* Clock,
-    uint32_t* RestartCount,
-    uint32_t* ResetCount,
-    TPMI_YES_NO* IsSafe
+    uint32_t InputSize,
+    const uint8_t* InputData,
+    uint32_t BufferSize,
+    uint8_t* OutputData
     )
 {
-    TPM_READ_CLOCK_CMD_HEADER* command;
-    TPM_READ_CLOCK_REPLY* reply;
+    TPM_COMMAND_SEGMENT segments[TpmSequenceCompleteCommand::MaximumSegments];
+    PTPM_CONTEXT context;
+    TPM_MARSHAL_BYTES result;
+    TPM_MARSHAL_BYTES ticketDigest;
+    uint32_t sequenceHandle;
+    uint32_t segmentCount;
     uint32_t commandSize;
-    uint32_t replySize;
-    bool osResult;
+    uint32_t ticketHierarchy;
+    uint16_t ticketTag;
     TPM_RC tpmResult;
 
     //
-    // Allocate the command
+    // Don't bother the TPM if it was found to not implement hash sequences
     //
-    commandSize = sizeof(*command);
-    command = TpmpAllocateCommand(command, commandSize);
-
-    //
-    // Fill out the TPM Command Header
-    //
-    TpmpFillCommandHeader(&command->Header,
-                          TPM_CC_ReadClock,
-                          TPM_ST_NO_SESSIONS,
-                          commandSize);
+    context = reinterpret_cast<PTPM_CONTEXT>(TpmHandle);
+    if (TpmPropHasCommand(context, TPM_CC_HashSequenceStart) == false)
+    {
+        return TPM_RC_COMMAND_CODE;
+    }
 
     //
-    // Make space for the response
+    // Start a SHA-2 sequence with an empty password
     //
-    replySize = TpmFixedResponseSize(reply);
-    reply = TpmpAllocateResponse(reply, replySize);
+    commandSize = TpmHashSequenceStartCommand::Marshal(context->CommandBuffer,
+                                                       context->CommandBufferSize,
+                                                       TpmConstant,
+                                                       TpmConstant);
+    tpmResult = TpmpIssueCommand(TpmHandle, commandSize);
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        return tpmResult;
+    }
+    if (TpmHashSequenceStartResponse::Unmarshal(context->ResponseBuffer,
+                                                context->ResponseBufferSize,
+                                                &sequenceHandle) == false)
+    {
+        return TPM_RC_FAILURE;
+    }
 
     //
-    // Call the OS function
+    // Feed it everything but the last buffer, each sent as-is from the input
     //
-    osResult = TpmOsIssueCommand(TpmHandle,
-                                 reinterpret_cast<uint8_t*>(command),
-                                 commandSize,
-                                 reinterpret_cast<uint8_t*>(reply),
-                                 replySize,
-                                 nullptr);
-    if (osResult == false)
+    while (InputSize > BufferSize)
     {
-        return TPM_RC_FAILURE;
+        segmentCount = TpmSequenceUpdateCommand::MarshalSegments(context->CommandBuffer,
+                                                                 context->CommandBufferSize,
+                                                                 segments,
+                                                                 sequenceHandle,
+                                                                 TPM_MARSHAL_BYTES{ nullptr, 0 },
+                                                                 TPM_MARSHAL_BYTES{
+                                                                     InputData,
+                                                                     static_cast<uint16_t>(BufferSize) });
+        tpmResult = TpmpIssueSegments(TpmHandle, segments, segmentCount);
+        if (tpmResult != TPM_RC_SUCCESS)
+        {
+            goto Flush;
+        }
+        InputData += BufferSize;
+        InputSize -= BufferSize;
     }
 
     //
-    // Read the response code, keep going only if we got success
+    // Complete it with the last buffer, in the NULL hierarchy
     //
-    tpmResult = TpmReadResponseCode(reply);
+    segmentCount = TpmSequenceCompleteCommand::MarshalSegments(context->CommandBuffer,
+                                                               context->CommandBufferSize,
+                                                               segments,
+                                                               sequenceHandle,
+                                                               TPM_MARSHAL_BYTES{ nullptr, 0 },
+                                                               TPM_MARSHAL_BYTES{
+                                                                   InputData,
+                                                                   static_cast<uint16_t>(InputSize) },
+                                                               TpmConstant);
+    tpmResult = TpmpIssueSegments(TpmHandle, segments, segmentCount);
     if (tpmResult != TPM_RC_SUCCESS)
     {
-        return tpmResult;
+        goto Flush;
     }
 
     //
     // Read and return the response data
     //
-    *Time = OsSwap64(reply->TimeInfo.Time);
-    *Clock = OsSwap64(reply->TimeInfo.ClockInfo.Clock);
-    *RestartCount = OsSwap32(reply->TimeInfo.ClockInfo.RestartCount);
-    *ResetCount = OsSwap32(reply->TimeInfo.ClockInfo.ResetCount);
-    *IsSafe = reply->TimeInfo.ClockInfo.Safe;
+    if ((TpmSequenceCompleteResponse::Unmarshal(context->ResponseBuffer,
+                                                context->ResponseBufferSize,
+                                                &result,
+                                                &ticketTag,
+                                                &ticketHierarchy,
+                                                &ticketDigest) == false) ||
+        (result.Size != TPM_SHA256_DIGEST_SIZE))
+    {
+        return TPM_RC_FAILURE;
+    }
+    memcpy(OutputData, result.Data, result.Size);
+    return tpmResult;
 
+Flush:
     //
-    // Finally, return the TPM response code
+    // A sequence that failed half-way still holds an object slot in the TPM
     //
+    commandSize = TpmFlushContextCommand::Marshal(context->CommandBuffer,
+                                                  context->CommandBufferSize,
+                                                  sequenceHandle);
+    TpmpIssueCommand(TpmHandle, commandSize);
     return tpmResult;
 }
 
 TPM_RC
 TpmHash (
     uintptr_t TpmHandle,
-    uint16_t InputSize,
-    uint8_t* InputData,
+    uint32_t InputSize,
+    const uint8_t* InputData,
     uint8_t* OutputData
     )
 {
-    TPM_HASH_CMD_HEADER* commandHeader;
-    TPM_HASH_CMD_BODY* commandData;
-    TPM_HASH_CMD_FOOTER* commandFooter;
-    TPM_HASH_CMD_REPLY* reply;
-    uint32_t commandSize;
-    uint32_t replySize;
-    uint16_t bytesReturned;
-    bool osResult;
+    TPM_COMMAND_SEGMENT segments[TpmHashCommand::MaximumSegments];
+    PTPM_CONTEXT context;
+    TPM_MARSHAL_BYTES outHash;
+    TPM_MARSHAL_BYTES ticketDigest;
+    uint32_t bufferSize;
+    uint32_t segmentCount;
+    uint32_t ticketHierarchy;
+    uint16_t ticketTag;
     TPM_RC tpmResult;
 
     //
-    // Allocate the command
+    // Don't bother the TPM if it was found to not implement SHA-2
+    //
+    context = reinterpret_cast<PTPM_CONTEXT>(TpmHandle);
+    if (TpmPropHasAlgorithm(context, TPM_ALG_SHA256) == false)
+    {
+        return TPM_RC_HASH;
+    }
+
+    //
+    // Input that does not fit in a single buffer goes through a sequence
     //
-    commandSize = sizeof(*commandHeader) + sizeof(*commandFooter) + InputSize + sizeof(uint16_t);
-    commandHeader = TpmpAllocateCommand(commandHeader, commandSize);
+    bufferSize = TpmPropGet(context, TPM_PT_INPUT_BUFFER);
+    if ((bufferSize == 0) || (bufferSize > UINT16_MAX))
+    {
+        bufferSize = TPM_HASH_BUFFER_DEFAULT;
+    }
+    if (InputSize > bufferSize)
+    {
+        return TpmpHashSequence(TpmHandle, InputSize, InputData, bufferSize, OutputData);
+    }
 
     //
-    // Fill out the TPM Command Header
+    // Build the command around the input buffer, which is sent as-is, using
+    // SHA-2 (always, for now) and the NULL hierarchy.
     //
-    TpmpFillCommandHeader(&commandHeader->Header,
-                          TPM_CC_Hash,
-                          TPM_ST_NO_SESSIONS,
-                          commandSize);
+    segmentCount = TpmHashCommand::MarshalSegments(context->CommandBuffer,
+                                                   context->CommandBufferSize,
+                                                   segments,
+                                                   TPM_MARSHAL_BYTES{
+                                                       InputData,
+                                                       static_cast<uint16_t>(InputSize) },
+                                                   TpmConstant,
+                                                   TpmConstant);
 
     //
-    // Fill out the command body, which contains the input buffer
+    // Send it, keep going only if we got success
     //
-    commandData = (TPM_HASH_CMD_BODY*)(commandHeader + 1);
-    commandData->Size = OsSwap16(InputSize);
-    for (int i = 0; i < InputSize; i++)
+    tpmResult = TpmpIssueSegments(TpmHandle, segments, segmentCount);
+    if (tpmResult != TPM_RC_SUCCESS)
     {
-        commandData->Buffer[i] = InputData[i];
+        return tpmResult;
     }
 
     //
-    // Fill out the footer with the algorithm chosen (always SHA-2 for now) and hierachy
+    // Read and return the response data
     //
-    commandFooter = (TPM_HASH_CMD_FOOTER*)((uint8_t*)commandData + InputSize + sizeof(uint16_t));
-    commandFooter->AlgHash = static_cast<TPMI_ALG_HASH>(OsSwap16(TPM_ALG_SHA256));
-    commandFooter->Hierarchy.Value = OsSwap32(TPM_RH_NULL.Value);
+    if ((TpmHashResponse::Unmarshal(context->ResponseBuffer,
+                                    context->ResponseBufferSize,
+                                    &outHash,
+                                    &ticketTag,
+                                    &ticketHierarchy,
+                                    &ticketDigest) == false) ||
+        (outHash.Size != TPM_SHA256_DIGEST_SIZE))
+    {
+        return TPM_RC_FAILURE;
+    }
+    memcpy(OutputData, outHash.Data, outHash.Size);
 
     //
-    // Make space for the response
+    // Finally, return the TPM response code
     //
-    replySize = TpmFixedResponseSize(reply);
-    reply = TpmpAllocateResponse(reply, replySize);
+    return tpmResult;
+}
+
+TPM_RC
+TpmGetProperties (
+    uintptr_t TpmHandle,
+    TPM_PT Property,
+    uint32_t PropertyCount,
+    uint32_t* Values
+    )
+{
+    PTPM_CONTEXT context;
+    TPM_MARSHAL_LIST properties;
+    const uint8_t* property;
+    uint32_t commandSize;
+    uint32_t capability;
+    uint32_t i;
+    uint32_t j;
+    uint8_t moreData;
+    TPM_RC tpmResult;
 
     //
-    // Call the OS function
+    // Fixed properties were already discovered when the handle was opened
     //
-    osResult = TpmOsIssueCommand(TpmHandle,
-                                 reinterpret_cast<uint8_t*>(commandHeader),
-                                 commandSize,
-                                 reinterpret_cast<uint8_t*>(reply),
-                                 replySize,
-                                 nullptr);
-    if (osResult == false)
+    context = reinterpret_cast<PTPM_CONTEXT>(TpmHandle);
+    if ((context->PropertiesValid != false) &&
+        (Property >= PT_FIXED) &&
+        (PropertyCount <= TPM_PROPERTY_FIXED_COUNT) &&
+        ((Property + PropertyCount) <= (PT_FIXED + TPM_PROPERTY_FIXED_COUNT)))
     {
-        return TPM_RC_FAILURE;
+        for (i = 0; i < PropertyCount; i++)
+        {
+            Values[i] = context->Properties.Fixed[Property - PT_FIXED + i];
+        }
+        return TPM_RC_SUCCESS;
     }
 
     //
-    // Read the response code, keep going only if we got success
+    // Build the command with the property query request
+    //
+    commandSize = TpmGetCapabilityCommand::Marshal(context->CommandBuffer,
+                                                   context->CommandBufferSize,
+                                                   TPM_CAP_TPM_PROPERTIES,
+                                                   Property,
+                                                   PropertyCount);
+
+    //
+    // Send it, keep going only if we got success
     //
-    tpmResult = TpmReadResponseCode(reply);
+    tpmResult = TpmpIssueCommand(TpmHandle, commandSize);
     if (tpmResult != TPM_RC_SUCCESS)
     {
         return tpmResult;
     }
 
     //
-    // Read and return the response data
+    // Decode the property list
+    //
+    if (TpmGetCapabilityResponse<TPMS_TAGGED_PROPERTY>::Unmarshal(context->ResponseBuffer,
+                                                                  context->ResponseBufferSize,
+                                                                  &moreData,
+                                                                  &capability,
+                                                                  &properties) == false)
+    {
+        return TPM_RC_FAILURE;
+    }
+
+    //
+    // Properties the TPM does not implement are skipped in the response, so
+    // return zero for them, and the value of each of the ones that it did.
     //
-    bytesReturned = OsSwap16(reply->OutHash.BufferSize);
-    for (int i = 0; i < bytesReturned; i++)
+    for (i = 0; i < PropertyCount; i++)
     {
-        OutputData[i] = reply->OutHash.Buffer.Digest.Sha256[i - 2];
+        Values[i] = 0;
+    }
+    for (i = 0; i < properties.Count; i++)
+    {
+        property = &properties.Data[i * sizeof(TPMS_TAGGED_PROPERTY)];
+        j = TpmDecodeInteger<uint32_t>(property) - Property;
+        if (j < PropertyCount)
+        {
+            Values[j] = TpmDecodeInteger<uint32_t>(property + sizeof(uint32_t));
+        }
     }
 
     //
@@ -8,9 +8,9 @@ Module Name:
 
 Abstract:
 
-    This header provides helper macros that simplify the construction of some
-    of the variable-sized TPM2.0 command and reply structures that are needed,
-    especially when using password authentication.
+    This header provides the internal definitions used to construct TPM2.0
+    commands and send them through a transport, including the compile-time
+    marshalling of each command and its reply.
 
 Author:
 
@@ -23,103 +23,461 @@ Environment:
 --*/
 
 #pragma once
-#include <type_traits>
+#ifdef _MSC_VER
+#include <stdlib.h>
+#endif
 
 //
-// This macro calculates the size of a variable data command made up of
-// A static-size header (including TPM_CMD_HEADER)
-// A dynamic-size data blob
-// A dynamic-size authorization session
-// A static-size footer
+// Endian swapping helpers, implemented with the compiler intrinsics so that
+// they are inlined into every marshalling routine instead of being called.
 //
-#define TpmVariableCmdSize(header, authSize, data, size, footer)    \
-    ((offsetof(std::remove_reference<decltype(*header)>::type,      \
-               AuthSession.Password)) +                             \
-     (authSize) +                                                   \
-     (offsetof(std::remove_reference<decltype(*data)>::type,        \
-               Data)) +                                             \
-     (size) +                                                       \
-     (sizeof(*footer)))
+static inline
+uint16_t
+OsSwap16 (
+    uint16_t Input
+    )
+{
+#ifdef _MSC_VER
+    return _byteswap_ushort(Input);
+#else
+    return __builtin_bswap16(Input);
+#endif
+}
+
+static inline
+uint32_t
+OsSwap32 (
+    uint32_t Input
+    )
+{
+#ifdef _MSC_VER
+    return _byteswap_ulong(Input);
+#else
+    return __builtin_bswap32(Input);
+#endif
+}
+
+static inline
+uint64_t
+OsSwap64 (
+    uint64_t Input
+    )
+{
+#ifdef _MSC_VER
+    return _byteswap_uint64(Input);
+#else
+    return __builtin_bswap64(Input);
+#endif
+}
 
 //
-// This macro calculates the size of a fixed data command made up of
-// A static-size header (including TPM_CMD_HEADER)
-// A dynamic-size authorization session
-// A static-size footer
+// Size of a SHA-256 digest, which is the only hash algorithm used
 //
-#define TpmFixedCmdSize(header, authSize, footer)                   \
-    ((offsetof(std::remove_reference<decltype(*header)>::type,      \
-               AuthSession.Password)) +                             \
-     (authSize) +                                                   \
-     (sizeof(*footer)))
+#define TPM_SHA256_DIGEST_SIZE      32
 
 //
-// This macro calculates the size of an empty data command made up of
-// A static-size header (including TPM_CMD_HEADER)
-// A dynamic-size authorization session
+// A command can be made up of several segments, such that large payloads are
+// sent straight from the caller's buffer instead of being copied in the middle
+// of the command buffer.
 //
-#define TpmEmptyCmdSize(header, authSize)                           \
-    ((offsetof(std::remove_reference<decltype(*header)>::type,      \
-               AuthSession.Password)) +                             \
-     (authSize))
+#define TPM_MAX_COMMAND_SEGMENTS    3
+
+typedef struct _TPM_COMMAND_SEGMENT
+{
+    const uint8_t* Buffer;
+    uint32_t Length;
+} TPM_COMMAND_SEGMENT, *PTPM_COMMAND_SEGMENT;
 
 //
-// This macro allocates a TPM 2.0 Command Buffer on the stack
+// Dispatch table for a transport, which is any backend able to deliver TPM2.0
+// commands and return their responses (the OS stack, a simulator, ...). Only
+// transports that can send a command from several segments at once implement
+// IssueCommandV, otherwise the segments are first gathered in one buffer.
+// Transports that can queue a command and collect its response later also
+// implement Submit and Receive, which allows the caller to work while the TPM
+// is executing the command. Transports where each open gets its own resource
+// manager context allow for more than one of them to have a command in flight.
 //
-#define TpmpAllocateCommand(header, commandSize)                    \
-    reinterpret_cast<decltype(header)>(alloca(commandSize));
+typedef struct _TPM_TRANSPORT
+{
+    const char* Name;
+    bool (*Open)(const char* Parameters, uintptr_t* TransportHandle);
+    bool (*IssueCommand)(uintptr_t TransportHandle,
+                         uint8_t* In,
+                         uint32_t InLength,
+                         uint8_t* Out,
+                         uint32_t OutLength,
+                         uint32_t* OsResult);
+    bool (*IssueCommandV)(uintptr_t TransportHandle,
+                          const TPM_COMMAND_SEGMENT* Segments,
+                          uint32_t SegmentCount,
+                          uint8_t* Out,
+                          uint32_t OutLength,
+                          uint32_t* OsResult);
+    bool (*Submit)(uintptr_t TransportHandle,
+                   const TPM_COMMAND_SEGMENT* Segments,
+                   uint32_t SegmentCount,
+                   uint32_t* OsResult);
+    bool (*Receive)(uintptr_t TransportHandle,
+                    uint8_t* Out,
+                    uint32_t OutLength,
+                    uint32_t* OsResult);
+    bool (*Close)(uintptr_t TransportHandle);
+    uint32_t MaximumContexts;
+} TPM_TRANSPORT, *PTPM_TRANSPORT;
 
 //
-// This macro calculates the size of a fixed data response made up of
-// A static-size header (including TPM_REPLY_HEADER)
-// The 32-bit parameter size
-// An empty authorization response
+// Properties of the TPM, discovered with a single sweep of its fixed
+// properties, algorithms and commands. They are cached on disk along with the
+// reset and restart counts of the TPM, and reused for as long as they match.
 //
-#define TpmFixedResponseSize(x)                                     \
-    (sizeof(*x))
+#define TPM_PROPERTY_FIXED_COUNT    (TPM_PT_MAX_CAP_BUFFER - PT_FIXED + 1)
+#define TPM_CACHE_PATH_SIZE         512
+#define TPM_PROPERTY_MAX_ALGORITHM  0x100
+#define TPM_PROPERTY_MAX_COMMAND    0x200
+
+typedef struct _TPM_PROPERTIES
+{
+    uint32_t ResetCount;
+    uint32_t RestartCount;
+    uint32_t Fixed[TPM_PROPERTY_FIXED_COUNT];
+    uint32_t Algorithms[TPM_PROPERTY_MAX_ALGORITHM / 32];
+    uint32_t Commands[TPM_PROPERTY_MAX_COMMAND / 32];
+} TPM_PROPERTIES, *PTPM_PROPERTIES;
 
 //
-// This macro calculates the size of a variable data response made up of
-// A static-size header (including TPM_REPLY_HEADER)
-// The 32-bit parameter size
-// A dynamic-size data blob
-// An empty authorization response
+// Public areas of the NV indices that were read, along with their name, which
+// is computed in software. They are kept along with the properties, for as
+// long as none of our own commands modify the index and the TPM is not reset
+// or restarted. Errors that show the cached flags to be stale, such as the
+// index being locked or not written, also drop the index. The least recently
+// added index is replaced once the cache is full. Only the indices that were
+// cached or dropped by this handle are merged into the file when it's saved,
+// so that other invocations don't lose what they learned in the meantime.
 //
-#define TpmVariableResponseSize(x, y)                               \
-    ((offsetof(std::remove_reference<decltype(*x)>::type,           \
-               Data)) +                                             \
-     (y) +                                                          \
-     (sizeof(TPMS_AUTH_RESPONSE_NO_NONCE)))
+#define TPM_NV_CACHE_ENTRIES        64
+#define TPM_NV_NAME_SIZE            (sizeof(uint16_t) + TPM_SHA256_DIGEST_SIZE)
+
+typedef struct _TPM_NV_CACHE_ENTRY
+{
+    uint32_t Index;
+    uint32_t Attributes;
+    uint16_t DataSize;
+    uint8_t Name[TPM_NV_NAME_SIZE];
+} TPM_NV_CACHE_ENTRY, *PTPM_NV_CACHE_ENTRY;
+
+typedef struct _TPM_NV_CACHE
+{
+    uint32_t NextEntry;
+    TPM_NV_CACHE_ENTRY Entries[TPM_NV_CACHE_ENTRIES];
+} TPM_NV_CACHE, *PTPM_NV_CACHE;
 
 //
-// This macro allocates a TPM 2.0 Response Buffer on the stack
+// Collects the NV indices found by an enumeration into the caller's array,
+// counting the ones that did not fit, or into an array that grows as needed.
 //
-#define TpmpAllocateResponse(x, y)                                  \
-    reinterpret_cast<decltype(x)>(alloca(y));
+typedef struct _TPM_NV_ENUMERATE_CONTEXT
+{
+    TPM_NV_INDEX* Array;
+    uint32_t Capacity;
+    uint32_t Count;
+} TPM_NV_ENUMERATE_CONTEXT, *PTPM_NV_ENUMERATE_CONTEXT;
 
 //
-// This macro returns a TPM 2.0 Result Code from a Response Buffer
+// The TPM handle returned to callers points to this context, which tracks the
+// transport that was selected when it was opened, the limits and properties
+// of the TPM, the cached NV public areas, and the command that was submitted
+// but whose response was not received yet.
 //
-#define TpmReadResponseCode(response)                               \
-    static_cast<TPM_RC>(OsSwap32((response)->Header.ResponseCode))
+typedef struct _TPM_CONTEXT
+{
+    const TPM_TRANSPORT* Transport;
+    uintptr_t TransportHandle;
+    uintptr_t Recorder;
+    uint8_t* CommandBuffer;
+    uint32_t CommandBufferSize;
+    uint8_t* ResponseBuffer;
+    uint32_t ResponseBufferSize;
+    size_t ArenaSize;
+    char* Parameters;
+    uint32_t NvBufferMax;
+    uint64_t TransportKey;
+    bool PropertiesValid;
+    TPM_PROPERTIES Properties;
+    bool NvCacheDirty;
+    TPM_NV_CACHE NvCache;
+    bool NvCacheTouched[TPM_NV_CACHE_ENTRIES];
+    uint32_t NvForgotten[TPM_NV_CACHE_ENTRIES];
+    uint32_t NvForgottenCount;
+    char CachePath[TPM_CACHE_PATH_SIZE];
+    TPM_COMMAND_SEGMENT PendingSegments[TPM_MAX_COMMAND_SEGMENTS];
+    uint32_t PendingCount;
+    uint64_t PendingTimestamp;
+    uint64_t PendingStartTime;
+} TPM_CONTEXT, *PTPM_CONTEXT;
 
 //
-// Internal Routines that require OS Support
+// Every handle owns an arena with one command and one response buffer, each
+// starting on a page boundary, which are sized to what the TPM supports and
+// reused by every command issued through the handle.
 //
-uint16_t
-OsSwap16 (
-    uint16_t Input
+#define TPM_ARENA_PAGE_SIZE         4096
+#define TPM_ARENA_DEFAULT_SIZE      4096
+#define TPM_ARENA_MAXIMUM_SIZE      (1024 * 1024)
+
+//
+// Most handles used at once by a batch of commands, each of which keeps one of
+// them queued to the TPM.
+//
+#define TPM_BATCH_CONTEXTS          4
+
+//
+// Size of each NV_Read or NV_Write when the TPM does not report its own limit
+// through TPM_PT_NV_BUFFER_MAX.
+//
+#define TPM_NV_BUFFER_DEFAULT       512
+
+//
+// Size of each buffer given to Hash or SequenceUpdate when the TPM does not
+// report its own limit through TPM_PT_INPUT_BUFFER.
+//
+#define TPM_HASH_BUFFER_DEFAULT     1024
+
+//
+// Differential writes compare the old and new contents a block at a time, and
+// write runs of changed bytes that are closer than the gap together.
+//
+#define TPM_NV_DIFF_BLOCK           64
+#define TPM_NV_DIFF_GAP             32
+
+//
+// Compressed data is stored in an NV index behind this header, which says
+// how it was encoded and how large it is. Data that does not get smaller is
+// stored as-is. All fields are little-endian.
+//
+#define TPM_NV_COMPRESSED_SIGNATURE 0x5A54
+
+typedef enum _TPM_NV_CODEC : uint8_t
+{
+    TpmNvCodecNone = 0,
+    TpmNvCodecLz = 1
+} TPM_NV_CODEC;
+
+#pragma pack(push, 1)
+typedef struct _TPM_NV_COMPRESSED_HEADER
+{
+    uint16_t Signature;
+    TPM_NV_CODEC Codec;
+    uint8_t Reserved;
+    uint16_t DataSize;
+    uint16_t StoredSize;
+} TPM_NV_COMPRESSED_HEADER, *PTPM_NV_COMPRESSED_HEADER;
+#pragma pack(pop)
+
+//
+// Environment variable that selects the default transport, using the same
+// "name[:parameters]" syntax as TpmOpenTransport.
+//
+#define TPM_TRANSPORT_VARIABLE      "TPMTOOL_TRANSPORT"
+
+//
+// Environment variable that records all commands sent through a transport
+// into the given capture file, which can later be used with "replay".
+//
+#define TPM_RECORD_VARIABLE         "TPMTOOL_RECORD"
+
+//
+// Environment variable that overrides where the properties of the TPM are
+// cached, which is disabled if the variable is set but empty.
+//
+#define TPM_CACHE_VARIABLE          "TPMTOOL_CACHE"
+
+//
+// Available Transports
+//
+extern const TPM_TRANSPORT TpmOsTransport;
+extern const TPM_TRANSPORT TpmSimTransport;
+extern const TPM_TRANSPORT TpmSwtpmTransport;
+extern const TPM_TRANSPORT TpmEmuTransport;
+extern const TPM_TRANSPORT TpmReplayTransport;
+
+//
+// Capture Files
+//
+bool
+TpmTapOpen (
+    const char* Path,
+    uintptr_t* Recorder
+    );
+
+void
+TpmTapRecord (
+    uintptr_t Recorder,
+    uint64_t Timestamp,
+    uint32_t RoundTrip,
+    const TPM_COMMAND_SEGMENT* Segments,
+    uint32_t SegmentCount,
+    const uint8_t* Out,
+    uint32_t OutLength,
+    bool Result,
+    uint32_t OsResult
+    );
+
+bool
+TpmTapClose (
+    uintptr_t Recorder
+    );
+
+//
+// Property Discovery
+//
+bool
+TpmPropDiscover (
+    PTPM_CONTEXT Context,
+    bool UseCache
     );
 
 uint32_t
-OsSwap32 (
-    uint32_t Input
+TpmPropGet (
+    PTPM_CONTEXT Context,
+    TPM_PT Property
     );
 
-uint64_t
-OsSwap64 (
-    uint64_t Input
-);
+bool
+TpmPropHasAlgorithm (
+    PTPM_CONTEXT Context,
+    TPM_ALG_ID Algorithm
+    );
+
+bool
+TpmPropHasCommand (
+    PTPM_CONTEXT Context,
+    TPM_CC CommandCode
+    );
+
+PTPM_NV_CACHE_ENTRY
+TpmPropLookupNv (
+    PTPM_CONTEXT Context,
+    uint32_t Index
+    );
+
+void
+TpmPropCacheNv (
+    PTPM_CONTEXT Context,
+    const TPM_NV_CACHE_ENTRY* Entry
+    );
+
+void
+TpmPropForgetNv (
+    PTPM_CONTEXT Context,
+    uint32_t Index
+    );
+
+void
+TpmPropSave (
+    PTPM_CONTEXT Context
+    );
+
+//
+// Software SHA-256
+//
+
+typedef struct _TPM_SHA256_CONTEXT
+{
+    uint32_t State[8];
+    uint64_t Length;
+    uint8_t Buffer[64];
+} TPM_SHA256_CONTEXT, *PTPM_SHA256_CONTEXT;
+
+void
+TpmSha256Init (
+    PTPM_SHA256_CONTEXT Context
+    );
+
+void
+TpmSha256Update (
+    PTPM_SHA256_CONTEXT Context,
+    const uint8_t* Data,
+    size_t DataSize
+    );
+
+void
+TpmSha256Final (
+    PTPM_SHA256_CONTEXT Context,
+    uint8_t* Digest
+    );
+
+void
+TpmSha256 (
+    const uint8_t* Data,
+    size_t DataSize,
+    uint8_t* Digest
+    );
+
+//
+// CRC-32
+//
+uint32_t
+TpmCrc32 (
+    uint32_t Crc,
+    const uint8_t* Data,
+    size_t DataSize
+    );
+
+//
+// LZ Compression
+//
+bool
+TpmLzCompress (
+    const uint8_t* Input,
+    uint32_t InputSize,
+    uint8_t* Output,
+    uint32_t OutputSize,
+    uint32_t* OutputWritten
+    );
+
+bool
+TpmLzDecompress (
+    const uint8_t* Input,
+    uint32_t InputSize,
+    uint8_t* Output,
+    uint32_t OutputSize,
+    uint32_t* OutputWritten
+    );
+
+//
+// Internal Routines that require OS Support
+//
+void*
+OsAllocatePages (
+    size_t Size
+    );
+
+void
+OsFreePages (
+    void* Base,
+    size_t Size
+    );
+
+bool
+OsGetCachePath (
+    char* Path,
+    size_t PathSize
+    );
+
+bool
+OsReadCacheFile (
+    const char* Path,
+    void* Buffer,
+    size_t Size
+    );
+
+bool
+OsWriteCacheFile (
+    const char* Path,
+    const void* Buffer,
+    size_t Size
+    );
 
 bool
 TpmOsIssueCommand (
@@ -130,3 +488,49 @@ TpmOsIssueCommand (
     uint32_t OutLength,
     uint32_t* OsResult
     );
+
+bool
+TpmOsIssueCommandV (
+    uintptr_t TpmHandle,
+    const TPM_COMMAND_SEGMENT* Segments,
+    uint32_t SegmentCount,
+    uint8_t* Out,
+    uint32_t OutLength,
+    uint32_t* OsResult
+    );
+
+bool
+TpmOsSubmitCommand (
+    uintptr_t TpmHandle,
+    const TPM_COMMAND_SEGMENT* Segments,
+    uint32_t SegmentCount,
+    uint32_t* OsResult
+    );
+
+bool
+TpmOsReceiveResponse (
+    uintptr_t TpmHandle,
+    uint8_t* Out,
+    uint32_t OutLength,
+    uint32_t* OsResult
+    );
+
+bool
+TpmOsOpenSibling (
+    PTPM_CONTEXT Context,
+    uintptr_t* TpmHandle
+    );
+
+//
+// Compile-time Command Marshalling
+//
+#include "tpmmarsh.hpp"
+
+//
+// Command Issuing
+//
+TPM_RC
+TpmpIssueCommand (
+    uintptr_t TpmHandle,
+    uint32_t CommandSize
+    );
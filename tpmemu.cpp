@@ -0,0 +1,2045 @@
+/*++
+
+Copyright (c) Alex Ionescu.  All rights reserved.
+
+Module Name:
+
+    tpmemu.cpp
+
+Abstract:
+
+    This module implements an in-process software TPM2.0 emulator transport,
+    which decodes the same command buffers that are sent to a real TPM and
+    executes them against an in-memory model of NV storage. Only the commands
+    used by the tool are implemented, with password sessions only.
+
+    The NV model can optionally be persisted to a memory-mapped file, and the
+    emulator can inject latency and error codes on a per-command basis, which
+    allows benchmarking the tool itself and reproducing slow or failing TPMs.
+
+Author:
+
+    Alex Ionescu (@aionescu) 16-Oct-2026 - Initial version
+
+Environment:
+
+    Portable to any environment.
+
+--*/
+
+#ifdef _MSC_VER
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+#include "tpmtool.hpp"
+#include "tpmcmd.hpp"
+
+//
+// Limits of the emulated TPM
+//
+#define TPM_EMU_MAGIC                   0x554d4554
+#define TPM_EMU_VERSION                 1
+#define TPM_EMU_MAX_INDICES             256
+#define TPM_EMU_MAX_INDEX_SIZE          2048
+#define TPM_EMU_MAX_AUTH_SIZE           TPM_SHA256_DIGEST_SIZE
+#define TPM_EMU_MAX_BUFFER              4096
+#define TPM_EMU_MAX_DIGEST_BUFFER       1024
+#define TPM_EMU_DEFAULT_NV_BUFFER       1024
+#define TPM_EMU_PCR_COUNT               24
+#define TPM_EMU_MAX_OVERRIDES           16
+#define TPM_EMU_MAX_SEQUENCES           3
+#define TPM_EMU_SEQUENCE_HANDLE         0x80000000
+
+//
+// Emulated NV Index, stored in the order the attributes are kept by the TPM
+//
+typedef struct _TPM_EMU_INDEX
+{
+    uint32_t Handle;
+    uint32_t Attributes;
+    uint16_t DataSize;
+    uint16_t AuthSize;
+    uint8_t Auth[TPM_EMU_MAX_AUTH_SIZE];
+    uint8_t Data[TPM_EMU_MAX_INDEX_SIZE];
+} TPM_EMU_INDEX, *PTPM_EMU_INDEX;
+
+//
+// Emulated persistent state, which is what gets mapped from a file (if any)
+//
+typedef struct _TPM_EMU_STATE
+{
+    uint32_t Magic;
+    uint32_t Version;
+    uint64_t Clock;
+    uint32_t ResetCount;
+    uint32_t RestartCount;
+    TPM_EMU_INDEX Index[TPM_EMU_MAX_INDICES];
+} TPM_EMU_STATE, *PTPM_EMU_STATE;
+
+//
+// Emulated hash sequence object, which only lasts as long as the emulator
+//
+typedef struct _TPM_EMU_SEQUENCE
+{
+    bool Active;
+    uint16_t AuthSize;
+    uint8_t Auth[TPM_EMU_MAX_AUTH_SIZE];
+    TPM_SHA256_CONTEXT Hash;
+} TPM_EMU_SEQUENCE, *PTPM_EMU_SEQUENCE;
+
+//
+// Per-command latency or error code injected by the emulator
+//
+typedef struct _TPM_EMU_OVERRIDE
+{
+    TPM_CC CommandCode;
+    uint32_t Value;
+} TPM_EMU_OVERRIDE;
+
+//
+// Emulator Transport Context
+//
+typedef struct _TPM_EMU_CONTEXT
+{
+    PTPM_EMU_STATE State;
+    uintptr_t MapHandle;
+    bool Mapped;
+    std::chrono::steady_clock::time_point StartTime;
+    uint64_t StartClock;
+    uint64_t RandomState;
+    uint32_t NvBufferMax;
+    uint32_t Latency;
+    uint32_t LatencyCount;
+    TPM_EMU_OVERRIDE Latencies[TPM_EMU_MAX_OVERRIDES];
+    uint32_t ErrorCount;
+    TPM_EMU_OVERRIDE Errors[TPM_EMU_MAX_OVERRIDES];
+    TPM_EMU_SEQUENCE Sequences[TPM_EMU_MAX_SEQUENCES];
+    uint8_t Response[TPM_EMU_MAX_BUFFER];
+    uint8_t Scratch[TPM_EMU_MAX_BUFFER];
+} TPM_EMU_CONTEXT, *PTPM_EMU_CONTEXT;
+
+//
+// Bounded cursor over a command or response buffer, in TPM byte order. Commands
+// are read straight from the segments they were sent in, and only the fields
+// that straddle two segments are gathered into the scratch buffer.
+//
+typedef struct _TPM_EMU_STREAM
+{
+    uint8_t* Buffer;
+    uint32_t Size;
+    uint32_t Offset;
+    bool Overflow;
+    const TPM_COMMAND_SEGMENT* Segments;
+    uint32_t SegmentCount;
+    uint8_t* Scratch;
+    uint32_t ScratchSize;
+} TPM_EMU_STREAM, *PTPM_EMU_STREAM;
+
+//
+// Decoded command, as passed to each command handler
+//
+typedef struct _TPM_EMU_REQUEST
+{
+    TPM_CC CommandCode;
+    uint32_t Handles[2];
+    uint16_t PasswordSize;
+    uint8_t* Password;
+    TPM_EMU_STREAM Parameters;
+} TPM_EMU_REQUEST, *PTPM_EMU_REQUEST;
+
+typedef
+TPM_RC
+(*PTPM_EMU_HANDLER) (
+    PTPM_EMU_CONTEXT Context,
+    PTPM_EMU_REQUEST Request,
+    PTPM_EMU_STREAM Response
+    );
+
+//
+// Command table entry, indicating how many handles precede the parameters
+// and whether the first handle requires an authorization session.
+//
+typedef struct _TPM_EMU_COMMAND
+{
+    TPM_CC CommandCode;
+    uint8_t HandleCount;
+    bool Authorized;
+    PTPM_EMU_HANDLER Handler;
+} TPM_EMU_COMMAND;
+
+bool
+TpmpEmuNextSegment (
+    PTPM_EMU_STREAM Stream
+    )
+{
+    //
+    // Move on to the next segment of the command, if there's one left
+    //
+    if (Stream->SegmentCount == 0)
+    {
+        return false;
+    }
+    Stream->Buffer = const_cast<uint8_t*>(Stream->Segments->Buffer);
+    Stream->Size = Stream->Segments->Length;
+    Stream->Offset = 0;
+    Stream->Segments++;
+    Stream->SegmentCount--;
+    return true;
+}
+
+uint32_t
+TpmpEmuRemaining (
+    PTPM_EMU_STREAM Stream
+    )
+{
+    uint32_t remaining;
+    uint32_t i;
+
+    //
+    // Count what's left in this segment and in all the following ones
+    //
+    remaining = Stream->Size - Stream->Offset;
+    for (i = 0; i < Stream->SegmentCount; i++)
+    {
+        remaining += Stream->Segments[i].Length;
+    }
+    return remaining;
+}
+
+uint8_t*
+TpmpEmuReadBytes (
+    PTPM_EMU_STREAM Stream,
+    uint32_t Size
+    )
+{
+    uint8_t* bytes;
+    uint32_t copied;
+    uint32_t chunk;
+
+    //
+    // Skip over the end of the segment, if it was fully read
+    //
+    if (Stream->Overflow)
+    {
+        return nullptr;
+    }
+    while ((Stream->Offset == Stream->Size) && (Size != 0))
+    {
+        if (TpmpEmuNextSegment(Stream) == false)
+        {
+            break;
+        }
+    }
+
+    //
+    // Return a pointer to the bytes if they are all in this segment
+    //
+    if (Size <= (Stream->Size - Stream->Offset))
+    {
+        bytes = &Stream->Buffer[Stream->Offset];
+        Stream->Offset += Size;
+        return bytes;
+    }
+
+    //
+    // Otherwise gather them, unless they would go past the end
+    //
+    if ((Size > TpmpEmuRemaining(Stream)) || (Size > Stream->ScratchSize))
+    {
+        Stream->Overflow = true;
+        return nullptr;
+    }
+    bytes = Stream->Scratch;
+    for (copied = 0; copied < Size; copied += chunk)
+    {
+        if (Stream->Offset == Stream->Size)
+        {
+            TpmpEmuNextSegment(Stream);
+        }
+        chunk = Stream->Size - Stream->Offset;
+        if (chunk > (Size - copied))
+        {
+            chunk = Size - copied;
+        }
+        memcpy(&bytes[copied], &Stream->Buffer[Stream->Offset], chunk);
+        Stream->Offset += chunk;
+    }
+    Stream->Scratch += Size;
+    Stream->ScratchSize -= Size;
+    return bytes;
+}
+
+uint8_t
+TpmpEmuRead8 (
+    PTPM_EMU_STREAM Stream
+    )
+{
+    uint8_t* bytes;
+
+    bytes = TpmpEmuReadBytes(Stream, sizeof(uint8_t));
+    return (bytes != nullptr) ? *bytes : 0;
+}
+
+uint16_t
+TpmpEmuRead16 (
+    PTPM_EMU_STREAM Stream
+    )
+{
+    uint8_t* bytes;
+    uint16_t value;
+
+    bytes = TpmpEmuReadBytes(Stream, sizeof(value));
+    if (bytes == nullptr)
+    {
+        return 0;
+    }
+    memcpy(&value, bytes, sizeof(value));
+    return OsSwap16(value);
+}
+
+uint32_t
+TpmpEmuRead32 (
+    PTPM_EMU_STREAM Stream
+    )
+{
+    uint8_t* bytes;
+    uint32_t value;
+
+    bytes = TpmpEmuReadBytes(Stream, sizeof(value));
+    if (bytes == nullptr)
+    {
+        return 0;
+    }
+    memcpy(&value, bytes, sizeof(value));
+    return OsSwap32(value);
+}
+
+uint64_t
+TpmpEmuRead64 (
+    PTPM_EMU_STREAM Stream
+    )
+{
+    uint8_t* bytes;
+    uint64_t value;
+
+    bytes = TpmpEmuReadBytes(Stream, sizeof(value));
+    if (bytes == nullptr)
+    {
+        return 0;
+    }
+    memcpy(&value, bytes, sizeof(value));
+    return OsSwap64(value);
+}
+
+void
+TpmpEmuWriteBytes (
+    PTPM_EMU_STREAM Stream,
+    const void* Data,
+    uint32_t Size
+    )
+{
+    //
+    // Append the bytes, unless they would go past the end
+    //
+    if ((Stream->Overflow) || (Size > (Stream->Size - Stream->Offset)))
+    {
+        Stream->Overflow = true;
+        return;
+    }
+    memcpy(&Stream->Buffer[Stream->Offset], Data, Size);
+    Stream->Offset += Size;
+}
+
+void
+TpmpEmuWrite8 (
+    PTPM_EMU_STREAM Stream,
+    uint8_t Value
+    )
+{
+    TpmpEmuWriteBytes(Stream, &Value, sizeof(Value));
+}
+
+void
+TpmpEmuWrite16 (
+    PTPM_EMU_STREAM Stream,
+    uint16_t Value
+    )
+{
+    Value = OsSwap16(Value);
+    TpmpEmuWriteBytes(Stream, &Value, sizeof(Value));
+}
+
+void
+TpmpEmuWrite32 (
+    PTPM_EMU_STREAM Stream,
+    uint32_t Value
+    )
+{
+    Value = OsSwap32(Value);
+    TpmpEmuWriteBytes(Stream, &Value, sizeof(Value));
+}
+
+void
+TpmpEmuWrite64 (
+    PTPM_EMU_STREAM Stream,
+    uint64_t Value
+    )
+{
+    Value = OsSwap64(Value);
+    TpmpEmuWriteBytes(Stream, &Value, sizeof(Value));
+}
+
+PTPM_EMU_INDEX
+TpmpEmuLookupIndex (
+    PTPM_EMU_CONTEXT Context,
+    uint32_t Handle
+    )
+{
+    uint32_t i;
+
+    //
+    // Find the slot holding the given index
+    //
+    for (i = 0; i < TPM_EMU_MAX_INDICES; i++)
+    {
+        if (Context->State->Index[i].Handle == Handle)
+        {
+            return &Context->State->Index[i];
+        }
+    }
+    return nullptr;
+}
+
+TPM_RC
+TpmpEmuAuthorizeNv (
+    PTPM_EMU_REQUEST Request,
+    PTPM_EMU_INDEX Index,
+    bool Write
+    )
+{
+    uint32_t ownerRight;
+    uint32_t authRight;
+
+    ownerRight = Write ? TPMA_NV_OWNERWRITE : TPMA_NV_OWNERREAD;
+    authRight = Write ? TPMA_NV_AUTHWRITE : TPMA_NV_AUTHREAD;
+
+    //
+    // Owner authorization uses the (empty) owner password
+    //
+    if (Request->Handles[0] == TPM_RH_OWNER.Value)
+    {
+        if ((Index->Attributes & ownerRight) == 0)
+        {
+            return TPM_RC_NV_AUTHORIZATION;
+        }
+        if (Request->PasswordSize != 0)
+        {
+            return static_cast<TPM_RC>(TPM_RC_AUTH_FAIL | TPM_RC_S | TPM_RC_1);
+        }
+        return TPM_RC_SUCCESS;
+    }
+
+    //
+    // Otherwise, the index authorizes itself with its own password
+    //
+    if (Request->Handles[0] != Index->Handle)
+    {
+        return static_cast<TPM_RC>(TPM_RC_HANDLE | TPM_RC_1);
+    }
+    if ((Index->Attributes & authRight) == 0)
+    {
+        return TPM_RC_NV_AUTHORIZATION;
+    }
+    if ((Request->PasswordSize != Index->AuthSize) ||
+        (memcmp(Request->Password, Index->Auth, Index->AuthSize) != 0))
+    {
+        return static_cast<TPM_RC>(TPM_RC_AUTH_FAIL | TPM_RC_S | TPM_RC_1);
+    }
+    return TPM_RC_SUCCESS;
+}
+
+TPM_RC
+TpmpEmuNvDefineSpace (
+    PTPM_EMU_CONTEXT Context,
+    PTPM_EMU_REQUEST Request,
+    PTPM_EMU_STREAM Response
+    )
+{
+    PTPM_EMU_INDEX index;
+    uint16_t authSize;
+    uint8_t* auth;
+    uint32_t handle;
+    uint16_t nameAlg;
+    uint32_t attributes;
+    uint16_t policySize;
+    uint16_t dataSize;
+    uint32_t i;
+
+    (void)Response;
+
+    //
+    // Only the owner hierarchy is emulated, which has an empty password
+    //
+    if (Request->Handles[0] != TPM_RH_OWNER.Value)
+    {
+        return static_cast<TPM_RC>(TPM_RC_HANDLE | TPM_RC_1);
+    }
+    if (Request->PasswordSize != 0)
+    {
+        return static_cast<TPM_RC>(TPM_RC_AUTH_FAIL | TPM_RC_S | TPM_RC_1);
+    }
+
+    //
+    // Decode the TPM2B_AUTH and the TPM2B_NV_PUBLIC
+    //
+    authSize = TpmpEmuRead16(&Request->Parameters);
+    auth = TpmpEmuReadBytes(&Request->Parameters, authSize);
+    TpmpEmuRead16(&Request->Parameters);
+    handle = TpmpEmuRead32(&Request->Parameters);
+    nameAlg = TpmpEmuRead16(&Request->Parameters);
+    attributes = TpmpEmuRead32(&Request->Parameters);
+    policySize = TpmpEmuRead16(&Request->Parameters);
+    TpmpEmuReadBytes(&Request->Parameters, policySize);
+    dataSize = TpmpEmuRead16(&Request->Parameters);
+    if (Request->Parameters.Overflow)
+    {
+        return TPM_RC_COMMAND_SIZE;
+    }
+
+    //
+    // Validate the public area
+    //
+    if (authSize > TPM_EMU_MAX_AUTH_SIZE)
+    {
+        return static_cast<TPM_RC>(TPM_RC_SIZE | TPM_RC_P | TPM_RC_1);
+    }
+    if (nameAlg != TPM_ALG_SHA256)
+    {
+        return static_cast<TPM_RC>(TPM_RC_HASH | TPM_RC_P | TPM_RC_2);
+    }
+    if ((handle >> HR_SHIFT) != TPM_HT_NV_INDEX)
+    {
+        return static_cast<TPM_RC>(TPM_RC_VALUE | TPM_RC_P | TPM_RC_2);
+    }
+    if (((attributes & (TPMA_NV_PPWRITE | TPMA_NV_OWNERWRITE |
+                        TPMA_NV_AUTHWRITE | TPMA_NV_POLICYWRITE)) == 0) ||
+        ((attributes & (TPMA_NV_PPREAD | TPMA_NV_OWNERREAD |
+                        TPMA_NV_AUTHREAD | TPMA_NV_POLICYREAD)) == 0) ||
+        (((attributes & TPMA_NV_TYPE) != 0) &&
+         ((attributes & TPMA_NV_TYPE) != TPMA_NV_COUNTER) &&
+         ((attributes & TPMA_NV_TYPE) != TPMA_NV_BITS) &&
+         ((attributes & TPMA_NV_TYPE) != TPMA_NV_EXTEND)) ||
+        (((attributes & TPMA_NV_TYPE) == TPMA_NV_COUNTER) &&
+         ((attributes & TPMA_NV_CLEAR_STCLEAR) != 0)) ||
+        ((attributes & (TPMA_NV_WRITELOCKED | TPMA_NV_READLOCKED |
+                        TPMA_NV_WRITTEN | TPMA_NV_PLATFORMCREATE)) != 0))
+    {
+        return static_cast<TPM_RC>(TPM_RC_ATTRIBUTES | TPM_RC_P | TPM_RC_2);
+    }
+    if (dataSize > TPM_EMU_MAX_INDEX_SIZE)
+    {
+        return TPM_RC_NV_SIZE;
+    }
+    if ((((attributes & TPMA_NV_TYPE) == TPMA_NV_EXTEND) &&
+         (dataSize != TPM_SHA256_DIGEST_SIZE)) ||
+        (((attributes & TPMA_NV_TYPE) != 0) &&
+         ((attributes & TPMA_NV_TYPE) != TPMA_NV_EXTEND) &&
+         (dataSize != sizeof(uint64_t))))
+    {
+        return static_cast<TPM_RC>(TPM_RC_SIZE | TPM_RC_P | TPM_RC_2);
+    }
+    if (TpmpEmuLookupIndex(Context, handle) != nullptr)
+    {
+        return TPM_RC_NV_DEFINED;
+    }
+
+    //
+    // Find a free slot for the new index
+    //
+    index = nullptr;
+    for (i = 0; i < TPM_EMU_MAX_INDICES; i++)
+    {
+        if (Context->State->Index[i].Handle == 0)
+        {
+            index = &Context->State->Index[i];
+            break;
+        }
+    }
+    if (index == nullptr)
+    {
+        return TPM_RC_NV_SPACE;
+    }
+
+    //
+    // And define it
+    //
+    memset(index, 0, sizeof(*index));
+    index->Handle = handle;
+    index->Attributes = attributes;
+    index->DataSize = dataSize;
+    index->AuthSize = authSize;
+    memcpy(index->Auth, auth, authSize);
+    return TPM_RC_SUCCESS;
+}
+
+TPM_RC
+TpmpEmuNvUndefineSpace (
+    PTPM_EMU_CONTEXT Context,
+    PTPM_EMU_REQUEST Request,
+    PTPM_EMU_STREAM Response
+    )
+{
+    PTPM_EMU_INDEX index;
+
+    (void)Response;
+
+    //
+    // Only the owner can delete indices
+    //
+    if (Request->Handles[0] != TPM_RH_OWNER.Value)
+    {
+        return static_cast<TPM_RC>(TPM_RC_HANDLE | TPM_RC_1);
+    }
+    if (Request->PasswordSize != 0)
+    {
+        return static_cast<TPM_RC>(TPM_RC_AUTH_FAIL | TPM_RC_S | TPM_RC_1);
+    }
+
+    //
+    // Find the index, and make sure it can be deleted without a policy
+    //
+    index = TpmpEmuLookupIndex(Context, Request->Handles[1]);
+    if (index == nullptr)
+    {
+        return static_cast<TPM_RC>(TPM_RC_HANDLE | TPM_RC_2);
+    }
+    if ((index->Attributes & TPMA_NV_POLICY_DELETE) != 0)
+    {
+        return static_cast<TPM_RC>(TPM_RC_ATTRIBUTES | TPM_RC_2);
+    }
+
+    //
+    // Free the slot
+    //
+    memset(index, 0, sizeof(*index));
+    return TPM_RC_SUCCESS;
+}
+
+TPM_RC
+TpmpEmuNvRead (
+    PTPM_EMU_CONTEXT Context,
+    PTPM_EMU_REQUEST Request,
+    PTPM_EMU_STREAM Response
+    )
+{
+    PTPM_EMU_INDEX index;
+    uint16_t size;
+    uint16_t offset;
+    TPM_RC tpmResult;
+
+    //
+    // Find the index and check if we can read from it
+    //
+    index = TpmpEmuLookupIndex(Context, Request->Handles[1]);
+    if (index == nullptr)
+    {
+        return static_cast<TPM_RC>(TPM_RC_HANDLE | TPM_RC_2);
+    }
+    tpmResult = TpmpEmuAuthorizeNv(Request, index, false);
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        return tpmResult;
+    }
+    if ((index->Attributes & TPMA_NV_READLOCKED) != 0)
+    {
+        return TPM_RC_NV_LOCKED;
+    }
+    if ((index->Attributes & TPMA_NV_WRITTEN) == 0)
+    {
+        return TPM_RC_NV_UNINITIALIZED;
+    }
+
+    //
+    // Validate the range being read
+    //
+    size = TpmpEmuRead16(&Request->Parameters);
+    offset = TpmpEmuRead16(&Request->Parameters);
+    if (Request->Parameters.Overflow)
+    {
+        return TPM_RC_COMMAND_SIZE;
+    }
+    if (size > Context->NvBufferMax)
+    {
+        return static_cast<TPM_RC>(TPM_RC_VALUE | TPM_RC_P | TPM_RC_1);
+    }
+    if ((offset + size) > index->DataSize)
+    {
+        return TPM_RC_NV_RANGE;
+    }
+
+    //
+    // Return the data as a TPM2B_MAX_NV_BUFFER
+    //
+    TpmpEmuWrite16(Response, size);
+    TpmpEmuWriteBytes(Response, &index->Data[offset], size);
+    return TPM_RC_SUCCESS;
+}
+
+TPM_RC
+TpmpEmuNvWrite (
+    PTPM_EMU_CONTEXT Context,
+    PTPM_EMU_REQUEST Request,
+    PTPM_EMU_STREAM Response
+    )
+{
+    PTPM_EMU_INDEX index;
+    uint16_t size;
+    uint8_t* data;
+    uint16_t offset;
+    TPM_RC tpmResult;
+
+    (void)Response;
+
+    //
+    // Find the index and check if we can write to it
+    //
+    index = TpmpEmuLookupIndex(Context, Request->Handles[1]);
+    if (index == nullptr)
+    {
+        return static_cast<TPM_RC>(TPM_RC_HANDLE | TPM_RC_2);
+    }
+    tpmResult = TpmpEmuAuthorizeNv(Request, index, true);
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        return tpmResult;
+    }
+    if ((index->Attributes & TPMA_NV_TYPE) != 0)
+    {
+        return static_cast<TPM_RC>(TPM_RC_ATTRIBUTES | TPM_RC_1);
+    }
+    if ((index->Attributes & TPMA_NV_WRITELOCKED) != 0)
+    {
+        return TPM_RC_NV_LOCKED;
+    }
+
+    //
+    // Validate the range being written
+    //
+    size = TpmpEmuRead16(&Request->Parameters);
+    data = TpmpEmuReadBytes(&Request->Parameters, size);
+    offset = TpmpEmuRead16(&Request->Parameters);
+    if (Request->Parameters.Overflow)
+    {
+        return TPM_RC_COMMAND_SIZE;
+    }
+    if (size > Context->NvBufferMax)
+    {
+        return static_cast<TPM_RC>(TPM_RC_SIZE | TPM_RC_P | TPM_RC_1);
+    }
+    if ((offset + size) > index->DataSize)
+    {
+        return TPM_RC_NV_RANGE;
+    }
+    if (((index->Attributes & TPMA_NV_WRITEALL) != 0) &&
+        ((offset != 0) || (size != index->DataSize)))
+    {
+        return TPM_RC_NV_RANGE;
+    }
+
+    //
+    // Update the data, and remember the index was written
+    //
+    memcpy(&index->Data[offset], data, size);
+    index->Attributes |= TPMA_NV_WRITTEN;
+    return TPM_RC_SUCCESS;
+}
+
+TPM_RC
+TpmpEmuNvUpdate (
+    PTPM_EMU_CONTEXT Context,
+    PTPM_EMU_REQUEST Request,
+    PTPM_EMU_STREAM Response
+    )
+{
+    PTPM_EMU_INDEX index;
+    TPM_SHA256_CONTEXT hashContext;
+    uint64_t value;
+    uint64_t bits;
+    uint16_t size;
+    uint8_t* data;
+    uint32_t type;
+    TPM_RC tpmResult;
+
+    (void)Response;
+
+    //
+    // Find the index and check if we can write to it
+    //
+    type = (Request->CommandCode == TPM_CC_NV_SetBits) ? TPMA_NV_BITS :
+           (Request->CommandCode == TPM_CC_NV_Extend) ? TPMA_NV_EXTEND :
+                                                        TPMA_NV_COUNTER;
+    index = TpmpEmuLookupIndex(Context, Request->Handles[1]);
+    if (index == nullptr)
+    {
+        return static_cast<TPM_RC>(TPM_RC_HANDLE | TPM_RC_2);
+    }
+    tpmResult = TpmpEmuAuthorizeNv(Request, index, true);
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        return tpmResult;
+    }
+    if ((index->Attributes & TPMA_NV_TYPE) != type)
+    {
+        return static_cast<TPM_RC>(TPM_RC_ATTRIBUTES | TPM_RC_1);
+    }
+    if ((index->Attributes & TPMA_NV_WRITELOCKED) != 0)
+    {
+        return TPM_RC_NV_LOCKED;
+    }
+
+    //
+    // Extend indices hash the data into the digest, which starts at zero
+    //
+    if (type == TPMA_NV_EXTEND)
+    {
+        size = TpmpEmuRead16(&Request->Parameters);
+        data = TpmpEmuReadBytes(&Request->Parameters, size);
+        if (Request->Parameters.Overflow)
+        {
+            return TPM_RC_COMMAND_SIZE;
+        }
+        if ((index->Attributes & TPMA_NV_WRITTEN) == 0)
+        {
+            memset(index->Data, 0, TPM_SHA256_DIGEST_SIZE);
+        }
+        TpmSha256Init(&hashContext);
+        TpmSha256Update(&hashContext, index->Data, TPM_SHA256_DIGEST_SIZE);
+        TpmSha256Update(&hashContext, data, size);
+        TpmSha256Final(&hashContext, index->Data);
+        index->Attributes |= TPMA_NV_WRITTEN;
+        return TPM_RC_SUCCESS;
+    }
+
+    //
+    // Get the bits to set, if any
+    //
+    bits = 0;
+    if (type == TPMA_NV_BITS)
+    {
+        bits = TpmpEmuRead64(&Request->Parameters);
+        if (Request->Parameters.Overflow)
+        {
+            return TPM_RC_COMMAND_SIZE;
+        }
+    }
+
+    //
+    // Update the value, which starts at zero, and remember it was written
+    //
+    value = 0;
+    if ((index->Attributes & TPMA_NV_WRITTEN) != 0)
+    {
+        memcpy(&value, index->Data, sizeof(value));
+        value = OsSwap64(value);
+    }
+    value = (type == TPMA_NV_BITS) ? (value | bits) : (value + 1);
+    value = OsSwap64(value);
+    memcpy(index->Data, &value, sizeof(value));
+    index->Attributes |= TPMA_NV_WRITTEN;
+    return TPM_RC_SUCCESS;
+}
+
+TPM_RC
+TpmpEmuNvLock (
+    PTPM_EMU_CONTEXT Context,
+    PTPM_EMU_REQUEST Request,
+    PTPM_EMU_STREAM Response
+    )
+{
+    PTPM_EMU_INDEX index;
+    bool writeLock;
+    TPM_RC tpmResult;
+
+    (void)Response;
+
+    //
+    // Find the index and check if the caller is authorized for the operation
+    // that it is trying to lock.
+    //
+    writeLock = (Request->CommandCode == TPM_CC_NV_WriteLock);
+    index = TpmpEmuLookupIndex(Context, Request->Handles[1]);
+    if (index == nullptr)
+    {
+        return static_cast<TPM_RC>(TPM_RC_HANDLE | TPM_RC_2);
+    }
+    tpmResult = TpmpEmuAuthorizeNv(Request, index, writeLock);
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        return tpmResult;
+    }
+
+    //
+    // The index must have been created as lockable
+    //
+    if (writeLock)
+    {
+        if ((index->Attributes & (TPMA_NV_WRITE_STCLEAR | TPMA_NV_WRITEDEFINE)) == 0)
+        {
+            return static_cast<TPM_RC>(TPM_RC_ATTRIBUTES | TPM_RC_2);
+        }
+        index->Attributes |= TPMA_NV_WRITELOCKED;
+    }
+    else
+    {
+        if ((index->Attributes & TPMA_NV_READ_STCLEAR) == 0)
+        {
+            return static_cast<TPM_RC>(TPM_RC_ATTRIBUTES | TPM_RC_2);
+        }
+        index->Attributes |= TPMA_NV_READLOCKED;
+    }
+    return TPM_RC_SUCCESS;
+}
+
+TPM_RC
+TpmpEmuNvReadPublic (
+    PTPM_EMU_CONTEXT Context,
+    PTPM_EMU_REQUEST Request,
+    PTPM_EMU_STREAM Response
+    )
+{
+    PTPM_EMU_INDEX index;
+    uint32_t publicOffset;
+    uint8_t digest[TPM_SHA256_DIGEST_SIZE];
+
+    //
+    // Find the index
+    //
+    index = TpmpEmuLookupIndex(Context, Request->Handles[0]);
+    if (index == nullptr)
+    {
+        return static_cast<TPM_RC>(TPM_RC_HANDLE | TPM_RC_1);
+    }
+
+    //
+    // Return the TPM2B_NV_PUBLIC
+    //
+    TpmpEmuWrite16(Response, sizeof(uint32_t) + sizeof(uint16_t) +
+                             sizeof(uint32_t) + sizeof(uint16_t) + sizeof(uint16_t));
+    publicOffset = Response->Offset;
+    TpmpEmuWrite32(Response, index->Handle);
+    TpmpEmuWrite16(Response, TPM_ALG_SHA256);
+    TpmpEmuWrite32(Response, index->Attributes);
+    TpmpEmuWrite16(Response, 0);
+    TpmpEmuWrite16(Response, index->DataSize);
+    if (Response->Overflow)
+    {
+        return TPM_RC_FAILURE;
+    }
+
+    //
+    // Followed by the TPM2B_NAME, which is the digest of the public area
+    //
+    TpmSha256(&Response->Buffer[publicOffset], Response->Offset - publicOffset, digest);
+    TpmpEmuWrite16(Response, sizeof(uint16_t) + sizeof(digest));
+    TpmpEmuWrite16(Response, TPM_ALG_SHA256);
+    TpmpEmuWriteBytes(Response, digest, sizeof(digest));
+    return TPM_RC_SUCCESS;
+}
+
+int
+TpmpEmuCompareHandles (
+    const void* First,
+    const void* Second
+    )
+{
+    uint32_t first;
+    uint32_t second;
+
+    first = *static_cast<const uint32_t*>(First);
+    second = *static_cast<const uint32_t*>(Second);
+    return (first > second) - (first < second);
+}
+
+TPM_RC
+TpmpEmuGetProperties (
+    PTPM_EMU_CONTEXT Context,
+    uint32_t Property,
+    uint32_t PropertyCount,
+    PTPM_EMU_STREAM Response
+    )
+{
+    TPMS_TAGGED_PROPERTY properties[7];
+    uint32_t propertyTotal;
+    uint32_t first;
+    uint32_t returnCount;
+    uint32_t i;
+
+    //
+    // Fixed properties of the emulated TPM, in ascending order
+    //
+    propertyTotal = 0;
+    properties[propertyTotal].Property = TPM_PT_INPUT_BUFFER;
+    properties[propertyTotal++].Value = TPM_EMU_MAX_DIGEST_BUFFER;
+    properties[propertyTotal].Property = TPM_PT_NV_INDEX_MAX;
+    properties[propertyTotal++].Value = TPM_EMU_MAX_INDEX_SIZE;
+    properties[propertyTotal].Property = TPM_PT_MAX_COMMAND_SIZE;
+    properties[propertyTotal++].Value = TPM_EMU_MAX_BUFFER;
+    properties[propertyTotal].Property = TPM_PT_MAX_RESPONSE_SIZE;
+    properties[propertyTotal++].Value = TPM_EMU_MAX_BUFFER;
+    properties[propertyTotal].Property = TPM_PT_MAX_DIGEST;
+    properties[propertyTotal++].Value = TPM_SHA256_DIGEST_SIZE;
+    properties[propertyTotal].Property = TPM_PT_NV_BUFFER_MAX;
+    properties[propertyTotal++].Value = Context->NvBufferMax;
+    properties[propertyTotal].Property = TPM_PT_MAX_CAP_BUFFER;
+    properties[propertyTotal++].Value = MAX_CAP_BUFFER;
+
+    //
+    // Return the ones starting at the requested property
+    //
+    for (first = 0; first < propertyTotal; first++)
+    {
+        if (properties[first].Property >= Property)
+        {
+            break;
+        }
+    }
+    returnCount = propertyTotal - first;
+    if (PropertyCount > MAX_TPM_PROPERTIES)
+    {
+        PropertyCount = MAX_TPM_PROPERTIES;
+    }
+    if (returnCount > PropertyCount)
+    {
+        returnCount = PropertyCount;
+    }
+    TpmpEmuWrite8(Response, ((first + returnCount) < propertyTotal) ? 1 : 0);
+    TpmpEmuWrite32(Response, TPM_CAP_TPM_PROPERTIES);
+    TpmpEmuWrite32(Response, returnCount);
+    for (i = first; i < (first + returnCount); i++)
+    {
+        TpmpEmuWrite32(Response, properties[i].Property);
+        TpmpEmuWrite32(Response, properties[i].Value);
+    }
+    return TPM_RC_SUCCESS;
+}
+
+TPM_RC
+TpmpEmuGetAlgorithms (
+    uint32_t Algorithm,
+    uint32_t AlgorithmCount,
+    PTPM_EMU_STREAM Response
+    )
+{
+    //
+    // SHA-2 is the only algorithm that the emulator implements
+    //
+    TpmpEmuWrite8(Response, 0);
+    TpmpEmuWrite32(Response, TPM_CAP_ALGS);
+    if ((Algorithm > TPM_ALG_SHA256) || (AlgorithmCount == 0))
+    {
+        TpmpEmuWrite32(Response, 0);
+        return TPM_RC_SUCCESS;
+    }
+    TpmpEmuWrite32(Response, 1);
+    TpmpEmuWrite16(Response, TPM_ALG_SHA256);
+    TpmpEmuWrite32(Response, TPMA_ALGORITHM_HASH);
+    return TPM_RC_SUCCESS;
+}
+
+TPM_RC
+TpmpEmuGetCommands (
+    uint32_t CommandCode,
+    uint32_t CommandCount,
+    PTPM_EMU_STREAM Response
+    );
+
+TPM_RC
+TpmpEmuGetCapability (
+    PTPM_EMU_CONTEXT Context,
+    PTPM_EMU_REQUEST Request,
+    PTPM_EMU_STREAM Response
+    )
+{
+    uint32_t handles[TPM_EMU_MAX_INDICES + TPM_EMU_PCR_COUNT];
+    uint32_t handleCount;
+    uint32_t capability;
+    uint32_t property;
+    uint32_t propertyCount;
+    uint32_t returnCount;
+    uint32_t handle;
+    uint32_t i;
+
+    capability = TpmpEmuRead32(&Request->Parameters);
+    property = TpmpEmuRead32(&Request->Parameters);
+    propertyCount = TpmpEmuRead32(&Request->Parameters);
+    if (Request->Parameters.Overflow)
+    {
+        return TPM_RC_COMMAND_SIZE;
+    }
+    if (capability == TPM_CAP_TPM_PROPERTIES)
+    {
+        return TpmpEmuGetProperties(Context, property, propertyCount, Response);
+    }
+    if (capability == TPM_CAP_ALGS)
+    {
+        return TpmpEmuGetAlgorithms(property, propertyCount, Response);
+    }
+    if (capability == TPM_CAP_COMMANDS)
+    {
+        return TpmpEmuGetCommands(property, propertyCount, Response);
+    }
+    if (capability != TPM_CAP_HANDLES)
+    {
+        return static_cast<TPM_RC>(TPM_RC_VALUE | TPM_RC_P | TPM_RC_1);
+    }
+
+    //
+    // Collect the handles of the requested type, starting at the property
+    //
+    handleCount = 0;
+    if ((property >> HR_SHIFT) == TPM_HT_NV_INDEX)
+    {
+        for (i = 0; i < TPM_EMU_MAX_INDICES; i++)
+        {
+            handle = Context->State->Index[i].Handle;
+            if ((handle != 0) && (handle >= property))
+            {
+                handles[handleCount++] = handle;
+            }
+        }
+        qsort(handles, handleCount, sizeof(handles[0]), TpmpEmuCompareHandles);
+    }
+    else if ((property >> HR_SHIFT) == TPM_HR_PCR)
+    {
+        for (handle = property; handle < TPM_EMU_PCR_COUNT; handle++)
+        {
+            handles[handleCount++] = handle;
+        }
+    }
+
+    //
+    // Return as many as were asked for, and whether there are more
+    //
+    returnCount = handleCount;
+    if (propertyCount > MAX_CAP_HANDLES)
+    {
+        propertyCount = MAX_CAP_HANDLES;
+    }
+    if (returnCount > propertyCount)
+    {
+        returnCount = propertyCount;
+    }
+    TpmpEmuWrite8(Response, (returnCount < handleCount) ? 1 : 0);
+    TpmpEmuWrite32(Response, capability);
+    TpmpEmuWrite32(Response, returnCount);
+    for (i = 0; i < returnCount; i++)
+    {
+        TpmpEmuWrite32(Response, handles[i]);
+    }
+    return TPM_RC_SUCCESS;
+}
+
+TPM_RC
+TpmpEmuGetRandom (
+    PTPM_EMU_CONTEXT Context,
+    PTPM_EMU_REQUEST Request,
+    PTPM_EMU_STREAM Response
+    )
+{
+    uint16_t bytesRequested;
+    uint64_t random;
+    uint16_t i;
+
+    //
+    // The TPM returns at most one digest worth of random bytes
+    //
+    bytesRequested = TpmpEmuRead16(&Request->Parameters);
+    if (Request->Parameters.Overflow)
+    {
+        return TPM_RC_COMMAND_SIZE;
+    }
+    if (bytesRequested > TPM_SHA256_DIGEST_SIZE)
+    {
+        bytesRequested = TPM_SHA256_DIGEST_SIZE;
+    }
+
+    //
+    // Use xorshift64* -- this is an emulator, not a source of entropy
+    //
+    TpmpEmuWrite16(Response, bytesRequested);
+    for (i = 0; i < bytesRequested; i++)
+    {
+        Context->RandomState ^= Context->RandomState >> 12;
+        Context->RandomState ^= Context->RandomState << 25;
+        Context->RandomState ^= Context->RandomState >> 27;
+        random = Context->RandomState * 0x2545F4914F6CDD1DULL;
+        TpmpEmuWrite8(Response, static_cast<uint8_t>(random >> 56));
+    }
+    return TPM_RC_SUCCESS;
+}
+
+TPM_RC
+TpmpEmuHash (
+    PTPM_EMU_CONTEXT Context,
+    PTPM_EMU_REQUEST Request,
+    PTPM_EMU_STREAM Response
+    )
+{
+    uint8_t digest[TPM_SHA256_DIGEST_SIZE];
+    uint16_t size;
+    uint8_t* data;
+    uint16_t hashAlg;
+
+    (void)Context;
+
+    //
+    // Decode the TPM2B_MAX_BUFFER and the algorithm
+    //
+    size = TpmpEmuRead16(&Request->Parameters);
+    data = TpmpEmuReadBytes(&Request->Parameters, size);
+    hashAlg = TpmpEmuRead16(&Request->Parameters);
+    TpmpEmuRead32(&Request->Parameters);
+    if (Request->Parameters.Overflow)
+    {
+        return TPM_RC_COMMAND_SIZE;
+    }
+    if (size > TPM_EMU_MAX_DIGEST_BUFFER)
+    {
+        return static_cast<TPM_RC>(TPM_RC_SIZE | TPM_RC_P | TPM_RC_1);
+    }
+    if (hashAlg != TPM_ALG_SHA256)
+    {
+        return static_cast<TPM_RC>(TPM_RC_HASH | TPM_RC_P | TPM_RC_2);
+    }
+
+    //
+    // Return the digest, and an empty ticket for the NULL hierarchy
+    //
+    TpmSha256(data, size, digest);
+    TpmpEmuWrite16(Response, sizeof(digest));
+    TpmpEmuWriteBytes(Response, digest, sizeof(digest));
+    TpmpEmuWrite16(Response, TPM_ST_HASHCHECK);
+    TpmpEmuWrite32(Response, TPM_RH_NULL.Value);
+    TpmpEmuWrite16(Response, 0);
+    return TPM_RC_SUCCESS;
+}
+
+TPM_RC
+TpmpEmuHashSequenceStart (
+    PTPM_EMU_CONTEXT Context,
+    PTPM_EMU_REQUEST Request,
+    PTPM_EMU_STREAM Response
+    )
+{
+    PTPM_EMU_SEQUENCE sequence;
+    uint16_t authSize;
+    uint8_t* auth;
+    uint16_t hashAlg;
+    uint32_t i;
+
+    //
+    // Decode the TPM2B_AUTH and the algorithm
+    //
+    authSize = TpmpEmuRead16(&Request->Parameters);
+    auth = TpmpEmuReadBytes(&Request->Parameters, authSize);
+    hashAlg = TpmpEmuRead16(&Request->Parameters);
+    if (Request->Parameters.Overflow)
+    {
+        return TPM_RC_COMMAND_SIZE;
+    }
+    if (authSize > TPM_EMU_MAX_AUTH_SIZE)
+    {
+        return static_cast<TPM_RC>(TPM_RC_SIZE | TPM_RC_P | TPM_RC_1);
+    }
+    if (hashAlg != TPM_ALG_SHA256)
+    {
+        return static_cast<TPM_RC>(TPM_RC_HASH | TPM_RC_P | TPM_RC_2);
+    }
+
+    //
+    // Find a free object slot for the sequence
+    //
+    for (i = 0; i < TPM_EMU_MAX_SEQUENCES; i++)
+    {
+        if (Context->Sequences[i].Active == false)
+        {
+            break;
+        }
+    }
+    if (i == TPM_EMU_MAX_SEQUENCES)
+    {
+        return TPM_RC_OBJECT_MEMORY;
+    }
+    sequence = &Context->Sequences[i];
+    sequence->Active = true;
+    sequence->AuthSize = authSize;
+    memcpy(sequence->Auth, auth, authSize);
+    TpmSha256Init(&sequence->Hash);
+
+    //
+    // Return its handle
+    //
+    TpmpEmuWrite32(Response, TPM_EMU_SEQUENCE_HANDLE + i);
+    return TPM_RC_SUCCESS;
+}
+
+TPM_RC
+TpmpEmuSequenceUpdate (
+    PTPM_EMU_CONTEXT Context,
+    PTPM_EMU_REQUEST Request,
+    PTPM_EMU_STREAM Response
+    )
+{
+    PTPM_EMU_SEQUENCE sequence;
+    uint8_t digest[TPM_SHA256_DIGEST_SIZE];
+    uint32_t slot;
+    uint16_t size;
+    uint8_t* data;
+
+    //
+    // The sequence authorizes itself with the password it was started with
+    //
+    slot = Request->Handles[0] - TPM_EMU_SEQUENCE_HANDLE;
+    if ((slot >= TPM_EMU_MAX_SEQUENCES) || (Context->Sequences[slot].Active == false))
+    {
+        return static_cast<TPM_RC>(TPM_RC_HANDLE | TPM_RC_1);
+    }
+    sequence = &Context->Sequences[slot];
+    if ((Request->PasswordSize != sequence->AuthSize) ||
+        (memcmp(Request->Password, sequence->Auth, sequence->AuthSize) != 0))
+    {
+        return static_cast<TPM_RC>(TPM_RC_AUTH_FAIL | TPM_RC_S | TPM_RC_1);
+    }
+
+    //
+    // Decode the TPM2B_MAX_BUFFER and, to complete, the hierarchy
+    //
+    size = TpmpEmuRead16(&Request->Parameters);
+    data = TpmpEmuReadBytes(&Request->Parameters, size);
+    if (Request->CommandCode == TPM_CC_SequenceComplete)
+    {
+        TpmpEmuRead32(&Request->Parameters);
+    }
+    if (Request->Parameters.Overflow)
+    {
+        return TPM_RC_COMMAND_SIZE;
+    }
+    if (size > TPM_EMU_MAX_DIGEST_BUFFER)
+    {
+        return static_cast<TPM_RC>(TPM_RC_SIZE | TPM_RC_P | TPM_RC_1);
+    }
+    TpmSha256Update(&sequence->Hash, data, size);
+    if (Request->CommandCode == TPM_CC_SequenceUpdate)
+    {
+        return TPM_RC_SUCCESS;
+    }
+
+    //
+    // Completing the sequence frees it, and returns the digest with an empty
+    // ticket for the NULL hierarchy.
+    //
+    TpmSha256Final(&sequence->Hash, digest);
+    sequence->Active = false;
+    TpmpEmuWrite16(Response, sizeof(digest));
+    TpmpEmuWriteBytes(Response, digest, sizeof(digest));
+    TpmpEmuWrite16(Response, TPM_ST_HASHCHECK);
+    TpmpEmuWrite32(Response, TPM_RH_NULL.Value);
+    TpmpEmuWrite16(Response, 0);
+    return TPM_RC_SUCCESS;
+}
+
+TPM_RC
+TpmpEmuFlushContext (
+    PTPM_EMU_CONTEXT Context,
+    PTPM_EMU_REQUEST Request,
+    PTPM_EMU_STREAM Response
+    )
+{
+    uint32_t slot;
+
+    (void)Response;
+
+    //
+    // Sequences are the only objects that can be flushed
+    //
+    slot = TpmpEmuRead32(&Request->Parameters) - TPM_EMU_SEQUENCE_HANDLE;
+    if (Request->Parameters.Overflow)
+    {
+        return TPM_RC_COMMAND_SIZE;
+    }
+    if ((slot >= TPM_EMU_MAX_SEQUENCES) || (Context->Sequences[slot].Active == false))
+    {
+        return static_cast<TPM_RC>(TPM_RC_HANDLE | TPM_RC_P | TPM_RC_1);
+    }
+    Context->Sequences[slot].Active = false;
+    return TPM_RC_SUCCESS;
+}
+
+TPM_RC
+TpmpEmuReadClock (
+    PTPM_EMU_CONTEXT Context,
+    PTPM_EMU_REQUEST Request,
+    PTPM_EMU_STREAM Response
+    )
+{
+    uint64_t elapsed;
+
+    (void)Request;
+
+    //
+    // Time counts from when the emulator was opened, while the clock keeps
+    // going across openings when the state is persisted.
+    //
+    elapsed = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - Context->StartTime).count());
+    Context->State->Clock = Context->StartClock + elapsed;
+    TpmpEmuWrite64(Response, elapsed);
+    TpmpEmuWrite64(Response, Context->State->Clock);
+    TpmpEmuWrite32(Response, Context->State->ResetCount);
+    TpmpEmuWrite32(Response, Context->State->RestartCount);
+    TpmpEmuWrite8(Response, 1);
+    return TPM_RC_SUCCESS;
+}
+
+TPM_RC
+TpmpEmuStartup (
+    PTPM_EMU_CONTEXT Context,
+    PTPM_EMU_REQUEST Request,
+    PTPM_EMU_STREAM Response
+    )
+{
+    (void)Context;
+    (void)Request;
+    (void)Response;
+
+    //
+    // The emulator is always started
+    //
+    return TPM_RC_INITIALIZE;
+}
+
+//
+// Emulated Commands
+//
+static const TPM_EMU_COMMAND TpmpEmuCommands[] =
+{
+    { TPM_CC_NV_UndefineSpace, 2, true, TpmpEmuNvUndefineSpace },
+    { TPM_CC_NV_DefineSpace, 1, true, TpmpEmuNvDefineSpace },
+    { TPM_CC_NV_Write, 2, true, TpmpEmuNvWrite },
+    { TPM_CC_NV_Increment, 2, true, TpmpEmuNvUpdate },
+    { TPM_CC_NV_SetBits, 2, true, TpmpEmuNvUpdate },
+    { TPM_CC_NV_Extend, 2, true, TpmpEmuNvUpdate },
+    { TPM_CC_NV_WriteLock, 2, true, TpmpEmuNvLock },
+    { TPM_CC_NV_Read, 2, true, TpmpEmuNvRead },
+    { TPM_CC_NV_ReadLock, 2, true, TpmpEmuNvLock },
+    { TPM_CC_NV_ReadPublic, 1, false, TpmpEmuNvReadPublic },
+    { TPM_CC_GetCapability, 0, false, TpmpEmuGetCapability },
+    { TPM_CC_GetRandom, 0, false, TpmpEmuGetRandom },
+    { TPM_CC_Hash, 0, false, TpmpEmuHash },
+    { TPM_CC_HashSequenceStart, 0, false, TpmpEmuHashSequenceStart },
+    { TPM_CC_SequenceUpdate, 1, true, TpmpEmuSequenceUpdate },
+    { TPM_CC_SequenceComplete, 1, true, TpmpEmuSequenceUpdate },
+    { TPM_CC_FlushContext, 0, false, TpmpEmuFlushContext },
+    { TPM_CC_ReadClock, 0, false, TpmpEmuReadClock },
+    { TPM_CC_Startup, 0, false, TpmpEmuStartup },
+};
+
+TPM_RC
+TpmpEmuGetCommands (
+    uint32_t CommandCode,
+    uint32_t CommandCount,
+    PTPM_EMU_STREAM Response
+    )
+{
+    uint32_t commands[sizeof(TpmpEmuCommands) / sizeof(TpmpEmuCommands[0])];
+    uint32_t commandTotal;
+    uint32_t first;
+    uint32_t returnCount;
+    uint32_t i;
+    uint32_t j;
+
+    //
+    // Describe each emulated command with its handle count, in ascending order
+    // of command code, which is always below the handle count field.
+    //
+    commandTotal = 0;
+    for (i = 0; i < (sizeof(TpmpEmuCommands) / sizeof(TpmpEmuCommands[0])); i++)
+    {
+        commands[commandTotal++] = TpmpEmuCommands[i].CommandCode;
+    }
+    qsort(commands, commandTotal, sizeof(commands[0]), TpmpEmuCompareHandles);
+    for (i = 0; i < commandTotal; i++)
+    {
+        for (j = 0; j < commandTotal; j++)
+        {
+            if (TpmpEmuCommands[j].CommandCode == commands[i])
+            {
+                commands[i] |= static_cast<uint32_t>(TpmpEmuCommands[j].HandleCount) << 25;
+                break;
+            }
+        }
+    }
+
+    //
+    // Return the ones starting at the requested command
+    //
+    for (first = 0; first < commandTotal; first++)
+    {
+        if ((commands[first] & TPMA_CC_COMMAND_INDEX) >= CommandCode)
+        {
+            break;
+        }
+    }
+    returnCount = commandTotal - first;
+    if (CommandCount > MAX_CAP_CC)
+    {
+        CommandCount = MAX_CAP_CC;
+    }
+    if (returnCount > CommandCount)
+    {
+        returnCount = CommandCount;
+    }
+    TpmpEmuWrite8(Response, ((first + returnCount) < commandTotal) ? 1 : 0);
+    TpmpEmuWrite32(Response, TPM_CAP_COMMANDS);
+    TpmpEmuWrite32(Response, returnCount);
+    for (i = first; i < (first + returnCount); i++)
+    {
+        TpmpEmuWrite32(Response, commands[i]);
+    }
+    return TPM_RC_SUCCESS;
+}
+
+TPM_RC
+TpmpEmuExecute (
+    PTPM_EMU_CONTEXT Context,
+    const TPM_COMMAND_SEGMENT* Segments,
+    uint32_t SegmentCount,
+    uint32_t* ResponseSize
+    )
+{
+    const TPM_EMU_COMMAND* command;
+    TPM_EMU_REQUEST request;
+    TPM_EMU_STREAM stream;
+    TPM_EMU_STREAM response;
+    uint32_t authorizationSize;
+    uint32_t authorizationEnd;
+    uint32_t commandSize;
+    uint16_t tag;
+    uint32_t size;
+    uint16_t nonceSize;
+    uint32_t i;
+    TPM_RC tpmResult;
+
+    //
+    // Decode the command header
+    //
+    memset(&stream, 0, sizeof(stream));
+    stream.Segments = Segments;
+    stream.SegmentCount = SegmentCount;
+    stream.Scratch = Context->Scratch;
+    stream.ScratchSize = sizeof(Context->Scratch);
+    commandSize = TpmpEmuRemaining(&stream);
+    tag = TpmpEmuRead16(&stream);
+    size = TpmpEmuRead32(&stream);
+    memset(&request, 0, sizeof(request));
+    request.CommandCode = static_cast<TPM_CC>(TpmpEmuRead32(&stream));
+    if ((stream.Overflow) || (size != commandSize))
+    {
+        return TPM_RC_COMMAND_SIZE;
+    }
+    if ((tag != TPM_ST_SESSIONS) && (tag != TPM_ST_NO_SESSIONS))
+    {
+        return TPM_RC_BAD_TAG;
+    }
+
+    //
+    // Find the command
+    //
+    command = nullptr;
+    for (i = 0; i < (sizeof(TpmpEmuCommands) / sizeof(TpmpEmuCommands[0])); i++)
+    {
+        if (TpmpEmuCommands[i].CommandCode == request.CommandCode)
+        {
+            command = &TpmpEmuCommands[i];
+            break;
+        }
+    }
+    if (command == nullptr)
+    {
+        return TPM_RC_COMMAND_CODE;
+    }
+
+    //
+    // Read the handles
+    //
+    for (i = 0; i < command->HandleCount; i++)
+    {
+        request.Handles[i] = TpmpEmuRead32(&stream);
+    }
+
+    //
+    // Decode the password session, if any. Additional sessions are skipped.
+    //
+    if (tag == TPM_ST_SESSIONS)
+    {
+        authorizationSize = TpmpEmuRead32(&stream);
+        if ((stream.Overflow) || (authorizationSize > TpmpEmuRemaining(&stream)))
+        {
+            return TPM_RC_COMMAND_SIZE;
+        }
+        authorizationEnd = TpmpEmuRemaining(&stream) - authorizationSize;
+        if (TpmpEmuRead32(&stream) != TPM_RS_PW.Value)
+        {
+            return static_cast<TPM_RC>(TPM_RC_HANDLE | TPM_RC_S | TPM_RC_1);
+        }
+        nonceSize = TpmpEmuRead16(&stream);
+        TpmpEmuReadBytes(&stream, nonceSize);
+        TpmpEmuRead8(&stream);
+        request.PasswordSize = TpmpEmuRead16(&stream);
+        request.Password = TpmpEmuReadBytes(&stream, request.PasswordSize);
+        if ((stream.Overflow) || (TpmpEmuRemaining(&stream) < authorizationEnd))
+        {
+            return TPM_RC_COMMAND_SIZE;
+        }
+        TpmpEmuReadBytes(&stream, TpmpEmuRemaining(&stream) - authorizationEnd);
+    }
+    else if (command->Authorized)
+    {
+        return TPM_RC_AUTH_MISSING;
+    }
+
+    //
+    // The rest of the command are the parameters
+    //
+    request.Parameters = stream;
+
+    //
+    // Leave room for the header and, with sessions, the parameter size
+    //
+    memset(&response, 0, sizeof(response));
+    response.Buffer = Context->Response;
+    response.Size = sizeof(Context->Response);
+    response.Offset = sizeof(TPM_REPLY_HEADER);
+    if (tag == TPM_ST_SESSIONS)
+    {
+        response.Offset += sizeof(uint32_t);
+    }
+
+    //
+    // Execute the command
+    //
+    tpmResult = command->Handler(Context, &request, &response);
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        return tpmResult;
+    }
+    if (response.Overflow)
+    {
+        return TPM_RC_FAILURE;
+    }
+
+    //
+    // With sessions, fill in the parameter size and append the password
+    // session's response, which has no nonce and an empty HMAC.
+    //
+    if (tag == TPM_ST_SESSIONS)
+    {
+        size = OsSwap32(response.Offset - sizeof(TPM_REPLY_HEADER) - sizeof(uint32_t));
+        memcpy(&Context->Response[sizeof(TPM_REPLY_HEADER)], &size, sizeof(size));
+        TpmpEmuWrite16(&response, 0);
+        TpmpEmuWrite8(&response, 0);
+        TpmpEmuWrite16(&response, 0);
+    }
+
+    //
+    // Finally, fill in the header
+    //
+    memset(&stream, 0, sizeof(stream));
+    stream.Buffer = Context->Response;
+    stream.Size = sizeof(TPM_REPLY_HEADER);
+    TpmpEmuWrite16(&stream, tag);
+    TpmpEmuWrite32(&stream, response.Offset);
+    TpmpEmuWrite32(&stream, TPM_RC_SUCCESS);
+    *ResponseSize = response.Offset;
+    return TPM_RC_SUCCESS;
+}
+
+uint32_t
+TpmpEmuLookupOverride (
+    TPM_EMU_OVERRIDE* Overrides,
+    uint32_t OverrideCount,
+    TPM_CC CommandCode,
+    uint32_t Default
+    )
+{
+    uint32_t i;
+
+    for (i = 0; i < OverrideCount; i++)
+    {
+        if (Overrides[i].CommandCode == CommandCode)
+        {
+            return Overrides[i].Value;
+        }
+    }
+    return Default;
+}
+
+bool
+TpmpEmuIssueCommandV (
+    uintptr_t TpmHandle,
+    const TPM_COMMAND_SEGMENT* Segments,
+    uint32_t SegmentCount,
+    uint8_t* Out,
+    uint32_t OutLength,
+    uint32_t* OsResult
+    )
+{
+    PTPM_EMU_CONTEXT context;
+    TPM_REPLY_HEADER header;
+    uint32_t responseSize;
+    uint32_t commandCode;
+    uint32_t latency;
+    TPM_RC tpmResult;
+
+    context = reinterpret_cast<PTPM_EMU_CONTEXT>(TpmHandle);
+
+    //
+    // Simulate the time the TPM would take to execute the command
+    //
+    commandCode = 0;
+    if ((SegmentCount != 0) && (Segments[0].Length >= sizeof(TPM_CMD_HEADER)))
+    {
+        memcpy(&commandCode,
+               &Segments[0].Buffer[offsetof(TPM_CMD_HEADER, CommandCode)],
+               sizeof(commandCode));
+        commandCode = OsSwap32(commandCode);
+    }
+    latency = TpmpEmuLookupOverride(context->Latencies,
+                                    context->LatencyCount,
+                                    static_cast<TPM_CC>(commandCode),
+                                    context->Latency);
+    if (latency != 0)
+    {
+        std::this_thread::sleep_for(std::chrono::microseconds(latency));
+    }
+
+    //
+    // Either fail with an injected error, or execute the command for real
+    //
+    tpmResult = static_cast<TPM_RC>(TpmpEmuLookupOverride(context->Errors,
+                                                          context->ErrorCount,
+                                                          static_cast<TPM_CC>(commandCode),
+                                                          TPM_RC_SUCCESS));
+    if (tpmResult == TPM_RC_SUCCESS)
+    {
+        tpmResult = TpmpEmuExecute(context, Segments, SegmentCount, &responseSize);
+    }
+
+    //
+    // Failures are reported with just a header
+    //
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        header.SessionTag = static_cast<TPM_ST>(OsSwap16(TPM_ST_NO_SESSIONS));
+        header.Size = OsSwap32(sizeof(header));
+        header.ResponseCode = static_cast<TPM_RC>(OsSwap32(tpmResult));
+        memcpy(context->Response, &header, sizeof(header));
+        responseSize = sizeof(header);
+    }
+
+    //
+    // Like the OS stack, truncate the response to the caller's buffer
+    //
+    memcpy(Out, context->Response, (responseSize < OutLength) ? responseSize : OutLength);
+    if (OsResult != nullptr)
+    {
+        *OsResult = 0;
+    }
+    return true;
+}
+
+bool
+TpmpEmuIssueCommand (
+    uintptr_t TpmHandle,
+    uint8_t* In,
+    uint32_t InLength,
+    uint8_t* Out,
+    uint32_t OutLength,
+    uint32_t* OsResult
+    )
+{
+    TPM_COMMAND_SEGMENT segment;
+
+    //
+    // Execute the command as a single segment
+    //
+    segment.Buffer = In;
+    segment.Length = InLength;
+    return TpmpEmuIssueCommandV(TpmHandle, &segment, 1, Out, OutLength, OsResult);
+}
+
+bool
+TpmpEmuParseOverride (
+    const char* Option,
+    TPM_EMU_OVERRIDE* Overrides,
+    uint32_t* OverrideCount
+    )
+{
+    char* end;
+
+    //
+    // Overrides are written as "@<command code>=<value>"
+    //
+    if ((Option[0] != '@') || (*OverrideCount == TPM_EMU_MAX_OVERRIDES))
+    {
+        return false;
+    }
+    Overrides[*OverrideCount].CommandCode = static_cast<TPM_CC>(strtoul(&Option[1], &end, 0));
+    if (*end != '=')
+    {
+        return false;
+    }
+    Overrides[*OverrideCount].Value = strtoul(end + 1, nullptr, 0);
+    *OverrideCount += 1;
+    return true;
+}
+
+bool
+TpmpEmuParseParameters (
+    PTPM_EMU_CONTEXT Context,
+    const char* Parameters,
+    char* FilePath,
+    size_t FilePathSize,
+    bool* Reset
+    )
+{
+    char option[512];
+    const char* end;
+    size_t length;
+
+    //
+    // Parameters are a comma-separated list of options
+    //
+    while ((Parameters != nullptr) && (Parameters[0] != '\0'))
+    {
+        end = strchr(Parameters, ',');
+        length = (end != nullptr) ? static_cast<size_t>(end - Parameters) : strlen(Parameters);
+        if (length >= sizeof(option))
+        {
+            return false;
+        }
+        memcpy(option, Parameters, length);
+        option[length] = '\0';
+        Parameters = (end != nullptr) ? (end + 1) : nullptr;
+
+        if (strncmp(option, "file=", 5) == 0)
+        {
+            if (strlen(&option[5]) >= FilePathSize)
+            {
+                return false;
+            }
+            strcpy(FilePath, &option[5]);
+        }
+        else if (strncmp(option, "latency=", 8) == 0)
+        {
+            Context->Latency = strtoul(&option[8], nullptr, 0);
+        }
+        else if (strncmp(option, "latency@", 8) == 0)
+        {
+            if (TpmpEmuParseOverride(&option[7],
+                                     Context->Latencies,
+                                     &Context->LatencyCount) == false)
+            {
+                return false;
+            }
+        }
+        else if (strncmp(option, "error@", 6) == 0)
+        {
+            if (TpmpEmuParseOverride(&option[5],
+                                     Context->Errors,
+                                     &Context->ErrorCount) == false)
+            {
+                return false;
+            }
+        }
+        else if (strncmp(option, "nvbuffer=", 9) == 0)
+        {
+            Context->NvBufferMax = strtoul(&option[9], nullptr, 0);
+            if ((Context->NvBufferMax == 0) ||
+                (Context->NvBufferMax > TPM_EMU_MAX_INDEX_SIZE))
+            {
+                return false;
+            }
+        }
+        else if (strcmp(option, "reset") == 0)
+        {
+            *Reset = true;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool
+TpmpEmuOpen (
+    const char* Parameters,
+    uintptr_t* TpmHandle
+    )
+{
+    PTPM_EMU_CONTEXT context;
+    PTPM_EMU_INDEX index;
+    char filePath[256];
+    size_t stateSize;
+    void* stateBase;
+    bool reset;
+    uint32_t i;
+
+    //
+    // Initialize for failure
+    //
+    *TpmHandle = 0;
+
+    //
+    // Allocate the context
+    //
+    context = static_cast<PTPM_EMU_CONTEXT>(calloc(1, sizeof(*context)));
+    if (context == nullptr)
+    {
+        return false;
+    }
+    context->NvBufferMax = TPM_EMU_DEFAULT_NV_BUFFER;
+    filePath[0] = '\0';
+    reset = false;
+    if (TpmpEmuParseParameters(context,
+                               Parameters,
+                               filePath,
+                               sizeof(filePath),
+                               &reset) == false)
+    {
+        goto Failure;
+    }
+
+    //
+    // Map the state from the file if one was given, otherwise it only lives
+    // as long as the handle.
+    //
+    if (filePath[0] != '\0')
+    {
+        stateSize = sizeof(*context->State);
+        if (OsMapFile(filePath, true, &stateSize, &stateBase, &context->MapHandle) == false)
+        {
+            goto Failure;
+        }
+        context->State = static_cast<PTPM_EMU_STATE>(stateBase);
+        context->Mapped = true;
+    }
+    else
+    {
+        context->State = static_cast<PTPM_EMU_STATE>(calloc(1, sizeof(*context->State)));
+        if (context->State == nullptr)
+        {
+            goto Failure;
+        }
+    }
+
+    //
+    // Start from a clean TPM if the state is new or from another version
+    //
+    if ((context->State->Magic != TPM_EMU_MAGIC) ||
+        (context->State->Version != TPM_EMU_VERSION))
+    {
+        memset(context->State, 0, sizeof(*context->State));
+        context->State->Magic = TPM_EMU_MAGIC;
+        context->State->Version = TPM_EMU_VERSION;
+    }
+
+    //
+    // Emulate a TPM Reset if asked to, which clears the volatile state
+    //
+    if (reset)
+    {
+        context->State->ResetCount++;
+        context->State->RestartCount = 0;
+        for (i = 0; i < TPM_EMU_MAX_INDICES; i++)
+        {
+            index = &context->State->Index[i];
+            index->Attributes &= ~TPMA_NV_READLOCKED;
+            if ((index->Attributes & TPMA_NV_WRITEDEFINE) == 0)
+            {
+                index->Attributes &= ~TPMA_NV_WRITELOCKED;
+            }
+            if ((index->Attributes & TPMA_NV_CLEAR_STCLEAR) != 0)
+            {
+                index->Attributes &= ~TPMA_NV_WRITTEN;
+            }
+        }
+    }
+
+    //
+    // Start the clocks
+    //
+    context->StartTime = std::chrono::steady_clock::now();
+    context->StartClock = context->State->Clock;
+    context->RandomState = static_cast<uint64_t>(
+        context->StartTime.time_since_epoch().count()) | 1;
+
+    //
+    // Return a handle that can be used for further commands
+    //
+    *TpmHandle = reinterpret_cast<uintptr_t>(context);
+    return true;
+
+Failure:
+    free(context);
+    return false;
+}
+
+bool
+TpmpEmuClose (
+    uintptr_t TpmHandle
+    )
+{
+    PTPM_EMU_CONTEXT context;
+    bool result;
+
+    //
+    // Save the clock, then release the state and the context
+    //
+    context = reinterpret_cast<PTPM_EMU_CONTEXT>(TpmHandle);
+    context->State->Clock = context->StartClock +
+        static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - context->StartTime).count());
+    if (context->Mapped)
+    {
+        result = OsUnmapFile(context->State, sizeof(*context->State), context->MapHandle);
+    }
+    else
+    {
+        free(context->State);
+        result = true;
+    }
+    free(context);
+    return result;
+}
+
+//
+// Transport for the in-process emulator
+//
+const TPM_TRANSPORT TpmEmuTransport =
+{
+    "emulator",
+    TpmpEmuOpen,
+    TpmpEmuIssueCommand,
+    TpmpEmuIssueCommandV,
+    nullptr,
+    nullptr,
+    TpmpEmuClose,
+    1
+};
@@ -0,0 +1,522 @@
+/*++
+
+Copyright (c) Alex Ionescu.  All rights reserved.
+
+Module Name:
+
+    tpmfmt.cpp
+
+Abstract:
+
+    This module implements a streaming writer for the machine-readable output
+    of the tool, either as JSON or as a compact TLV encoding. Fields are
+    written into a buffer as they are given, without building the document in
+    memory first, and the buffer is written out whenever it fills up, so that
+    documents of any size only take a single write for every few KB.
+
+Author:
+
+    Alex Ionescu (@aionescu) 16-Oct-2026 - Initial version
+
+Environment:
+
+    Portable to any environment.
+
+--*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "tpmtool.hpp"
+
+//
+// Size of the output buffer, and how deep objects and arrays can be nested
+//
+#define TPM_FORMAT_BUFFER_SIZE      4096
+#define TPM_FORMAT_MAX_DEPTH        16
+
+//
+// Each TLV element starts with this header, followed by Length bytes of value.
+// Integers take the fewest bytes of 1, 2, 4 or 8 that hold them, and objects
+// and arrays have no value, but contain all the elements that come after them
+// until the matching end element. Elements in an array have no field. All
+// fields are little-endian.
+//
+typedef enum _TPM_FORMAT_TLV_TYPE : uint8_t
+{
+    TpmFormatTlvEnd,
+    TpmFormatTlvInteger,
+    TpmFormatTlvBoolean,
+    TpmFormatTlvString,
+    TpmFormatTlvBytes,
+    TpmFormatTlvObject,
+    TpmFormatTlvArray
+} TPM_FORMAT_TLV_TYPE;
+
+#pragma pack(push, 1)
+typedef struct _TPM_FORMAT_TLV_HEADER
+{
+    uint8_t Field;
+    TPM_FORMAT_TLV_TYPE Type;
+    uint16_t Length;
+} TPM_FORMAT_TLV_HEADER, *PTPM_FORMAT_TLV_HEADER;
+#pragma pack(pop)
+
+//
+// Name of each field in JSON, in the order of TPM_FORMAT_FIELD
+//
+static const char* const TpmpFormatFieldNames[] =
+{
+    nullptr,
+    "index",
+    "result",
+    "dataSize",
+    "written",
+    "ownerRights",
+    "authRights",
+    "attributes",
+    "indices",
+    "handles",
+    "range",
+    "handle",
+    "clock",
+    "time",
+    "resets",
+    "restarts",
+    "safe",
+    "random"
+};
+
+//
+// Writer Context. Each level of nesting remembers if it is an array, and if
+// anything was written into it yet, which then needs a separator in JSON.
+//
+typedef struct _TPM_FORMAT_CONTEXT
+{
+    TPM_FORMAT_TYPE Type;
+    int FileDescriptor;
+    bool Failed;
+    uint32_t Depth;
+    bool IsArray[TPM_FORMAT_MAX_DEPTH];
+    bool HasElements[TPM_FORMAT_MAX_DEPTH];
+    uint32_t BufferSize;
+    uint8_t Buffer[TPM_FORMAT_BUFFER_SIZE];
+} TPM_FORMAT_CONTEXT, *PTPM_FORMAT_CONTEXT;
+
+//
+// Digit of each nibble in a hex string
+//
+static const char TpmpFormatHexDigits[] = "0123456789abcdef";
+
+void
+TpmpFormatFlush (
+    PTPM_FORMAT_CONTEXT Context
+    )
+{
+    //
+    // Write out whatever is buffered, and remember if that failed
+    //
+    if ((Context->BufferSize != 0) &&
+        (OsWriteFile(Context->FileDescriptor, Context->Buffer, Context->BufferSize) == false))
+    {
+        Context->Failed = true;
+    }
+    Context->BufferSize = 0;
+}
+
+void
+TpmpFormatWrite (
+    PTPM_FORMAT_CONTEXT Context,
+    const void* Data,
+    size_t DataSize
+    )
+{
+    const uint8_t* data;
+    size_t copySize;
+
+    //
+    // Copy as much as fits in the buffer, and flush it when it fills up
+    //
+    data = static_cast<const uint8_t*>(Data);
+    while (DataSize != 0)
+    {
+        if (Context->BufferSize == sizeof(Context->Buffer))
+        {
+            TpmpFormatFlush(Context);
+        }
+        copySize = sizeof(Context->Buffer) - Context->BufferSize;
+        if (copySize > DataSize)
+        {
+            copySize = DataSize;
+        }
+        memcpy(&Context->Buffer[Context->BufferSize], data, copySize);
+        Context->BufferSize += static_cast<uint32_t>(copySize);
+        data += copySize;
+        DataSize -= copySize;
+    }
+}
+
+void
+TpmpFormatWriteString (
+    PTPM_FORMAT_CONTEXT Context,
+    const char* String
+    )
+{
+    TpmpFormatWrite(Context, String, strlen(String));
+}
+
+void
+TpmpFormatBeginElement (
+    PTPM_FORMAT_CONTEXT Context,
+    TPM_FORMAT_FIELD Field,
+    TPM_FORMAT_TLV_TYPE TlvType,
+    size_t Length
+    )
+{
+    TPM_FORMAT_TLV_HEADER header;
+
+    //
+    // In TLV, the header holds the field and the type of the value, along with
+    // its size, which must fit in 16 bits.
+    //
+    if (Context->Type == TpmFormatTlv)
+    {
+        if (Length > UINT16_MAX)
+        {
+            Context->Failed = true;
+            Length = 0;
+        }
+        header.Field = static_cast<uint8_t>(Field);
+        header.Type = TlvType;
+        header.Length = static_cast<uint16_t>(Length);
+        TpmpFormatWrite(Context, &header, sizeof(header));
+        return;
+    }
+
+    //
+    // In JSON, separate it from the previous element at the same level, and
+    // name it unless it is in an array.
+    //
+    if (Context->HasElements[Context->Depth])
+    {
+        TpmpFormatWrite(Context, ",", 1);
+    }
+    Context->HasElements[Context->Depth] = true;
+    if ((Context->Depth != 0) && (Context->IsArray[Context->Depth] == false))
+    {
+        TpmpFormatWrite(Context, "\"", 1);
+        TpmpFormatWriteString(Context, TpmpFormatFieldNames[Field]);
+        TpmpFormatWrite(Context, "\":", 2);
+    }
+}
+
+void
+TpmpFormatBeginContainer (
+    PTPM_FORMAT_CONTEXT Context,
+    TPM_FORMAT_FIELD Field,
+    bool IsArray
+    )
+{
+    //
+    // Write the element that opens it, and move on to the next level
+    //
+    if ((Context->Depth + 1) == TPM_FORMAT_MAX_DEPTH)
+    {
+        Context->Failed = true;
+        return;
+    }
+    TpmpFormatBeginElement(Context,
+                           Field,
+                           IsArray ? TpmFormatTlvArray : TpmFormatTlvObject,
+                           0);
+    if (Context->Type == TpmFormatJson)
+    {
+        TpmpFormatWrite(Context, IsArray ? "[" : "{", 1);
+    }
+    Context->Depth++;
+    Context->IsArray[Context->Depth] = IsArray;
+    Context->HasElements[Context->Depth] = false;
+}
+
+bool
+TpmFormatOpen (
+    TPM_FORMAT_TYPE Type,
+    int FileDescriptor,
+    uintptr_t* FormatHandle
+    )
+{
+    PTPM_FORMAT_CONTEXT context;
+
+    //
+    // Text output is printed by each command directly, without a writer
+    //
+    if ((Type != TpmFormatJson) && (Type != TpmFormatTlv))
+    {
+        return false;
+    }
+
+    //
+    // Allocate the context, with nothing written yet
+    //
+    context = static_cast<PTPM_FORMAT_CONTEXT>(malloc(sizeof(*context)));
+    if (context == nullptr)
+    {
+        return false;
+    }
+    context->Type = Type;
+    context->FileDescriptor = FileDescriptor;
+    context->Failed = false;
+    context->Depth = 0;
+    context->IsArray[0] = false;
+    context->HasElements[0] = false;
+    context->BufferSize = 0;
+    *FormatHandle = reinterpret_cast<uintptr_t>(context);
+    return true;
+}
+
+void
+TpmFormatBeginObject (
+    uintptr_t FormatHandle,
+    TPM_FORMAT_FIELD Field
+    )
+{
+    TpmpFormatBeginContainer(reinterpret_cast<PTPM_FORMAT_CONTEXT>(FormatHandle),
+                             Field,
+                             false);
+}
+
+void
+TpmFormatBeginArray (
+    uintptr_t FormatHandle,
+    TPM_FORMAT_FIELD Field
+    )
+{
+    TpmpFormatBeginContainer(reinterpret_cast<PTPM_FORMAT_CONTEXT>(FormatHandle),
+                             Field,
+                             true);
+}
+
+void
+TpmFormatEnd (
+    uintptr_t FormatHandle
+    )
+{
+    PTPM_FORMAT_CONTEXT context;
+
+    //
+    // Close the innermost object or array, and go back to the previous level
+    //
+    context = reinterpret_cast<PTPM_FORMAT_CONTEXT>(FormatHandle);
+    if (context->Depth == 0)
+    {
+        context->Failed = true;
+        return;
+    }
+    if (context->Type == TpmFormatTlv)
+    {
+        TpmpFormatBeginElement(context, TpmFormatNone, TpmFormatTlvEnd, 0);
+    }
+    else
+    {
+        TpmpFormatWrite(context, context->IsArray[context->Depth] ? "]" : "}", 1);
+    }
+    context->Depth--;
+}
+
+void
+TpmFormatInteger (
+    uintptr_t FormatHandle,
+    TPM_FORMAT_FIELD Field,
+    uint64_t Value
+    )
+{
+    PTPM_FORMAT_CONTEXT context;
+    uint8_t value[sizeof(Value)];
+    char digits[20];
+    uint32_t length;
+    uint32_t i;
+
+    //
+    // In TLV, use the fewest bytes that hold the value, in little-endian
+    //
+    context = reinterpret_cast<PTPM_FORMAT_CONTEXT>(FormatHandle);
+    if (context->Type == TpmFormatTlv)
+    {
+        length = (Value > UINT32_MAX) ? 8 :
+                 (Value > UINT16_MAX) ? 4 :
+                 (Value > UINT8_MAX) ? 2 : 1;
+        TpmpFormatBeginElement(context, Field, TpmFormatTlvInteger, length);
+        for (i = 0; i < length; i++)
+        {
+            value[i] = static_cast<uint8_t>(Value >> (i * 8));
+        }
+        TpmpFormatWrite(context, value, length);
+        return;
+    }
+
+    //
+    // In JSON, write the decimal digits, which are generated backwards
+    //
+    TpmpFormatBeginElement(context, Field, TpmFormatTlvInteger, 0);
+    length = 0;
+    do
+    {
+        digits[sizeof(digits) - ++length] = static_cast<char>('0' + (Value % 10));
+        Value /= 10;
+    } while (Value != 0);
+    TpmpFormatWrite(context, &digits[sizeof(digits) - length], length);
+}
+
+void
+TpmFormatBoolean (
+    uintptr_t FormatHandle,
+    TPM_FORMAT_FIELD Field,
+    bool Value
+    )
+{
+    PTPM_FORMAT_CONTEXT context;
+    uint8_t value;
+
+    //
+    // A single byte in TLV, or a literal in JSON
+    //
+    context = reinterpret_cast<PTPM_FORMAT_CONTEXT>(FormatHandle);
+    if (context->Type == TpmFormatTlv)
+    {
+        value = Value ? 1 : 0;
+        TpmpFormatBeginElement(context, Field, TpmFormatTlvBoolean, sizeof(value));
+        TpmpFormatWrite(context, &value, sizeof(value));
+        return;
+    }
+    TpmpFormatBeginElement(context, Field, TpmFormatTlvBoolean, 0);
+    TpmpFormatWriteString(context, Value ? "true" : "false");
+}
+
+void
+TpmFormatString (
+    uintptr_t FormatHandle,
+    TPM_FORMAT_FIELD Field,
+    const char* Value
+    )
+{
+    PTPM_FORMAT_CONTEXT context;
+    char escape[6];
+    size_t length;
+    size_t start;
+    size_t i;
+
+    //
+    // The string is written as-is in TLV, without its terminator
+    //
+    context = reinterpret_cast<PTPM_FORMAT_CONTEXT>(FormatHandle);
+    length = strlen(Value);
+    if (context->Type == TpmFormatTlv)
+    {
+        TpmpFormatBeginElement(context, Field, TpmFormatTlvString, length);
+        TpmpFormatWrite(context, Value, length);
+        return;
+    }
+
+    //
+    // In JSON, quotes, backslashes and control characters must be escaped, so
+    // write the runs of characters in between them as they are.
+    //
+    TpmpFormatBeginElement(context, Field, TpmFormatTlvString, 0);
+    TpmpFormatWrite(context, "\"", 1);
+    start = 0;
+    for (i = 0; i < length; i++)
+    {
+        if ((Value[i] != '"') &&
+            (Value[i] != '\\') &&
+            (static_cast<uint8_t>(Value[i]) >= ' '))
+        {
+            continue;
+        }
+        TpmpFormatWrite(context, &Value[start], i - start);
+        escape[0] = '\\';
+        if (static_cast<uint8_t>(Value[i]) >= ' ')
+        {
+            escape[1] = Value[i];
+            TpmpFormatWrite(context, escape, 2);
+        }
+        else
+        {
+            escape[1] = 'u';
+            escape[2] = '0';
+            escape[3] = '0';
+            escape[4] = TpmpFormatHexDigits[static_cast<uint8_t>(Value[i]) >> 4];
+            escape[5] = TpmpFormatHexDigits[Value[i] & 0xF];
+            TpmpFormatWrite(context, escape, sizeof(escape));
+        }
+        start = i + 1;
+    }
+    TpmpFormatWrite(context, &Value[start], length - start);
+    TpmpFormatWrite(context, "\"", 1);
+}
+
+void
+TpmFormatBytes (
+    uintptr_t FormatHandle,
+    TPM_FORMAT_FIELD Field,
+    const uint8_t* Data,
+    size_t DataSize
+    )
+{
+    PTPM_FORMAT_CONTEXT context;
+    char digits[64];
+    size_t length;
+    size_t i;
+
+    //
+    // The bytes are written as-is in TLV
+    //
+    context = reinterpret_cast<PTPM_FORMAT_CONTEXT>(FormatHandle);
+    if (context->Type == TpmFormatTlv)
+    {
+        TpmpFormatBeginElement(context, Field, TpmFormatTlvBytes, DataSize);
+        TpmpFormatWrite(context, Data, DataSize);
+        return;
+    }
+
+    //
+    // In JSON, they become a hex string, converted a few bytes at a time
+    //
+    TpmpFormatBeginElement(context, Field, TpmFormatTlvBytes, 0);
+    TpmpFormatWrite(context, "\"", 1);
+    length = 0;
+    for (i = 0; i < DataSize; i++)
+    {
+        digits[length++] = TpmpFormatHexDigits[Data[i] >> 4];
+        digits[length++] = TpmpFormatHexDigits[Data[i] & 0xF];
+        if (length == sizeof(digits))
+        {
+            TpmpFormatWrite(context, digits, length);
+            length = 0;
+        }
+    }
+    TpmpFormatWrite(context, digits, length);
+    TpmpFormatWrite(context, "\"", 1);
+}
+
+bool
+TpmFormatClose (
+    uintptr_t FormatHandle
+    )
+{
+    PTPM_FORMAT_CONTEXT context;
+    bool result;
+
+    //
+    // JSON documents end with a new line, then write out what is left. The
+    // document is only valid if every object and array was closed, and all of
+    // it was written.
+    //
+    context = reinterpret_cast<PTPM_FORMAT_CONTEXT>(FormatHandle);
+    if (context->Type == TpmFormatJson)
+    {
+        TpmpFormatWrite(context, "\n", 1);
+    }
+    TpmpFormatFlush(context);
+    result = (context->Failed == false) && (context->Depth == 0);
+    free(context);
+    return result;
+}
@@ -0,0 +1,943 @@
+/*++
+
+Copyright (c) Alex Ionescu.  All rights reserved.
+
+Module Name:
+
+    tpmkv.cpp
+
+Abstract:
+
+    This module implements a key-value store which packs many small values
+    into a pool of large NV indices, so that they don't each need an index of
+    their own. A directory index holds the hash of each key along with where
+    its record is stored, and is cached when the store is opened, so that a
+    lookup costs a single NV_Read.
+
+Author:
+
+    Alex Ionescu (@aionescu) 16-Oct-2026 - Initial version
+
+Environment:
+
+    Portable to any environment.
+
+--*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "tpmtool.hpp"
+#include "tpmcmd.hpp"
+
+//
+// The directory index starts with this header, followed by the entries, and
+// the pool indices follow the directory index. All fields are little-endian.
+//
+#define TPM_KV_MAGIC                0x5653564B
+#define TPM_KV_VERSION              1
+#define TPM_KV_KEY_HASH_SIZE        8
+#define TPM_KV_MAX_KEY_SIZE         255
+
+#pragma pack(push, 1)
+typedef struct _TPM_KV_HEADER
+{
+    uint32_t Magic;
+    uint16_t Version;
+    uint16_t PoolCount;
+    uint16_t PoolSize;
+    uint16_t EntryCount;
+    uint16_t EntryCapacity;
+    uint16_t Reserved;
+} TPM_KV_HEADER, *PTPM_KV_HEADER;
+
+//
+// Each entry points to a record in a pool, which holds the size of the key,
+// the key itself and then the value. Keys are compared in full once their
+// record is read, so a truncated hash is enough to find them.
+//
+typedef struct _TPM_KV_ENTRY
+{
+    uint8_t KeyHash[TPM_KV_KEY_HASH_SIZE];
+    uint16_t Pool;
+    uint16_t Offset;
+    uint16_t Length;
+} TPM_KV_ENTRY, *PTPM_KV_ENTRY;
+#pragma pack(pop)
+
+//
+// Key-Value Store Context, followed by the cached directory and then by the
+// authorization data of the indices
+//
+typedef struct _TPM_KV_CONTEXT
+{
+    uintptr_t TpmHandle;
+    TPM_NV_INDEX DirectoryIndex;
+    uint16_t AuthorizationSize;
+    uint8_t* AuthorizationData;
+    uint16_t DirectorySize;
+    PTPM_KV_HEADER Header;
+    PTPM_KV_ENTRY Entries;
+} TPM_KV_CONTEXT, *PTPM_KV_CONTEXT;
+
+TPM_NV_INDEX
+TpmpKvPoolIndex (
+    PTPM_KV_CONTEXT Context,
+    uint16_t Pool
+    )
+{
+    TPM_NV_INDEX index;
+
+    //
+    // Pools follow the directory
+    //
+    index.Value = Context->DirectoryIndex.Value + 1 + Pool;
+    return index;
+}
+
+void
+TpmpKvHashKey (
+    const char* Key,
+    uint8_t* KeyHash
+    )
+{
+    uint8_t digest[TPM_SHA256_DIGEST_SIZE];
+
+    //
+    // Keep the start of the SHA-256 digest of the key
+    //
+    TpmSha256(reinterpret_cast<const uint8_t*>(Key), strlen(Key), digest);
+    memcpy(KeyHash, digest, TPM_KV_KEY_HASH_SIZE);
+}
+
+uint16_t
+TpmpKvPoolEnd (
+    PTPM_KV_CONTEXT Context,
+    uint16_t Pool
+    )
+{
+    PTPM_KV_ENTRY entry;
+    uint16_t end;
+    uint16_t i;
+
+    //
+    // Records are only ever appended, so the free space of a pool starts after
+    // the last of its records.
+    //
+    end = 0;
+    for (i = 0; i < Context->Header->EntryCount; i++)
+    {
+        entry = &Context->Entries[i];
+        if ((entry->Pool == Pool) && ((entry->Offset + entry->Length) > end))
+        {
+            end = entry->Offset + entry->Length;
+        }
+    }
+    return end;
+}
+
+TPM_RC
+TpmpKvReadRecord (
+    PTPM_KV_CONTEXT Context,
+    const TPM_KV_ENTRY* Entry,
+    uint8_t** Record
+    )
+{
+    TPM_RC tpmResult;
+
+    //
+    // Read the whole record in one go
+    //
+    *Record = static_cast<uint8_t*>(malloc(Entry->Length));
+    if (*Record == nullptr)
+    {
+        return TPM_RC_FAILURE;
+    }
+    tpmResult = TpmNvRead2(Context->TpmHandle,
+                           TpmpKvPoolIndex(Context, Entry->Pool),
+                           Context->AuthorizationSize,
+                           Context->AuthorizationData,
+                           Entry->Offset,
+                           Entry->Length,
+                           *Record);
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        free(*Record);
+        *Record = nullptr;
+        return tpmResult;
+    }
+
+    //
+    // Make sure the key fits in the record
+    //
+    if ((Entry->Length == 0) || ((*Record)[0] >= Entry->Length))
+    {
+        free(*Record);
+        *Record = nullptr;
+        return TPM_RC_INTEGRITY;
+    }
+    return TPM_RC_SUCCESS;
+}
+
+void
+TpmpKvLimits (
+    PTPM_KV_CONTEXT Context,
+    const char* Key,
+    PTPM_KV_LIMITS Limits
+    )
+{
+    uint8_t keyHash[TPM_KV_KEY_HASH_SIZE];
+    PTPM_KV_ENTRY entry;
+    uint32_t poolUsed;
+    uint32_t poolFree;
+    uint32_t overhead;
+    size_t keySize;
+    uint16_t pool;
+    uint16_t i;
+
+    //
+    // An entry with the same hash may be the key itself, in which case it
+    // does not need a new entry, and its old record will be dropped. This
+    // only looks at the cached directory, so it costs no command.
+    //
+    memset(Limits, 0, sizeof(*Limits));
+    Limits->EntryCount = Context->Header->EntryCount;
+    Limits->EntryCapacity = Context->Header->EntryCapacity;
+    TpmpKvHashKey(Key, keyHash);
+    for (i = 0; i < Context->Header->EntryCount; i++)
+    {
+        if (memcmp(Context->Entries[i].KeyHash, keyHash, sizeof(keyHash)) == 0)
+        {
+            Limits->Replacing = true;
+        }
+    }
+
+    //
+    // Keys that are empty or too long can't hold anything
+    //
+    keySize = strlen(Key);
+    if ((keySize == 0) || (keySize > TPM_KV_MAX_KEY_SIZE))
+    {
+        return;
+    }
+
+    //
+    // Each record holds the size of the key and the key before the value
+    //
+    overhead = static_cast<uint32_t>(1 + keySize);
+    if (Context->Header->PoolSize > overhead)
+    {
+        Limits->MaximumValueSize = static_cast<uint16_t>(Context->Header->PoolSize - overhead);
+    }
+
+    //
+    // A record must fit in a single pool, which has the space of all the
+    // records it holds back once compacted.
+    //
+    for (pool = 0; pool < Context->Header->PoolCount; pool++)
+    {
+        poolUsed = 0;
+        for (i = 0; i < Context->Header->EntryCount; i++)
+        {
+            entry = &Context->Entries[i];
+            if ((entry->Pool == pool) &&
+                (memcmp(entry->KeyHash, keyHash, sizeof(keyHash)) != 0))
+            {
+                poolUsed += entry->Length;
+            }
+        }
+        poolFree = (poolUsed < Context->Header->PoolSize) ?
+                   (Context->Header->PoolSize - poolUsed) : 0;
+        if ((poolFree > overhead) && ((poolFree - overhead) > Limits->FreeValueSize))
+        {
+            Limits->FreeValueSize = static_cast<uint16_t>(poolFree - overhead);
+        }
+    }
+}
+
+TPM_RC
+TpmpKvLookup (
+    PTPM_KV_CONTEXT Context,
+    const char* Key,
+    uint16_t* EntryIndex,
+    uint8_t** Record
+    )
+{
+    uint8_t keyHash[TPM_KV_KEY_HASH_SIZE];
+    size_t keySize;
+    TPM_RC tpmResult;
+    uint16_t i;
+
+    //
+    // Find the entries with the same hash in the cached directory, and read
+    // their record to compare the whole key.
+    //
+    TpmpKvHashKey(Key, keyHash);
+    keySize = strlen(Key);
+    for (i = 0; i < Context->Header->EntryCount; i++)
+    {
+        if (memcmp(Context->Entries[i].KeyHash, keyHash, sizeof(keyHash)) != 0)
+        {
+            continue;
+        }
+        tpmResult = TpmpKvReadRecord(Context, &Context->Entries[i], Record);
+        if (tpmResult != TPM_RC_SUCCESS)
+        {
+            return tpmResult;
+        }
+        if (((*Record)[0] == keySize) && (memcmp(&(*Record)[1], Key, keySize) == 0))
+        {
+            *EntryIndex = i;
+            return TPM_RC_SUCCESS;
+        }
+        free(*Record);
+        *Record = nullptr;
+    }
+
+    //
+    // The key is not in the store
+    //
+    return TPM_RC_VALUE;
+}
+
+TPM_RC
+TpmpKvWriteDirectory (
+    PTPM_KV_CONTEXT Context
+    )
+{
+    //
+    // Write the header and the live entries, which is all that changes
+    //
+    return TpmNvWrite2(Context->TpmHandle,
+                       Context->DirectoryIndex,
+                       Context->AuthorizationSize,
+                       Context->AuthorizationData,
+                       0,
+                       static_cast<uint16_t>(sizeof(TPM_KV_HEADER) +
+                                             (Context->Header->EntryCount *
+                                              sizeof(TPM_KV_ENTRY))),
+                       reinterpret_cast<uint8_t*>(Context->Header));
+}
+
+TPM_RC
+TpmpKvCompact (
+    PTPM_KV_CONTEXT Context,
+    uint16_t Pool
+    )
+{
+    uint8_t* oldPool;
+    uint8_t* newPool;
+    uint16_t poolEnd;
+    uint16_t newEnd;
+    PTPM_KV_ENTRY entry;
+    TPM_RC tpmResult;
+    uint16_t i;
+
+    //
+    // Nothing to do if the pool holds nothing
+    //
+    poolEnd = TpmpKvPoolEnd(Context, Pool);
+    if (poolEnd == 0)
+    {
+        return TPM_RC_SUCCESS;
+    }
+
+    //
+    // Read the used part of the pool at once
+    //
+    newPool = nullptr;
+    oldPool = static_cast<uint8_t*>(malloc(poolEnd));
+    if (oldPool == nullptr)
+    {
+        return TPM_RC_FAILURE;
+    }
+    tpmResult = TpmNvRead2(Context->TpmHandle,
+                           TpmpKvPoolIndex(Context, Pool),
+                           Context->AuthorizationSize,
+                           Context->AuthorizationData,
+                           0,
+                           poolEnd,
+                           oldPool);
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        goto Exit;
+    }
+
+    //
+    // Pack the live records together, dropping the space left behind by the
+    // records that were replaced or deleted.
+    //
+    tpmResult = TPM_RC_FAILURE;
+    newPool = static_cast<uint8_t*>(malloc(poolEnd));
+    if (newPool == nullptr)
+    {
+        goto Exit;
+    }
+    newEnd = 0;
+    for (i = 0; i < Context->Header->EntryCount; i++)
+    {
+        entry = &Context->Entries[i];
+        if (entry->Pool == Pool)
+        {
+            memcpy(&newPool[newEnd], &oldPool[entry->Offset], entry->Length);
+            entry->Offset = newEnd;
+            newEnd += entry->Length;
+        }
+    }
+
+    //
+    // Write the pool back, followed by the directory. This is not atomic, so
+    // a failure in between leaves the directory pointing at the old offsets.
+    //
+    tpmResult = TPM_RC_SUCCESS;
+    if (newEnd != 0)
+    {
+        tpmResult = TpmNvWrite2(Context->TpmHandle,
+                                TpmpKvPoolIndex(Context, Pool),
+                                Context->AuthorizationSize,
+                                Context->AuthorizationData,
+                                0,
+                                newEnd,
+                                newPool);
+    }
+    if (tpmResult == TPM_RC_SUCCESS)
+    {
+        tpmResult = TpmpKvWriteDirectory(Context);
+    }
+
+Exit:
+    free(newPool);
+    free(oldPool);
+    return tpmResult;
+}
+
+TPM_RC
+TpmKvFormat (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX DirectoryIndex,
+    uint16_t PoolCount,
+    uint16_t PoolSize,
+    uint16_t EntryCapacity,
+    uint16_t AuthorizationSize,
+    uint8_t* AuthorizationData
+    )
+{
+    TPM_KV_HEADER header;
+    TPM_NV_INDEX index;
+    uint32_t directorySize;
+    TPM_RC tpmResult;
+    uint16_t i;
+
+    //
+    // Validate the layout
+    //
+    directorySize = sizeof(header) + (EntryCapacity * sizeof(TPM_KV_ENTRY));
+    if ((PoolCount == 0) || (PoolSize == 0) || (EntryCapacity == 0) ||
+        (directorySize > UINT16_MAX))
+    {
+        return TPM_RC_SIZE;
+    }
+
+    //
+    // Create the directory, and the pools right after it
+    //
+    tpmResult = TpmDefineSpace2(TpmHandle,
+                                DirectoryIndex,
+                                static_cast<uint16_t>(directorySize),
+                                0,
+                                TpmToolReadWriteAccess,
+                                TpmToolReadWriteAccess,
+                                AuthorizationSize,
+                                AuthorizationData);
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        return tpmResult;
+    }
+    for (i = 0; i < PoolCount; i++)
+    {
+        index.Value = DirectoryIndex.Value + 1 + i;
+        tpmResult = TpmDefineSpace2(TpmHandle,
+                                    index,
+                                    PoolSize,
+                                    0,
+                                    TpmToolReadWriteAccess,
+                                    TpmToolReadWriteAccess,
+                                    AuthorizationSize,
+                                    AuthorizationData);
+        if (tpmResult != TPM_RC_SUCCESS)
+        {
+            goto Exit;
+        }
+    }
+
+    //
+    // Write an empty directory
+    //
+    header.Magic = TPM_KV_MAGIC;
+    header.Version = TPM_KV_VERSION;
+    header.PoolCount = PoolCount;
+    header.PoolSize = PoolSize;
+    header.EntryCount = 0;
+    header.EntryCapacity = EntryCapacity;
+    header.Reserved = 0;
+    tpmResult = TpmNvWrite2(TpmHandle,
+                            DirectoryIndex,
+                            AuthorizationSize,
+                            AuthorizationData,
+                            0,
+                            sizeof(header),
+                            reinterpret_cast<uint8_t*>(&header));
+
+Exit:
+    //
+    // Don't leave a partial store behind
+    //
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        while (i-- != 0)
+        {
+            index.Value = DirectoryIndex.Value + 1 + i;
+            TpmUndefineSpace2(TpmHandle, index);
+        }
+        TpmUndefineSpace2(TpmHandle, DirectoryIndex);
+    }
+    return tpmResult;
+}
+
+TPM_RC
+TpmKvOpen (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX DirectoryIndex,
+    uint16_t AuthorizationSize,
+    uint8_t* AuthorizationData,
+    uintptr_t* KvHandle
+    )
+{
+    PTPM_KV_CONTEXT context;
+    TPM_KV_HEADER header;
+    uint32_t directorySize;
+    TPM_RC tpmResult;
+
+    //
+    // Initialize for failure
+    //
+    *KvHandle = 0;
+
+    //
+    // Read the header, which tells us how large the directory is
+    //
+    tpmResult = TpmNvRead2(TpmHandle,
+                           DirectoryIndex,
+                           AuthorizationSize,
+                           AuthorizationData,
+                           0,
+                           sizeof(header),
+                           reinterpret_cast<uint8_t*>(&header));
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        return tpmResult;
+    }
+    if ((header.Magic != TPM_KV_MAGIC) ||
+        (header.Version != TPM_KV_VERSION) ||
+        (header.EntryCount > header.EntryCapacity))
+    {
+        return TPM_RC_INTEGRITY;
+    }
+
+    //
+    // Allocate the context, with room for the whole directory and a copy of
+    // the authorization data.
+    //
+    directorySize = sizeof(header) + (header.EntryCapacity * sizeof(TPM_KV_ENTRY));
+    context = static_cast<PTPM_KV_CONTEXT>(malloc(sizeof(*context) +
+                                                  directorySize +
+                                                  AuthorizationSize));
+    if (context == nullptr)
+    {
+        return TPM_RC_FAILURE;
+    }
+    context->TpmHandle = TpmHandle;
+    context->DirectoryIndex = DirectoryIndex;
+    context->DirectorySize = static_cast<uint16_t>(directorySize);
+    context->Header = reinterpret_cast<PTPM_KV_HEADER>(context + 1);
+    context->Entries = reinterpret_cast<PTPM_KV_ENTRY>(context->Header + 1);
+    context->AuthorizationSize = AuthorizationSize;
+    context->AuthorizationData = reinterpret_cast<uint8_t*>(context->Header) +
+                                 directorySize;
+    if (AuthorizationSize != 0)
+    {
+        memcpy(context->AuthorizationData, AuthorizationData, AuthorizationSize);
+    }
+
+    //
+    // Then read the live entries, and cache them for as long as we're open
+    //
+    *context->Header = header;
+    if (header.EntryCount != 0)
+    {
+        tpmResult = TpmNvRead2(TpmHandle,
+                               DirectoryIndex,
+                               AuthorizationSize,
+                               AuthorizationData,
+                               sizeof(header),
+                               static_cast<uint16_t>(header.EntryCount *
+                                                     sizeof(TPM_KV_ENTRY)),
+                               reinterpret_cast<uint8_t*>(context->Entries));
+        if (tpmResult != TPM_RC_SUCCESS)
+        {
+            free(context);
+            return tpmResult;
+        }
+    }
+
+    //
+    // Return the context as the handle
+    //
+    *KvHandle = reinterpret_cast<uintptr_t>(context);
+    return TPM_RC_SUCCESS;
+}
+
+TPM_RC
+TpmKvGet (
+    uintptr_t KvHandle,
+    const char* Key,
+    uint16_t* ValueSize,
+    uint8_t* Value
+    )
+{
+    PTPM_KV_CONTEXT context;
+    uint16_t entryIndex;
+    uint8_t* record;
+    uint16_t valueOffset;
+    uint16_t valueSize;
+    TPM_RC tpmResult;
+
+    //
+    // Find the record and read it
+    //
+    context = reinterpret_cast<PTPM_KV_CONTEXT>(KvHandle);
+    tpmResult = TpmpKvLookup(context, Key, &entryIndex, &record);
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        return tpmResult;
+    }
+
+    //
+    // Return the value if it fits, or its size if it doesn't
+    //
+    valueOffset = 1 + record[0];
+    valueSize = context->Entries[entryIndex].Length - valueOffset;
+    if (valueSize > *ValueSize)
+    {
+        tpmResult = TPM_RC_SIZE;
+    }
+    else
+    {
+        memcpy(Value, &record[valueOffset], valueSize);
+    }
+    *ValueSize = valueSize;
+    free(record);
+    return tpmResult;
+}
+
+TPM_RC
+TpmKvPut (
+    uintptr_t KvHandle,
+    const char* Key,
+    uint16_t ValueSize,
+    const uint8_t* Value
+    )
+{
+    PTPM_KV_CONTEXT context;
+    TPM_KV_LIMITS limits;
+    TPM_KV_ENTRY oldEntry;
+    PTPM_KV_ENTRY entry;
+    uint16_t entryIndex;
+    uint8_t* record;
+    uint8_t* oldRecord;
+    size_t keySize;
+    uint32_t recordSize;
+    uint16_t pool;
+    uint16_t poolEnd;
+    bool replacing;
+    bool compacted;
+    TPM_RC tpmResult;
+
+    //
+    // Check that the record fits in a pool, and that the store has room for
+    // it, before issuing any command.
+    //
+    context = reinterpret_cast<PTPM_KV_CONTEXT>(KvHandle);
+    TpmpKvLimits(context, Key, &limits);
+    if ((limits.MaximumValueSize == 0) || (ValueSize > limits.MaximumValueSize))
+    {
+        return TPM_RC_SIZE;
+    }
+    if (((limits.Replacing == false) && (limits.EntryCount == limits.EntryCapacity)) ||
+        (ValueSize > limits.FreeValueSize))
+    {
+        return TPM_RC_NV_SPACE;
+    }
+
+    //
+    // Build the record
+    //
+    keySize = strlen(Key);
+    recordSize = static_cast<uint32_t>(1 + keySize + ValueSize);
+    record = static_cast<uint8_t*>(malloc(recordSize));
+    if (record == nullptr)
+    {
+        return TPM_RC_FAILURE;
+    }
+    record[0] = static_cast<uint8_t>(keySize);
+    memcpy(&record[1], Key, keySize);
+    if (ValueSize != 0)
+    {
+        memcpy(&record[1 + keySize], Value, ValueSize);
+    }
+
+    //
+    // Look for the key, since it may already be in the store
+    //
+    replacing = false;
+    compacted = false;
+    tpmResult = TpmpKvLookup(context, Key, &entryIndex, &oldRecord);
+    if (tpmResult == TPM_RC_SUCCESS)
+    {
+        free(oldRecord);
+        entry = &context->Entries[entryIndex];
+
+        //
+        // A value of the same size is simply overwritten, which leaves the
+        // directory as it is.
+        //
+        if (entry->Length == recordSize)
+        {
+            tpmResult = TpmNvWrite2(context->TpmHandle,
+                                    TpmpKvPoolIndex(context, entry->Pool),
+                                    context->AuthorizationSize,
+                                    context->AuthorizationData,
+                                    entry->Offset,
+                                    static_cast<uint16_t>(recordSize),
+                                    record);
+            goto Exit;
+        }
+
+        //
+        // Otherwise drop the old record, so that its space can be reclaimed
+        //
+        oldEntry = *entry;
+        *entry = context->Entries[--context->Header->EntryCount];
+        replacing = true;
+    }
+    else if (tpmResult != TPM_RC_VALUE)
+    {
+        goto Exit;
+    }
+    else if (context->Header->EntryCount == context->Header->EntryCapacity)
+    {
+        tpmResult = TPM_RC_NV_SPACE;
+        goto Exit;
+    }
+
+    //
+    // Find a pool with enough free space at its end, compacting them one at a
+    // time if none has it. A replaced key is missing from the directory that
+    // compaction writes, until the new record is added.
+    //
+    for (pool = 0; pool < context->Header->PoolCount; pool++)
+    {
+        poolEnd = TpmpKvPoolEnd(context, pool);
+        if ((poolEnd + recordSize) <= context->Header->PoolSize)
+        {
+            break;
+        }
+    }
+    if (pool == context->Header->PoolCount)
+    {
+        for (pool = 0; pool < context->Header->PoolCount; pool++)
+        {
+            tpmResult = TpmpKvCompact(context, pool);
+            if (tpmResult != TPM_RC_SUCCESS)
+            {
+                goto Exit;
+            }
+            compacted = true;
+            poolEnd = TpmpKvPoolEnd(context, pool);
+            if ((poolEnd + recordSize) <= context->Header->PoolSize)
+            {
+                break;
+            }
+        }
+        if (pool == context->Header->PoolCount)
+        {
+            tpmResult = TPM_RC_NV_SPACE;
+            goto Exit;
+        }
+    }
+
+    //
+    // Write the record into the free space, which the directory on the TPM
+    // does not point to yet, and only then write the directory.
+    //
+    tpmResult = TpmNvWrite2(context->TpmHandle,
+                            TpmpKvPoolIndex(context, pool),
+                            context->AuthorizationSize,
+                            context->AuthorizationData,
+                            poolEnd,
+                            static_cast<uint16_t>(recordSize),
+                            record);
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        goto Exit;
+    }
+    entry = &context->Entries[context->Header->EntryCount++];
+    TpmpKvHashKey(Key, entry->KeyHash);
+    entry->Pool = pool;
+    entry->Offset = poolEnd;
+    entry->Length = static_cast<uint16_t>(recordSize);
+    tpmResult = TpmpKvWriteDirectory(context);
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        context->Header->EntryCount--;
+    }
+
+Exit:
+    //
+    // Put the old record back if it is still what the TPM has
+    //
+    if ((tpmResult != TPM_RC_SUCCESS) && (replacing) && !(compacted))
+    {
+        context->Entries[context->Header->EntryCount++] = oldEntry;
+    }
+    free(record);
+    return tpmResult;
+}
+
+void
+TpmKvQueryLimits (
+    uintptr_t KvHandle,
+    const char* Key,
+    PTPM_KV_LIMITS Limits
+    )
+{
+    //
+    // Work out the room for the key from the cached directory
+    //
+    TpmpKvLimits(reinterpret_cast<PTPM_KV_CONTEXT>(KvHandle), Key, Limits);
+}
+
+TPM_RC
+TpmKvDelete (
+    uintptr_t KvHandle,
+    const char* Key
+    )
+{
+    PTPM_KV_CONTEXT context;
+    TPM_KV_ENTRY oldEntry;
+    uint16_t entryIndex;
+    uint8_t* record;
+    TPM_RC tpmResult;
+
+    //
+    // Find the key
+    //
+    context = reinterpret_cast<PTPM_KV_CONTEXT>(KvHandle);
+    tpmResult = TpmpKvLookup(context, Key, &entryIndex, &record);
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        return tpmResult;
+    }
+    free(record);
+
+    //
+    // Drop its entry, whose space is reclaimed by the next compaction
+    //
+    oldEntry = context->Entries[entryIndex];
+    context->Entries[entryIndex] = context->Entries[--context->Header->EntryCount];
+    tpmResult = TpmpKvWriteDirectory(context);
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        context->Entries[context->Header->EntryCount++] = oldEntry;
+    }
+    return tpmResult;
+}
+
+TPM_RC
+TpmKvList (
+    uintptr_t KvHandle,
+    PTPM_KV_LIST_CALLBACK Callback,
+    void* CallbackContext
+    )
+{
+    PTPM_KV_CONTEXT context;
+    PTPM_KV_ENTRY entry;
+    uint8_t* poolData;
+    uint8_t* record;
+    char key[TPM_KV_MAX_KEY_SIZE + 1];
+    uint16_t poolEnd;
+    uint16_t pool;
+    uint16_t i;
+    TPM_RC tpmResult;
+
+    //
+    // Read each pool that is in use once, and return the keys found in it
+    //
+    context = reinterpret_cast<PTPM_KV_CONTEXT>(KvHandle);
+    for (pool = 0; pool < context->Header->PoolCount; pool++)
+    {
+        poolEnd = TpmpKvPoolEnd(context, pool);
+        if (poolEnd == 0)
+        {
+            continue;
+        }
+        poolData = static_cast<uint8_t*>(malloc(poolEnd));
+        if (poolData == nullptr)
+        {
+            return TPM_RC_FAILURE;
+        }
+        tpmResult = TpmNvRead2(context->TpmHandle,
+                               TpmpKvPoolIndex(context, pool),
+                               context->AuthorizationSize,
+                               context->AuthorizationData,
+                               0,
+                               poolEnd,
+                               poolData);
+        for (i = 0; (tpmResult == TPM_RC_SUCCESS) && (i < context->Header->EntryCount); i++)
+        {
+            entry = &context->Entries[i];
+            if (entry->Pool != pool)
+            {
+                continue;
+            }
+            record = &poolData[entry->Offset];
+            if ((entry->Length == 0) || (record[0] >= entry->Length))
+            {
+                tpmResult = TPM_RC_INTEGRITY;
+                break;
+            }
+            memcpy(key, &record[1], record[0]);
+            key[record[0]] = '\0';
+            if (Callback(CallbackContext, key, entry->Length - 1 - record[0]) == false)
+            {
+                tpmResult = TPM_RC_CANCELED;
+            }
+        }
+        free(poolData);
+        if (tpmResult != TPM_RC_SUCCESS)
+        {
+            return tpmResult;
+        }
+    }
+    return TPM_RC_SUCCESS;
+}
+
+void
+TpmKvClose (
+    uintptr_t KvHandle
+    )
+{
+    //
+    // The directory is always written as soon as it changes, so just free it
+    //
+    free(reinterpret_cast<PTPM_KV_CONTEXT>(KvHandle));
+}
@@ -0,0 +1,315 @@
+/*++
+
+Copyright (c) Alex Ionescu.  All rights reserved.
+
+Module Name:
+
+    tpmlz.cpp
+
+Abstract:
+
+    This module implements a small LZ77 codec, used to compress the data that
+    is stored in NV indices. The format is a series of sequences, each made of
+    a token, a run of literal bytes and a match against the bytes that were
+    already output, in the same spirit as the LZ4 block format. It favors a
+    tiny, bounds-checked decoder over the best possible ratio.
+
+Author:
+
+    Alex Ionescu (@aionescu) 16-Oct-2026 - Initial version
+
+Environment:
+
+    Portable to any environment.
+
+--*/
+
+#include <string.h>
+#include "tpmtool.hpp"
+#include "tpmcmd.hpp"
+
+//
+// Each token holds the number of literals in its high nibble and the length
+// of the match, less the minimum, in its low nibble. A nibble of 15 is
+// followed by bytes which are added to it, for as long as they are 255. The
+// literals follow, and then the 16-bit little-endian distance of the match.
+// The last sequence only has literals, and ends the input.
+//
+#define TPM_LZ_MIN_MATCH            4
+#define TPM_LZ_MAX_DISTANCE         UINT16_MAX
+#define TPM_LZ_NIBBLE_MAX           15
+#define TPM_LZ_HASH_BITS            12
+
+bool
+TpmpLzWriteLength (
+    uint8_t* Output,
+    uint32_t OutputSize,
+    uint32_t* Cursor,
+    uint32_t Length
+    )
+{
+    //
+    // Write the part of the length that did not fit in the nibble
+    //
+    for (Length -= TPM_LZ_NIBBLE_MAX; ; Length -= UINT8_MAX)
+    {
+        if (*Cursor == OutputSize)
+        {
+            return false;
+        }
+        if (Length < UINT8_MAX)
+        {
+            Output[(*Cursor)++] = static_cast<uint8_t>(Length);
+            return true;
+        }
+        Output[(*Cursor)++] = UINT8_MAX;
+    }
+}
+
+bool
+TpmpLzWriteSequence (
+    uint8_t* Output,
+    uint32_t OutputSize,
+    uint32_t* Cursor,
+    const uint8_t* Literals,
+    uint32_t LiteralCount,
+    uint32_t Distance,
+    uint32_t MatchLength
+    )
+{
+    uint32_t matchNibble;
+
+    //
+    // Write the token, with the length of the match only if there is one
+    //
+    if (*Cursor == OutputSize)
+    {
+        return false;
+    }
+    matchNibble = (MatchLength != 0) ? (MatchLength - TPM_LZ_MIN_MATCH) : 0;
+    Output[(*Cursor)++] = static_cast<uint8_t>(
+        (((LiteralCount < TPM_LZ_NIBBLE_MAX) ? LiteralCount : TPM_LZ_NIBBLE_MAX) << 4) |
+        ((matchNibble < TPM_LZ_NIBBLE_MAX) ? matchNibble : TPM_LZ_NIBBLE_MAX));
+
+    //
+    // Then the literals
+    //
+    if ((LiteralCount >= TPM_LZ_NIBBLE_MAX) &&
+        (TpmpLzWriteLength(Output, OutputSize, Cursor, LiteralCount) == false))
+    {
+        return false;
+    }
+    if ((OutputSize - *Cursor) < LiteralCount)
+    {
+        return false;
+    }
+    memcpy(&Output[*Cursor], Literals, LiteralCount);
+    *Cursor += LiteralCount;
+
+    //
+    // And the match, if any
+    //
+    if (MatchLength == 0)
+    {
+        return true;
+    }
+    if ((OutputSize - *Cursor) < sizeof(uint16_t))
+    {
+        return false;
+    }
+    Output[(*Cursor)++] = static_cast<uint8_t>(Distance);
+    Output[(*Cursor)++] = static_cast<uint8_t>(Distance >> 8);
+    return (matchNibble < TPM_LZ_NIBBLE_MAX) ||
+           (TpmpLzWriteLength(Output, OutputSize, Cursor, matchNibble));
+}
+
+bool
+TpmLzCompress (
+    const uint8_t* Input,
+    uint32_t InputSize,
+    uint8_t* Output,
+    uint32_t OutputSize,
+    uint32_t* OutputWritten
+    )
+{
+    uint32_t table[1 << TPM_LZ_HASH_BITS];
+    uint32_t sequence;
+    uint32_t hash;
+    uint32_t candidate;
+    uint32_t position;
+    uint32_t anchor;
+    uint32_t length;
+    uint32_t cursor;
+
+    //
+    // The table holds the last position (plus one) where each hash of four
+    // bytes was seen, which is where matches are looked for.
+    //
+    memset(table, 0, sizeof(table));
+    cursor = 0;
+    anchor = 0;
+    position = 0;
+    while ((position + TPM_LZ_MIN_MATCH) <= InputSize)
+    {
+        memcpy(&sequence, &Input[position], sizeof(sequence));
+        hash = (sequence * 2654435761U) >> (32 - TPM_LZ_HASH_BITS);
+        candidate = table[hash];
+        table[hash] = position + 1;
+        if ((candidate == 0) ||
+            ((position - (candidate - 1)) > TPM_LZ_MAX_DISTANCE) ||
+            (memcmp(&Input[candidate - 1], &Input[position], TPM_LZ_MIN_MATCH) != 0))
+        {
+            position++;
+            continue;
+        }
+
+        //
+        // Extend the match as far as it goes, and write it out along with the
+        // literals before it.
+        //
+        candidate--;
+        length = TPM_LZ_MIN_MATCH;
+        while (((position + length) < InputSize) &&
+               (Input[candidate + length] == Input[position + length]))
+        {
+            length++;
+        }
+        if (TpmpLzWriteSequence(Output,
+                                OutputSize,
+                                &cursor,
+                                &Input[anchor],
+                                position - anchor,
+                                position - candidate,
+                                length) == false)
+        {
+            return false;
+        }
+        position += length;
+        anchor = position;
+    }
+
+    //
+    // Finish with the remaining literals
+    //
+    if (TpmpLzWriteSequence(Output,
+                            OutputSize,
+                            &cursor,
+                            &Input[anchor],
+                            InputSize - anchor,
+                            0,
+                            0) == false)
+    {
+        return false;
+    }
+    *OutputWritten = cursor;
+    return true;
+}
+
+bool
+TpmpLzReadLength (
+    const uint8_t* Input,
+    uint32_t InputSize,
+    uint32_t* Cursor,
+    uint32_t* Length
+    )
+{
+    uint8_t value;
+
+    //
+    // Add bytes to the length for as long as they are full
+    //
+    do
+    {
+        if (*Cursor == InputSize)
+        {
+            return false;
+        }
+        value = Input[(*Cursor)++];
+        *Length += value;
+    } while (value == UINT8_MAX);
+    return true;
+}
+
+bool
+TpmLzDecompress (
+    const uint8_t* Input,
+    uint32_t InputSize,
+    uint8_t* Output,
+    uint32_t OutputSize,
+    uint32_t* OutputWritten
+    )
+{
+    uint32_t cursor;
+    uint32_t position;
+    uint32_t literalCount;
+    uint32_t matchLength;
+    uint32_t distance;
+    uint8_t token;
+
+    cursor = 0;
+    position = 0;
+    for (;;)
+    {
+        //
+        // Read the token and copy the literals, making sure that they are all
+        // there and that they fit.
+        //
+        if (cursor == InputSize)
+        {
+            return false;
+        }
+        token = Input[cursor++];
+        literalCount = token >> 4;
+        if ((literalCount == TPM_LZ_NIBBLE_MAX) &&
+            (TpmpLzReadLength(Input, InputSize, &cursor, &literalCount) == false))
+        {
+            return false;
+        }
+        if (((InputSize - cursor) < literalCount) ||
+            ((OutputSize - position) < literalCount))
+        {
+            return false;
+        }
+        memcpy(&Output[position], &Input[cursor], literalCount);
+        cursor += literalCount;
+        position += literalCount;
+
+        //
+        // The last sequence has no match
+        //
+        if (cursor == InputSize)
+        {
+            break;
+        }
+
+        //
+        // Copy the match a byte at a time, since it can overlap itself
+        //
+        if ((InputSize - cursor) < sizeof(uint16_t))
+        {
+            return false;
+        }
+        distance = Input[cursor] | (Input[cursor + 1] << 8);
+        cursor += sizeof(uint16_t);
+        matchLength = token & TPM_LZ_NIBBLE_MAX;
+        if ((matchLength == TPM_LZ_NIBBLE_MAX) &&
+            (TpmpLzReadLength(Input, InputSize, &cursor, &matchLength) == false))
+        {
+            return false;
+        }
+        matchLength += TPM_LZ_MIN_MATCH;
+        if ((distance == 0) ||
+            (distance > position) ||
+            ((OutputSize - position) < matchLength))
+        {
+            return false;
+        }
+        for (; matchLength != 0; matchLength--, position++)
+        {
+            Output[position] = Output[position - distance];
+        }
+    }
+
+    *OutputWritten = position;
+    return true;
+}
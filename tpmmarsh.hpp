@@ -0,0 +1,772 @@
+/*++
+
+Copyright (c) Alex Ionescu.  All rights reserved.
+
+Module Name:
+
+    tpmmarsh.hpp
+
+Abstract:
+
+    This header implements compile-time marshalling of TPM2.0 commands and
+    responses. Each command is described by the list of fields following its
+    header, from which the fixed part of its size, the big-endian encoding of
+    its constants and the bounds-checked decoding of its response are all
+    generated by the compiler and fully inlined.
+
+Author:
+
+    Alex Ionescu (@aionescu) 16-Oct-2026 - Initial version
+
+Environment:
+
+    Portable to any environment.
+
+--*/
+
+#pragma once
+#include <string.h>
+#include <type_traits>
+
+//
+// Values of variable-sized fields, which point into the caller's buffer when
+// encoding, or straight into the response buffer when decoding.
+//
+typedef struct _TPM_MARSHAL_BYTES
+{
+    const uint8_t* Data;
+    uint16_t Size;
+} TPM_MARSHAL_BYTES, *PTPM_MARSHAL_BYTES;
+
+typedef struct _TPM_MARSHAL_LIST
+{
+    const uint8_t* Data;
+    uint32_t Count;
+} TPM_MARSHAL_LIST, *PTPM_MARSHAL_LIST;
+
+//
+// Constant fields take no value from the caller, who passes TpmConstant
+//
+typedef struct _TPM_MARSHAL_CONSTANT
+{
+} TPM_MARSHAL_CONSTANT;
+static constexpr TPM_MARSHAL_CONSTANT TpmConstant = {};
+
+//
+// Byte swapping for values known at compile time, which can't use intrinsics
+//
+template<typename T>
+constexpr
+T
+TpmpSwapConstant (
+    T Value
+    )
+{
+    uint64_t result = 0;
+
+    for (size_t i = 0; i < sizeof(T); i++)
+    {
+        result = (result << 8) | ((static_cast<uint64_t>(Value) >> (i * 8)) & 0xFF);
+    }
+    return static_cast<T>(result);
+}
+
+//
+// Byte swapping for values known at run time, using the OS intrinsics
+//
+template<typename T>
+static inline
+T
+TpmpSwap (
+    T Value
+    )
+{
+    if constexpr (sizeof(T) == sizeof(uint64_t))
+    {
+        return static_cast<T>(OsSwap64(static_cast<uint64_t>(Value)));
+    }
+    else if constexpr (sizeof(T) == sizeof(uint32_t))
+    {
+        return static_cast<T>(OsSwap32(static_cast<uint32_t>(Value)));
+    }
+    else if constexpr (sizeof(T) == sizeof(uint16_t))
+    {
+        return static_cast<T>(OsSwap16(static_cast<uint16_t>(Value)));
+    }
+    else
+    {
+        return Value;
+    }
+}
+
+//
+// Value of a handle as a compile-time constant
+//
+constexpr
+uint32_t
+TpmpHandleValue (
+    const TPM_HANDLE& Handle
+    )
+{
+    return static_cast<uint32_t>(Handle.Index[0]) |
+           (static_cast<uint32_t>(Handle.Index[1]) << 8) |
+           (static_cast<uint32_t>(Handle.Index[2]) << 16) |
+           (static_cast<uint32_t>(Handle.Type) << 24);
+}
+
+//
+// Decodes an integer in TPM byte order from an unaligned location
+//
+template<typename T>
+static inline
+T
+TpmDecodeInteger (
+    const uint8_t* Buffer
+    )
+{
+    T value;
+
+    memcpy(&value, Buffer, sizeof(value));
+    return TpmpSwap(value);
+}
+
+//
+// Field descriptors. Each field has a fixed size known at compile time, and
+// variable fields add the size of their value on top. When decoding, the
+// bytes available beyond the fixed size of the response ("slack") are what
+// variable fields are checked against, so fixed fields never need a check.
+//
+
+//
+// An integer of the given type
+//
+template<typename T>
+struct TpmInteger
+{
+    using Type = T;
+    static constexpr uint32_t FixedSize = sizeof(T);
+
+    static constexpr
+    uint32_t
+    VariableSize (
+        const Type&
+        )
+    {
+        return 0;
+    }
+
+    static inline
+    uint8_t*
+    Encode (
+        uint8_t* Cursor,
+        const Type& Value
+        )
+    {
+        T value;
+
+        value = TpmpSwap(Value);
+        memcpy(Cursor, &value, sizeof(value));
+        return Cursor + sizeof(value);
+    }
+
+    static inline
+    const uint8_t*
+    Decode (
+        const uint8_t* Cursor,
+        uint32_t* Slack,
+        Type* Value
+        )
+    {
+        (void)Slack;
+        *Value = TpmDecodeInteger<T>(Cursor);
+        return Cursor + sizeof(T);
+    }
+};
+
+//
+// An integer whose value is always the same, and is encoded at compile time
+//
+template<typename T, T Constant>
+struct TpmFixed
+{
+    using Type = TPM_MARSHAL_CONSTANT;
+    static constexpr uint32_t FixedSize = sizeof(T);
+    static constexpr T Encoded = TpmpSwapConstant(Constant);
+
+    static constexpr
+    uint32_t
+    VariableSize (
+        const Type&
+        )
+    {
+        return 0;
+    }
+
+    static inline
+    uint8_t*
+    Encode (
+        uint8_t* Cursor,
+        const Type&
+        )
+    {
+        memcpy(Cursor, &Encoded, sizeof(Encoded));
+        return Cursor + sizeof(Encoded);
+    }
+
+    static inline
+    const uint8_t*
+    Decode (
+        const uint8_t* Cursor,
+        uint32_t* Slack,
+        Type* Value
+        )
+    {
+        (void)Slack;
+        (void)Value;
+        return Cursor + sizeof(T);
+    }
+};
+
+//
+// A TPM2B, which is a 16-bit size followed by as many bytes
+//
+struct TpmSized
+{
+    using Type = TPM_MARSHAL_BYTES;
+    static constexpr uint32_t FixedSize = sizeof(uint16_t);
+
+    static inline
+    uint32_t
+    VariableSize (
+        const Type& Value
+        )
+    {
+        return Value.Size;
+    }
+
+    static inline
+    uint8_t*
+    Encode (
+        uint8_t* Cursor,
+        const Type& Value
+        )
+    {
+        Cursor = TpmInteger<uint16_t>::Encode(Cursor, Value.Size);
+        if (Value.Size != 0)
+        {
+            memcpy(Cursor, Value.Data, Value.Size);
+        }
+        return Cursor + Value.Size;
+    }
+
+    static inline
+    const uint8_t*
+    Decode (
+        const uint8_t* Cursor,
+        uint32_t* Slack,
+        Type* Value
+        )
+    {
+        Value->Size = TpmDecodeInteger<uint16_t>(Cursor);
+        if (Value->Size > *Slack)
+        {
+            return nullptr;
+        }
+        *Slack -= Value->Size;
+        Value->Data = Cursor + sizeof(uint16_t);
+        return Value->Data + Value->Size;
+    }
+};
+
+//
+// A TPML, which is a 32-bit count followed by as many elements of the given
+// type. Elements are left in TPM byte order, and must be already encoded.
+//
+template<typename T>
+struct TpmList
+{
+    using Type = TPM_MARSHAL_LIST;
+    static constexpr uint32_t FixedSize = sizeof(uint32_t);
+
+    static inline
+    uint32_t
+    VariableSize (
+        const Type& Value
+        )
+    {
+        return Value.Count * sizeof(T);
+    }
+
+    static inline
+    uint8_t*
+    Encode (
+        uint8_t* Cursor,
+        const Type& Value
+        )
+    {
+        Cursor = TpmInteger<uint32_t>::Encode(Cursor, Value.Count);
+        memcpy(Cursor, Value.Data, Value.Count * sizeof(T));
+        return Cursor + (Value.Count * sizeof(T));
+    }
+
+    static inline
+    const uint8_t*
+    Decode (
+        const uint8_t* Cursor,
+        uint32_t* Slack,
+        Type* Value
+        )
+    {
+        Value->Count = TpmDecodeInteger<uint32_t>(Cursor);
+        if (Value->Count > (*Slack / sizeof(T)))
+        {
+            return nullptr;
+        }
+        *Slack -= Value->Count * static_cast<uint32_t>(sizeof(T));
+        Value->Data = Cursor + sizeof(uint32_t);
+        return Value->Data + (Value->Count * sizeof(T));
+    }
+};
+
+//
+// A TPM2B whose bytes are not copied into the command buffer. Instead, they
+// are sent straight from the caller's buffer as their own command segment,
+// which means that commands using it can only be built with MarshalSegments.
+//
+struct TpmSizedReference
+{
+    using Type = TPM_MARSHAL_BYTES;
+    static constexpr uint32_t FixedSize = sizeof(uint16_t);
+
+    static inline
+    uint32_t
+    VariableSize (
+        const Type& Value
+        )
+    {
+        return Value.Size;
+    }
+};
+
+//
+// The authorization area of a command, with a single password session. If
+// there's no password this will simply use the empty password, which is how
+// the owner is authenticated.
+//
+struct TpmPasswordSession
+{
+    using Type = TPM_MARSHAL_BYTES;
+    static constexpr uint32_t FixedSize = sizeof(uint32_t) +
+                                          sizeof(TPMI_SH_AUTH_SESSION) +
+                                          sizeof(uint16_t) +
+                                          sizeof(TPMA_SESSION) +
+                                          sizeof(uint16_t);
+
+    static inline
+    uint32_t
+    VariableSize (
+        const Type& Value
+        )
+    {
+        return Value.Size;
+    }
+
+    static inline
+    uint8_t*
+    Encode (
+        uint8_t* Cursor,
+        const Type& Value
+        )
+    {
+        Cursor = TpmInteger<uint32_t>::Encode(Cursor,
+                                              FixedSize - sizeof(uint32_t) + Value.Size);
+        Cursor = TpmFixed<uint32_t, TpmpHandleValue(TPM_RS_PW)>::Encode(Cursor, TpmConstant);
+        Cursor = TpmFixed<uint16_t, 0>::Encode(Cursor, TpmConstant);
+        Cursor = TpmFixed<uint8_t, 0>::Encode(Cursor, TpmConstant);
+        return TpmSized::Encode(Cursor, Value);
+    }
+};
+
+//
+// Number of bytes that a field stores in the command buffer itself
+//
+template<typename Field>
+static inline
+uint32_t
+TpmpBufferedSize (
+    const typename Field::Type& Value
+    )
+{
+    if constexpr (std::is_same_v<Field, TpmSizedReference>)
+    {
+        (void)Value;
+        return 0;
+    }
+    else
+    {
+        return Field::VariableSize(Value);
+    }
+}
+
+//
+// Appends a segment to a command, unless it is empty
+//
+static inline
+void
+TpmpAddSegment (
+    PTPM_COMMAND_SEGMENT Segments,
+    uint32_t* SegmentCount,
+    const uint8_t* Buffer,
+    uint32_t Length
+    )
+{
+    if (Length != 0)
+    {
+        Segments[*SegmentCount].Buffer = Buffer;
+        Segments[*SegmentCount].Length = Length;
+        (*SegmentCount)++;
+    }
+}
+
+//
+// Encodes a field into the command buffer, except for a referenced TPM2B.
+// That ends the current segment right after its size, and adds the caller's
+// bytes as the following segment.
+//
+template<typename Field>
+static inline
+uint8_t*
+TpmpEncodeSegment (
+    uint8_t* Cursor,
+    const typename Field::Type& Value,
+    PTPM_COMMAND_SEGMENT Segments,
+    uint32_t* SegmentCount,
+    uint8_t** SegmentStart
+    )
+{
+    if constexpr (std::is_same_v<Field, TpmSizedReference>)
+    {
+        Cursor = TpmInteger<uint16_t>::Encode(Cursor, Value.Size);
+        TpmpAddSegment(Segments,
+                       SegmentCount,
+                       *SegmentStart,
+                       static_cast<uint32_t>(Cursor - *SegmentStart));
+        TpmpAddSegment(Segments, SegmentCount, Value.Data, Value.Size);
+        *SegmentStart = Cursor;
+        return Cursor;
+    }
+    else
+    {
+        return Field::Encode(Cursor, Value);
+    }
+}
+
+//
+// A command, made up of its header and the given fields. Marshal returns the
+// size of the command, or zero if it did not fit in the buffer. Commands with
+// referenced fields use MarshalSegments instead, which returns the number of
+// segments making up the command, or zero if its buffered part did not fit.
+//
+template<TPM_CC CommandCode, TPM_ST SessionTag, typename... Fields>
+struct TpmCommand
+{
+    static constexpr uint32_t FixedSize = sizeof(TPM_CMD_HEADER) + (0 + ... + Fields::FixedSize);
+    static constexpr uint32_t MaximumSegments = 1 +
+        (0 + ... + (std::is_same_v<Fields, TpmSizedReference> ? 2 : 0));
+    static constexpr uint16_t EncodedTag = TpmpSwapConstant<uint16_t>(SessionTag);
+    static constexpr uint32_t EncodedCode = TpmpSwapConstant<uint32_t>(CommandCode);
+
+    static inline
+    uint32_t
+    Size (
+        const typename Fields::Type&... Values
+        )
+    {
+        return FixedSize + (0 + ... + Fields::VariableSize(Values));
+    }
+
+    static inline
+    uint8_t*
+    EncodeHeader (
+        uint8_t* Buffer,
+        uint32_t Size
+        )
+    {
+        memcpy(Buffer, &EncodedTag, sizeof(EncodedTag));
+        TpmInteger<uint32_t>::Encode(Buffer + sizeof(EncodedTag), Size);
+        memcpy(Buffer + sizeof(EncodedTag) + sizeof(Size), &EncodedCode, sizeof(EncodedCode));
+        return Buffer + sizeof(TPM_CMD_HEADER);
+    }
+
+    static inline
+    uint32_t
+    Marshal (
+        uint8_t* Buffer,
+        uint32_t BufferSize,
+        const typename Fields::Type&... Values
+        )
+    {
+        uint8_t* cursor;
+        uint32_t size;
+
+        size = Size(Values...);
+        if (size > BufferSize)
+        {
+            return 0;
+        }
+        cursor = EncodeHeader(Buffer, size);
+        ((cursor = Fields::Encode(cursor, Values)), ...);
+        (void)cursor;
+        return size;
+    }
+
+    static inline
+    uint32_t
+    MarshalSegments (
+        uint8_t* Buffer,
+        uint32_t BufferSize,
+        PTPM_COMMAND_SEGMENT Segments,
+        const typename Fields::Type&... Values
+        )
+    {
+        uint8_t* segmentStart;
+        uint32_t segmentCount;
+        uint8_t* cursor;
+
+        if ((FixedSize + (0 + ... + TpmpBufferedSize<Fields>(Values))) > BufferSize)
+        {
+            return 0;
+        }
+        cursor = EncodeHeader(Buffer, Size(Values...));
+        segmentStart = Buffer;
+        segmentCount = 0;
+        ((cursor = TpmpEncodeSegment<Fields>(cursor,
+                                             Values,
+                                             Segments,
+                                             &segmentCount,
+                                             &segmentStart)), ...);
+        TpmpAddSegment(Segments,
+                       &segmentCount,
+                       segmentStart,
+                       static_cast<uint32_t>(cursor - segmentStart));
+        return segmentCount;
+    }
+};
+
+//
+// A response, made up of its header, the parameter size if sessions were
+// used, and the given fields. Unmarshal fails if the response is too short
+// for the fields, which can otherwise be trusted.
+//
+template<TPM_ST SessionTag, typename... Fields>
+struct TpmResponse
+{
+    static constexpr uint32_t ParameterOffset = sizeof(TPM_REPLY_HEADER) +
+        ((SessionTag == TPM_ST_SESSIONS) ? sizeof(uint32_t) : 0);
+    static constexpr uint32_t FixedSize = ParameterOffset + (0 + ... + Fields::FixedSize);
+
+    static inline
+    bool
+    Unmarshal (
+        const uint8_t* Buffer,
+        uint32_t BufferSize,
+        typename Fields::Type*... Values
+        )
+    {
+        const uint8_t* cursor;
+        uint32_t size;
+        uint32_t slack;
+
+        size = TpmDecodeInteger<uint32_t>(Buffer + offsetof(TPM_REPLY_HEADER, Size));
+        if (size > BufferSize)
+        {
+            size = BufferSize;
+        }
+        if (size < FixedSize)
+        {
+            return false;
+        }
+        slack = size - FixedSize;
+        cursor = Buffer + ParameterOffset;
+        return (((cursor = Fields::Decode(cursor, &slack, Values)) != nullptr) && ...);
+    }
+};
+
+//
+// Returns the TPM 2.0 Result Code from a Response Buffer
+//
+static inline
+TPM_RC
+TpmReadResponseCode (
+    const uint8_t* Response
+    )
+{
+    return static_cast<TPM_RC>(
+        TpmDecodeInteger<uint32_t>(Response + offsetof(TPM_REPLY_HEADER, ResponseCode)));
+}
+
+//
+// Command and Response Descriptors
+//
+using TpmNvUndefineSpaceCommand =
+    TpmCommand<TPM_CC_NV_UndefineSpace, TPM_ST_SESSIONS,
+               TpmFixed<uint32_t, TpmpHandleValue(TPM_RH_OWNER)>,   // authHandle
+               TpmInteger<uint32_t>,                                // nvIndex
+               TpmPasswordSession>;
+using TpmNvUndefineSpaceResponse = TpmResponse<TPM_ST_SESSIONS>;
+
+using TpmNvDefineSpaceCommand =
+    TpmCommand<TPM_CC_NV_DefineSpace, TPM_ST_SESSIONS,
+               TpmFixed<uint32_t, TpmpHandleValue(TPM_RH_OWNER)>,   // authHandle
+               TpmPasswordSession,
+               TpmSized,                                            // auth
+               TpmFixed<uint16_t, 14>,                              // publicInfo.size
+               TpmInteger<uint32_t>,                                // nvIndex
+               TpmFixed<uint16_t, TPM_ALG_SHA256>,                  // nameAlg
+               TpmInteger<uint32_t>,                                // attributes
+               TpmFixed<uint16_t, 0>,                               // authPolicy
+               TpmInteger<uint16_t>>;                               // dataSize
+using TpmNvDefineSpaceResponse = TpmResponse<TPM_ST_SESSIONS>;
+
+using TpmNvReadCommand =
+    TpmCommand<TPM_CC_NV_Read, TPM_ST_SESSIONS,
+               TpmInteger<uint32_t>,                                // authHandle
+               TpmInteger<uint32_t>,                                // nvIndex
+               TpmPasswordSession,
+               TpmInteger<uint16_t>,                                // size
+               TpmInteger<uint16_t>>;                               // offset
+using TpmNvReadResponse = TpmResponse<TPM_ST_SESSIONS,
+                                      TpmSized>;                    // data
+
+using TpmNvWriteCommand =
+    TpmCommand<TPM_CC_NV_Write, TPM_ST_SESSIONS,
+               TpmInteger<uint32_t>,                                // authHandle
+               TpmInteger<uint32_t>,                                // nvIndex
+               TpmPasswordSession,
+               TpmSizedReference,                                   // data
+               TpmInteger<uint16_t>>;                               // offset
+using TpmNvWriteResponse = TpmResponse<TPM_ST_SESSIONS>;
+
+using TpmNvIncrementCommand =
+    TpmCommand<TPM_CC_NV_Increment, TPM_ST_SESSIONS,
+               TpmInteger<uint32_t>,                                // authHandle
+               TpmInteger<uint32_t>,                                // nvIndex
+               TpmPasswordSession>;
+using TpmNvIncrementResponse = TpmResponse<TPM_ST_SESSIONS>;
+
+using TpmNvSetBitsCommand =
+    TpmCommand<TPM_CC_NV_SetBits, TPM_ST_SESSIONS,
+               TpmInteger<uint32_t>,                                // authHandle
+               TpmInteger<uint32_t>,                                // nvIndex
+               TpmPasswordSession,
+               TpmInteger<uint64_t>>;                               // bits
+using TpmNvSetBitsResponse = TpmResponse<TPM_ST_SESSIONS>;
+
+using TpmNvExtendCommand =
+    TpmCommand<TPM_CC_NV_Extend, TPM_ST_SESSIONS,
+               TpmInteger<uint32_t>,                                // authHandle
+               TpmInteger<uint32_t>,                                // nvIndex
+               TpmPasswordSession,
+               TpmSized>;                                           // data
+using TpmNvExtendResponse = TpmResponse<TPM_ST_SESSIONS>;
+
+template<TPM_CC CommandCode>
+using TpmNvLockCommand =
+    TpmCommand<CommandCode, TPM_ST_SESSIONS,
+               TpmInteger<uint32_t>,                                // authHandle
+               TpmInteger<uint32_t>,                                // nvIndex
+               TpmPasswordSession>;
+using TpmNvReadLockCommand = TpmNvLockCommand<TPM_CC_NV_ReadLock>;
+using TpmNvWriteLockCommand = TpmNvLockCommand<TPM_CC_NV_WriteLock>;
+using TpmNvLockResponse = TpmResponse<TPM_ST_SESSIONS>;
+
+using TpmNvReadPublicCommand =
+    TpmCommand<TPM_CC_NV_ReadPublic, TPM_ST_NO_SESSIONS,
+               TpmInteger<uint32_t>>;                               // nvIndex
+using TpmNvReadPublicResponse =
+    TpmResponse<TPM_ST_NO_SESSIONS,
+                TpmInteger<uint16_t>,                               // nvPublic.size
+                TpmInteger<uint32_t>,                               // nvIndex
+                TpmInteger<uint16_t>,                               // nameAlg
+                TpmInteger<uint32_t>,                               // attributes
+                TpmSized,                                           // authPolicy
+                TpmInteger<uint16_t>,                               // dataSize
+                TpmSized>;                                          // nvName
+
+using TpmGetCapabilityCommand =
+    TpmCommand<TPM_CC_GetCapability, TPM_ST_NO_SESSIONS,
+               TpmInteger<uint32_t>,                                // capability
+               TpmInteger<uint32_t>,                                // property
+               TpmInteger<uint32_t>>;                               // propertyCount
+template<typename T>
+using TpmGetCapabilityResponse =
+    TpmResponse<TPM_ST_NO_SESSIONS,
+                TpmInteger<uint8_t>,                                // moreData
+                TpmInteger<uint32_t>,                               // capability
+                TpmList<T>>;                                        // data
+
+using TpmGetRandomCommand =
+    TpmCommand<TPM_CC_GetRandom, TPM_ST_NO_SESSIONS,
+               TpmInteger<uint16_t>>;                               // bytesRequested
+using TpmGetRandomResponse =
+    TpmResponse<TPM_ST_NO_SESSIONS,
+                TpmSized>;                                          // randomBytes
+
+using TpmReadClockCommand = TpmCommand<TPM_CC_ReadClock, TPM_ST_NO_SESSIONS>;
+using TpmReadClockResponse =
+    TpmResponse<TPM_ST_NO_SESSIONS,
+                TpmInteger<uint64_t>,                               // time
+                TpmInteger<uint64_t>,                               // clock
+                TpmInteger<uint32_t>,                               // resetCount
+                TpmInteger<uint32_t>,                               // restartCount
+                TpmInteger<uint8_t>>;                               // safe
+
+using TpmHashCommand =
+    TpmCommand<TPM_CC_Hash, TPM_ST_NO_SESSIONS,
+               TpmSizedReference,                                   // data
+               TpmFixed<uint16_t, TPM_ALG_SHA256>,                  // hashAlg
+               TpmFixed<uint32_t, TpmpHandleValue(TPM_RH_NULL)>>;   // hierarchy
+using TpmHashResponse =
+    TpmResponse<TPM_ST_NO_SESSIONS,
+                TpmSized,                                           // outHash
+                TpmInteger<uint16_t>,                               // validation.tag
+                TpmInteger<uint32_t>,                               // validation.hierarchy
+                TpmSized>;                                          // validation.digest
+
+using TpmHashSequenceStartCommand =
+    TpmCommand<TPM_CC_HashSequenceStart, TPM_ST_NO_SESSIONS,
+               TpmFixed<uint16_t, 0>,                               // auth.size
+               TpmFixed<uint16_t, TPM_ALG_SHA256>>;                 // hashAlg
+using TpmHashSequenceStartResponse =
+    TpmResponse<TPM_ST_NO_SESSIONS,
+                TpmInteger<uint32_t>>;                              // sequenceHandle
+
+using TpmSequenceUpdateCommand =
+    TpmCommand<TPM_CC_SequenceUpdate, TPM_ST_SESSIONS,
+               TpmInteger<uint32_t>,                                // sequenceHandle
+               TpmPasswordSession,
+               TpmSizedReference>;                                  // buffer
+using TpmSequenceUpdateResponse = TpmResponse<TPM_ST_SESSIONS>;
+
+using TpmSequenceCompleteCommand =
+    TpmCommand<TPM_CC_SequenceComplete, TPM_ST_SESSIONS,
+               TpmInteger<uint32_t>,                                // sequenceHandle
+               TpmPasswordSession,
+               TpmSizedReference,                                   // buffer
+               TpmFixed<uint32_t, TpmpHandleValue(TPM_RH_NULL)>>;   // hierarchy
+using TpmSequenceCompleteResponse =
+    TpmResponse<TPM_ST_SESSIONS,
+                TpmSized,                                           // result
+                TpmInteger<uint16_t>,                               // validation.tag
+                TpmInteger<uint32_t>,                               // validation.hierarchy
+                TpmSized>;                                          // validation.digest
+
+using TpmFlushContextCommand =
+    TpmCommand<TPM_CC_FlushContext, TPM_ST_NO_SESSIONS,
+               TpmInteger<uint32_t>>;                               // flushHandle
+using TpmFlushContextResponse = TpmResponse<TPM_ST_NO_SESSIONS>;
+
+using TpmStartupCommand =
+    TpmCommand<TPM_CC_Startup, TPM_ST_NO_SESSIONS,
+               TpmInteger<uint16_t>>;                               // startupType
+using TpmStartupResponse = TpmResponse<TPM_ST_NO_SESSIONS>;
@@ -0,0 +1,570 @@
+/*++
+
+Copyright (c) Alex Ionescu.  All rights reserved.
+
+Module Name:
+
+    tpmoslin.cpp
+
+Abstract:
+
+    This module handles the Linux-specific functionality for accessing the
+    TPM2.0 interface of the operating system, which is exposed by the kernel
+    TPM Resource Manager as a character device (/dev/tpmrm0 by default).
+
+Author:
+
+    Alex Ionescu (@aionescu) 16-Oct-2026 - Initial version
+
+Environment:
+
+    Linux 4.12 and above, user mode.
+
+--*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "tpmtool.hpp"
+#include "tpmcmd.hpp"
+
+//
+// Default path of the kernel's TPM Resource Manager, which can be overridden
+// through the environment in order to target a different chip (or /dev/tpm0
+// on systems without a resource manager).
+//
+#define TPM_OS_DEFAULT_DEVICE       "/dev/tpmrm0"
+#define TPM_OS_DEVICE_VARIABLE      "TPMTOOL_DEVICE"
+
+//
+// Each open of the Resource Manager gets its own context, so a few of them can
+// keep commands queued to the chip. Devices that only allow one open (such as
+// /dev/tpm0) simply fail to open the others.
+//
+#define TPM_OS_DEVICE_CONTEXTS      4
+
+bool
+TpmOsDeviceSubmit (
+    uintptr_t TpmHandle,
+    const TPM_COMMAND_SEGMENT* Segments,
+    uint32_t SegmentCount,
+    uint32_t* OsResult
+    )
+{
+    ssize_t bytesTransferred;
+    int32_t fileDescriptor;
+    int32_t error;
+
+    //
+    // The handle is the file descriptor that was opened by TpmOsDeviceOpen
+    //
+    fileDescriptor = static_cast<int32_t>(TpmHandle);
+    error = 0;
+
+    //
+    // The driver requires the entire command in a single write, which is then
+    // queued to the chip without blocking us since the descriptor was opened
+    // as non-blocking.
+    //
+    if (SegmentCount != 1)
+    {
+        error = EINVAL;
+        goto Exit;
+    }
+    do
+    {
+        bytesTransferred = write(fileDescriptor, Segments[0].Buffer, Segments[0].Length);
+    } while ((bytesTransferred < 0) && (errno == EINTR));
+    if (bytesTransferred != static_cast<ssize_t>(Segments[0].Length))
+    {
+        error = (bytesTransferred < 0) ? errno : EIO;
+        goto Exit;
+    }
+
+Exit:
+    //
+    // Return the OS result if needed
+    //
+    if (OsResult != nullptr)
+    {
+        *OsResult = static_cast<uint32_t>(error);
+    }
+    return (error == 0);
+}
+
+bool
+TpmOsDeviceReceive (
+    uintptr_t TpmHandle,
+    uint8_t* Out,
+    uint32_t OutLength,
+    uint32_t* OsResult
+    )
+{
+    struct pollfd pollDescriptor;
+    ssize_t bytesTransferred;
+    int32_t fileDescriptor;
+    int32_t error;
+
+    fileDescriptor = static_cast<int32_t>(TpmHandle);
+    error = 0;
+
+    //
+    // Wait for the response to become available
+    //
+    pollDescriptor.fd = fileDescriptor;
+    pollDescriptor.events = POLLIN;
+    pollDescriptor.revents = 0;
+    while (poll(&pollDescriptor, 1, -1) < 0)
+    {
+        if (errno != EINTR)
+        {
+            error = errno;
+            goto Exit;
+        }
+    }
+
+    //
+    // Now read the full response back with a single read -- the driver will
+    // hand us the whole reply at once, truncated to the size of our buffer.
+    //
+    do
+    {
+        bytesTransferred = read(fileDescriptor, Out, OutLength);
+    } while ((bytesTransferred < 0) && (errno == EINTR));
+    if (bytesTransferred < static_cast<ssize_t>(sizeof(TPM_REPLY_HEADER)))
+    {
+        error = (bytesTransferred < 0) ? errno : EIO;
+        goto Exit;
+    }
+
+Exit:
+    //
+    // Return the OS result if needed
+    //
+    if (OsResult != nullptr)
+    {
+        *OsResult = static_cast<uint32_t>(error);
+    }
+
+    //
+    // Return a boolean if the TPM command was issued. The actual TPM may still
+    // return an error code as part of the respone header.
+    //
+    return (error == 0);
+}
+
+bool
+TpmOsDeviceIssueCommand (
+    uintptr_t TpmHandle,
+    uint8_t* In,
+    uint32_t InLength,
+    uint8_t* Out,
+    uint32_t OutLength,
+    uint32_t* OsResult
+    )
+{
+    TPM_COMMAND_SEGMENT segment;
+
+    //
+    // Queue the command, and then wait for its response
+    //
+    segment.Buffer = In;
+    segment.Length = InLength;
+    if (TpmOsDeviceSubmit(TpmHandle, &segment, 1, OsResult) == false)
+    {
+        return false;
+    }
+    return TpmOsDeviceReceive(TpmHandle, Out, OutLength, OsResult);
+}
+
+bool
+TpmOsDeviceOpen (
+    const char* Parameters,
+    uintptr_t* TpmHandle
+    )
+{
+    const char* devicePath;
+    int32_t fileDescriptor;
+
+    //
+    // Initialize for failure
+    //
+    *TpmHandle = 0;
+
+    //
+    // Use the resource manager unless the caller asked for a specific device,
+    // either as part of the transport parameters or through the environment.
+    //
+    devicePath = Parameters;
+    if ((devicePath == nullptr) || (devicePath[0] == '\0'))
+    {
+        devicePath = getenv(TPM_OS_DEVICE_VARIABLE);
+        if ((devicePath == nullptr) || (devicePath[0] == '\0'))
+        {
+            devicePath = TPM_OS_DEFAULT_DEVICE;
+        }
+    }
+
+    //
+    // Open the device once -- the same descriptor is then used for all of the
+    // commands that are sent through this handle.
+    //
+    fileDescriptor = open(devicePath, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fileDescriptor < 0)
+    {
+        return false;
+    }
+
+    //
+    // Return a handle that can be used for further commands
+    //
+    *TpmHandle = static_cast<uintptr_t>(fileDescriptor);
+    return true;
+}
+
+bool
+TpmOsDeviceClose (
+    uintptr_t TpmHandle
+    )
+{
+    //
+    // Close the device
+    //
+    return (close(static_cast<int32_t>(TpmHandle)) == 0);
+}
+
+bool
+OsMapFile (
+    const char* Path,
+    bool Write,
+    size_t* Size,
+    void** Base,
+    uintptr_t* MapHandle
+    )
+{
+    struct stat fileInformation;
+    int32_t fileDescriptor;
+    void* mapping;
+    bool result;
+
+    //
+    // Initialize for failure
+    //
+    *Base = nullptr;
+    *MapHandle = 0;
+    result = false;
+
+    //
+    // Writable mappings are created (or resized) to the caller's size, while
+    // read-only mappings cover the whole existing file.
+    //
+    fileDescriptor = open(Path,
+                          Write ? (O_RDWR | O_CREAT | O_CLOEXEC) : (O_RDONLY | O_CLOEXEC),
+                          0600);
+    if (fileDescriptor < 0)
+    {
+        return false;
+    }
+    if (Write)
+    {
+        if (ftruncate(fileDescriptor, static_cast<off_t>(*Size)) != 0)
+        {
+            goto Exit;
+        }
+    }
+    else
+    {
+        if (fstat(fileDescriptor, &fileInformation) != 0)
+        {
+            goto Exit;
+        }
+        *Size = static_cast<size_t>(fileInformation.st_size);
+    }
+
+    //
+    // Empty files cannot be mapped, but are not an error either
+    //
+    if (*Size == 0)
+    {
+        result = true;
+        goto Exit;
+    }
+
+    //
+    // Map the file -- the mapping stays valid after the descriptor is closed
+    //
+    mapping = mmap(nullptr,
+                   *Size,
+                   Write ? (PROT_READ | PROT_WRITE) : PROT_READ,
+                   MAP_SHARED,
+                   fileDescriptor,
+                   0);
+    if (mapping == MAP_FAILED)
+    {
+        goto Exit;
+    }
+    *Base = mapping;
+    result = true;
+
+Exit:
+    close(fileDescriptor);
+    return result;
+}
+
+bool
+OsUnmapFile (
+    void* Base,
+    size_t Size,
+    uintptr_t MapHandle
+    )
+{
+    //
+    // There is no handle to close on Linux, only the mapping itself
+    //
+    (void)MapHandle;
+    if (Base == nullptr)
+    {
+        return true;
+    }
+    return (munmap(Base, Size) == 0);
+}
+
+void*
+OsAllocatePages (
+    size_t Size
+    )
+{
+    void* base;
+
+    //
+    // Anonymous mappings always start on a page boundary
+    //
+    base = mmap(nullptr, Size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return (base != MAP_FAILED) ? base : nullptr;
+}
+
+void
+OsFreePages (
+    void* Base,
+    size_t Size
+    )
+{
+    //
+    // Release the whole mapping
+    //
+    munmap(Base, Size);
+}
+
+bool
+OsWriteFile (
+    int FileDescriptor,
+    const uint8_t* Buffer,
+    size_t Size
+    )
+{
+    ssize_t bytesWritten;
+
+    //
+    // Pipes and sockets can accept less than the whole buffer, so keep going
+    // until everything was written.
+    //
+    while (Size != 0)
+    {
+        bytesWritten = write(FileDescriptor, Buffer, Size);
+        if (bytesWritten < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        Buffer += bytesWritten;
+        Size -= static_cast<size_t>(bytesWritten);
+    }
+    return true;
+}
+
+bool
+OsGetCachePath (
+    char* Path,
+    size_t PathSize
+    )
+{
+    const char* runtimeDirectory;
+    char directory[TPM_CACHE_PATH_SIZE];
+    struct stat directoryInformation;
+    int length;
+
+    //
+    // root keeps the cache in a directory of its own under /run, as its
+    // temporary directory is shared with everyone else. Other users prefer
+    // their runtime directory, and otherwise use a directory of their own in
+    // the temporary directory. All of them only last until the next boot.
+    //
+    runtimeDirectory = getenv("XDG_RUNTIME_DIR");
+    if (geteuid() == 0)
+    {
+        length = snprintf(directory, sizeof(directory), "/run/tpmtool");
+    }
+    else if ((runtimeDirectory != nullptr) && (runtimeDirectory[0] != '\0'))
+    {
+        length = snprintf(directory, sizeof(directory), "%s", runtimeDirectory);
+    }
+    else
+    {
+        length = snprintf(directory, sizeof(directory), "/tmp/tpmtool-%u", geteuid());
+    }
+    if ((length <= 0) || (static_cast<size_t>(length) >= sizeof(directory)))
+    {
+        return false;
+    }
+
+    //
+    // Create the directory if needed. It must be an actual directory that is
+    // ours, and that no one else can write to, so that no one else can plant
+    // a file or a link where the cache goes.
+    //
+    if ((mkdir(directory, 0700) != 0) && (errno != EEXIST))
+    {
+        return false;
+    }
+    if ((lstat(directory, &directoryInformation) != 0) ||
+        (S_ISDIR(directoryInformation.st_mode) == 0) ||
+        (directoryInformation.st_uid != geteuid()) ||
+        ((directoryInformation.st_mode & (S_IWGRP | S_IWOTH)) != 0))
+    {
+        return false;
+    }
+    length = snprintf(Path, PathSize, "%s/tpmtool.cache", directory);
+    return (length > 0) && (static_cast<size_t>(length) < PathSize);
+}
+
+bool
+OsReadCacheFile (
+    const char* Path,
+    void* Buffer,
+    size_t Size
+    )
+{
+    struct stat fileInformation;
+    int32_t fileDescriptor;
+    ssize_t bytesRead;
+    size_t offset;
+    bool result;
+
+    //
+    // Never follow a link, and only trust a regular file of exactly the size
+    // we expect, which is ours, and which no one else can write to.
+    //
+    fileDescriptor = open(Path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fileDescriptor < 0)
+    {
+        return false;
+    }
+    result = false;
+    if ((fstat(fileDescriptor, &fileInformation) != 0) ||
+        (S_ISREG(fileInformation.st_mode) == 0) ||
+        (fileInformation.st_uid != geteuid()) ||
+        ((fileInformation.st_mode & (S_IWGRP | S_IWOTH)) != 0) ||
+        (static_cast<size_t>(fileInformation.st_size) != Size))
+    {
+        goto Exit;
+    }
+
+    //
+    // Read all of it
+    //
+    offset = 0;
+    while (offset != Size)
+    {
+        bytesRead = read(fileDescriptor, static_cast<uint8_t*>(Buffer) + offset, Size - offset);
+        if (bytesRead < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            goto Exit;
+        }
+        if (bytesRead == 0)
+        {
+            goto Exit;
+        }
+        offset += static_cast<size_t>(bytesRead);
+    }
+    result = true;
+
+Exit:
+    close(fileDescriptor);
+    return result;
+}
+
+bool
+OsWriteCacheFile (
+    const char* Path,
+    const void* Buffer,
+    size_t Size
+    )
+{
+    char temporaryPath[TPM_CACHE_PATH_SIZE + 32];
+    int32_t fileDescriptor;
+    bool result;
+    int length;
+
+    //
+    // Write a new file next to the cache, which must not exist yet, so that
+    // a link planted in its place is never followed.
+    //
+    length = snprintf(temporaryPath, sizeof(temporaryPath), "%s.%d.tmp", Path, getpid());
+    if ((length <= 0) || (static_cast<size_t>(length) >= sizeof(temporaryPath)))
+    {
+        return false;
+    }
+    fileDescriptor = open(temporaryPath,
+                          O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+                          0600);
+    if (fileDescriptor < 0)
+    {
+        return false;
+    }
+    result = OsWriteFile(fileDescriptor, static_cast<const uint8_t*>(Buffer), Size);
+    result = (close(fileDescriptor) == 0) && result;
+
+    //
+    // Then move it in place of the cache at once, so that readers either see
+    // the previous cache or the new one, and never a torn one.
+    //
+    if ((result == false) || (rename(temporaryPath, Path) != 0))
+    {
+        unlink(temporaryPath);
+        return false;
+    }
+    return true;
+}
+
+//
+// Transport for the OS TPM stack. The TPM character device has no support for
+// vectored writes, and treats every write() as a complete command, so a
+// writev() would be split into several broken commands. Segmented commands
+// are therefore gathered into a single buffer first. On the other hand, the
+// descriptor is non-blocking, so commands can be queued and their responses
+// read back later.
+//
+const TPM_TRANSPORT TpmOsTransport =
+{
+    "device",
+    TpmOsDeviceOpen,
+    TpmOsDeviceIssueCommand,
+    nullptr,
+    TpmOsDeviceSubmit,
+    TpmOsDeviceReceive,
+    TpmOsDeviceClose,
+    TPM_OS_DEVICE_CONTEXTS
+};
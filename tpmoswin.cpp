@@ -9,8 +9,7 @@ Module Name:
 Abstract:
 
     This module handles the Windows-specific functionality for accessing the
-    TPM2.0 interface of the operating system. It also provides the compiler
-    intrinsics for endian swapping.
+    TPM2.0 interface of the operating system.
 
 Author:
 
@@ -23,36 +22,16 @@ Environment:
 --*/
 
 #include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 #include <Windows.h>
+#include <io.h>
 #include <tbs.h>
-#include <intrin.h>
-
-uint16_t
-OsSwap16 (
-    _In_ uint16_t Input
-    )
-{
-    return _byteswap_ushort(Input);
-}
-
-uint32_t
-OsSwap32 (
-    _In_ uint32_t Input
-    )
-{
-    return _byteswap_ulong(Input);
-}
-
-uint64_t
-OsSwap64 (
-    _In_ uint64_t Input
-    )
-{
-    return _byteswap_uint64(Input);
-}
+#include "tpmtool.hpp"
+#include "tpmcmd.hpp"
 
 bool
-TpmOsIssueCommand (
+TpmOsDeviceIssueCommand (
     _In_ uintptr_t TpmHandle,
     _In_ uint8_t* In,
     _In_ uint32_t InLength,
@@ -99,7 +78,8 @@ TpmOsIssueCommand (
 }
 
 bool
-TpmOsOpen (
+TpmOsDeviceOpen (
+    _In_opt_ const char* Parameters,
     _Out_ uintptr_t* TpmHandle
     )
 {
@@ -108,6 +88,11 @@ TpmOsOpen (
     TBS_RESULT tbsResult;
     bool result;
 
+    //
+    // TBS always routes to the system TPM, so there is nothing to configure
+    //
+    UNREFERENCED_PARAMETER(Parameters);
+
     //
     // Initialize for failure
     //
@@ -137,7 +122,7 @@ Exit:
 }
 
 bool
-TpmOsClose (
+TpmOsDeviceClose (
     _In_ uintptr_t TpmHandle
     )
 {
@@ -150,3 +135,310 @@ TpmOsClose (
     return (tbsResult == TBS_SUCCESS);
 }
 
+bool
+OsMapFile (
+    _In_ const char* Path,
+    _In_ bool Write,
+    _Inout_ size_t* Size,
+    _Out_ void** Base,
+    _Out_ uintptr_t* MapHandle
+    )
+{
+    LARGE_INTEGER fileSize;
+    HANDLE fileHandle;
+    HANDLE mappingHandle;
+    void* mapping;
+    bool result;
+
+    //
+    // Initialize for failure
+    //
+    *Base = nullptr;
+    *MapHandle = 0;
+    mappingHandle = nullptr;
+    result = false;
+
+    //
+    // Writable mappings are created (or resized) to the caller's size, while
+    // read-only mappings cover the whole existing file.
+    //
+    fileHandle = CreateFileA(Path,
+                             Write ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ,
+                             FILE_SHARE_READ,
+                             nullptr,
+                             Write ? OPEN_ALWAYS : OPEN_EXISTING,
+                             FILE_ATTRIBUTE_NORMAL,
+                             nullptr);
+    if (fileHandle == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+    if (Write)
+    {
+        fileSize.QuadPart = static_cast<LONGLONG>(*Size);
+        if ((SetFilePointerEx(fileHandle, fileSize, nullptr, FILE_BEGIN) == FALSE) ||
+            (SetEndOfFile(fileHandle) == FALSE))
+        {
+            goto Exit;
+        }
+    }
+    else
+    {
+        if (GetFileSizeEx(fileHandle, &fileSize) == FALSE)
+        {
+            goto Exit;
+        }
+        *Size = static_cast<size_t>(fileSize.QuadPart);
+    }
+
+    //
+    // Empty files cannot be mapped, but are not an error either
+    //
+    if (*Size == 0)
+    {
+        result = true;
+        goto Exit;
+    }
+
+    //
+    // Create and map a section for the file, which keeps the file referenced
+    //
+    mappingHandle = CreateFileMappingA(fileHandle,
+                                       nullptr,
+                                       Write ? PAGE_READWRITE : PAGE_READONLY,
+                                       0,
+                                       0,
+                                       nullptr);
+    if (mappingHandle == nullptr)
+    {
+        goto Exit;
+    }
+    mapping = MapViewOfFile(mappingHandle,
+                            Write ? (FILE_MAP_READ | FILE_MAP_WRITE) : FILE_MAP_READ,
+                            0,
+                            0,
+                            *Size);
+    if (mapping == nullptr)
+    {
+        CloseHandle(mappingHandle);
+        goto Exit;
+    }
+    *Base = mapping;
+    *MapHandle = reinterpret_cast<uintptr_t>(mappingHandle);
+    result = true;
+
+Exit:
+    CloseHandle(fileHandle);
+    return result;
+}
+
+bool
+OsUnmapFile (
+    _In_opt_ void* Base,
+    _In_ size_t Size,
+    _In_ uintptr_t MapHandle
+    )
+{
+    UNREFERENCED_PARAMETER(Size);
+
+    //
+    // Unmap the view and close the section
+    //
+    if (Base == nullptr)
+    {
+        return true;
+    }
+    UnmapViewOfFile(Base);
+    return (CloseHandle(reinterpret_cast<HANDLE>(MapHandle)) != FALSE);
+}
+
+void*
+OsAllocatePages (
+    _In_ size_t Size
+    )
+{
+    //
+    // Allocations from VirtualAlloc always start on a page boundary
+    //
+    return VirtualAlloc(nullptr, Size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+}
+
+void
+OsFreePages (
+    _In_ void* Base,
+    _In_ size_t Size
+    )
+{
+    UNREFERENCED_PARAMETER(Size);
+
+    //
+    // Release the whole allocation
+    //
+    VirtualFree(Base, 0, MEM_RELEASE);
+}
+
+bool
+OsWriteFile (
+    _In_ int FileDescriptor,
+    _In_ const uint8_t* Buffer,
+    _In_ size_t Size
+    )
+{
+    int bytesWritten;
+
+    //
+    // The CRT can only write up to UINT_MAX bytes at a time, and pipes can
+    // accept less than that, so keep going until everything was written.
+    //
+    while (Size != 0)
+    {
+        bytesWritten = _write(FileDescriptor,
+                              Buffer,
+                              (Size > INT_MAX) ? INT_MAX : static_cast<unsigned int>(Size));
+        if (bytesWritten < 0)
+        {
+            return false;
+        }
+        Buffer += bytesWritten;
+        Size -= static_cast<size_t>(bytesWritten);
+    }
+    return true;
+}
+
+bool
+OsGetCachePath (
+    _Out_writes_z_(PathSize) char* Path,
+    _In_ size_t PathSize
+    )
+{
+    DWORD length;
+
+    //
+    // Use a file in the user's temporary directory
+    //
+    length = GetTempPathA(static_cast<DWORD>(PathSize), Path);
+    if ((length == 0) || (length >= PathSize))
+    {
+        return false;
+    }
+    return (strcat_s(Path, PathSize, "tpmtool.cache") == 0);
+}
+
+bool
+OsReadCacheFile (
+    _In_ const char* Path,
+    _Out_writes_bytes_(Size) void* Buffer,
+    _In_ size_t Size
+    )
+{
+    BY_HANDLE_FILE_INFORMATION fileInformation;
+    HANDLE fileHandle;
+    DWORD bytesRead;
+    bool result;
+
+    //
+    // Never follow a link, and only trust a file of exactly the size we expect
+    //
+    fileHandle = CreateFileA(Path,
+                             GENERIC_READ,
+                             FILE_SHARE_READ,
+                             nullptr,
+                             OPEN_EXISTING,
+                             FILE_FLAG_OPEN_REPARSE_POINT,
+                             nullptr);
+    if (fileHandle == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+    result = false;
+    if ((Size > MAXDWORD) ||
+        (GetFileInformationByHandle(fileHandle, &fileInformation) == FALSE) ||
+        ((fileInformation.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0) ||
+        (fileInformation.nFileSizeHigh != 0) ||
+        (fileInformation.nFileSizeLow != Size))
+    {
+        goto Exit;
+    }
+
+    //
+    // Read all of it
+    //
+    if ((ReadFile(fileHandle, Buffer, static_cast<DWORD>(Size), &bytesRead, nullptr) != FALSE) &&
+        (bytesRead == Size))
+    {
+        result = true;
+    }
+
+Exit:
+    CloseHandle(fileHandle);
+    return result;
+}
+
+bool
+OsWriteCacheFile (
+    _In_ const char* Path,
+    _In_reads_bytes_(Size) const void* Buffer,
+    _In_ size_t Size
+    )
+{
+    char temporaryPath[TPM_CACHE_PATH_SIZE + 32];
+    HANDLE fileHandle;
+    DWORD bytesWritten;
+    bool result;
+
+    //
+    // Write a new file next to the cache, which must not exist yet
+    //
+    if ((Size > MAXDWORD) ||
+        (sprintf_s(temporaryPath,
+                   sizeof(temporaryPath),
+                   "%s.%lu.tmp",
+                   Path,
+                   GetCurrentProcessId()) < 0))
+    {
+        return false;
+    }
+    fileHandle = CreateFileA(temporaryPath,
+                             GENERIC_WRITE,
+                             0,
+                             nullptr,
+                             CREATE_NEW,
+                             FILE_ATTRIBUTE_TEMPORARY,
+                             nullptr);
+    if (fileHandle == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+    result = (WriteFile(fileHandle, Buffer, static_cast<DWORD>(Size), &bytesWritten, nullptr) != FALSE) &&
+             (bytesWritten == Size);
+    CloseHandle(fileHandle);
+
+    //
+    // Then move it in place of the cache at once, so that readers either see
+    // the previous cache or the new one, and never a torn one.
+    //
+    if ((result == false) ||
+        (MoveFileExA(temporaryPath, Path, MOVEFILE_REPLACE_EXISTING) == FALSE))
+    {
+        DeleteFileA(temporaryPath);
+        return false;
+    }
+    return true;
+}
+
+//
+// Transport for the OS TPM stack. TBS only takes a single command buffer, so
+// segmented commands are gathered into one first, and it waits for the result
+// of each command before returning.
+//
+const TPM_TRANSPORT TpmOsTransport =
+{
+    "device",
+    TpmOsDeviceOpen,
+    TpmOsDeviceIssueCommand,
+    nullptr,
+    nullptr,
+    nullptr,
+    TpmOsDeviceClose,
+    1
+};
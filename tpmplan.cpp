@@ -0,0 +1,511 @@
+/*++
+
+Copyright (c) Alex Ionescu.  All rights reserved.
+
+Module Name:
+
+    tpmplan.cpp
+
+Abstract:
+
+    This module implements bringing NV indices to a desired state, such as the
+    one described by a provisioning manifest or saved in a snapshot. The
+    current state is read once, with one enumeration, one batch of public
+    areas and one batch of contents, and compared with the desired one to find
+    the few commands that are needed: deleting indices that are in the way or
+    defined differently, defining the missing ones, and writing the contents
+    that differ. The plan can also only be reported, without running it.
+
+Author:
+
+    Alex Ionescu (@aionescu) 16-Oct-2026 - Initial version
+
+Environment:
+
+    Portable to any environment.
+
+--*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "tpmtool.hpp"
+#include "tpmcmd.hpp"
+
+//
+// Attributes that an index is defined with, as opposed to its status, which
+// must all match for an existing index to be kept as-is
+//
+#define TPM_PLAN_DEFINED_ATTRIBUTES                                         \
+    (TpmToolReadLockable | TpmToolWriteLockable | TpmToolWriteOnce |        \
+     TpmToolWriteAll | TpmToolNonProtected | TpmToolCached |                \
+     TpmToolVolatileDirtyFlag | TpmToolPermanent | TpmToolCounter |         \
+     TpmToolBits | TpmToolExtend)
+
+//
+// Current state of each index, and where its contents are kept once read.
+// Contents are only read from the indices that are kept and were written, and
+// that the owner can read.
+//
+typedef struct _TPM_PLAN_ENTRY
+{
+    TPM_RC Result;
+    bool Exists;
+    bool Defined;
+    bool Read;
+    uint16_t Attributes;
+    uint8_t OwnerRights;
+    uint8_t AuthRights;
+    uint16_t DataSize;
+    uint32_t ContentOffset;
+} TPM_PLAN_ENTRY, *PTPM_PLAN_ENTRY;
+
+//
+// Plan Context
+//
+typedef struct _TPM_PLAN_CONTEXT
+{
+    TPM_NV_INDEX* Handles;
+    uint32_t HandleCount;
+    PTPM_PLAN_ENTRY Entries;
+    uint32_t* Positions;
+    uint8_t* Contents;
+} TPM_PLAN_CONTEXT, *PTPM_PLAN_CONTEXT;
+
+bool
+TpmpPlanExists (
+    PTPM_PLAN_CONTEXT Context,
+    TPM_NV_INDEX Index
+    )
+{
+    uint32_t low;
+    uint32_t high;
+    uint32_t middle;
+
+    //
+    // The TPM returns the handles in ascending order, so look for it by halves
+    //
+    low = 0;
+    high = Context->HandleCount;
+    while (low < high)
+    {
+        middle = low + ((high - low) / 2);
+        if (Context->Handles[middle].Value == Index.Value)
+        {
+            return true;
+        }
+        if (Context->Handles[middle].Value < Index.Value)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return false;
+}
+
+bool
+TpmpPlanPublic (
+    void* Context,
+    uint32_t Position,
+    TPM_RC Result,
+    uint16_t Attributes,
+    uint8_t OwnerRights,
+    uint8_t AuthRights,
+    uint16_t DataSize
+    )
+{
+    PTPM_PLAN_CONTEXT context;
+    PTPM_PLAN_ENTRY entry;
+
+    //
+    // Save the public area of the index, which is only known to exist if it
+    // could be read.
+    //
+    context = static_cast<PTPM_PLAN_CONTEXT>(Context);
+    entry = &context->Entries[context->Positions[Position]];
+    entry->Result = Result;
+    entry->Exists = (Result == TPM_RC_SUCCESS);
+    entry->Attributes = Attributes;
+    entry->OwnerRights = OwnerRights;
+    entry->AuthRights = AuthRights;
+    entry->DataSize = DataSize;
+    return true;
+}
+
+bool
+TpmpPlanContents (
+    void* Context,
+    uint32_t Position,
+    TPM_RC Result,
+    uint16_t Offset,
+    const uint8_t* Data,
+    uint16_t DataSize
+    )
+{
+    PTPM_PLAN_CONTEXT context;
+    PTPM_PLAN_ENTRY entry;
+
+    //
+    // Copy each piece in place, or forget about the contents of the index if
+    // it could not be read after all, which then gets a full write.
+    //
+    context = static_cast<PTPM_PLAN_CONTEXT>(Context);
+    entry = &context->Entries[Position];
+    if (Result != TPM_RC_SUCCESS)
+    {
+        entry->Read = false;
+        return true;
+    }
+    memcpy(&context->Contents[entry->ContentOffset + Offset], Data, DataSize);
+    return true;
+}
+
+TPM_RC
+TpmpPlanWrite (
+    uintptr_t TpmHandle,
+    const TPM_NV_DESIRED_STATE* State,
+    const uint8_t* Current,
+    bool Locked,
+    bool DryRun,
+    uint32_t Position,
+    PTPM_PLAN_CALLBACK Callback,
+    void* CallbackContext,
+    PTPM_PLAN_STATISTICS Statistics
+    )
+{
+    TPM_NV_WRITE_STATISTICS writeStatistics;
+    uint16_t authorizationSize;
+    uint16_t changedSize;
+    uint64_t bits;
+    TPM_RC tpmResult;
+    uint32_t i;
+
+    //
+    // Leave the contents alone if they already match
+    //
+    if ((Current != nullptr) && (memcmp(Current, State->Content, State->ContentSize) == 0))
+    {
+        Statistics->Unchanged++;
+        return Callback(CallbackContext, Position, TpmPlanKeep, 0) ?
+               TPM_RC_SUCCESS : TPM_RC_CANCELED;
+    }
+
+    //
+    // Contents can only be written with the rights of the owner, or with the
+    // password of the index, and not once the index is locked. Counters and
+    // extend indices can't be given an arbitrary value either.
+    //
+    if ((Locked) ||
+        (((State->OwnerRights & TpmToolWriteAccess) == 0) &&
+         (((State->AuthRights & TpmToolWriteAccess) == 0) ||
+          (State->AuthorizationSize == 0))) ||
+        ((State->Attributes & (TpmToolCounter | TpmToolExtend)) != 0) ||
+        (((State->Attributes & TpmToolBits) != 0) && (State->ContentSize != sizeof(bits))))
+    {
+        Statistics->Skipped++;
+        return Callback(CallbackContext, Position, TpmPlanSkip, State->ContentSize) ?
+               TPM_RC_SUCCESS : TPM_RC_CANCELED;
+    }
+
+    //
+    // Report how many bytes change, which is all of them if the current ones
+    // are not known.
+    //
+    changedSize = State->ContentSize;
+    if (Current != nullptr)
+    {
+        changedSize = 0;
+        for (i = 0; i < State->ContentSize; i++)
+        {
+            changedSize += (Current[i] != State->Content[i]) ? 1 : 0;
+        }
+    }
+    Statistics->Written++;
+    if (Callback(CallbackContext, Position, TpmPlanWrite, changedSize) == false)
+    {
+        return TPM_RC_CANCELED;
+    }
+    if (DryRun)
+    {
+        return TPM_RC_SUCCESS;
+    }
+    authorizationSize = ((State->OwnerRights & TpmToolWriteAccess) != 0) ?
+                        0 : State->AuthorizationSize;
+
+    //
+    // Bits are set all at once. The ones that are already set can't be
+    // cleared, which the TPM will then simply leave as they are.
+    //
+    if ((State->Attributes & TpmToolBits) != 0)
+    {
+        bits = 0;
+        for (i = 0; i < sizeof(bits); i++)
+        {
+            bits = (bits << 8) | State->Content[i];
+        }
+        return TpmNvSetBits2(TpmHandle,
+                             State->Index,
+                             authorizationSize,
+                             State->AuthorizationData,
+                             bits);
+    }
+
+    //
+    // Ordinary indices only get the runs of bytes that changed written, if
+    // their current contents are known and they can be written partially.
+    //
+    if ((Current != nullptr) && ((State->Attributes & TpmToolWriteAll) == 0))
+    {
+        tpmResult = TpmNvWriteChanges(TpmHandle,
+                                      State->Index,
+                                      authorizationSize,
+                                      State->AuthorizationData,
+                                      0,
+                                      State->ContentSize,
+                                      Current,
+                                      State->Content,
+                                      &writeStatistics);
+    }
+    else
+    {
+        tpmResult = TpmNvWrite2(TpmHandle,
+                                State->Index,
+                                authorizationSize,
+                                State->AuthorizationData,
+                                0,
+                                State->ContentSize,
+                                State->Content);
+    }
+    return tpmResult;
+}
+
+TPM_RC
+TpmApplyState (
+    uintptr_t TpmHandle,
+    uint32_t StateCount,
+    const TPM_NV_DESIRED_STATE* States,
+    bool DryRun,
+    PTPM_PLAN_CALLBACK Callback,
+    void* CallbackContext,
+    PTPM_PLAN_STATISTICS Statistics
+    )
+{
+    TPM_PLAN_CONTEXT context;
+    const TPM_NV_DESIRED_STATE* state;
+    PTPM_PLAN_ENTRY entry;
+    TPM_NV_INDEX* existing;
+    uint16_t* readSizes;
+    uint32_t existingCount;
+    uint32_t contentSize;
+    uint32_t i;
+    TPM_RC tpmResult;
+
+    //
+    // Find out which indices exist, with a single enumeration
+    //
+    memset(Statistics, 0, sizeof(*Statistics));
+    memset(&context, 0, sizeof(context));
+    existing = nullptr;
+    readSizes = nullptr;
+    tpmResult = TpmNvEnumerateAll(TpmHandle, &context.HandleCount, &context.Handles);
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        goto Exit;
+    }
+    context.Entries = static_cast<PTPM_PLAN_ENTRY>(
+        calloc((StateCount != 0) ? StateCount : 1, sizeof(*context.Entries)));
+    context.Positions = static_cast<uint32_t*>(
+        calloc((StateCount != 0) ? StateCount : 1, sizeof(*context.Positions)));
+    existing = static_cast<TPM_NV_INDEX*>(
+        calloc((StateCount != 0) ? StateCount : 1, sizeof(*existing)));
+    readSizes = static_cast<uint16_t*>(
+        calloc((StateCount != 0) ? StateCount : 1, sizeof(*readSizes)));
+    if ((context.Entries == nullptr) ||
+        (context.Positions == nullptr) ||
+        (existing == nullptr) ||
+        (readSizes == nullptr))
+    {
+        tpmResult = TPM_RC_FAILURE;
+        goto Exit;
+    }
+
+    //
+    // Then read the public areas of the ones that are wanted, in one batch
+    //
+    existingCount = 0;
+    for (i = 0; i < StateCount; i++)
+    {
+        if (TpmpPlanExists(&context, States[i].Index))
+        {
+            context.Positions[existingCount] = i;
+            existing[existingCount++] = States[i].Index;
+        }
+    }
+    tpmResult = TpmReadPublicBatch(TpmHandle,
+                                   existingCount,
+                                   existing,
+                                   TpmpPlanPublic,
+                                   &context);
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        goto Exit;
+    }
+
+    //
+    // Delete the indices that are not wanted, or that are defined differently
+    // than wanted, and define the ones that are missing.
+    //
+    contentSize = 0;
+    for (i = 0; i < StateCount; i++)
+    {
+        state = &States[i];
+        entry = &context.Entries[i];
+        if ((entry->Result != TPM_RC_SUCCESS) &&
+            ((entry->Result & ~TPM_RC_N_MASK) != TPM_RC_HANDLE))
+        {
+            tpmResult = entry->Result;
+            goto Exit;
+        }
+        if ((entry->Exists) &&
+            ((state->Delete) ||
+             (entry->DataSize != state->DataSize) ||
+             (entry->OwnerRights != state->OwnerRights) ||
+             (entry->AuthRights != state->AuthRights) ||
+             ((entry->Attributes & TPM_PLAN_DEFINED_ATTRIBUTES) !=
+              (state->Attributes & TPM_PLAN_DEFINED_ATTRIBUTES))))
+        {
+            Statistics->Undefined++;
+            if (Callback(CallbackContext, i, TpmPlanUndefine, entry->DataSize) == false)
+            {
+                tpmResult = TPM_RC_CANCELED;
+                goto Exit;
+            }
+            if (DryRun == false)
+            {
+                tpmResult = TpmUndefineSpace2(TpmHandle, state->Index);
+                if (tpmResult != TPM_RC_SUCCESS)
+                {
+                    goto Exit;
+                }
+            }
+            entry->Exists = false;
+        }
+        if (state->Delete)
+        {
+            continue;
+        }
+        if (entry->Exists == false)
+        {
+            Statistics->Defined++;
+            if (Callback(CallbackContext, i, TpmPlanDefine, state->DataSize) == false)
+            {
+                tpmResult = TPM_RC_CANCELED;
+                goto Exit;
+            }
+            if (DryRun == false)
+            {
+                tpmResult = TpmDefineSpace2(TpmHandle,
+                                            state->Index,
+                                            state->DataSize,
+                                            state->Attributes & TPM_PLAN_DEFINED_ATTRIBUTES,
+                                            state->OwnerRights,
+                                            state->AuthRights,
+                                            state->AuthorizationSize,
+                                            state->AuthorizationData);
+                if (tpmResult != TPM_RC_SUCCESS)
+                {
+                    goto Exit;
+                }
+            }
+            entry->Defined = true;
+            continue;
+        }
+
+        //
+        // The contents of the ones that are kept, and were written, must be
+        // compared with the wanted ones, so lay them out to be read.
+        //
+        if ((state->ContentSize != 0) &&
+            ((entry->Attributes & TpmToolWritten) != 0) &&
+            ((entry->Attributes & TpmToolReadLocked) == 0) &&
+            ((entry->OwnerRights & TpmToolReadAccess) != 0))
+        {
+            entry->Read = true;
+            entry->ContentOffset = contentSize;
+            readSizes[i] = state->ContentSize;
+            contentSize += state->ContentSize;
+        }
+        else if (state->ContentSize == 0)
+        {
+            if (Callback(CallbackContext, i, TpmPlanKeep, 0) == false)
+            {
+                tpmResult = TPM_RC_CANCELED;
+                goto Exit;
+            }
+        }
+    }
+
+    //
+    // Read all of their contents in one batch
+    //
+    context.Contents = static_cast<uint8_t*>(malloc((contentSize != 0) ? contentSize : 1));
+    if (context.Contents == nullptr)
+    {
+        tpmResult = TPM_RC_FAILURE;
+        goto Exit;
+    }
+    for (i = 0; i < StateCount; i++)
+    {
+        existing[i] = States[i].Index;
+    }
+    tpmResult = TpmNvReadBatch(TpmHandle,
+                               StateCount,
+                               existing,
+                               readSizes,
+                               TpmpPlanContents,
+                               &context);
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        goto Exit;
+    }
+
+    //
+    // Finally, write the contents that differ
+    //
+    for (i = 0; i < StateCount; i++)
+    {
+        state = &States[i];
+        entry = &context.Entries[i];
+        if ((state->Delete) || (state->ContentSize == 0))
+        {
+            continue;
+        }
+        tpmResult = TpmpPlanWrite(TpmHandle,
+                                  state,
+                                  entry->Read ? &context.Contents[entry->ContentOffset] : nullptr,
+                                  (entry->Exists) &&
+                                  (((entry->Attributes & TpmToolWriteLocked) != 0) ||
+                                   (((entry->Attributes & TpmToolWriteOnce) != 0) &&
+                                    ((entry->Attributes & TpmToolWritten) != 0))),
+                                  DryRun,
+                                  i,
+                                  Callback,
+                                  CallbackContext,
+                                  Statistics);
+        if (tpmResult != TPM_RC_SUCCESS)
+        {
+            goto Exit;
+        }
+    }
+
+Exit:
+    free(context.Contents);
+    free(context.Positions);
+    free(context.Entries);
+    free(context.Handles);
+    free(existing);
+    free(readSizes);
+    return tpmResult;
+}
@@ -0,0 +1,633 @@
+/*++
+
+Copyright (c) Alex Ionescu.  All rights reserved.
+
+Module Name:
+
+    tpmprop.cpp
+
+Abstract:
+
+    This module implements the discovery of the properties of the TPM, which
+    are its fixed properties, and the algorithms and commands it supports. They
+    are all read with a single sweep of GetCapability, and cached in a small
+    file keyed on the reset and restart counts of the TPM, so that the next
+    invocations in the same boot can skip the sweep entirely. The public areas
+    of the NV indices that were read are cached along with them.
+
+Author:
+
+    Alex Ionescu (@aionescu) 16-Oct-2026 - Initial version
+
+Environment:
+
+    Portable to any environment.
+
+--*/
+
+#ifdef _MSC_VER
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tpmtool.hpp"
+#include "tpmcmd.hpp"
+
+//
+// Cache files hold a single entry, which is only used if it was written for
+// the same transport, and is followed by a digest of its contents so that a
+// corrupted file is caught. The digest is not a key, so it says nothing about
+// who wrote the file: that is up to where it is kept, and the limits in it are
+// still checked like the ones returned by the TPM. All fields are
+// little-endian.
+//
+#define TPM_PROP_CACHE_MAGIC        0x504f5250
+#define TPM_PROP_CACHE_VERSION      2
+
+#pragma pack(push, 1)
+typedef struct _TPM_PROP_CACHE_FILE
+{
+    uint32_t Magic;
+    uint32_t Version;
+    uint64_t TransportKey;
+    TPM_PROPERTIES Properties;
+    TPM_NV_CACHE NvCache;
+    uint8_t Digest[TPM_SHA256_DIGEST_SIZE];
+} TPM_PROP_CACHE_FILE, *PTPM_PROP_CACHE_FILE;
+#pragma pack(pop)
+
+//
+// Limits of the TPM that size buffers and chunks, along with the smallest and
+// largest values that make sense for them. The smallest ones are what the PC
+// Client profile asks of any TPM, except for the NV buffer, which emulated
+// TPMs can make smaller to exercise chunking. The largest ones are what their
+// TPM2B size field can hold, or what an arena can be.
+//
+typedef struct _TPM_PROP_LIMIT
+{
+    TPM_PT Property;
+    uint32_t Minimum;
+    uint32_t Maximum;
+} TPM_PROP_LIMIT, *PTPM_PROP_LIMIT;
+
+static const TPM_PROP_LIMIT TpmpPropLimits[] =
+{
+    { TPM_PT_INPUT_BUFFER, 1024, UINT16_MAX },
+    { TPM_PT_NV_INDEX_MAX, 2048, UINT16_MAX },
+    { TPM_PT_MAX_COMMAND_SIZE, TPM_ARENA_DEFAULT_SIZE, TPM_ARENA_MAXIMUM_SIZE },
+    { TPM_PT_MAX_RESPONSE_SIZE, TPM_ARENA_DEFAULT_SIZE, TPM_ARENA_MAXIMUM_SIZE },
+    { TPM_PT_MAX_DIGEST, 20, 64 },
+    { TPM_PT_NV_BUFFER_MAX, 64, UINT16_MAX },
+    { TPM_PT_MAX_CAP_BUFFER, 1024, UINT16_MAX },
+};
+
+template<typename T>
+TPM_RC
+TpmpPropQuery (
+    PTPM_CONTEXT Context,
+    TPM_CAP Capability,
+    uint32_t Property,
+    uint32_t PropertyCount,
+    uint8_t* MoreData,
+    PTPM_MARSHAL_LIST List
+    )
+{
+    uint32_t commandSize;
+    uint32_t capability;
+    TPM_RC tpmResult;
+
+    //
+    // Build the command with the capability and range to query
+    //
+    commandSize = TpmGetCapabilityCommand::Marshal(Context->CommandBuffer,
+                                                   Context->CommandBufferSize,
+                                                   Capability,
+                                                   Property,
+                                                   PropertyCount);
+
+    //
+    // Send it, keep going only if we got success
+    //
+    tpmResult = TpmpIssueCommand(reinterpret_cast<uintptr_t>(Context), commandSize);
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        return tpmResult;
+    }
+
+    //
+    // Decode the list, which must be for the capability we asked for
+    //
+    if ((TpmGetCapabilityResponse<T>::Unmarshal(Context->ResponseBuffer,
+                                                Context->ResponseBufferSize,
+                                                MoreData,
+                                                &capability,
+                                                List) == false) ||
+        (capability != Capability))
+    {
+        return TPM_RC_FAILURE;
+    }
+    return tpmResult;
+}
+
+bool
+TpmpPropSweep (
+    PTPM_CONTEXT Context,
+    PTPM_PROPERTIES Properties
+    )
+{
+    TPM_MARSHAL_LIST list;
+    const uint8_t* element;
+    uint32_t property;
+    uint32_t value;
+    uint8_t moreData;
+    uint32_t i;
+
+    //
+    // Read the fixed properties, for as long as the TPM has more of them
+    //
+    property = PT_FIXED;
+    do
+    {
+        if (TpmpPropQuery<TPMS_TAGGED_PROPERTY>(Context,
+                                                TPM_CAP_TPM_PROPERTIES,
+                                                property,
+                                                PT_FIXED + TPM_PROPERTY_FIXED_COUNT - property,
+                                                &moreData,
+                                                &list) != TPM_RC_SUCCESS)
+        {
+            return false;
+        }
+        for (i = 0; i < list.Count; i++)
+        {
+            element = &list.Data[i * sizeof(TPMS_TAGGED_PROPERTY)];
+            value = TpmDecodeInteger<uint32_t>(element);
+            if ((value < property) || (value >= (PT_FIXED + TPM_PROPERTY_FIXED_COUNT)))
+            {
+                moreData = 0;
+                break;
+            }
+            Properties->Fixed[value - PT_FIXED] =
+                TpmDecodeInteger<uint32_t>(element + sizeof(uint32_t));
+            property = value + 1;
+        }
+    } while ((moreData != 0) &&
+             (list.Count != 0) &&
+             (property < (PT_FIXED + TPM_PROPERTY_FIXED_COUNT)));
+
+    //
+    // Then the algorithms, keeping track of which ones are implemented
+    //
+    property = 0;
+    do
+    {
+        if (TpmpPropQuery<TPMS_ALG_PROPERTY>(Context,
+                                             TPM_CAP_ALGS,
+                                             property,
+                                             MAX_CAP_ALGS,
+                                             &moreData,
+                                             &list) != TPM_RC_SUCCESS)
+        {
+            return false;
+        }
+        for (i = 0; i < list.Count; i++)
+        {
+            element = &list.Data[i * sizeof(TPMS_ALG_PROPERTY)];
+            value = TpmDecodeInteger<uint16_t>(element);
+            if ((value < property) || (value >= TPM_PROPERTY_MAX_ALGORITHM))
+            {
+                moreData = 0;
+                break;
+            }
+            Properties->Algorithms[value / 32] |= 1u << (value % 32);
+            property = value + 1;
+        }
+    } while ((moreData != 0) && (list.Count != 0));
+
+    //
+    // And finally the commands, stopping at the vendor-specific ones
+    //
+    property = TPM_CC_FIRST;
+    do
+    {
+        if (TpmpPropQuery<TPMA_CC>(Context,
+                                   TPM_CAP_COMMANDS,
+                                   property,
+                                   MAX_CAP_CC,
+                                   &moreData,
+                                   &list) != TPM_RC_SUCCESS)
+        {
+            return false;
+        }
+        for (i = 0; i < list.Count; i++)
+        {
+            element = &list.Data[i * sizeof(TPMA_CC)];
+            value = TpmDecodeInteger<uint32_t>(element);
+            if (((value & TPMA_CC_V) != 0) ||
+                ((value & TPMA_CC_COMMAND_INDEX) < property) ||
+                ((value & TPMA_CC_COMMAND_INDEX) >= TPM_PROPERTY_MAX_COMMAND))
+            {
+                moreData = 0;
+                break;
+            }
+            value &= TPMA_CC_COMMAND_INDEX;
+            Properties->Commands[value / 32] |= 1u << (value % 32);
+            property = value + 1;
+        }
+    } while ((moreData != 0) && (list.Count != 0));
+    return true;
+}
+
+bool
+TpmpPropCheckLimits (
+    PTPM_PROPERTIES Properties
+    )
+{
+    uint32_t* value;
+    bool result;
+    uint32_t i;
+
+    //
+    // Drop the limits that are out of range, so that the defaults are used
+    // instead, and say whether there were any.
+    //
+    result = true;
+    for (i = 0; i < (sizeof(TpmpPropLimits) / sizeof(TpmpPropLimits[0])); i++)
+    {
+        value = &Properties->Fixed[TpmpPropLimits[i].Property - PT_FIXED];
+        if ((*value != 0) &&
+            ((*value < TpmpPropLimits[i].Minimum) || (*value > TpmpPropLimits[i].Maximum)))
+        {
+            *value = 0;
+            result = false;
+        }
+    }
+    return result;
+}
+
+bool
+TpmpPropReadCache (
+    PTPM_CONTEXT Context,
+    const TPM_PROPERTIES* Properties,
+    PTPM_PROP_CACHE_FILE Cache
+    )
+{
+    uint8_t digest[TPM_SHA256_DIGEST_SIZE];
+
+    //
+    // Read the whole entry, which must be exactly the size we expect, from a
+    // file that only we could have written.
+    //
+    if (OsReadCacheFile(Context->CachePath, Cache, sizeof(*Cache)) == false)
+    {
+        return false;
+    }
+
+    //
+    // It must be intact, for the same transport and TPM boot, and hold limits
+    // that make sense.
+    //
+    TpmSha256(reinterpret_cast<uint8_t*>(Cache), offsetof(TPM_PROP_CACHE_FILE, Digest), digest);
+    if ((Cache->Magic != TPM_PROP_CACHE_MAGIC) ||
+        (Cache->Version != TPM_PROP_CACHE_VERSION) ||
+        (Cache->TransportKey != Context->TransportKey) ||
+        (Cache->Properties.ResetCount != Properties->ResetCount) ||
+        (Cache->Properties.RestartCount != Properties->RestartCount) ||
+        (Cache->NvCache.NextEntry >= TPM_NV_CACHE_ENTRIES) ||
+        (memcmp(digest, Cache->Digest, sizeof(digest)) != 0) ||
+        (TpmpPropCheckLimits(&Cache->Properties) == false))
+    {
+        return false;
+    }
+    return true;
+}
+
+bool
+TpmpPropLoadCache (
+    PTPM_CONTEXT Context,
+    PTPM_PROPERTIES Properties
+    )
+{
+    TPM_PROP_CACHE_FILE cache;
+
+    //
+    // Take both the properties and the NV public areas from the cache
+    //
+    if (TpmpPropReadCache(Context, Properties, &cache) == false)
+    {
+        return false;
+    }
+    *Properties = cache.Properties;
+    Context->NvCache = cache.NvCache;
+    return true;
+}
+
+PTPM_NV_CACHE_ENTRY
+TpmpPropLookupNv (
+    PTPM_NV_CACHE NvCache,
+    uint32_t Index
+    )
+{
+    uint32_t i;
+
+    //
+    // Find the public area of the index, if it was cached
+    //
+    for (i = 0; i < TPM_NV_CACHE_ENTRIES; i++)
+    {
+        if (NvCache->Entries[i].Index == Index)
+        {
+            return &NvCache->Entries[i];
+        }
+    }
+    return nullptr;
+}
+
+uint32_t
+TpmpPropInsertNv (
+    PTPM_NV_CACHE NvCache,
+    const TPM_NV_CACHE_ENTRY* Entry
+    )
+{
+    PTPM_NV_CACHE_ENTRY entry;
+
+    //
+    // Replace the public area of the index if it was already cached, or else
+    // take the place of the oldest index.
+    //
+    entry = TpmpPropLookupNv(NvCache, Entry->Index);
+    if (entry == nullptr)
+    {
+        entry = &NvCache->Entries[NvCache->NextEntry];
+        NvCache->NextEntry = (NvCache->NextEntry + 1) % TPM_NV_CACHE_ENTRIES;
+    }
+    *entry = *Entry;
+    return static_cast<uint32_t>(entry - NvCache->Entries);
+}
+
+void
+TpmPropSave (
+    PTPM_CONTEXT Context
+    )
+{
+    TPM_PROP_CACHE_FILE cache;
+    PTPM_NV_CACHE_ENTRY entry;
+    bool merge;
+    uint32_t i;
+
+    //
+    // Nothing to do if caching is disabled
+    //
+    Context->NvCacheDirty = false;
+    if ((Context->PropertiesValid == false) || (Context->CachePath[0] == '\0'))
+    {
+        return;
+    }
+
+    //
+    // Start from what other invocations cached in the meantime, for the same
+    // TPM boot, as long as we know every index this handle dropped from it.
+    //
+    merge = (Context->NvForgottenCount <= TPM_NV_CACHE_ENTRIES) &&
+            (TpmpPropReadCache(Context, &Context->Properties, &cache) != false);
+    if (merge == false)
+    {
+        memset(&cache.NvCache, 0, sizeof(cache.NvCache));
+    }
+
+    //
+    // Drop the indices that this handle found to be stale, then add the ones
+    // that it read itself, which are the most recent.
+    //
+    for (i = 0; (merge != false) && (i < Context->NvForgottenCount); i++)
+    {
+        entry = TpmpPropLookupNv(&cache.NvCache, Context->NvForgotten[i]);
+        if (entry != nullptr)
+        {
+            memset(entry, 0, sizeof(*entry));
+        }
+    }
+    for (i = 0; i < TPM_NV_CACHE_ENTRIES; i++)
+    {
+        if ((Context->NvCacheTouched[i] != false) &&
+            (Context->NvCache.Entries[i].Index != 0))
+        {
+            TpmpPropInsertNv(&cache.NvCache, &Context->NvCache.Entries[i]);
+        }
+    }
+
+    //
+    // Build the entry and its digest
+    //
+    cache.Magic = TPM_PROP_CACHE_MAGIC;
+    cache.Version = TPM_PROP_CACHE_VERSION;
+    cache.TransportKey = Context->TransportKey;
+    cache.Properties = Context->Properties;
+    TpmSha256(reinterpret_cast<uint8_t*>(&cache),
+              offsetof(TPM_PROP_CACHE_FILE, Digest),
+              cache.Digest);
+
+    //
+    // Replace whatever was cached before, all at once. Failing to do so simply
+    // means that the next invocation will do the sweep again.
+    //
+    OsWriteCacheFile(Context->CachePath, &cache, sizeof(cache));
+}
+
+bool
+TpmPropDiscover (
+    PTPM_CONTEXT Context,
+    bool UseCache
+    )
+{
+    TPM_PROPERTIES properties;
+    const char* path;
+    uint64_t time;
+    uint64_t clock;
+    TPMI_YES_NO isSafe;
+    TPM_RC tpmResult;
+
+    //
+    // Forget about anything discovered before
+    //
+    Context->PropertiesValid = false;
+    Context->NvCacheDirty = false;
+    memset(&Context->NvCache, 0, sizeof(Context->NvCache));
+    memset(Context->NvCacheTouched, 0, sizeof(Context->NvCacheTouched));
+    Context->NvForgottenCount = 0;
+    memset(&properties, 0, sizeof(properties));
+
+    //
+    // Find where the properties are cached, unless caching was disabled
+    //
+    Context->CachePath[0] = '\0';
+    if (UseCache != false)
+    {
+        path = getenv(TPM_CACHE_VARIABLE);
+        if (path == nullptr)
+        {
+            if (OsGetCachePath(Context->CachePath, sizeof(Context->CachePath)) == false)
+            {
+                Context->CachePath[0] = '\0';
+            }
+        }
+        else if (strlen(path) < sizeof(Context->CachePath))
+        {
+            strcpy(Context->CachePath, path);
+        }
+    }
+
+    //
+    // The reset and restart counts of the TPM tell whether the cache is still
+    // valid. If the TPM can't return them, the properties are never cached.
+    //
+    tpmResult = TpmReadClock(reinterpret_cast<uintptr_t>(Context),
+                             &time,
+                             &clock,
+                             &properties.ResetCount,
+                             &properties.RestartCount,
+                             &isSafe);
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        Context->CachePath[0] = '\0';
+        properties.ResetCount = 0;
+        properties.RestartCount = 0;
+    }
+
+    //
+    // Use the cache if it's still valid, otherwise do the sweep and cache it
+    //
+    if ((Context->CachePath[0] != '\0') &&
+        (TpmpPropLoadCache(Context, &properties) != false))
+    {
+        Context->Properties = properties;
+        Context->PropertiesValid = true;
+        return true;
+    }
+    if (TpmpPropSweep(Context, &properties) == false)
+    {
+        return false;
+    }
+    TpmpPropCheckLimits(&properties);
+    Context->Properties = properties;
+    Context->PropertiesValid = true;
+    TpmPropSave(Context);
+    return true;
+}
+
+uint32_t
+TpmPropGet (
+    PTPM_CONTEXT Context,
+    TPM_PT Property
+    )
+{
+    //
+    // Properties that were not discovered, or that the TPM does not have, are
+    // returned as zero.
+    //
+    if ((Context->PropertiesValid == false) ||
+        (Property < PT_FIXED) ||
+        (Property >= (PT_FIXED + TPM_PROPERTY_FIXED_COUNT)))
+    {
+        return 0;
+    }
+    return Context->Properties.Fixed[Property - PT_FIXED];
+}
+
+bool
+TpmPropHasAlgorithm (
+    PTPM_CONTEXT Context,
+    TPM_ALG_ID Algorithm
+    )
+{
+    //
+    // Without any discovered properties, let the TPM decide for itself
+    //
+    if ((Context->PropertiesValid == false) ||
+        (Algorithm >= TPM_PROPERTY_MAX_ALGORITHM))
+    {
+        return true;
+    }
+    return (Context->Properties.Algorithms[Algorithm / 32] & (1u << (Algorithm % 32))) != 0;
+}
+
+bool
+TpmPropHasCommand (
+    PTPM_CONTEXT Context,
+    TPM_CC CommandCode
+    )
+{
+    //
+    // Without any discovered properties, let the TPM decide for itself
+    //
+    if ((Context->PropertiesValid == false) ||
+        (CommandCode >= TPM_PROPERTY_MAX_COMMAND))
+    {
+        return true;
+    }
+    return (Context->Properties.Commands[CommandCode / 32] & (1u << (CommandCode % 32))) != 0;
+}
+
+PTPM_NV_CACHE_ENTRY
+TpmPropLookupNv (
+    PTPM_CONTEXT Context,
+    uint32_t Index
+    )
+{
+    //
+    // Find the public area of the index, if it was cached
+    //
+    return TpmpPropLookupNv(&Context->NvCache, Index);
+}
+
+void
+TpmPropCacheNv (
+    PTPM_CONTEXT Context,
+    const TPM_NV_CACHE_ENTRY* Entry
+    )
+{
+    uint32_t slot;
+
+    //
+    // Cache the public area, and remember that this handle read it so that
+    // it's merged into the file when it's saved.
+    //
+    slot = TpmpPropInsertNv(&Context->NvCache, Entry);
+    Context->NvCacheTouched[slot] = true;
+    Context->NvCacheDirty = true;
+}
+
+void
+TpmPropForgetNv (
+    PTPM_CONTEXT Context,
+    uint32_t Index
+    )
+{
+    PTPM_NV_CACHE_ENTRY entry;
+
+    //
+    // Drop the public area of the index, if it was cached
+    //
+    entry = TpmpPropLookupNv(&Context->NvCache, Index);
+    if (entry != nullptr)
+    {
+        Context->NvCacheTouched[entry - Context->NvCache.Entries] = false;
+        memset(entry, 0, sizeof(*entry));
+    }
+
+    //
+    // Another invocation may have cached it since, so remember to drop it from
+    // the file as well. Once there are too many to remember, the cached public
+    // areas of other invocations are all dropped instead.
+    //
+    if (Context->NvForgottenCount < TPM_NV_CACHE_ENTRIES)
+    {
+        Context->NvForgotten[Context->NvForgottenCount] = Index;
+    }
+    if (Context->NvForgottenCount <= TPM_NV_CACHE_ENTRIES)
+    {
+        Context->NvForgottenCount++;
+    }
+    Context->NvCacheDirty = true;
+}
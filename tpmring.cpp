@@ -0,0 +1,501 @@
+/*++
+
+Copyright (c) Alex Ionescu.  All rights reserved.
+
+Module Name:
+
+    tpmring.cpp
+
+Abstract:
+
+    This module implements a log-structured record store over a ring of NV
+    indices, used for small state that is updated often. Each update appends
+    a record with a sequence number and a CRC after the previous one, instead
+    of rewriting the same bytes, and moves on to the next index in the ring
+    once the current one is full. This spreads the writes over all of the
+    indices, and the newest record is found again by reading the ring once.
+
+Author:
+
+    Alex Ionescu (@aionescu) 16-Oct-2026 - Initial version
+
+Environment:
+
+    Portable to any environment.
+
+--*/
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tpmtool.hpp"
+#include "tpmcmd.hpp"
+
+//
+// Each record starts with this header, followed by Size bytes of data. The
+// CRC covers the rest of the header and the data, so that torn writes are
+// detected, and the sequence grows with each record, so that the records left
+// behind from the previous pass over an index are ignored. All fields are
+// little-endian.
+//
+#pragma pack(push, 1)
+typedef struct _TPM_RING_RECORD
+{
+    uint32_t Crc;
+    uint32_t Sequence;
+    uint16_t Size;
+} TPM_RING_RECORD, *PTPM_RING_RECORD;
+#pragma pack(pop)
+
+//
+// Ring Context, followed by the data of the newest record and then by the
+// authorization data of the indices
+//
+typedef struct _TPM_RING_CONTEXT
+{
+    uintptr_t TpmHandle;
+    TPM_NV_INDEX BaseIndex;
+    uint16_t SegmentCount;
+    uint16_t SegmentSize;
+    uint16_t AuthorizationSize;
+    uint8_t* AuthorizationData;
+    uint32_t Sequence;
+    uint16_t Segment;
+    uint16_t Offset;
+    uint16_t NewestSize;
+    uint8_t* Newest;
+} TPM_RING_CONTEXT, *PTPM_RING_CONTEXT;
+
+//
+// CRC-32 (IEEE 802.3) Table, built at compile time
+//
+typedef struct _TPM_CRC32_TABLE
+{
+    uint32_t Entries[256];
+} TPM_CRC32_TABLE;
+
+constexpr
+TPM_CRC32_TABLE
+TpmpCrc32BuildTable (
+    void
+    )
+{
+    TPM_CRC32_TABLE table = {};
+    uint32_t value = 0;
+    uint32_t i = 0;
+    uint32_t bit = 0;
+
+    for (i = 0; i < 256; i++)
+    {
+        value = i;
+        for (bit = 0; bit < 8; bit++)
+        {
+            value = (value & 1) ? ((value >> 1) ^ 0xEDB88320) : (value >> 1);
+        }
+        table.Entries[i] = value;
+    }
+    return table;
+}
+
+static constexpr TPM_CRC32_TABLE TpmpCrc32Table = TpmpCrc32BuildTable();
+
+uint32_t
+TpmCrc32 (
+    uint32_t Crc,
+    const uint8_t* Data,
+    size_t DataSize
+    )
+{
+    size_t i;
+
+    //
+    // Continue from the given CRC, which starts at zero
+    //
+    Crc = ~Crc;
+    for (i = 0; i < DataSize; i++)
+    {
+        Crc = TpmpCrc32Table.Entries[(Crc ^ Data[i]) & 0xFF] ^ (Crc >> 8);
+    }
+    return ~Crc;
+}
+
+uint32_t
+TpmpRingRecordCrc (
+    const TPM_RING_RECORD* Record,
+    const uint8_t* Data
+    )
+{
+    //
+    // Cover everything but the CRC itself
+    //
+    return TpmCrc32(TpmCrc32(0,
+                             reinterpret_cast<const uint8_t*>(&Record->Sequence),
+                             sizeof(*Record) - offsetof(TPM_RING_RECORD, Sequence)),
+                    Data,
+                    Record->Size);
+}
+
+TPM_NV_INDEX
+TpmpRingSegmentIndex (
+    PTPM_RING_CONTEXT Context,
+    uint16_t Segment
+    )
+{
+    TPM_NV_INDEX index;
+
+    //
+    // Segments are consecutive indices
+    //
+    index.Value = Context->BaseIndex.Value + Segment;
+    return index;
+}
+
+void
+TpmpRingScanSegment (
+    PTPM_RING_CONTEXT Context,
+    uint16_t Segment,
+    const uint8_t* Data
+    )
+{
+    TPM_RING_RECORD record;
+    uint32_t previous;
+    uint32_t offset;
+
+    //
+    // Walk the records that were written on the latest pass over the index,
+    // which end at the first torn record, or at the first one whose sequence
+    // does not follow, as it is left over from an earlier pass.
+    //
+    previous = 0;
+    for (offset = 0;
+         (offset + sizeof(record)) <= Context->SegmentSize;
+         offset += sizeof(record) + record.Size)
+    {
+        memcpy(&record, &Data[offset], sizeof(record));
+        if ((record.Sequence <= previous) ||
+            ((offset + sizeof(record) + record.Size) > Context->SegmentSize) ||
+            (TpmpRingRecordCrc(&record, &Data[offset + sizeof(record)]) != record.Crc))
+        {
+            break;
+        }
+        previous = record.Sequence;
+
+        //
+        // Keep the newest record of the whole ring, and append after it
+        //
+        if (record.Sequence > Context->Sequence)
+        {
+            Context->Sequence = record.Sequence;
+            Context->Segment = Segment;
+            Context->Offset = static_cast<uint16_t>(offset + sizeof(record) + record.Size);
+            Context->NewestSize = record.Size;
+            memcpy(Context->Newest, &Data[offset + sizeof(record)], record.Size);
+        }
+    }
+}
+
+TPM_RC
+TpmRingFormat (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX BaseIndex,
+    uint16_t SegmentCount,
+    uint16_t SegmentSize,
+    uint16_t AuthorizationSize,
+    uint8_t* AuthorizationData
+    )
+{
+    TPM_NV_INDEX index;
+    TPM_RC tpmResult;
+    uint16_t i;
+
+    //
+    // The newest record must survive moving on to the next index, and each
+    // index must hold at least one record.
+    //
+    if ((SegmentCount < 2) || (SegmentSize <= sizeof(TPM_RING_RECORD)))
+    {
+        return TPM_RC_SIZE;
+    }
+
+    //
+    // Create each index of the ring, which are left unwritten
+    //
+    tpmResult = TPM_RC_SUCCESS;
+    for (i = 0; i < SegmentCount; i++)
+    {
+        index.Value = BaseIndex.Value + i;
+        tpmResult = TpmDefineSpace2(TpmHandle,
+                                    index,
+                                    SegmentSize,
+                                    0,
+                                    TpmToolReadWriteAccess,
+                                    TpmToolReadWriteAccess,
+                                    AuthorizationSize,
+                                    AuthorizationData);
+        if (tpmResult != TPM_RC_SUCCESS)
+        {
+            break;
+        }
+    }
+
+    //
+    // Don't leave a partial ring behind
+    //
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        while (i-- != 0)
+        {
+            index.Value = BaseIndex.Value + i;
+            TpmUndefineSpace2(TpmHandle, index);
+        }
+    }
+    return tpmResult;
+}
+
+TPM_RC
+TpmRingOpen (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX BaseIndex,
+    uint16_t SegmentCount,
+    uint16_t AuthorizationSize,
+    uint8_t* AuthorizationData,
+    uintptr_t* RingHandle
+    )
+{
+    PTPM_RING_CONTEXT context;
+    TPM_NV_INDEX index;
+    uint16_t attributes;
+    uint8_t ownerRights;
+    uint8_t authRights;
+    uint16_t segmentSize;
+    uint16_t dataSize;
+    uint8_t* segment;
+    TPM_RC tpmResult;
+    uint16_t i;
+
+    //
+    // Initialize for failure
+    //
+    *RingHandle = 0;
+    if (SegmentCount < 2)
+    {
+        return TPM_RC_SIZE;
+    }
+
+    //
+    // All the indices of the ring must have the same size, which is known
+    // without a round trip once their public areas are cached.
+    //
+    segmentSize = 0;
+    for (i = 0; i < SegmentCount; i++)
+    {
+        index.Value = BaseIndex.Value + i;
+        tpmResult = TpmReadPublicCached(TpmHandle,
+                                       index,
+                                       &attributes,
+                                       &ownerRights,
+                                       &authRights,
+                                       &dataSize);
+        if (tpmResult != TPM_RC_SUCCESS)
+        {
+            return tpmResult;
+        }
+        if ((i != 0) && (dataSize != segmentSize))
+        {
+            return TPM_RC_NV_SIZE;
+        }
+        segmentSize = dataSize;
+    }
+    if (segmentSize <= sizeof(TPM_RING_RECORD))
+    {
+        return TPM_RC_NV_SIZE;
+    }
+
+    //
+    // Allocate the context, with room for the newest record, a copy of the
+    // authorization data, and one index worth of data to scan.
+    //
+    context = static_cast<PTPM_RING_CONTEXT>(malloc(sizeof(*context) +
+                                                    segmentSize +
+                                                    AuthorizationSize));
+    segment = static_cast<uint8_t*>(malloc(segmentSize));
+    if ((context == nullptr) || (segment == nullptr))
+    {
+        free(segment);
+        free(context);
+        return TPM_RC_FAILURE;
+    }
+    context->TpmHandle = TpmHandle;
+    context->BaseIndex = BaseIndex;
+    context->SegmentCount = SegmentCount;
+    context->SegmentSize = segmentSize;
+    context->Newest = reinterpret_cast<uint8_t*>(context + 1);
+    context->AuthorizationSize = AuthorizationSize;
+    context->AuthorizationData = context->Newest + segmentSize;
+    if (AuthorizationSize != 0)
+    {
+        memcpy(context->AuthorizationData, AuthorizationData, AuthorizationSize);
+    }
+    context->Sequence = 0;
+    context->Segment = 0;
+    context->Offset = 0;
+    context->NewestSize = 0;
+
+    //
+    // Read the whole ring once, in as few chunks as the TPM allows, to find
+    // the newest record. Indices that were never written hold no records.
+    //
+    for (i = 0; i < SegmentCount; i++)
+    {
+        tpmResult = TpmNvRead2(TpmHandle,
+                               TpmpRingSegmentIndex(context, i),
+                               AuthorizationSize,
+                               AuthorizationData,
+                               0,
+                               segmentSize,
+                               segment);
+        if (tpmResult == TPM_RC_NV_UNINITIALIZED)
+        {
+            continue;
+        }
+        if (tpmResult != TPM_RC_SUCCESS)
+        {
+            free(segment);
+            free(context);
+            return tpmResult;
+        }
+        TpmpRingScanSegment(context, i, segment);
+    }
+    free(segment);
+
+    //
+    // Return the context as the handle
+    //
+    *RingHandle = reinterpret_cast<uintptr_t>(context);
+    return TPM_RC_SUCCESS;
+}
+
+TPM_RC
+TpmRingAppend (
+    uintptr_t RingHandle,
+    uint16_t DataSize,
+    const uint8_t* Data
+    )
+{
+    PTPM_RING_CONTEXT context;
+    TPM_RING_RECORD record;
+    uint8_t* buffer;
+    uint32_t recordSize;
+    uint16_t segment;
+    uint16_t offset;
+    TPM_RC tpmResult;
+
+    //
+    // The record must fit in an index
+    //
+    context = reinterpret_cast<PTPM_RING_CONTEXT>(RingHandle);
+    recordSize = sizeof(record) + DataSize;
+    if (recordSize > context->SegmentSize)
+    {
+        return TPM_RC_SIZE;
+    }
+
+    //
+    // Append it after the newest record, or start over at the beginning of
+    // the next index if it does not fit. That index holds the oldest records
+    // of the ring, which are the ones that are given up.
+    //
+    segment = context->Segment;
+    offset = context->Offset;
+    if ((offset + recordSize) > context->SegmentSize)
+    {
+        segment = static_cast<uint16_t>((segment + 1) % context->SegmentCount);
+        offset = 0;
+    }
+
+    //
+    // Build the record and write it in one go
+    //
+    buffer = static_cast<uint8_t*>(malloc(recordSize));
+    if (buffer == nullptr)
+    {
+        return TPM_RC_FAILURE;
+    }
+    record.Sequence = context->Sequence + 1;
+    record.Size = DataSize;
+    record.Crc = TpmpRingRecordCrc(&record, Data);
+    memcpy(buffer, &record, sizeof(record));
+    if (DataSize != 0)
+    {
+        memcpy(buffer + sizeof(record), Data, DataSize);
+    }
+    tpmResult = TpmNvWrite2(context->TpmHandle,
+                            TpmpRingSegmentIndex(context, segment),
+                            context->AuthorizationSize,
+                            context->AuthorizationData,
+                            offset,
+                            static_cast<uint16_t>(recordSize),
+                            buffer);
+    free(buffer);
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        return tpmResult;
+    }
+
+    //
+    // This is now the newest record
+    //
+    context->Sequence = record.Sequence;
+    context->Segment = segment;
+    context->Offset = static_cast<uint16_t>(offset + recordSize);
+    context->NewestSize = DataSize;
+    if (DataSize != 0)
+    {
+        memcpy(context->Newest, Data, DataSize);
+    }
+    return TPM_RC_SUCCESS;
+}
+
+TPM_RC
+TpmRingRead (
+    uintptr_t RingHandle,
+    uint16_t* DataSize,
+    uint8_t* Data,
+    uint32_t* Sequence
+    )
+{
+    PTPM_RING_CONTEXT context;
+
+    //
+    // The newest record was found when the ring was opened, or appended since
+    //
+    context = reinterpret_cast<PTPM_RING_CONTEXT>(RingHandle);
+    *Sequence = context->Sequence;
+    if (context->Sequence == 0)
+    {
+        return TPM_RC_NV_UNINITIALIZED;
+    }
+
+    //
+    // Return it if it fits, or its size if it doesn't
+    //
+    if (context->NewestSize > *DataSize)
+    {
+        *DataSize = context->NewestSize;
+        return TPM_RC_SIZE;
+    }
+    memcpy(Data, context->Newest, context->NewestSize);
+    *DataSize = context->NewestSize;
+    return TPM_RC_SUCCESS;
+}
+
+void
+TpmRingClose (
+    uintptr_t RingHandle
+    )
+{
+    //
+    // Records are written as soon as they are appended, so just free it
+    //
+    free(reinterpret_cast<PTPM_RING_CONTEXT>(RingHandle));
+}
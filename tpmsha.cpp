@@ -0,0 +1,238 @@
+/*++
+
+Copyright (c) Alex Ionescu.  All rights reserved.
+
+Module Name:
+
+    tpmsha.cpp
+
+Abstract:
+
+    This module implements SHA-256 in software, following FIPS 180-4. It is
+    used wherever the tool needs to compute the same digests as the TPM would,
+    such as the Name of an NV index, without a round trip to the chip.
+
+Author:
+
+    Alex Ionescu (@aionescu) 16-Oct-2026 - Initial version
+
+Environment:
+
+    Portable to any environment.
+
+--*/
+
+#include <string.h>
+#include "tpmtool.hpp"
+#include "tpmcmd.hpp"
+
+//
+// SHA-256 Round Constants
+//
+static const uint32_t TpmpSha256K[64] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline
+uint32_t
+TpmpRotateRight (
+    uint32_t Value,
+    uint32_t Count
+    )
+{
+    return (Value >> Count) | (Value << (32 - Count));
+}
+
+void
+TpmpSha256Transform (
+    PTPM_SHA256_CONTEXT Context,
+    const uint8_t* Block
+    )
+{
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, h;
+    uint32_t t1, t2;
+    uint32_t i;
+
+    //
+    // Build the message schedule from the big-endian block
+    //
+    for (i = 0; i < 16; i++)
+    {
+        memcpy(&w[i], &Block[i * 4], sizeof(w[i]));
+        w[i] = OsSwap32(w[i]);
+    }
+    for (i = 16; i < 64; i++)
+    {
+        t1 = TpmpRotateRight(w[i - 2], 17) ^ TpmpRotateRight(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        t2 = TpmpRotateRight(w[i - 15], 7) ^ TpmpRotateRight(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        w[i] = t1 + w[i - 7] + t2 + w[i - 16];
+    }
+
+    //
+    // Run the 64 rounds of the compression function
+    //
+    a = Context->State[0];
+    b = Context->State[1];
+    c = Context->State[2];
+    d = Context->State[3];
+    e = Context->State[4];
+    f = Context->State[5];
+    g = Context->State[6];
+    h = Context->State[7];
+    for (i = 0; i < 64; i++)
+    {
+        t1 = h +
+             (TpmpRotateRight(e, 6) ^ TpmpRotateRight(e, 11) ^ TpmpRotateRight(e, 25)) +
+             ((e & f) ^ (~e & g)) +
+             TpmpSha256K[i] +
+             w[i];
+        t2 = (TpmpRotateRight(a, 2) ^ TpmpRotateRight(a, 13) ^ TpmpRotateRight(a, 22)) +
+             ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    Context->State[0] += a;
+    Context->State[1] += b;
+    Context->State[2] += c;
+    Context->State[3] += d;
+    Context->State[4] += e;
+    Context->State[5] += f;
+    Context->State[6] += g;
+    Context->State[7] += h;
+}
+
+void
+TpmSha256Init (
+    PTPM_SHA256_CONTEXT Context
+    )
+{
+    //
+    // Initial hash value from the standard
+    //
+    Context->State[0] = 0x6a09e667;
+    Context->State[1] = 0xbb67ae85;
+    Context->State[2] = 0x3c6ef372;
+    Context->State[3] = 0xa54ff53a;
+    Context->State[4] = 0x510e527f;
+    Context->State[5] = 0x9b05688c;
+    Context->State[6] = 0x1f83d9ab;
+    Context->State[7] = 0x5be0cd19;
+    Context->Length = 0;
+}
+
+void
+TpmSha256Update (
+    PTPM_SHA256_CONTEXT Context,
+    const uint8_t* Data,
+    size_t DataSize
+    )
+{
+    uint32_t bufferUsed;
+    uint32_t copySize;
+
+    //
+    // Top off a partially filled block first
+    //
+    bufferUsed = static_cast<uint32_t>(Context->Length % sizeof(Context->Buffer));
+    Context->Length += DataSize;
+    if (bufferUsed != 0)
+    {
+        copySize = sizeof(Context->Buffer) - bufferUsed;
+        if (DataSize < copySize)
+        {
+            memcpy(&Context->Buffer[bufferUsed], Data, DataSize);
+            return;
+        }
+        memcpy(&Context->Buffer[bufferUsed], Data, copySize);
+        TpmpSha256Transform(Context, Context->Buffer);
+        Data += copySize;
+        DataSize -= copySize;
+    }
+
+    //
+    // Then hash whole blocks straight out of the caller's buffer
+    //
+    while (DataSize >= sizeof(Context->Buffer))
+    {
+        TpmpSha256Transform(Context, Data);
+        Data += sizeof(Context->Buffer);
+        DataSize -= sizeof(Context->Buffer);
+    }
+
+    //
+    // And keep the remainder for later
+    //
+    memcpy(Context->Buffer, Data, DataSize);
+}
+
+void
+TpmSha256Final (
+    PTPM_SHA256_CONTEXT Context,
+    uint8_t* Digest
+    )
+{
+    uint64_t bitLength;
+    uint32_t bufferUsed;
+    uint32_t i;
+
+    //
+    // Pad with a one bit, zeroes, and the message length in bits
+    //
+    bitLength = OsSwap64(Context->Length * 8);
+    bufferUsed = static_cast<uint32_t>(Context->Length % sizeof(Context->Buffer));
+    Context->Buffer[bufferUsed++] = 0x80;
+    if (bufferUsed > (sizeof(Context->Buffer) - sizeof(bitLength)))
+    {
+        memset(&Context->Buffer[bufferUsed], 0, sizeof(Context->Buffer) - bufferUsed);
+        TpmpSha256Transform(Context, Context->Buffer);
+        bufferUsed = 0;
+    }
+    memset(&Context->Buffer[bufferUsed],
+           0,
+           sizeof(Context->Buffer) - sizeof(bitLength) - bufferUsed);
+    memcpy(&Context->Buffer[sizeof(Context->Buffer) - sizeof(bitLength)],
+           &bitLength,
+           sizeof(bitLength));
+    TpmpSha256Transform(Context, Context->Buffer);
+
+    //
+    // Output the state in big-endian order
+    //
+    for (i = 0; i < 8; i++)
+    {
+        Context->State[i] = OsSwap32(Context->State[i]);
+    }
+    memcpy(Digest, Context->State, TPM_SHA256_DIGEST_SIZE);
+}
+
+void
+TpmSha256 (
+    const uint8_t* Data,
+    size_t DataSize,
+    uint8_t* Digest
+    )
+{
+    TPM_SHA256_CONTEXT context;
+
+    //
+    // One-shot helper for small buffers
+    //
+    TpmSha256Init(&context);
+    TpmSha256Update(&context, Data, DataSize);
+    TpmSha256Final(&context, Digest);
+}
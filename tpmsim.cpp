@@ -0,0 +1,863 @@
+/*++
+
+Copyright (c) Alex Ionescu.  All rights reserved.
+
+Module Name:
+
+    tpmsim.cpp
+
+Abstract:
+
+    This module implements transports for software TPMs reachable over TCP,
+    namely the Microsoft/TCG reference simulator ("mssim"), which frames each
+    command with TPM_SEND_COMMAND and has a separate platform socket used for
+    power and NV signals, and swtpm, which accepts raw commands.
+
+    The connection is kept open across commands and is transparently
+    re-established if the simulator goes away between two commands.
+
+Author:
+
+    Alex Ionescu (@aionescu) 16-Oct-2026 - Initial version
+
+Environment:
+
+    Any environment with BSD sockets or Winsock.
+
+--*/
+
+#ifdef _MSC_VER
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+#include "tpmtool.hpp"
+#include "tpmcmd.hpp"
+
+//
+// Abstraction over the socket types of each platform
+//
+#ifdef _WIN32
+typedef SOCKET TPM_SIM_SOCKET;
+#define TPM_SIM_INVALID_SOCKET      INVALID_SOCKET
+#define TpmpSimCloseSocket          closesocket
+#define TpmpSimLastError()          static_cast<uint32_t>(WSAGetLastError())
+#else
+typedef int32_t TPM_SIM_SOCKET;
+#define TPM_SIM_INVALID_SOCKET      (-1)
+#define TpmpSimCloseSocket          close
+#define TpmpSimLastError()          static_cast<uint32_t>(errno)
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL                0
+#endif
+#endif
+
+//
+// Default location of the simulator. The platform socket of the reference
+// simulator always listens on the port following the command port.
+//
+#define TPM_SIM_DEFAULT_HOST        "127.0.0.1"
+#define TPM_SIM_DEFAULT_PORT        2321
+
+//
+// Reference Simulator Socket Commands
+//
+typedef enum _TPM_SIM_COMMAND : uint32_t
+{
+    TPM_SIGNAL_POWER_ON = 1,
+    TPM_SIGNAL_POWER_OFF = 2,
+    TPM_SEND_COMMAND = 8,
+    TPM_SIGNAL_NV_ON = 11,
+    TPM_SESSION_END = 20
+} TPM_SIM_COMMAND;
+
+//
+// Framing in front of each command sent to the reference simulator
+//
+#pragma pack(push)
+#pragma pack(1)
+typedef struct
+{
+    uint32_t Command;
+    uint8_t Locality;
+    uint32_t Size;
+} TPM_SIM_COMMAND_HEADER;
+#pragma pack(pop)
+
+//
+// Dialects of the simulator protocol
+//
+typedef enum _TPM_SIM_PROTOCOL
+{
+    TpmSimProtocolMssim,
+    TpmSimProtocolSwtpm
+} TPM_SIM_PROTOCOL;
+
+//
+// Simulator Transport Context
+//
+typedef struct _TPM_SIM_CONTEXT
+{
+    TPM_SIM_PROTOCOL Protocol;
+    char Host[256];
+    uint16_t Port;
+    uint8_t Locality;
+    TPM_SIM_SOCKET CommandSocket;
+    TPM_SIM_SOCKET PlatformSocket;
+} TPM_SIM_CONTEXT, *PTPM_SIM_CONTEXT;
+
+//
+// A piece of a message, which is gathered with the others into one send
+//
+typedef struct _TPM_SIM_BUFFER
+{
+    const void* Buffer;
+    uint32_t Length;
+} TPM_SIM_BUFFER;
+
+TPM_SIM_SOCKET
+TpmpSimConnectSocket (
+    const char* Host,
+    uint16_t Port
+    )
+{
+    struct addrinfo hints;
+    struct addrinfo* addressList;
+    struct addrinfo* address;
+    TPM_SIM_SOCKET simSocket;
+    char portString[sizeof("65535")];
+    int32_t noDelay;
+
+    //
+    // Resolve the simulator's address
+    //
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    snprintf(portString, sizeof(portString), "%u", Port);
+    if (getaddrinfo(Host, portString, &hints, &addressList) != 0)
+    {
+        return TPM_SIM_INVALID_SOCKET;
+    }
+
+    //
+    // Connect to the first address that accepts us
+    //
+    simSocket = TPM_SIM_INVALID_SOCKET;
+    for (address = addressList; address != nullptr; address = address->ai_next)
+    {
+        simSocket = socket(address->ai_family,
+                           address->ai_socktype,
+                           address->ai_protocol);
+        if (simSocket == TPM_SIM_INVALID_SOCKET)
+        {
+            continue;
+        }
+
+        if (connect(simSocket,
+                    address->ai_addr,
+                    static_cast<int32_t>(address->ai_addrlen)) == 0)
+        {
+            break;
+        }
+
+        TpmpSimCloseSocket(simSocket);
+        simSocket = TPM_SIM_INVALID_SOCKET;
+    }
+    freeaddrinfo(addressList);
+
+    //
+    // Commands are small request/response exchanges, so never let Nagle hold
+    // back the tail of a command waiting for an ACK.
+    //
+    if (simSocket != TPM_SIM_INVALID_SOCKET)
+    {
+        noDelay = 1;
+        setsockopt(simSocket,
+                   IPPROTO_TCP,
+                   TCP_NODELAY,
+                   reinterpret_cast<const char*>(&noDelay),
+                   sizeof(noDelay));
+    }
+    return simSocket;
+}
+
+bool
+TpmpSimSend (
+    TPM_SIM_SOCKET Socket,
+    TPM_SIM_BUFFER* Buffers,
+    uint32_t BufferCount
+    )
+{
+#ifdef _WIN32
+    WSABUF wsaBuffers[TPM_MAX_COMMAND_SEGMENTS + 1];
+    DWORD bytesSent;
+    uint32_t i;
+
+    //
+    // Gather all the pieces into a single send
+    //
+    if (BufferCount > ARRAYSIZE(wsaBuffers))
+    {
+        return false;
+    }
+    for (i = 0; i < BufferCount; i++)
+    {
+        wsaBuffers[i].buf = static_cast<CHAR*>(const_cast<void*>(Buffers[i].Buffer));
+        wsaBuffers[i].len = Buffers[i].Length;
+    }
+    return (WSASend(Socket, wsaBuffers, BufferCount, &bytesSent, 0, nullptr, nullptr) == 0);
+#else
+    struct iovec vectors[TPM_MAX_COMMAND_SEGMENTS + 1];
+    struct msghdr message;
+    ssize_t bytesSent;
+    uint32_t i;
+
+    //
+    // Gather all the pieces into a single send
+    //
+    if (BufferCount > (sizeof(vectors) / sizeof(vectors[0])))
+    {
+        return false;
+    }
+    for (i = 0; i < BufferCount; i++)
+    {
+        vectors[i].iov_base = const_cast<void*>(Buffers[i].Buffer);
+        vectors[i].iov_len = Buffers[i].Length;
+    }
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = vectors;
+    message.msg_iovlen = BufferCount;
+
+    //
+    // Keep sending until the socket accepted everything
+    //
+    while (message.msg_iovlen != 0)
+    {
+        bytesSent = sendmsg(Socket, &message, MSG_NOSIGNAL);
+        if (bytesSent < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+
+        //
+        // Skip over whatever was fully sent, and adjust a partial vector
+        //
+        while ((message.msg_iovlen != 0) &&
+               (static_cast<size_t>(bytesSent) >= message.msg_iov->iov_len))
+        {
+            bytesSent -= message.msg_iov->iov_len;
+            message.msg_iov++;
+            message.msg_iovlen--;
+        }
+        if (message.msg_iovlen != 0)
+        {
+            message.msg_iov->iov_base = static_cast<uint8_t*>(message.msg_iov->iov_base) +
+                                        bytesSent;
+            message.msg_iov->iov_len -= bytesSent;
+        }
+    }
+    return true;
+#endif
+}
+
+bool
+TpmpSimReceive (
+    TPM_SIM_SOCKET Socket,
+    void* Buffer,
+    uint32_t Length
+    )
+{
+    uint8_t* position;
+    int32_t bytesReceived;
+
+    //
+    // Keep receiving until the whole buffer was filled
+    //
+    position = static_cast<uint8_t*>(Buffer);
+    while (Length != 0)
+    {
+        bytesReceived = static_cast<int32_t>(recv(Socket,
+                                                  reinterpret_cast<char*>(position),
+                                                  Length,
+                                                  0));
+        if (bytesReceived <= 0)
+        {
+#ifndef _WIN32
+            if ((bytesReceived < 0) && (errno == EINTR))
+            {
+                continue;
+            }
+#endif
+            return false;
+        }
+        position += bytesReceived;
+        Length -= bytesReceived;
+    }
+    return true;
+}
+
+bool
+TpmpSimDiscard (
+    TPM_SIM_SOCKET Socket,
+    uint32_t Length
+    )
+{
+    uint8_t scratch[256];
+    uint32_t chunkLength;
+
+    //
+    // Drain data that does not fit in the caller's buffer
+    //
+    while (Length != 0)
+    {
+        chunkLength = (Length < sizeof(scratch)) ? Length : sizeof(scratch);
+        if (TpmpSimReceive(Socket, scratch, chunkLength) == false)
+        {
+            return false;
+        }
+        Length -= chunkLength;
+    }
+    return true;
+}
+
+bool
+TpmpSimSignal (
+    PTPM_SIM_CONTEXT Context,
+    TPM_SIM_COMMAND Signal
+    )
+{
+    TPM_SIM_BUFFER buffer;
+    uint32_t signal;
+    uint32_t ack;
+
+    //
+    // Platform signals are a single big-endian command, answered with zero
+    //
+    signal = OsSwap32(Signal);
+    buffer.Buffer = &signal;
+    buffer.Length = sizeof(signal);
+    if ((TpmpSimSend(Context->PlatformSocket, &buffer, 1) == false) ||
+        (TpmpSimReceive(Context->PlatformSocket, &ack, sizeof(ack)) == false))
+    {
+        return false;
+    }
+    return (ack == 0);
+}
+
+bool
+TpmpSimSendCommand (
+    PTPM_SIM_CONTEXT Context,
+    const TPM_COMMAND_SEGMENT* Segments,
+    uint32_t SegmentCount
+    )
+{
+    TPM_SIM_COMMAND_HEADER header;
+    TPM_SIM_BUFFER buffers[TPM_MAX_COMMAND_SEGMENTS + 1];
+    uint32_t bufferCount;
+    uint32_t commandLength;
+    uint32_t i;
+
+    //
+    // The reference simulator needs the TPM_SEND_COMMAND framing first, which
+    // is gathered with the command so that it leaves in the same segment,
+    // while swtpm takes the raw command as-is.
+    //
+    if (SegmentCount > TPM_MAX_COMMAND_SEGMENTS)
+    {
+        return false;
+    }
+    bufferCount = 0;
+    if (Context->Protocol == TpmSimProtocolMssim)
+    {
+        commandLength = 0;
+        for (i = 0; i < SegmentCount; i++)
+        {
+            commandLength += Segments[i].Length;
+        }
+        header.Command = OsSwap32(TPM_SEND_COMMAND);
+        header.Locality = Context->Locality;
+        header.Size = OsSwap32(commandLength);
+        buffers[bufferCount].Buffer = &header;
+        buffers[bufferCount].Length = sizeof(header);
+        bufferCount++;
+    }
+
+    //
+    // Each segment of the command is sent straight from where it is
+    //
+    for (i = 0; i < SegmentCount; i++)
+    {
+        buffers[bufferCount].Buffer = Segments[i].Buffer;
+        buffers[bufferCount].Length = Segments[i].Length;
+        bufferCount++;
+    }
+    return TpmpSimSend(Context->CommandSocket, buffers, bufferCount);
+}
+
+bool
+TpmpSimReceiveResponse (
+    PTPM_SIM_CONTEXT Context,
+    uint8_t* Out,
+    uint32_t OutLength
+    )
+{
+    TPM_REPLY_HEADER header;
+    uint32_t responseLength;
+    uint32_t copyLength;
+    uint32_t ack;
+
+    if (Context->Protocol == TpmSimProtocolSwtpm)
+    {
+        //
+        // swtpm sends back the raw response, so get its size from the header
+        //
+        if (TpmpSimReceive(Context->CommandSocket, &header, sizeof(header)) == false)
+        {
+            return false;
+        }
+        responseLength = OsSwap32(header.Size);
+        if (responseLength < sizeof(header))
+        {
+            return false;
+        }
+
+        copyLength = (OutLength < sizeof(header)) ? OutLength : sizeof(header);
+        memcpy(Out, &header, copyLength);
+        Out += copyLength;
+        OutLength -= copyLength;
+        responseLength -= sizeof(header);
+    }
+    else
+    {
+        //
+        // The reference simulator sends the size of the response first
+        //
+        if (TpmpSimReceive(Context->CommandSocket, &responseLength, sizeof(responseLength)) == false)
+        {
+            return false;
+        }
+        responseLength = OsSwap32(responseLength);
+    }
+
+    //
+    // Read what fits in the caller's buffer, and throw away the rest
+    //
+    copyLength = (OutLength < responseLength) ? OutLength : responseLength;
+    if ((TpmpSimReceive(Context->CommandSocket, Out, copyLength) == false) ||
+        (TpmpSimDiscard(Context->CommandSocket, responseLength - copyLength) == false))
+    {
+        return false;
+    }
+
+    //
+    // The reference simulator terminates each exchange with a zero status
+    //
+    if (Context->Protocol == TpmSimProtocolMssim)
+    {
+        if ((TpmpSimReceive(Context->CommandSocket, &ack, sizeof(ack)) == false) ||
+            (ack != 0))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void
+TpmpSimDisconnect (
+    PTPM_SIM_CONTEXT Context
+    )
+{
+    TPM_SIM_BUFFER buffer;
+    uint32_t sessionEnd;
+
+    //
+    // Politely let the reference simulator know we're going away, otherwise it
+    // will log an error. This is best effort since the socket may be broken.
+    //
+    sessionEnd = OsSwap32(TPM_SESSION_END);
+    buffer.Buffer = &sessionEnd;
+    buffer.Length = sizeof(sessionEnd);
+    if (Context->CommandSocket != TPM_SIM_INVALID_SOCKET)
+    {
+        if (Context->Protocol == TpmSimProtocolMssim)
+        {
+            TpmpSimSend(Context->CommandSocket, &buffer, 1);
+        }
+        TpmpSimCloseSocket(Context->CommandSocket);
+        Context->CommandSocket = TPM_SIM_INVALID_SOCKET;
+    }
+    if (Context->PlatformSocket != TPM_SIM_INVALID_SOCKET)
+    {
+        TpmpSimSend(Context->PlatformSocket, &buffer, 1);
+        TpmpSimCloseSocket(Context->PlatformSocket);
+        Context->PlatformSocket = TPM_SIM_INVALID_SOCKET;
+    }
+}
+
+bool
+TpmpSimConnect (
+    PTPM_SIM_CONTEXT Context
+    )
+{
+    uint8_t startup[TpmStartupCommand::FixedSize];
+    uint8_t startupReply[TpmStartupResponse::FixedSize];
+    TPM_COMMAND_SEGMENT segment;
+    TPM_RC tpmResult;
+
+    //
+    // Connect the command socket
+    //
+    Context->CommandSocket = TpmpSimConnectSocket(Context->Host, Context->Port);
+    if (Context->CommandSocket == TPM_SIM_INVALID_SOCKET)
+    {
+        goto Failure;
+    }
+
+    //
+    // The reference simulator starts powered off, so use the platform socket
+    // to turn on the power and the NV storage. This is a no-op if it already
+    // was powered on by an earlier connection.
+    //
+    if (Context->Protocol == TpmSimProtocolMssim)
+    {
+        Context->PlatformSocket = TpmpSimConnectSocket(Context->Host, Context->Port + 1);
+        if ((Context->PlatformSocket == TPM_SIM_INVALID_SOCKET) ||
+            (TpmpSimSignal(Context, TPM_SIGNAL_POWER_ON) == false) ||
+            (TpmpSimSignal(Context, TPM_SIGNAL_NV_ON) == false))
+        {
+            goto Failure;
+        }
+    }
+
+    //
+    // Software TPMs also need TPM2_Startup, which is normally done by firmware.
+    // If it already happened, the TPM will tell us with TPM_RC_INITIALIZE.
+    //
+    segment.Buffer = startup;
+    segment.Length = TpmStartupCommand::Marshal(startup, sizeof(startup), TPM_SU_CLEAR);
+    if ((TpmpSimSendCommand(Context, &segment, 1) == false) ||
+        (TpmpSimReceiveResponse(Context, startupReply, sizeof(startupReply)) == false))
+    {
+        goto Failure;
+    }
+    tpmResult = TpmReadResponseCode(startupReply);
+    if ((tpmResult != TPM_RC_SUCCESS) && (tpmResult != TPM_RC_INITIALIZE))
+    {
+        goto Failure;
+    }
+    return true;
+
+Failure:
+    TpmpSimDisconnect(Context);
+    return false;
+}
+
+bool
+TpmpSimSubmitCommand (
+    uintptr_t TpmHandle,
+    const TPM_COMMAND_SEGMENT* Segments,
+    uint32_t SegmentCount,
+    uint32_t* OsResult
+    )
+{
+    PTPM_SIM_CONTEXT context;
+    uint32_t attempt;
+    bool result;
+
+    context = reinterpret_cast<PTPM_SIM_CONTEXT>(TpmHandle);
+    result = false;
+    for (attempt = 0; attempt < 2; attempt++)
+    {
+        //
+        // (Re)connect if the previous connection was lost
+        //
+        if ((context->CommandSocket == TPM_SIM_INVALID_SOCKET) &&
+            (TpmpSimConnect(context) == false))
+        {
+            break;
+        }
+
+        //
+        // If the command could not be sent, the simulator never executed it,
+        // so it is safe to reconnect and try once more.
+        //
+        result = TpmpSimSendCommand(context, Segments, SegmentCount);
+        if (result != false)
+        {
+            break;
+        }
+        TpmpSimDisconnect(context);
+    }
+
+    //
+    // Return the OS result if needed
+    //
+    if (OsResult != nullptr)
+    {
+        *OsResult = result ? 0 : TpmpSimLastError();
+    }
+    return result;
+}
+
+bool
+TpmpSimCompleteCommand (
+    uintptr_t TpmHandle,
+    uint8_t* Out,
+    uint32_t OutLength,
+    uint32_t* OsResult
+    )
+{
+    PTPM_SIM_CONTEXT context;
+    bool result;
+
+    //
+    // However, if the response got lost, the command may have executed and
+    // it is not safe to send it again. Only reconnect for the next one.
+    //
+    context = reinterpret_cast<PTPM_SIM_CONTEXT>(TpmHandle);
+    result = TpmpSimReceiveResponse(context, Out, OutLength);
+    if (result == false)
+    {
+        TpmpSimDisconnect(context);
+    }
+
+    //
+    // Return the OS result if needed
+    //
+    if (OsResult != nullptr)
+    {
+        *OsResult = result ? 0 : TpmpSimLastError();
+    }
+    return result;
+}
+
+bool
+TpmpSimIssueCommandV (
+    uintptr_t TpmHandle,
+    const TPM_COMMAND_SEGMENT* Segments,
+    uint32_t SegmentCount,
+    uint8_t* Out,
+    uint32_t OutLength,
+    uint32_t* OsResult
+    )
+{
+    //
+    // Send the command, and then wait for its response
+    //
+    if (TpmpSimSubmitCommand(TpmHandle, Segments, SegmentCount, OsResult) == false)
+    {
+        return false;
+    }
+    return TpmpSimCompleteCommand(TpmHandle, Out, OutLength, OsResult);
+}
+
+bool
+TpmpSimIssueCommand (
+    uintptr_t TpmHandle,
+    uint8_t* In,
+    uint32_t InLength,
+    uint8_t* Out,
+    uint32_t OutLength,
+    uint32_t* OsResult
+    )
+{
+    TPM_COMMAND_SEGMENT segment;
+
+    //
+    // Send the command as a single segment
+    //
+    segment.Buffer = In;
+    segment.Length = InLength;
+    return TpmpSimIssueCommandV(TpmHandle, &segment, 1, Out, OutLength, OsResult);
+}
+
+bool
+TpmpSimOpen (
+    TPM_SIM_PROTOCOL Protocol,
+    const char* Parameters,
+    uintptr_t* TpmHandle
+    )
+{
+    PTPM_SIM_CONTEXT context;
+    const char* portString;
+    size_t hostLength;
+#ifdef _WIN32
+    WSADATA wsaData;
+#endif
+
+    //
+    // Initialize for failure
+    //
+    *TpmHandle = 0;
+
+    //
+    // Allocate the context
+    //
+    context = static_cast<PTPM_SIM_CONTEXT>(calloc(1, sizeof(*context)));
+    if (context == nullptr)
+    {
+        return false;
+    }
+    context->Protocol = Protocol;
+    context->Port = TPM_SIM_DEFAULT_PORT;
+    context->Locality = 0;
+    context->CommandSocket = TPM_SIM_INVALID_SOCKET;
+    context->PlatformSocket = TPM_SIM_INVALID_SOCKET;
+
+    //
+    // Parse "host[:port]", where an IPv6 host must be written as "[host]"
+    //
+    if ((Parameters == nullptr) || (Parameters[0] == '\0'))
+    {
+        Parameters = TPM_SIM_DEFAULT_HOST;
+    }
+    if (Parameters[0] == '[')
+    {
+        Parameters++;
+        portString = strchr(Parameters, ']');
+        if (portString == nullptr)
+        {
+            goto Failure;
+        }
+        hostLength = static_cast<size_t>(portString - Parameters);
+        portString = (portString[1] == ':') ? &portString[2] : nullptr;
+    }
+    else
+    {
+        portString = strrchr(Parameters, ':');
+        hostLength = (portString != nullptr) ?
+                     static_cast<size_t>(portString - Parameters) :
+                     strlen(Parameters);
+        portString = (portString != nullptr) ? &portString[1] : nullptr;
+    }
+    if ((hostLength == 0) || (hostLength >= sizeof(context->Host)))
+    {
+        goto Failure;
+    }
+    memcpy(context->Host, Parameters, hostLength);
+    context->Host[hostLength] = '\0';
+    if (portString != nullptr)
+    {
+        context->Port = static_cast<uint16_t>(strtoul(portString, nullptr, 0));
+        if (context->Port == 0)
+        {
+            goto Failure;
+        }
+    }
+
+#ifdef _WIN32
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+    {
+        goto Failure;
+    }
+#endif
+
+    //
+    // Connect right away so that an absent simulator is reported at open time
+    //
+    if (TpmpSimConnect(context) == false)
+    {
+#ifdef _WIN32
+        WSACleanup();
+#endif
+        goto Failure;
+    }
+
+    //
+    // Return a handle that can be used for further commands
+    //
+    *TpmHandle = reinterpret_cast<uintptr_t>(context);
+    return true;
+
+Failure:
+    free(context);
+    return false;
+}
+
+bool
+TpmpMssimOpen (
+    const char* Parameters,
+    uintptr_t* TpmHandle
+    )
+{
+    return TpmpSimOpen(TpmSimProtocolMssim, Parameters, TpmHandle);
+}
+
+bool
+TpmpSwtpmOpen (
+    const char* Parameters,
+    uintptr_t* TpmHandle
+    )
+{
+    return TpmpSimOpen(TpmSimProtocolSwtpm, Parameters, TpmHandle);
+}
+
+bool
+TpmpSimClose (
+    uintptr_t TpmHandle
+    )
+{
+    PTPM_SIM_CONTEXT context;
+
+    //
+    // Disconnect and free the context
+    //
+    context = reinterpret_cast<PTPM_SIM_CONTEXT>(TpmHandle);
+    TpmpSimDisconnect(context);
+    free(context);
+#ifdef _WIN32
+    WSACleanup();
+#endif
+    return true;
+}
+
+//
+// Transport for the reference simulator ("mssim")
+//
+const TPM_TRANSPORT TpmSimTransport =
+{
+    "mssim",
+    TpmpMssimOpen,
+    TpmpSimIssueCommand,
+    TpmpSimIssueCommandV,
+    TpmpSimSubmitCommand,
+    TpmpSimCompleteCommand,
+    TpmpSimClose,
+    1
+};
+
+//
+// Transport for swtpm's raw command socket
+//
+const TPM_TRANSPORT TpmSwtpmTransport =
+{
+    "swtpm",
+    TpmpSwtpmOpen,
+    TpmpSimIssueCommand,
+    TpmpSimIssueCommandV,
+    TpmpSimSubmitCommand,
+    TpmpSimCompleteCommand,
+    TpmpSimClose,
+    1
+};
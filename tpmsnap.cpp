@@ -0,0 +1,514 @@
+/*++
+
+Copyright (c) Alex Ionescu.  All rights reserved.
+
+Module Name:
+
+    tpmsnap.cpp
+
+Abstract:
+
+    This module implements snapshots of all the NV indices of the owner, which
+    are saved in an archive along with their public area and contents, and
+    restored later on, such as after the TPM was cleared. Snapshots read all
+    the public areas in one batch, and all the contents in another. Restores
+    apply the archive as the desired state of its indices, so that only the
+    indices that are missing or that changed are defined, and only the
+    contents that differ from what is already there are written.
+
+Author:
+
+    Alex Ionescu (@aionescu) 16-Oct-2026 - Initial version
+
+Environment:
+
+    Portable to any environment.
+
+--*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "tpmtool.hpp"
+#include "tpmcmd.hpp"
+
+//
+// The archive starts with this header, followed by a record for each index,
+// in the order they were enumerated. Each record is followed by the contents
+// of the index, if they were saved, which are always all of its data. The
+// digest covers all of the records and their contents. All fields are
+// little-endian.
+//
+#define TPM_SNAPSHOT_SIGNATURE      0x534E5654  // 'TVNS'
+#define TPM_SNAPSHOT_VERSION        1
+
+#pragma pack(push, 1)
+typedef struct _TPM_SNAPSHOT_HEADER
+{
+    uint32_t Signature;
+    uint16_t Version;
+    uint16_t Reserved;
+    uint32_t IndexCount;
+    uint32_t RecordsSize;
+    uint8_t Digest[32];
+} TPM_SNAPSHOT_HEADER, *PTPM_SNAPSHOT_HEADER;
+
+typedef struct _TPM_SNAPSHOT_RECORD
+{
+    uint32_t Index;
+    uint16_t Attributes;
+    uint8_t OwnerRights;
+    uint8_t AuthRights;
+    uint16_t DataSize;
+    uint16_t ContentSize;
+} TPM_SNAPSHOT_RECORD, *PTPM_SNAPSHOT_RECORD;
+#pragma pack(pop)
+
+//
+// Public area of each index, as returned by the TPM, and where its contents
+// are kept once read to be saved. Contents are only read from the indices
+// that were written, and that the owner can read.
+//
+typedef struct _TPM_SNAPSHOT_ENTRY
+{
+    TPM_RC Result;
+    uint16_t Attributes;
+    uint8_t OwnerRights;
+    uint8_t AuthRights;
+    uint16_t DataSize;
+    bool Archived;
+    bool Saved;
+    uint32_t ContentOffset;
+} TPM_SNAPSHOT_ENTRY, *PTPM_SNAPSHOT_ENTRY;
+
+//
+// Snapshot Context
+//
+typedef struct _TPM_SNAPSHOT_CONTEXT
+{
+    TPM_NV_INDEX* Indices;
+    uint32_t Count;
+    PTPM_SNAPSHOT_ENTRY Entries;
+    uint8_t* Contents;
+} TPM_SNAPSHOT_CONTEXT, *PTPM_SNAPSHOT_CONTEXT;
+
+bool
+TpmpSnapshotPublic (
+    void* Context,
+    uint32_t Position,
+    TPM_RC Result,
+    uint16_t Attributes,
+    uint8_t OwnerRights,
+    uint8_t AuthRights,
+    uint16_t DataSize
+    )
+{
+    PTPM_SNAPSHOT_ENTRY entry;
+
+    //
+    // Save the public area of the index
+    //
+    entry = &static_cast<PTPM_SNAPSHOT_CONTEXT>(Context)->Entries[Position];
+    entry->Result = Result;
+    entry->Attributes = Attributes;
+    entry->OwnerRights = OwnerRights;
+    entry->AuthRights = AuthRights;
+    entry->DataSize = DataSize;
+    return true;
+}
+
+bool
+TpmpSnapshotContents (
+    void* Context,
+    uint32_t Position,
+    TPM_RC Result,
+    uint16_t Offset,
+    const uint8_t* Data,
+    uint16_t DataSize
+    )
+{
+    PTPM_SNAPSHOT_CONTEXT context;
+    PTPM_SNAPSHOT_ENTRY entry;
+
+    //
+    // Copy each piece in place, or forget about the contents of the index if
+    // it could not be read after all.
+    //
+    context = static_cast<PTPM_SNAPSHOT_CONTEXT>(Context);
+    entry = &context->Entries[Position];
+    if (Result != TPM_RC_SUCCESS)
+    {
+        entry->Saved = false;
+        return true;
+    }
+    memcpy(&context->Contents[entry->ContentOffset + Offset], Data, DataSize);
+    return true;
+}
+
+TPM_RC
+TpmSnapshotCreate (
+    uintptr_t TpmHandle,
+    const char* Path,
+    PTPM_SNAPSHOT_STATISTICS Statistics
+    )
+{
+    TPM_SNAPSHOT_CONTEXT context;
+    TPM_SNAPSHOT_HEADER header;
+    TPM_SNAPSHOT_RECORD record;
+    PTPM_SNAPSHOT_ENTRY entry;
+    uint16_t* readSizes;
+    uint32_t contentSize;
+    size_t archiveSize;
+    uint8_t* archive;
+    uintptr_t mapHandle;
+    void* mapping;
+    uint32_t offset;
+    uint32_t i;
+    TPM_RC tpmResult;
+
+    //
+    // Get all the NV indices first, as they need to be known up front for all
+    // of the commands to be sent back to back.
+    //
+    memset(Statistics, 0, sizeof(*Statistics));
+    memset(&context, 0, sizeof(context));
+    readSizes = nullptr;
+    tpmResult = TpmNvEnumerateAll(TpmHandle, &context.Count, &context.Indices);
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        goto Exit;
+    }
+    context.Entries = static_cast<PTPM_SNAPSHOT_ENTRY>(
+        calloc((context.Count != 0) ? context.Count : 1, sizeof(*context.Entries)));
+    readSizes = static_cast<uint16_t*>(
+        calloc((context.Count != 0) ? context.Count : 1, sizeof(*readSizes)));
+    if ((context.Entries == nullptr) || (readSizes == nullptr))
+    {
+        tpmResult = TPM_RC_FAILURE;
+        goto Exit;
+    }
+
+    //
+    // Read all of their public areas in one batch. An index that is gone by
+    // now would make the snapshot incomplete, so that fails it.
+    //
+    tpmResult = TpmReadPublicBatch(TpmHandle,
+                                   context.Count,
+                                   context.Indices,
+                                   TpmpSnapshotPublic,
+                                   &context);
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        goto Exit;
+    }
+
+    //
+    // Only keep the indices of the owner, and lay out the contents of those
+    // that can be read, one after the other.
+    //
+    contentSize = 0;
+    for (i = 0; i < context.Count; i++)
+    {
+        entry = &context.Entries[i];
+        if (entry->Result != TPM_RC_SUCCESS)
+        {
+            tpmResult = entry->Result;
+            goto Exit;
+        }
+        if ((entry->Attributes & TpmToolPlatformOwned) != 0)
+        {
+            continue;
+        }
+        entry->Archived = true;
+        Statistics->IndexCount++;
+        if (((entry->Attributes & TpmToolWritten) == 0) || (entry->DataSize == 0))
+        {
+            continue;
+        }
+        if (((entry->OwnerRights & TpmToolReadAccess) == 0) ||
+            ((entry->Attributes & TpmToolReadLocked) != 0))
+        {
+            Statistics->Skipped++;
+            continue;
+        }
+        entry->Saved = true;
+        entry->ContentOffset = contentSize;
+        readSizes[i] = entry->DataSize;
+        contentSize += entry->DataSize;
+    }
+
+    //
+    // Then read all of their contents in one batch
+    //
+    context.Contents = static_cast<uint8_t*>(malloc((contentSize != 0) ? contentSize : 1));
+    if (context.Contents == nullptr)
+    {
+        tpmResult = TPM_RC_FAILURE;
+        goto Exit;
+    }
+    tpmResult = TpmNvReadBatch(TpmHandle,
+                               context.Count,
+                               context.Indices,
+                               readSizes,
+                               TpmpSnapshotContents,
+                               &context);
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        goto Exit;
+    }
+
+    //
+    // Size the archive to what was actually read, and map it
+    //
+    archiveSize = sizeof(header);
+    for (i = 0; i < context.Count; i++)
+    {
+        entry = &context.Entries[i];
+        if (entry->Archived == false)
+        {
+            continue;
+        }
+        archiveSize += sizeof(record);
+        if (entry->Saved)
+        {
+            archiveSize += entry->DataSize;
+        }
+        else if (readSizes[i] != 0)
+        {
+            Statistics->Skipped++;
+        }
+    }
+    if (OsMapFile(Path, true, &archiveSize, &mapping, &mapHandle) == false)
+    {
+        tpmResult = TPM_RC_FAILURE;
+        goto Exit;
+    }
+    archive = static_cast<uint8_t*>(mapping);
+
+    //
+    // Write each record, followed by the contents of the index, if saved
+    //
+    offset = sizeof(header);
+    for (i = 0; i < context.Count; i++)
+    {
+        entry = &context.Entries[i];
+        if (entry->Archived == false)
+        {
+            continue;
+        }
+        record.Index = context.Indices[i].Value;
+        record.Attributes = entry->Attributes;
+        record.OwnerRights = entry->OwnerRights;
+        record.AuthRights = entry->AuthRights;
+        record.DataSize = entry->DataSize;
+        record.ContentSize = entry->Saved ? entry->DataSize : 0;
+        memcpy(&archive[offset], &record, sizeof(record));
+        offset += sizeof(record);
+        if (entry->Saved)
+        {
+            memcpy(&archive[offset], &context.Contents[entry->ContentOffset], entry->DataSize);
+            offset += entry->DataSize;
+            Statistics->ContentCount++;
+        }
+    }
+
+    //
+    // Finally, write the header, with the digest of everything after it
+    //
+    header.Signature = TPM_SNAPSHOT_SIGNATURE;
+    header.Version = TPM_SNAPSHOT_VERSION;
+    header.Reserved = 0;
+    header.IndexCount = Statistics->IndexCount;
+    header.RecordsSize = offset - sizeof(header);
+    TpmSha256(&archive[sizeof(header)], header.RecordsSize, header.Digest);
+    memcpy(archive, &header, sizeof(header));
+    if (OsUnmapFile(mapping, archiveSize, mapHandle) == false)
+    {
+        tpmResult = TPM_RC_FAILURE;
+    }
+
+Exit:
+    free(context.Contents);
+    free(context.Entries);
+    free(context.Indices);
+    free(readSizes);
+    return tpmResult;
+}
+
+bool
+TpmpSnapshotPlan (
+    void* Context,
+    uint32_t Position,
+    TPM_PLAN_OPERATION Operation,
+    uint16_t DataSize
+    )
+{
+    uint8_t* operations;
+
+    (void)DataSize;
+
+    //
+    // Restores carry out the whole plan, and remember what it did to each
+    // index, so that each one is only counted once.
+    //
+    operations = static_cast<uint8_t*>(Context);
+    operations[Position] |= static_cast<uint8_t>(1 << Operation);
+    return true;
+}
+
+TPM_RC
+TpmSnapshotRestore (
+    uintptr_t TpmHandle,
+    const char* Path,
+    PTPM_HANDLE_CALLBACK NotRestorableCallback,
+    void* CallbackContext,
+    PTPM_SNAPSHOT_STATISTICS Statistics
+    )
+{
+    TPM_SNAPSHOT_HEADER header;
+    TPM_SNAPSHOT_RECORD record;
+    TPM_PLAN_STATISTICS planStatistics;
+    PTPM_NV_DESIRED_STATE states;
+    PTPM_NV_DESIRED_STATE state;
+    uint8_t* operations;
+    uint8_t digest[32];
+    const uint8_t* archive;
+    size_t archiveSize;
+    uintptr_t mapHandle;
+    void* mapping;
+    uint32_t offset;
+    uint32_t i;
+    TPM_RC tpmResult;
+
+    //
+    // Map the archive, and make sure it is whole before using any of it
+    //
+    memset(Statistics, 0, sizeof(*Statistics));
+    states = nullptr;
+    operations = nullptr;
+    if (OsMapFile(Path, false, &archiveSize, &mapping, &mapHandle) == false)
+    {
+        return TPM_RC_FAILURE;
+    }
+    archive = static_cast<const uint8_t*>(mapping);
+    tpmResult = TPM_RC_INTEGRITY;
+    if (archiveSize < sizeof(header))
+    {
+        goto Exit;
+    }
+    memcpy(&header, archive, sizeof(header));
+    if ((header.Signature != TPM_SNAPSHOT_SIGNATURE) ||
+        (header.Version != TPM_SNAPSHOT_VERSION) ||
+        (header.RecordsSize != (archiveSize - sizeof(header))))
+    {
+        goto Exit;
+    }
+    TpmSha256(&archive[sizeof(header)], header.RecordsSize, digest);
+    if (memcmp(digest, header.Digest, sizeof(digest)) != 0)
+    {
+        goto Exit;
+    }
+
+    //
+    // Turn each record into the desired state of its index, checking that it
+    // fits and makes sense. Indices are defined without a password, as it is
+    // not part of their public area, so contents can only be written back
+    // with the rights of the owner.
+    //
+    states = static_cast<PTPM_NV_DESIRED_STATE>(
+        calloc((header.IndexCount != 0) ? header.IndexCount : 1, sizeof(*states)));
+    operations = static_cast<uint8_t*>(
+        calloc((header.IndexCount != 0) ? header.IndexCount : 1, sizeof(*operations)));
+    if ((states == nullptr) || (operations == nullptr))
+    {
+        tpmResult = TPM_RC_FAILURE;
+        goto Exit;
+    }
+    offset = sizeof(header);
+    for (i = 0; i < header.IndexCount; i++)
+    {
+        if ((archiveSize - offset) < sizeof(record))
+        {
+            goto Exit;
+        }
+        memcpy(&record, &archive[offset], sizeof(record));
+        state = &states[i];
+        state->Index.Value = record.Index;
+        if ((state->Index.Type != TPM_HT_NV_INDEX) ||
+            ((record.ContentSize != 0) && (record.ContentSize != record.DataSize)) ||
+            ((archiveSize - offset - sizeof(record)) < record.ContentSize))
+        {
+            goto Exit;
+        }
+        state->DataSize = record.DataSize;
+        state->Attributes = record.Attributes;
+        state->OwnerRights = record.OwnerRights;
+        state->AuthRights = record.AuthRights;
+        state->ContentSize = record.ContentSize;
+        state->Content = &archive[offset + sizeof(record)];
+        offset += sizeof(record) + record.ContentSize;
+    }
+    if (offset != archiveSize)
+    {
+        goto Exit;
+    }
+
+    //
+    // Then only define the indices that are missing or that changed, and only
+    // write the contents that differ from what is already there.
+    //
+    tpmResult = TpmApplyState(TpmHandle,
+                              header.IndexCount,
+                              states,
+                              false,
+                              TpmpSnapshotPlan,
+                              operations,
+                              &planStatistics);
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        goto Exit;
+    }
+
+    //
+    // Count each index once. Counters and extend indices come first, whether
+    // or not they had to be defined, since their value is never restored,
+    // even when the archive has none. Then come the indices whose contents
+    // could not be set, even if they were defined. Defining an index also
+    // covers writing its contents, and an index that needed nothing already
+    // matched.
+    //
+    Statistics->IndexCount = header.IndexCount;
+    for (i = 0; i < header.IndexCount; i++)
+    {
+        if ((states[i].Attributes & (TpmToolCounter | TpmToolExtend)) != 0)
+        {
+            Statistics->NotRestorable++;
+            if ((NotRestorableCallback != nullptr) &&
+                (NotRestorableCallback(CallbackContext, states[i].Index.Value) == false))
+            {
+                NotRestorableCallback = nullptr;
+            }
+        }
+        else if ((operations[i] & (1 << TpmPlanSkip)) != 0)
+        {
+            Statistics->Skipped++;
+        }
+        else if ((operations[i] & (1 << TpmPlanDefine)) != 0)
+        {
+            Statistics->Defined++;
+        }
+        else if ((operations[i] & (1 << TpmPlanWrite)) != 0)
+        {
+            Statistics->Written++;
+        }
+        else
+        {
+            Statistics->Unchanged++;
+        }
+    }
+
+Exit:
+    OsUnmapFile(mapping, archiveSize, mapHandle);
+    free(operations);
+    free(states);
+    return tpmResult;
+}
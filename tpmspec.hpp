@@ -34,7 +34,8 @@ Environment:
 typedef enum _TPM_ST : uint16_t
 {
     TPM_ST_NO_SESSIONS = 0x8001,
-    TPM_ST_SESSIONS = 0x8002
+    TPM_ST_SESSIONS = 0x8002,
+    TPM_ST_HASHCHECK = 0x8024
 } TPM_ST, TPMI_ST_COMMAND_TAG;
 
 //
@@ -42,34 +43,93 @@ typedef enum _TPM_ST : uint16_t
 //
 typedef enum _TPM_CC : uint32_t
 {
+    TPM_CC_FIRST = 0x11F,
     TPM_CC_NV_UndefineSpace = 0x122,
+    TPM_CC_Startup = 0x144,
+    TPM_CC_SequenceUpdate = 0x15C,
+    TPM_CC_FlushContext = 0x165,
     TPM_CC_NV_WriteLock = 0x138,
     TPM_CC_NV_DefineSpace = 0x12A,
+    TPM_CC_NV_Increment = 0x134,
+    TPM_CC_NV_SetBits = 0x135,
+    TPM_CC_NV_Extend = 0x136,
     TPM_CC_NV_Write = 0x137,
+    TPM_CC_SequenceComplete = 0x13E,
     TPM_CC_NV_Read = 0x14E,
     TPM_CC_NV_ReadLock = 0x14F,
     TPM_CC_NV_ReadPublic = 0x169,
     TPM_CC_GetCapability = 0x17A,
     TPM_CC_GetRandom = 0x17B,
     TPM_CC_Hash = 0x17D,
-    TPM_CC_ReadClock = 0x181
+    TPM_CC_ReadClock = 0x181,
+    TPM_CC_HashSequenceStart = 0x186
 } TPM_CC;
 
+//
+// TPM2.0 Command Attributes, as returned for TPM_CAP_COMMANDS
+//
+typedef enum _TPMA_CC : uint32_t
+{
+    TPMA_CC_COMMAND_INDEX = 0x0000FFFF,
+    TPMA_CC_NV = 0x00400000,
+    TPMA_CC_EXTENSIVE = 0x00800000,
+    TPMA_CC_FLUSHED = 0x01000000,
+    TPMA_CC_C_HANDLES = 0x0E000000,
+    TPMA_CC_R_HANDLE = 0x10000000,
+    TPMA_CC_V = 0x20000000
+} TPMA_CC;
+
+//
+// TPM2.0 Startup Types
+//
+typedef enum _TPM_SU : uint16_t
+{
+    TPM_SU_CLEAR = 0x0000,
+    TPM_SU_STATE = 0x0001
+} TPM_SU;
+
 //
 // TPM2.0 Response Codes
 //
 typedef enum _TPM_RC : uint32_t
 {
     TPM_RC_SUCCESS = 0,
+    TPM_RC_BAD_TAG = 0x01E,
+    TPM_RC_ATTRIBUTES = 0x082,
+    TPM_RC_HASH = 0x083,
+    TPM_RC_VALUE = 0x084,
+    TPM_RC_HANDLE = 0x08B,
+    TPM_RC_AUTH_FAIL = 0x08E,
+    TPM_RC_SIZE = 0x095,
+    TPM_RC_INTEGRITY = 0x09F,
+    TPM_RC_INITIALIZE = 0x100,
     TPM_RC_FAILURE = 0x101,
+    TPM_RC_AUTH_MISSING = 0x125,
+    TPM_RC_COMMAND_SIZE = 0x142,
+    TPM_RC_COMMAND_CODE = 0x143,
     TPM_RC_NV_RANGE = 0x146,
+    TPM_RC_NV_SIZE = 0x147,
     TPM_RC_NV_LOCKED = 0x148,
     TPM_RC_NV_AUTHORIZATION = 0x149,
     TPM_RC_NV_UNINITIALIZED = 0x14A,
+    TPM_RC_NV_SPACE = 0x14B,
     TPM_RC_NV_DEFINED = 0x14C,
     TPM_RC_HANDLE_1 = 0x18B,
+    TPM_RC_OBJECT_MEMORY = 0x902,
+    TPM_RC_CANCELED = 0x909,
 } TPM_RC;
 
+//
+// Modifiers of format-one response codes, indicating which handle, parameter
+// or session the error refers to.
+//
+#define TPM_RC_H            0x000
+#define TPM_RC_P            0x040
+#define TPM_RC_S            0x800
+#define TPM_RC_1            0x100
+#define TPM_RC_2            0x200
+#define TPM_RC_N_MASK       0xF00
+
 //
 // TPM2.0 Handle Types
 //
@@ -85,6 +145,8 @@ typedef enum _TPM_HT : uint8_t
     TPM_HT_TRANSIENT = 0x80,
     TPM_HT_PERSISTENT = 0x81
 } TPM_HT;
+#define HR_HANDLE_MASK         0x00FFFFFF
+#define HR_RANGE_MASK          0xFF000000
 #define HR_SHIFT               24
 #define HR_NV_INDEX           (TPM_HT_NV_INDEX <<  HR_SHIFT)
 
@@ -95,7 +157,12 @@ typedef enum _TPM_CAP : uint32_t
 {
     TPM_CAP_FIRST = 0,
     TPM_CAP_ALGS = TPM_CAP_FIRST,
-    TPM_CAP_HANDLES
+    TPM_CAP_HANDLES,
+    TPM_CAP_COMMANDS,
+    TPM_CAP_PP_COMMANDS,
+    TPM_CAP_AUDIT_COMMANDS,
+    TPM_CAP_PCRS,
+    TPM_CAP_TPM_PROPERTIES
 } TPM_CAP;
 #define MAX_CAP_BUFFER      1024
 #define MAX_CAP_DATA       (MAX_CAP_BUFFER - sizeof(TPM_CAP) - sizeof(uint32_t))
@@ -106,9 +173,26 @@ typedef enum _TPM_CAP : uint32_t
 //
 typedef enum _TPM_ALG_ID : uint16_t
 {
-    TPM_ALG_SHA256 = 0x000B
+    TPM_ALG_SHA1 = 0x0004,
+    TPM_ALG_SHA256 = 0x000B,
+    TPM_ALG_SHA384 = 0x000C,
+    TPM_ALG_SHA512 = 0x000D
 } TPM_ALG_ID, TPMI_ALG_HASH;
 
+//
+// TPM2.0 Algorithm Attributes, as returned for TPM_CAP_ALGS
+//
+typedef enum _TPMA_ALGORITHM : uint32_t
+{
+    TPMA_ALGORITHM_ASYMMETRIC = 0x00000001,
+    TPMA_ALGORITHM_SYMMETRIC = 0x00000002,
+    TPMA_ALGORITHM_HASH = 0x00000004,
+    TPMA_ALGORITHM_OBJECT = 0x00000008,
+    TPMA_ALGORITHM_SIGNING = 0x00000100,
+    TPMA_ALGORITHM_ENCRYPTING = 0x00000200,
+    TPMA_ALGORITHM_METHOD = 0x00000400
+} TPMA_ALGORITHM;
+
 //
 // TPM Attributes for Non Volatile Index Values
 //
@@ -125,6 +209,7 @@ typedef enum _TPMA_NV : uint32_t
     //
     // Types
     //
+    TPMA_NV_TYPE = 0x000000F0,
     TPMA_NV_COUNTER = 0x00000010,
     TPMA_NV_BITS = 0x00000020,
     TPMA_NV_EXTEND = 0x00000040,
@@ -173,7 +258,21 @@ typedef enum _TPMA_NV : uint32_t
 typedef enum _TPM_PT : uint32_t
 {
     TPM_PT_NONE = 0x0,
-    PT_FIXED = 0x100
+    PT_GROUP = 0x100,
+    PT_FIXED = PT_GROUP * 1,
+    TPM_PT_FAMILY_INDICATOR = PT_FIXED + 0,
+    TPM_PT_REVISION = PT_FIXED + 2,
+    TPM_PT_MANUFACTURER = PT_FIXED + 5,
+    TPM_PT_INPUT_BUFFER = PT_FIXED + 13,
+    TPM_PT_NV_COUNTERS_MAX = PT_FIXED + 22,
+    TPM_PT_NV_INDEX_MAX = PT_FIXED + 23,
+    TPM_PT_MAX_COMMAND_SIZE = PT_FIXED + 30,
+    TPM_PT_MAX_RESPONSE_SIZE = PT_FIXED + 31,
+    TPM_PT_MAX_DIGEST = PT_FIXED + 32,
+    TPM_PT_NV_BUFFER_MAX = PT_FIXED + 44,
+    TPM_PT_MODES = PT_FIXED + 45,
+    TPM_PT_MAX_CAP_BUFFER = PT_FIXED + 46,
+    PT_VAR = PT_GROUP * 2
 } TPM_PT;
 
 //
@@ -266,6 +365,37 @@ typedef struct
     TPM_HANDLE Handle[MAX_CAP_HANDLES];
 } TPML_HANDLE, *PTPML_HANDLE;
 
+//
+// TPM2.0 Algorithm List
+//
+typedef struct
+{
+    TPM_ALG_ID Alg;
+    TPMA_ALGORITHM AlgProperties;
+} TPMS_ALG_PROPERTY, *PTPMS_ALG_PROPERTY;
+#define MAX_CAP_ALGS       (MAX_CAP_DATA / sizeof(TPMS_ALG_PROPERTY))
+
+//
+// TPM2.0 Command Attribute List
+//
+#define MAX_CAP_CC         (MAX_CAP_DATA / sizeof(TPMA_CC))
+
+//
+// TPM2.0 Property List
+//
+typedef struct
+{
+    TPM_PT Property;
+    uint32_t Value;
+} TPMS_TAGGED_PROPERTY, *PTPMS_TAGGED_PROPERTY;
+#define MAX_TPM_PROPERTIES (MAX_CAP_DATA / sizeof(TPMS_TAGGED_PROPERTY))
+
+typedef struct
+{
+    uint32_t Count;
+    TPMS_TAGGED_PROPERTY TpmProperty[MAX_TPM_PROPERTIES];
+} TPML_TAGGED_TPM_PROPERTY, *PTPML_TAGGED_TPM_PROPERTY;
+
 //
 // TPM2.0 Ticket for Hash Check
 //
@@ -282,6 +412,7 @@ typedef struct
 typedef union
 {
     TPML_HANDLE Handles;
+    TPML_TAGGED_TPM_PROPERTY TpmProperties;
 } TPMU_CAPABILITIES, *PTPMU_CAPABILITIES;
 
 //
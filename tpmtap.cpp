@@ -0,0 +1,474 @@
+/*++
+
+Copyright (c) Alex Ionescu.  All rights reserved.
+
+Module Name:
+
+    tpmtap.cpp
+
+Abstract:
+
+    This module implements capture files, which record every command sent
+    through a transport along with its response and round-trip time, and the
+    replay transport, which serves the recorded responses back. This allows a
+    workload to be captured once on real hardware and then replayed without
+    any of the timing noise of the chip.
+
+Author:
+
+    Alex Ionescu (@aionescu) 16-Oct-2026 - Initial version
+
+Environment:
+
+    Portable to any environment.
+
+--*/
+
+#ifdef _MSC_VER
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+#include "tpmtool.hpp"
+#include "tpmcmd.hpp"
+
+//
+// Capture files start with this header, followed by the records. All fields
+// are little-endian, while the command and response bytes are left exactly
+// as they were on the wire.
+//
+#define TPM_TAP_MAGIC               0x50415454
+#define TPM_TAP_VERSION             1
+#define TPM_TAP_BUFFER_SIZE         (64 * 1024)
+
+#pragma pack(push, 1)
+typedef struct _TPM_TAP_FILE_HEADER
+{
+    uint32_t Magic;
+    uint32_t Version;
+} TPM_TAP_FILE_HEADER, *PTPM_TAP_FILE_HEADER;
+
+//
+// Each record is followed by CommandSize bytes of command and ResponseSize
+// bytes of response. Commands that the transport failed to deliver have no
+// response, and the OS result that was returned instead.
+//
+typedef struct _TPM_TAP_RECORD
+{
+    uint64_t Timestamp;
+    uint32_t CommandCode;
+    uint32_t RoundTrip;
+    uint32_t OsResult;
+    uint32_t CommandSize;
+    uint32_t ResponseSize;
+} TPM_TAP_RECORD, *PTPM_TAP_RECORD;
+#pragma pack(pop)
+
+//
+// Replay Transport Context
+//
+typedef struct _TPM_REPLAY_CONTEXT
+{
+    uint8_t* Base;
+    size_t Size;
+    uintptr_t MapHandle;
+    PTPM_TAP_RECORD* Records;
+    uint32_t RecordCount;
+    uint32_t NextRecord;
+    bool Timed;
+} TPM_REPLAY_CONTEXT, *PTPM_REPLAY_CONTEXT;
+
+bool
+TpmTapOpen (
+    const char* Path,
+    uintptr_t* Recorder
+    )
+{
+    TPM_TAP_FILE_HEADER header;
+    FILE* file;
+
+    //
+    // Initialize for failure
+    //
+    *Recorder = 0;
+
+    //
+    // Create the capture file, with a large buffer so that recording does not
+    // add a system call to every command.
+    //
+    file = fopen(Path, "wb");
+    if (file == nullptr)
+    {
+        return false;
+    }
+    setvbuf(file, nullptr, _IOFBF, TPM_TAP_BUFFER_SIZE);
+
+    //
+    // Write the header
+    //
+    header.Magic = TPM_TAP_MAGIC;
+    header.Version = TPM_TAP_VERSION;
+    if (fwrite(&header, sizeof(header), 1, file) != 1)
+    {
+        fclose(file);
+        return false;
+    }
+
+    //
+    // Return the file as the recorder
+    //
+    *Recorder = reinterpret_cast<uintptr_t>(file);
+    return true;
+}
+
+void
+TpmTapRecord (
+    uintptr_t Recorder,
+    uint64_t Timestamp,
+    uint32_t RoundTrip,
+    const TPM_COMMAND_SEGMENT* Segments,
+    uint32_t SegmentCount,
+    const uint8_t* Out,
+    uint32_t OutLength,
+    bool Result,
+    uint32_t OsResult
+    )
+{
+    TPM_TAP_RECORD record;
+    TPM_REPLY_HEADER header;
+    uint32_t commandCode;
+    FILE* file;
+    uint32_t i;
+
+    file = reinterpret_cast<FILE*>(Recorder);
+
+    //
+    // Pull out the command code, so that captures can be summarized without
+    // having to parse each command. The header is always in the first segment.
+    //
+    commandCode = 0;
+    if ((SegmentCount != 0) && (Segments[0].Length >= sizeof(TPM_CMD_HEADER)))
+    {
+        memcpy(&commandCode,
+               &Segments[0].Buffer[offsetof(TPM_CMD_HEADER, CommandCode)],
+               sizeof(commandCode));
+        commandCode = OsSwap32(commandCode);
+    }
+
+    //
+    // Transports don't return how much was read, so use the size that the
+    // response claims, as far as it fit in the caller's buffer.
+    //
+    record.ResponseSize = 0;
+    if ((Result) && (OutLength >= sizeof(header)))
+    {
+        memcpy(&header, Out, sizeof(header));
+        record.ResponseSize = OsSwap32(header.Size);
+        if (record.ResponseSize > OutLength)
+        {
+            record.ResponseSize = OutLength;
+        }
+        else if (record.ResponseSize < sizeof(header))
+        {
+            record.ResponseSize = sizeof(header);
+        }
+    }
+
+    //
+    // Write the record, followed by the raw bytes of each segment, so that the
+    // command is saved exactly as it was on the wire.
+    //
+    record.Timestamp = Timestamp;
+    record.CommandCode = commandCode;
+    record.RoundTrip = RoundTrip;
+    record.OsResult = Result ? 0 : OsResult;
+    record.CommandSize = 0;
+    for (i = 0; i < SegmentCount; i++)
+    {
+        record.CommandSize += Segments[i].Length;
+    }
+    fwrite(&record, sizeof(record), 1, file);
+    for (i = 0; i < SegmentCount; i++)
+    {
+        fwrite(Segments[i].Buffer, 1, Segments[i].Length, file);
+    }
+    fwrite(Out, 1, record.ResponseSize, file);
+}
+
+bool
+TpmTapClose (
+    uintptr_t Recorder
+    )
+{
+    //
+    // Flush any buffered records and close the file
+    //
+    return (fclose(reinterpret_cast<FILE*>(Recorder)) == 0);
+}
+
+bool
+TpmpReplayMatch (
+    PTPM_TAP_RECORD Record,
+    const TPM_COMMAND_SEGMENT* Segments,
+    uint32_t SegmentCount
+    )
+{
+    const uint8_t* command;
+    uint32_t remaining;
+    uint32_t i;
+
+    //
+    // Compare the recorded command against each segment in turn
+    //
+    command = reinterpret_cast<const uint8_t*>(Record + 1);
+    remaining = Record->CommandSize;
+    for (i = 0; i < SegmentCount; i++)
+    {
+        if ((Segments[i].Length > remaining) ||
+            (memcmp(command, Segments[i].Buffer, Segments[i].Length) != 0))
+        {
+            return false;
+        }
+        command += Segments[i].Length;
+        remaining -= Segments[i].Length;
+    }
+    return (remaining == 0);
+}
+
+bool
+TpmpReplayIssueCommandV (
+    uintptr_t TpmHandle,
+    const TPM_COMMAND_SEGMENT* Segments,
+    uint32_t SegmentCount,
+    uint8_t* Out,
+    uint32_t OutLength,
+    uint32_t* OsResult
+    )
+{
+    PTPM_REPLAY_CONTEXT context;
+    PTPM_TAP_RECORD record;
+    uint32_t responseSize;
+    uint32_t i;
+    uint32_t j;
+
+    context = reinterpret_cast<PTPM_REPLAY_CONTEXT>(TpmHandle);
+
+    //
+    // Find the next record with the exact same command bytes. Commands are
+    // normally replayed in the order they were captured, but wrapping around
+    // allows a capture to be replayed in a loop, or out of order.
+    //
+    record = nullptr;
+    for (i = 0; i < context->RecordCount; i++)
+    {
+        j = (context->NextRecord + i) % context->RecordCount;
+        if (TpmpReplayMatch(context->Records[j], Segments, SegmentCount))
+        {
+            record = context->Records[j];
+            context->NextRecord = j + 1;
+            break;
+        }
+    }
+    if (record == nullptr)
+    {
+        if (OsResult != nullptr)
+        {
+            *OsResult = ENOENT;
+        }
+        return false;
+    }
+
+    //
+    // Take as long as the original command did, if asked to
+    //
+    if (context->Timed)
+    {
+        std::this_thread::sleep_for(std::chrono::microseconds(record->RoundTrip));
+    }
+
+    //
+    // Commands that failed to be delivered fail again the same way
+    //
+    if (record->ResponseSize == 0)
+    {
+        if (OsResult != nullptr)
+        {
+            *OsResult = record->OsResult;
+        }
+        return false;
+    }
+
+    //
+    // Return the recorded response, truncated to the caller's buffer
+    //
+    responseSize = (record->ResponseSize < OutLength) ? record->ResponseSize : OutLength;
+    memcpy(Out, reinterpret_cast<uint8_t*>(record + 1) + record->CommandSize, responseSize);
+    if (OsResult != nullptr)
+    {
+        *OsResult = 0;
+    }
+    return true;
+}
+
+bool
+TpmpReplayIssueCommand (
+    uintptr_t TpmHandle,
+    uint8_t* In,
+    uint32_t InLength,
+    uint8_t* Out,
+    uint32_t OutLength,
+    uint32_t* OsResult
+    )
+{
+    TPM_COMMAND_SEGMENT segment;
+
+    //
+    // Match the command as a single segment
+    //
+    segment.Buffer = In;
+    segment.Length = InLength;
+    return TpmpReplayIssueCommandV(TpmHandle, &segment, 1, Out, OutLength, OsResult);
+}
+
+bool
+TpmpReplayOpen (
+    const char* Parameters,
+    uintptr_t* TpmHandle
+    )
+{
+    PTPM_REPLAY_CONTEXT context;
+    PTPM_TAP_FILE_HEADER header;
+    PTPM_TAP_RECORD record;
+    char path[256];
+    const char* separator;
+    size_t pathLength;
+    size_t offset;
+    void* base;
+
+    //
+    // Initialize for failure
+    //
+    *TpmHandle = 0;
+
+    //
+    // The parameters are the path of the capture file, optionally followed by
+    // ",timed" in order to reproduce the original round-trip times.
+    //
+    if ((Parameters == nullptr) || (Parameters[0] == '\0'))
+    {
+        return false;
+    }
+    context = static_cast<PTPM_REPLAY_CONTEXT>(calloc(1, sizeof(*context)));
+    if (context == nullptr)
+    {
+        return false;
+    }
+    separator = strrchr(Parameters, ',');
+    if ((separator != nullptr) && (strcmp(separator + 1, "timed") == 0))
+    {
+        pathLength = static_cast<size_t>(separator - Parameters);
+        context->Timed = true;
+    }
+    else
+    {
+        pathLength = strlen(Parameters);
+    }
+    if (pathLength >= sizeof(path))
+    {
+        goto Failure;
+    }
+    memcpy(path, Parameters, pathLength);
+    path[pathLength] = '\0';
+
+    //
+    // Map the capture and validate its header
+    //
+    if (OsMapFile(path, false, &context->Size, &base, &context->MapHandle) == false)
+    {
+        goto Failure;
+    }
+    context->Base = static_cast<uint8_t*>(base);
+    header = reinterpret_cast<PTPM_TAP_FILE_HEADER>(context->Base);
+    if ((context->Size < sizeof(*header)) ||
+        (header->Magic != TPM_TAP_MAGIC) ||
+        (header->Version != TPM_TAP_VERSION))
+    {
+        goto Failure;
+    }
+
+    //
+    // Index the records, ignoring a truncated one at the end (which happens
+    // if the recording process was killed).
+    //
+    context->Records = static_cast<PTPM_TAP_RECORD*>(
+        malloc((context->Size / sizeof(*record)) * sizeof(*context->Records)));
+    if (context->Records == nullptr)
+    {
+        goto Failure;
+    }
+    offset = sizeof(*header);
+    while ((context->Size - offset) >= sizeof(*record))
+    {
+        record = reinterpret_cast<PTPM_TAP_RECORD>(&context->Base[offset]);
+        if ((static_cast<uint64_t>(record->CommandSize) + record->ResponseSize) >
+            (context->Size - offset - sizeof(*record)))
+        {
+            break;
+        }
+        context->Records[context->RecordCount++] = record;
+        offset += sizeof(*record) + record->CommandSize + record->ResponseSize;
+    }
+
+    //
+    // Return a handle that can be used for further commands
+    //
+    *TpmHandle = reinterpret_cast<uintptr_t>(context);
+    return true;
+
+Failure:
+    if (context->Base != nullptr)
+    {
+        OsUnmapFile(context->Base, context->Size, context->MapHandle);
+    }
+    free(context->Records);
+    free(context);
+    return false;
+}
+
+bool
+TpmpReplayClose (
+    uintptr_t TpmHandle
+    )
+{
+    PTPM_REPLAY_CONTEXT context;
+    bool result;
+
+    //
+    // Unmap the capture and free the context
+    //
+    context = reinterpret_cast<PTPM_REPLAY_CONTEXT>(TpmHandle);
+    result = OsUnmapFile(context->Base, context->Size, context->MapHandle);
+    free(context->Records);
+    free(context);
+    return result;
+}
+
+//
+// Transport serving responses from a capture file
+//
+const TPM_TRANSPORT TpmReplayTransport =
+{
+    "replay",
+    TpmpReplayOpen,
+    TpmpReplayIssueCommand,
+    TpmpReplayIssueCommandV,
+    nullptr,
+    nullptr,
+    TpmpReplayClose,
+    1
+};
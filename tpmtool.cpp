@@ -31,62 +31,360 @@ Environment:
 //
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <ctype.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#ifdef _WIN32
 #include <io.h>
+#include <fcntl.h>
+#else
+#include <unistd.h>
+#define _isatty isatty
+#define _fileno fileno
+#endif
 
 //
 // Shared Library Header
 //
 #include "tpmtool.hpp"
 
+//
+// Extend spaces hold a SHA-256 digest. Audit logs extend their events into one
+// in batches, each closed after this many events or milliseconds.
+//
+#define TPM_TOOL_EXTEND_SIZE            32
+#define TPM_TOOL_AUDIT_WINDOW_EVENTS    4096
+#define TPM_TOOL_AUDIT_WINDOW_MS        1000
+
+//
+// Hex dumps are rendered into a buffer, a line of 16 bytes at a time, and
+// written to STDERR with a single call when the buffer fills up or the dump
+// is over.
+//
+#define TPM_TOOL_DUMP_LINE_SIZE         71
+#define TPM_TOOL_DUMP_ASCII_COLUMN      53
+#define TPM_TOOL_DUMP_LINES             256
+
+//
+// Global options that change how the commands read and write data. Input from
+// a file is mapped whole, and used in place instead of being read from STDIN.
+// Machine-readable output is written as a single document to STDOUT, into
+// which each command writes its fields as it goes.
+//
+typedef struct _TPM_TOOL_OPTIONS
+{
+    bool Differential;
+    bool Compressed;
+    bool Quiet;
+    const char* InputPath;
+    const uint8_t* Input;
+    size_t InputSize;
+    const char* OutputPath;
+    TPM_FORMAT_TYPE Format;
+    uintptr_t Writer;
+} TPM_TOOL_OPTIONS, *PTPM_TOOL_OPTIONS;
+
+//
+// State of a read or write that is streamed to or from STDIO, one chunk at a
+// time. The hex dump is done a whole line at a time, so the tail of each chunk
+// is kept until the next one completes it. Writes read each chunk from STDIN
+// in alternating buffers, as one is being written while the next one is read,
+// or use it in place from the mapped input file. Reads go to STDOUT, or are
+// copied into the mapped output file.
+//
+typedef struct _TPM_TOOL_STREAM_CONTEXT
+{
+    bool WriteOutput;
+    uint32_t LineSize;
+    uint8_t Line[16];
+    uint8_t* Buffers[2];
+    uint32_t Current;
+    size_t SizeRead;
+    const TPM_TOOL_OPTIONS* Options;
+    uint8_t* Output;
+} TPM_TOOL_STREAM_CONTEXT, *PTPM_TOOL_STREAM_CONTEXT;
+
+//
+// Size, rights and attributes of an NV index, formatted for output, and the
+// names of each attribute in the order they are printed.
+//
+typedef struct _TPM_TOOL_SPACE_INFO
+{
+    uint16_t DataSize;
+    const char* Written;
+    const char* OwnerRights;
+    const char* AuthRights;
+    char Attributes[(16 * 3) + 1];
+} TPM_TOOL_SPACE_INFO, *PTPM_TOOL_SPACE_INFO;
+
+typedef struct _TPM_TOOL_ATTRIBUTE_NAME
+{
+    uint16_t Attribute;
+    char Name[3];
+} TPM_TOOL_ATTRIBUTE_NAME, *PTPM_TOOL_ATTRIBUTE_NAME;
+
+const TPM_TOOL_ATTRIBUTE_NAME TpmToolAttributeNames[] =
+{
+    { TpmToolReadLockable, "RL" },
+    { TpmToolWriteLockable, "WL" },
+    { TpmToolWriteOnce, "WO" },
+    { TpmToolWriteAll, "WA" },
+    { TpmToolNonProtected, "NP" },
+    { TpmToolCached, "CH" },
+    { TpmToolVolatileDirtyFlag, "VL" },
+    { TpmToolPermanent, "PT" },
+    { TpmToolReadLocked, "LR" },
+    { TpmToolWriteLocked, "LW" },
+    { TpmToolPlatformOwned, "PO" },
+    { TpmToolCounter, "CT" },
+    { TpmToolBits, "BT" },
+    { TpmToolExtend, "EX" },
+};
+
+//
+// Handle ranges that can be enumerated, along with how they are labelled in
+// the output. Querying is only supported for NV indices.
+//
+typedef struct _TPM_TOOL_HANDLE_RANGE
+{
+    const char* Name;
+    TPM_HT Type;
+    const char* Label;
+} TPM_TOOL_HANDLE_RANGE, *PTPM_TOOL_HANDLE_RANGE;
+
+const TPM_TOOL_HANDLE_RANGE TpmToolHandleRanges[] =
+{
+    { "pcr", TPM_HR_PCR, "PCR" },
+    { "nv", TPM_HT_NV_INDEX, "NV index" },
+    { "session", TPM_HT_LOADED_SESSION, "Loaded session" },
+    { "saved", TPM_HT_SAVED_SESSION, "Saved session" },
+    { "permanent", TPM_HT_PERMANENT, "Permanent handle" },
+    { "transient", TPM_HT_TRANSIENT, "Transient object" },
+    { "persistent", TPM_HT_PERSISTENT, "Persistent object" },
+};
+
+typedef struct _TPM_TOOL_ENUMERATE_CONTEXT
+{
+    const TPM_TOOL_HANDLE_RANGE* Range;
+    const TPM_TOOL_OPTIONS* Options;
+} TPM_TOOL_ENUMERATE_CONTEXT, *PTPM_TOOL_ENUMERATE_CONTEXT;
+
+//
+// State of a query of all NV indices. The results come in as the TPM answers,
+// and are printed in order by the output thread, which is told when the batch
+// is over in case some of them never come.
+//
+typedef struct _TPM_TOOL_QUERY_RESULT
+{
+    bool Completed;
+    TPM_RC Result;
+    uint16_t Attributes;
+    uint8_t OwnerRights;
+    uint8_t AuthRights;
+    uint16_t DataSize;
+} TPM_TOOL_QUERY_RESULT, *PTPM_TOOL_QUERY_RESULT;
+
+typedef struct _TPM_TOOL_QUERY_CONTEXT
+{
+    TPM_NV_INDEX* Indices;
+    uint32_t Count;
+    PTPM_TOOL_QUERY_RESULT Results;
+    const TPM_TOOL_OPTIONS* Options;
+    bool Finished;
+    std::mutex Lock;
+    std::condition_variable Changed;
+} TPM_TOOL_QUERY_CONTEXT, *PTPM_TOOL_QUERY_CONTEXT;
+
+//
+// Digit of each nibble in a hex dump
+//
+const char TpmToolHexDigits[] = "0123456789ABCDEF";
+
 void
-DumpHex (
-    uint8_t* Buffer,
+DumpHexLines (
+    const uint8_t* Buffer,
     int32_t Size
     )
 {
-    char ascii[17];
-    int32_t i, j;
+    char output[TPM_TOOL_DUMP_LINES * TPM_TOOL_DUMP_LINE_SIZE];
+    size_t outputSize;
+    char* line;
+    int32_t lineSize;
+    int32_t column;
+    int32_t i;
 
     //
-    // Taken and adapted from https://gist.github.com/ccbrown/9722406
+    // Each line has the hex digits of up to 16 bytes, split in two halves and
+    // padded to the same width, followed by their printable characters.
     //
-    ascii[16] = '\0';
-    for (i = 0; i < Size; ++i)
+    outputSize = 0;
+    for (; Size > 0; Buffer += lineSize, Size -= lineSize)
     {
-        fprintf(stderr, "%02X ", Buffer[i]);
-        if ((Buffer[i] >= ' ') && (Buffer[i] <= '~'))
+        lineSize = (Size < 16) ? Size : 16;
+        line = &output[outputSize];
+        memset(line, ' ', TPM_TOOL_DUMP_ASCII_COLUMN);
+        line[TPM_TOOL_DUMP_ASCII_COLUMN - 3] = '|';
+        for (i = 0; i < lineSize; i++)
         {
-            ascii[i % 16] = Buffer[i];
+            column = (i * 3) + ((i >= 8) ? 1 : 0);
+            line[column] = TpmToolHexDigits[Buffer[i] >> 4];
+            line[column + 1] = TpmToolHexDigits[Buffer[i] & 0xF];
+            line[TPM_TOOL_DUMP_ASCII_COLUMN + i] =
+                ((Buffer[i] >= ' ') && (Buffer[i] <= '~')) ? static_cast<char>(Buffer[i]) : '.';
         }
-        else
+        line[TPM_TOOL_DUMP_ASCII_COLUMN + lineSize] = ' ';
+        line[TPM_TOOL_DUMP_ASCII_COLUMN + lineSize + 1] = '\n';
+        outputSize += TPM_TOOL_DUMP_ASCII_COLUMN + lineSize + 2;
+
+        //
+        // Write out the lines once there's no room left for another one
+        //
+        if ((sizeof(output) - outputSize) < TPM_TOOL_DUMP_LINE_SIZE)
         {
-            ascii[i % 16] = '.';
+            OsWriteFile(_fileno(stderr), reinterpret_cast<uint8_t*>(output), outputSize);
+            outputSize = 0;
         }
-        if ((((i + 1) % 8) == 0) || ((i + 1) == Size))
-        {
-            fprintf(stderr, " ");
-            if ((i + 1) % 16 == 0)
-            {
-                fprintf(stderr, "|  %s \n", ascii);
+    }
+    if (outputSize != 0)
+    {
+        OsWriteFile(_fileno(stderr), reinterpret_cast<uint8_t*>(output), outputSize);
+    }
+}
 
-            }
-            else if ((i + 1) == Size)
-            {
-                ascii[((i + 1) % 16)] = '\0';
-                if (((i + 1) % 16) <= 8)
-                {
-                    fprintf(stderr, " ");
-                }
+void
+DumpHex (
+    const TPM_TOOL_OPTIONS* Options,
+    const uint8_t* Buffer,
+    int32_t Size
+    )
+{
+    //
+    // Scripts can skip the dumps entirely
+    //
+    if (Options->Quiet)
+    {
+        return;
+    }
+    DumpHexLines(Buffer, Size);
+    fprintf(stderr, "\n");
+}
 
-                for (j = ((i + 1) % 16); j < 16; ++j)
-                {
-                    fprintf(stderr, "   ");
-                }
-                fprintf(stderr, "|  %s \n", ascii);
-            }
+void
+DumpHexStream (
+    PTPM_TOOL_STREAM_CONTEXT Context,
+    const uint8_t* Data,
+    uint16_t DataSize
+    )
+{
+    uint32_t lineSize;
+
+    //
+    // Scripts can skip the dumps entirely
+    //
+    if (Context->Options->Quiet)
+    {
+        return;
+    }
+
+    //
+    // Complete the line that was left over from the previous chunk
+    //
+    if (Context->LineSize != 0)
+    {
+        lineSize = sizeof(Context->Line) - Context->LineSize;
+        lineSize = (DataSize < lineSize) ? DataSize : lineSize;
+        memcpy(&Context->Line[Context->LineSize], Data, lineSize);
+        Context->LineSize += lineSize;
+        Data += lineSize;
+        DataSize -= static_cast<uint16_t>(lineSize);
+        if (Context->LineSize < sizeof(Context->Line))
+        {
+            return;
         }
+        DumpHexLines(Context->Line, sizeof(Context->Line));
+        Context->LineSize = 0;
     }
-    fprintf(stderr, "\n");
+
+    //
+    // Dump all the whole lines, and keep the rest for later
+    //
+    lineSize = DataSize % sizeof(Context->Line);
+    DumpHexLines(Data, DataSize - lineSize);
+    memcpy(Context->Line, &Data[DataSize - lineSize], lineSize);
+    Context->LineSize = lineSize;
+}
+
+size_t
+ReadInput (
+    const TPM_TOOL_OPTIONS* Options,
+    size_t Offset,
+    uint8_t* Buffer,
+    size_t Size,
+    const uint8_t** Data
+    )
+{
+    size_t available;
+
+    //
+    // STDIN is read sequentially into the buffer, ignoring the offset
+    //
+    *Data = Buffer;
+    if (Options->InputPath == nullptr)
+    {
+        return fread(Buffer, 1, Size, stdin);
+    }
+
+    //
+    // The mapped input file is used in place, unless it ends early, in which
+    // case what is left is copied into the buffer for the caller to pad.
+    //
+    available = (Offset < Options->InputSize) ? (Options->InputSize - Offset) : 0;
+    if (available >= Size)
+    {
+        *Data = &Options->Input[Offset];
+        return Size;
+    }
+    if (available != 0)
+    {
+        memcpy(Buffer, &Options->Input[Offset], available);
+    }
+    return available;
+}
+
+bool
+WriteOutput (
+    const TPM_TOOL_OPTIONS* Options,
+    const uint8_t* Data,
+    size_t DataSize
+    )
+{
+    uintptr_t mapHandle;
+    void* output;
+
+    //
+    // Without an output file, raw data only goes to STDOUT when redirected
+    //
+    if (Options->OutputPath == nullptr)
+    {
+        fflush(stdout);
+        return (_isatty(_fileno(stdout)) != false) ||
+               (OsWriteFile(_fileno(stdout), Data, DataSize) != false);
+    }
+
+    //
+    // Otherwise, size the file to the data and copy it in
+    //
+    if (OsMapFile(Options->OutputPath, true, &DataSize, &output, &mapHandle) == false)
+    {
+        return false;
+    }
+    if (DataSize != 0)
+    {
+        memcpy(output, Data, DataSize);
+    }
+    return OsUnmapFile(output, DataSize, mapHandle);
 }
 
 void
@@ -100,12 +398,53 @@ PrintUsage (
     fprintf(stderr, "TpmTool allows you to define non-volatile (NV) spaces (indices) and\n");
     fprintf(stderr, "read/write data within them. Password authentication can optionally\n");
     fprintf(stderr, "be used to protect their contents.\n\n");
-    fprintf(stderr, "Usage: tpmtool [-h <size>|-r <size>|-t|-e|index] [-c <attributes> <owner> <auth> <size>|-r <offset> <size>|-w <offset> <size>|-rl|-wl|-d|-q|-qa] [password]\n");
+    fprintf(stderr, "Usage: tpmtool [--transport <transport>] [--record <file>] [--snapshot|--restore <file>] [--apply <file> [--dry-run]] [--diff|--compress] [--json|--tlv] [--quiet] [-i <file>] [-o <file>] [-h <size>|-r <size>|-t|-e [<range>]|index] [-c <attributes> <owner> <auth> <size>|-r <offset> <size>|-w <offset> <size>|-inc|-sb <bits>|-log <file>|-vl <file>|-kv <operation>|-ring <count> <operation>|-rl|-wl|-d|-q|-qa] [password]\n");
+    fprintf(stderr, "    --transport  Send commands through the given transport instead of\n");
+    fprintf(stderr, "          the OS TPM stack. TPMTOOL_TRANSPORT can also be used to set it.\n");
+    fprintf(stderr, "              device[:<path>]        OS TPM stack, or the given device.\n");
+    fprintf(stderr, "              mssim[:<host>[:<port>]] TPM reference simulator (2321).\n");
+    fprintf(stderr, "              swtpm[:<host>[:<port>]] swtpm command socket (2321).\n");
+    fprintf(stderr, "              emulator[:<options>]   In-process software TPM, options are\n");
+    fprintf(stderr, "                  file=<path>, reset, nvbuffer=<n>, latency[@<cc>]=<us>\n");
+    fprintf(stderr, "                  and error@<cc>=<rc>, separated by commas.\n");
+    fprintf(stderr, "              replay:<file>[,timed]  Responses from a capture file.\n");
+    fprintf(stderr, "    --record     Capture all commands and responses into the given file,\n");
+    fprintf(stderr, "          which can be replayed later. TPMTOOL_RECORD can also be used.\n");
+    fprintf(stderr, "    --diff       Read the index first, and only write the bytes that changed.\n");
+    fprintf(stderr, "    --compress   Compress the data written with -w, and expand the data\n");
+    fprintf(stderr, "          read with -r, whose size is then the most stored data that will\n");
+    fprintf(stderr, "          be read after its header, up to the end of the index.\n");
+    fprintf(stderr, "    --snapshot   Save all the NV spaces of the owner into the given file,\n");
+    fprintf(stderr, "          along with the contents of those the owner can read.\n");
+    fprintf(stderr, "    --restore    Define and write back the NV spaces saved in the given\n");
+    fprintf(stderr, "          file, skipping the ones that already match. Passwords are\n");
+    fprintf(stderr, "          not saved, so restored spaces have none.\n");
+    fprintf(stderr, "    --apply      Bring the NV spaces listed in the given manifest to the\n");
+    fprintf(stderr, "          state it describes, only deleting, creating and writing the\n");
+    fprintf(stderr, "          spaces that differ from it. Each line of the manifest is:\n");
+    fprintf(stderr, "              <index> <owner> <auth> <attributes> <size> [<contents>] [password]\n");
+    fprintf(stderr, "          with the same values as -c, or <index> delete. Contents are\n");
+    fprintf(stderr, "          hex:<bytes>, file:<path>, or - for none. # starts a comment.\n");
+    fprintf(stderr, "    --dry-run    Print the changes --apply would make to STDOUT instead.\n");
+    fprintf(stderr, "    --json       Write the results of -q, -qa, -e, -t and -r to STDOUT as\n");
+    fprintf(stderr, "          a single JSON document instead of text.\n");
+    fprintf(stderr, "    --tlv        Same as --json, but with a compact binary encoding.\n");
+    fprintf(stderr, "    --quiet      Don't dump the data that is read or written to STDERR,\n");
+    fprintf(stderr, "          which is still written to the output. --no-dump is the same.\n");
+    fprintf(stderr, "    -i    Read the data for -w and -h from the given file instead of\n");
+    fprintf(stderr, "          STDIN. The file is mapped and its data is sent as-is.\n");
+    fprintf(stderr, "    -o    Write the data that is read, the random bytes or the hash into\n");
+    fprintf(stderr, "          the given file instead of STDOUT. The file is created or\n");
+    fprintf(stderr, "          resized to the data.\n");
     fprintf(stderr, "    -r    Retrieves random bytes based on the size given.\n");
     fprintf(stderr, "    -t    Reads the TPM Time Information.\n");
     fprintf(stderr, "    -h    Computes the SHA-256 hash of the data in STDIN.\n");
     fprintf(stderr, "          You can use pipes or redirection to write from a file.\n");
-    fprintf(stderr, "    -e    Enumerates all NV spaces active on the TPM.\n");
+    fprintf(stderr, "          Data that does not fit in a single command is hashed in a\n");
+    fprintf(stderr, "          sequence, and with -i, the size can go over 64KB.\n");
+    fprintf(stderr, "    -e    Enumerates all NV spaces active on the TPM, or all the handles\n");
+    fprintf(stderr, "          in the given range: nv, pcr, session, saved, permanent,\n");
+    fprintf(stderr, "          transient, persistent, or all of them.\n");
     fprintf(stderr, "    -c    Create a new NV space with the given index value.\n");
     fprintf(stderr, "          Attributes can be a combination (use + for multiple) of:\n");
     fprintf(stderr, "              RL    Allow the resulting NV index to be read-locked.\n");
@@ -116,6 +455,12 @@ PrintUsage (
     fprintf(stderr, "              CH    Cache the resulting NV index in RAM (orderly).\n");
     fprintf(stderr, "              VL    Makes the dirty flag volatile (cleared at startup).\n");
     fprintf(stderr, "              PT    Marks the NV space as non-deletable without a policy.\n");
+    fprintf(stderr, "          The NV space can also be given one of these types, which must\n");
+    fprintf(stderr, "          have a size of 8, instead of holding ordinary data:\n");
+    fprintf(stderr, "              CT    A 64-bit counter which can only be incremented.\n");
+    fprintf(stderr, "              BT    A 64-bit bit field in which bits can only be set.\n");
+    fprintf(stderr, "          Or this type, which must have a size of 32:\n");
+    fprintf(stderr, "              EX    A SHA-256 digest which data can only be extended into.\n");
     fprintf(stderr, "          Owner and Auth rights can be one of R, RW, or NA.\n");
     fprintf(stderr, "          Size is limited by TPM should usually be 2048 or less.\n");
     fprintf(stderr, "    -r    Read the data stored at the given index value.\n");
@@ -131,6 +476,29 @@ PrintUsage (
     fprintf(stderr, "              LW    The index is locked against writes until reset.\n");
     fprintf(stderr, "                    NOTE: If the WO attribute is set, locked forever.\n");
     fprintf(stderr, "              PO    The index was created and is owned by the platform.\n");
+    fprintf(stderr, "    -inc  Increment the counter at the given index value.\n");
+    fprintf(stderr, "    -sb   Set the given bits in the bit field at the given index value.\n");
+    fprintf(stderr, "    -log  Append each line of STDIN as an event to the given audit log,\n");
+    fprintf(stderr, "          extending them in batches into the extend space at the given\n");
+    fprintf(stderr, "          index value, in batches of up to 4096 events or one second.\n");
+    fprintf(stderr, "    -vl   Verify the given audit log against the extend space at the\n");
+    fprintf(stderr, "          given index value.\n");
+    fprintf(stderr, "    -kv   Use the key-value store whose directory is at the given index\n");
+    fprintf(stderr, "          value. Operations are one of:\n");
+    fprintf(stderr, "              format <pools> <size> <keys>  Create the directory, with\n");
+    fprintf(stderr, "                    room for the given number of keys, followed by the\n");
+    fprintf(stderr, "                    given number of pool spaces of the given size.\n");
+    fprintf(stderr, "              put <key>   Store the data from STDIN as the key's value.\n");
+    fprintf(stderr, "              get <key>   Print the value of the key to STDOUT.\n");
+    fprintf(stderr, "              del <key>   Delete the key from the store.\n");
+    fprintf(stderr, "              list        List the keys and the size of their value.\n");
+    fprintf(stderr, "    -ring Use the ring of the given number of NV spaces starting at the\n");
+    fprintf(stderr, "          given index value, which keeps the newest of the records that\n");
+    fprintf(stderr, "          are appended to it, spreading the writes over all the spaces.\n");
+    fprintf(stderr, "          Operations are one of:\n");
+    fprintf(stderr, "              format <size>  Create the spaces, of the given size.\n");
+    fprintf(stderr, "              put   Append the data from STDIN as the newest record.\n");
+    fprintf(stderr, "              get   Print the newest record to STDOUT.\n");
     fprintf(stderr, "    -qa   Query all NV spaces active on the TPM.\n");
     fprintf(stderr, "          Prints size, rights and attributes for each index.\n");
     fprintf(stderr, "    -rl   Lock the NV space at the given index value against reads.\n");
@@ -205,116 +573,250 @@ LockSpace (
 }
 
 int32_t
-DeleteSpace (
+UpdateSpace (
     int32_t ArgumentCount,
+    char* Arguments[],
     uintptr_t TpmHandle,
-    TPM_NV_INDEX Index
+    TPM_NV_INDEX Index,
+    bool SetBits
     )
 {
+    uint8_t* password;
+    uint16_t passwordSize;
+    uint64_t bits;
+    int32_t passwordArgument;
     TPM_RC tpmResult;
 
     //
-    // We should only have 3 arguments
+    // Setting bits takes the bits as well, and both can take a password
     //
-    if (ArgumentCount != 3)
+    passwordArgument = SetBits ? 4 : 3;
+    if ((ArgumentCount < passwordArgument) || (ArgumentCount > (passwordArgument + 1)))
     {
         PrintUsage();
         return -1;
     }
 
     //
-    // Undefine it
+    // Read the bits and make sure they're valid
     //
-    fprintf(stderr, "Deleting NV space with index 0x%08x...\n\n", Index.Value);
-    tpmResult = TpmUndefineSpace2(TpmHandle, Index);
+    bits = 0;
+    if (SetBits)
+    {
+        bits = strtoull(Arguments[3], nullptr, 0);
+        if (bits == 0)
+        {
+            fprintf(stderr, "Bits %s not valid!\n", Arguments[3]);
+            return -1;
+        }
+    }
+
+    //
+    // Check if a password was entered
+    //
+    if (ArgumentCount == (passwordArgument + 1))
+    {
+        //
+        // Read it and calculate its size
+        //
+        password = reinterpret_cast<uint8_t*>(Arguments[passwordArgument]);
+        passwordSize = static_cast<uint16_t>(strlen(Arguments[passwordArgument]));
+        if (passwordSize == 0)
+        {
+            fprintf(stderr, "Password %s not valid!\n", Arguments[passwordArgument]);
+            return -1;
+        }
+    }
+    else
+    {
+        //
+        // We'll use owner auth
+        //
+        password = nullptr;
+        passwordSize = 0;
+    }
+
+    //
+    // Update it, with a single command and no data going either way
+    //
+    if (SetBits)
+    {
+        fprintf(stderr,
+                "Setting bits 0x%016llx in NV space with index 0x%08x...\n\n",
+                static_cast<unsigned long long>(bits),
+                Index.Value);
+        tpmResult = TpmNvSetBits2(TpmHandle, Index, passwordSize, password, bits);
+    }
+    else
+    {
+        fprintf(stderr, "Incrementing NV space with index 0x%08x...\n\n", Index.Value);
+        tpmResult = TpmNvIncrement2(TpmHandle, Index, passwordSize, password);
+    }
     if (tpmResult != TPM_RC_SUCCESS)
     {
-        fprintf(stderr, "Undefine failed with code 0x%02x\n", tpmResult);
+        fprintf(stderr, "Update failed with code 0x%02x\n", tpmResult);
         return -1;
     }
-    fprintf(stderr, "Undefine completed!\n");
+    fprintf(stderr, "Update completed!\n");
     return 0;
 }
 
 int32_t
-WriteSpace (
+LogEvents (
     int32_t ArgumentCount,
     char* Arguments[],
     uintptr_t TpmHandle,
     TPM_NV_INDEX Index
     )
 {
-    uint16_t dataSize;
-    uint16_t offset;
-    uint8_t* data;
     uint8_t* password;
     uint16_t passwordSize;
+    uintptr_t auditHandle;
+    TPM_AUDIT_STATISTICS statistics;
+    char line[4096];
+    size_t lineSize;
+    uint32_t eventCount;
     TPM_RC tpmResult;
-    size_t sizeRead;
+    TPM_RC closeResult;
 
     //
-    // We need at least 5 arguments, and no more than 6
+    // We need at least 4 arguments, and no more than 5
     //
-    if ((ArgumentCount < 5) || (ArgumentCount > 6))
+    if ((ArgumentCount < 4) || (ArgumentCount > 5))
     {
         PrintUsage();
         return -1;
     }
 
     //
-    // Read the offset and make sure it's valid
+    // Check if a password was entered
     //
-    offset = static_cast<uint16_t>(strtoul(Arguments[3], nullptr, 0));
-    if ((offset == 0) && (Arguments[3][0] != '0'))
+    if (ArgumentCount == 5)
     {
-        fprintf(stderr, "Offset of %s bytes not permitted!\n", Arguments[3]);
-        return -1;
+        //
+        // Read it and calculate its size
+        //
+        password = reinterpret_cast<uint8_t*>(Arguments[4]);
+        passwordSize = static_cast<uint16_t>(strlen(Arguments[4]));
+        if (passwordSize == 0)
+        {
+            fprintf(stderr, "Password %s not valid!\n", Arguments[4]);
+            return -1;
+        }
+    }
+    else
+    {
+        //
+        // We'll use owner auth
+        //
+        password = nullptr;
+        passwordSize = 0;
     }
 
     //
-    // Read the size and make sure it's valid
+    // Open the log, which must match what was extended into the index so far
     //
-    dataSize = static_cast<uint16_t>(strtoul(Arguments[4], nullptr, 0));
-    if (dataSize == 0)
-    {
-        fprintf(stderr, "Size of %s bytes not permitted!\n", Arguments[4]);
+    fprintf(stderr,
+            "Logging events from STDIN into NV space with index 0x%08x...\n\n",
+            Index.Value);
+    tpmResult = TpmAuditOpen(TpmHandle,
+                             Index,
+                             passwordSize,
+                             password,
+                             Arguments[3],
+                             TPM_TOOL_AUDIT_WINDOW_EVENTS,
+                             TPM_TOOL_AUDIT_WINDOW_MS,
+                             &auditHandle);
+    if (tpmResult == TPM_RC_INTEGRITY)
+    {
+        fprintf(stderr, "Audit log %s does not match the NV space!\n", Arguments[3]);
         return -1;
     }
-    else if (dataSize > USHRT_MAX)
+    if (tpmResult != TPM_RC_SUCCESS)
     {
-        fprintf(stderr, "Size of %d bytes is too large!\n", dataSize);
+        fprintf(stderr, "Opening audit log failed with code 0x%02x\n", tpmResult);
         return -1;
     }
 
     //
-    // Allocate space for the data
+    // Log each line as an event, without its line ending. Longer lines are
+    // logged as several events.
     //
-    data = reinterpret_cast<uint8_t*>(alloca(dataSize));
-    memset(data, 0, dataSize);
+    eventCount = 0;
+    while (fgets(line, sizeof(line), stdin) != nullptr)
+    {
+        lineSize = strlen(line);
+        while ((lineSize != 0) &&
+               ((line[lineSize - 1] == '\n') || (line[lineSize - 1] == '\r')))
+        {
+            lineSize--;
+        }
+        tpmResult = TpmAuditAppend(auditHandle,
+                                   reinterpret_cast<uint8_t*>(line),
+                                   static_cast<uint32_t>(lineSize));
+        if (tpmResult != TPM_RC_SUCCESS)
+        {
+            break;
+        }
+        eventCount++;
+    }
 
     //
-    // Read input
+    // Extend whatever is left and close the log
     //
-    sizeRead = fread(data, 1, dataSize, stdin);
-    if (sizeRead == 0)
+    closeResult = TpmAuditClose(auditHandle, &statistics);
+    if (tpmResult == TPM_RC_SUCCESS)
+    {
+        tpmResult = closeResult;
+    }
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        fprintf(stderr, "Logging failed with code 0x%02x\n", tpmResult);
+        return -1;
+    }
+    fprintf(stderr,
+            "Logged %u events, the log now holds %u events in %u batches\n",
+            eventCount,
+            statistics.EventCount,
+            statistics.BatchCount);
+    return 0;
+}
+
+int32_t
+VerifyLog (
+    int32_t ArgumentCount,
+    char* Arguments[],
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX Index
+    )
+{
+    uint8_t* password;
+    uint16_t passwordSize;
+    TPM_AUDIT_STATISTICS statistics;
+    TPM_RC tpmResult;
+
+    //
+    // We need at least 4 arguments, and no more than 5
+    //
+    if ((ArgumentCount < 4) || (ArgumentCount > 5))
     {
-        fprintf(stderr, "Could not read from STDIN\n");
+        PrintUsage();
         return -1;
     }
 
     //
     // Check if a password was entered
     //
-    if (ArgumentCount == 6)
+    if (ArgumentCount == 5)
     {
         //
         // Read it and calculate its size
         //
-        password = reinterpret_cast<uint8_t*>(Arguments[5]);
-        passwordSize = static_cast<uint16_t>(strlen(Arguments[5]));
+        password = reinterpret_cast<uint8_t*>(Arguments[4]);
+        passwordSize = static_cast<uint16_t>(strlen(Arguments[4]));
         if (passwordSize == 0)
         {
-            fprintf(stderr, "Password %s not valid!\n", Arguments[5]);
+            fprintf(stderr, "Password %s not valid!\n", Arguments[4]);
             return -1;
         }
     }
@@ -328,97 +830,124 @@ WriteSpace (
     }
 
     //
-    // Go and do the write
+    // Recompute the chain of the log and compare it with the index
     //
     fprintf(stderr,
-            "Writing to NV space with index 0x%08x at offset 0x%04x...\n\n",
-            Index.Value,
-            offset);
-    DumpHex(data, dataSize);
-    tpmResult = TpmNvWrite2(TpmHandle,
-                            Index,
-                            passwordSize,
-                            password,
-                            offset,
-                            dataSize,
-                            data);
+            "Verifying audit log against NV space with index 0x%08x...\n\n",
+            Index.Value);
+    tpmResult = TpmAuditVerify(TpmHandle,
+                               Index,
+                               passwordSize,
+                               password,
+                               Arguments[3],
+                               &statistics);
+    if (tpmResult == TPM_RC_INTEGRITY)
+    {
+        fprintf(stderr,
+                "Audit log %s does not match the NV space, after %u valid batches!\n",
+                Arguments[3],
+                statistics.BatchCount);
+        return -1;
+    }
     if (tpmResult != TPM_RC_SUCCESS)
     {
-        fprintf(stderr, "Write failed with code 0x%02x\n", tpmResult);
+        fprintf(stderr, "Verification failed with code 0x%02x\n", tpmResult);
         return -1;
     }
-    fprintf(stderr, "Write completed!\n");
+    fprintf(stderr,
+            "Verified %u events in %u batches\n",
+            statistics.EventCount - statistics.PendingCount,
+            statistics.BatchCount);
+    if (statistics.PendingCount != 0)
+    {
+        fprintf(stderr,
+                "%u events at the end were never extended and are not verified\n",
+                statistics.PendingCount);
+    }
     return 0;
 }
 
+bool
+ListKey (
+    void* Context,
+    const char* Key,
+    uint16_t ValueSize
+    )
+{
+    (void)Context;
+    printf("%s: 0x%04x bytes\n", Key, ValueSize);
+    return true;
+}
+
 int32_t
-ReadSpace (
+KeyValueStore (
     int32_t ArgumentCount,
     char* Arguments[],
     uintptr_t TpmHandle,
-    TPM_NV_INDEX Index
+    TPM_NV_INDEX Index,
+    const TPM_TOOL_OPTIONS* Options
     )
 {
-    uint16_t dataSize;
-    uint16_t offset;
-    uint8_t* data;
     uint8_t* password;
     uint16_t passwordSize;
+    int32_t passwordArgument;
+    uint16_t poolCount;
+    uint16_t poolSize;
+    uint16_t entryCapacity;
+    TPM_KV_LIMITS limits;
+    uintptr_t kvHandle;
+    uint8_t* value;
+    size_t sizeRead;
+    uint16_t valueSize;
     TPM_RC tpmResult;
+    int32_t res;
 
     //
-    // We need at least 5 arguments, and no more than 6
+    // Each operation takes its own arguments, followed by an optional password
     //
-    if ((ArgumentCount < 5) || (ArgumentCount > 6))
+    if (ArgumentCount < 4)
     {
         PrintUsage();
         return -1;
     }
-
-    //
-    // Read the offset and make sure it's valid
-    //
-    offset = static_cast<uint16_t>(strtoul(Arguments[3], nullptr, 0));
-    if ((offset == 0) && (Arguments[3][0] != '0'))
+    if (strcmp(Arguments[3], "format") == 0)
     {
-        fprintf(stderr, "Offset of %s bytes not permitted!\n", Arguments[3]);
-        return -1;
+        passwordArgument = 7;
     }
-
-    //
-    // Read the size and make sure it's valid
-    //
-    dataSize = static_cast<uint16_t>(strtoul(Arguments[4], nullptr, 0));
-    if (dataSize == 0)
+    else if ((strcmp(Arguments[3], "get") == 0) ||
+             (strcmp(Arguments[3], "put") == 0) ||
+             (strcmp(Arguments[3], "del") == 0))
     {
-        fprintf(stderr, "Size of %s bytes not permitted!\n", Arguments[4]);
+        passwordArgument = 5;
+    }
+    else if (strcmp(Arguments[3], "list") == 0)
+    {
+        passwordArgument = 4;
+    }
+    else
+    {
+        PrintUsage();
         return -1;
     }
-    else if (dataSize > USHRT_MAX)
+    if ((ArgumentCount < passwordArgument) || (ArgumentCount > (passwordArgument + 1)))
     {
-        fprintf(stderr, "Size of %d bytes is too large!\n", dataSize);
+        PrintUsage();
         return -1;
     }
 
-    //
-    // Allocate space for the data
-    //
-    data = reinterpret_cast<uint8_t*>(alloca(dataSize));
-    memset(data, 0, dataSize);
-
     //
     // Check if a password was entered
     //
-    if (ArgumentCount == 6)
+    if (ArgumentCount == (passwordArgument + 1))
     {
         //
         // Read it and calculate its size
         //
-        password = reinterpret_cast<uint8_t*>(Arguments[5]);
-        passwordSize = static_cast<uint16_t>(strlen(Arguments[5]));
+        password = reinterpret_cast<uint8_t*>(Arguments[passwordArgument]);
+        passwordSize = static_cast<uint16_t>(strlen(Arguments[passwordArgument]));
         if (passwordSize == 0)
         {
-            fprintf(stderr, "Password %s not valid!\n", Arguments[5]);
+            fprintf(stderr, "Password %s not valid!\n", Arguments[passwordArgument]);
             return -1;
         }
     }
@@ -432,172 +961,242 @@ ReadSpace (
     }
 
     //
-    // Go and do the write
+    // Formatting creates the directory at the given index, and the pools
+    // right after it.
     //
-    fprintf(stderr,
-            "Reading 0x%04x bytes from NV space with index "
-            "0x%08x at offset 0x%04x...\n\n",
-            dataSize,
-            Index.Value,
-            offset);
-    tpmResult = TpmNvRead2(TpmHandle,
-                           Index,
-                           passwordSize,
-                           password,
-                           offset,
-                           dataSize,
-                           data);
+    if (strcmp(Arguments[3], "format") == 0)
+    {
+        poolCount = static_cast<uint16_t>(strtoul(Arguments[4], nullptr, 0));
+        poolSize = static_cast<uint16_t>(strtoul(Arguments[5], nullptr, 0));
+        entryCapacity = static_cast<uint16_t>(strtoul(Arguments[6], nullptr, 0));
+        if ((poolCount == 0) || (poolSize == 0) || (entryCapacity == 0))
+        {
+            fprintf(stderr, "Store of %s pools of %s bytes for %s keys not permitted!\n",
+                    Arguments[4],
+                    Arguments[5],
+                    Arguments[6]);
+            return -1;
+        }
+        fprintf(stderr,
+                "Creating key-value store at index 0x%08x with %d pools of 0x%04x bytes...\n\n",
+                Index.Value,
+                poolCount,
+                poolSize);
+        tpmResult = TpmKvFormat(TpmHandle,
+                                Index,
+                                poolCount,
+                                poolSize,
+                                entryCapacity,
+                                passwordSize,
+                                password);
+        if (tpmResult != TPM_RC_SUCCESS)
+        {
+            fprintf(stderr, "Create failed with code 0x%02x\n", tpmResult);
+            return -1;
+        }
+        fprintf(stderr, "Create completed!\n");
+        return 0;
+    }
+
+    //
+    // Everything else works on the cached directory of the store
+    //
+    tpmResult = TpmKvOpen(TpmHandle, Index, passwordSize, password, &kvHandle);
     if (tpmResult != TPM_RC_SUCCESS)
     {
-        fprintf(stderr, "Read failed with code 0x%02x\n", tpmResult);
+        fprintf(stderr,
+                "Opening key-value store at index 0x%08x failed with code 0x%02x\n",
+                Index.Value,
+                tpmResult);
         return -1;
     }
+    res = -1;
+    value = nullptr;
+    sizeRead = 0;
+    if (strcmp(Arguments[3], "list") == 0)
+    {
+        fprintf(stderr, "Listing keys in store at index 0x%08x...\n\n", Index.Value);
+        tpmResult = TpmKvList(kvHandle, ListKey, nullptr);
+    }
+    else if (strcmp(Arguments[3], "del") == 0)
+    {
+        fprintf(stderr, "Deleting key %s...\n\n", Arguments[4]);
+        tpmResult = TpmKvDelete(kvHandle, Arguments[4]);
+    }
+    else
+    {
+        //
+        // Values are read and written whole, so allocate for the largest one
+        //
+        value = static_cast<uint8_t*>(malloc(UINT16_MAX));
+        if (value == nullptr)
+        {
+            fprintf(stderr, "Out of memory allocating %d bytes\n", UINT16_MAX);
+            goto Exit;
+        }
+
+        if (strcmp(Arguments[3], "put") == 0)
+        {
+            sizeRead = fread(value, 1, UINT16_MAX, stdin);
+            fprintf(stderr,
+                    "Writing 0x%04x bytes into key %s...\n\n",
+                    static_cast<uint32_t>(sizeRead),
+                    Arguments[4]);
+            DumpHex(Options, value, static_cast<int32_t>(sizeRead));
+            tpmResult = TpmKvPut(kvHandle,
+                                 Arguments[4],
+                                 static_cast<uint16_t>(sizeRead),
+                                 value);
+        }
+        else
+        {
+            fprintf(stderr, "Reading key %s...\n\n", Arguments[4]);
+            valueSize = UINT16_MAX;
+            tpmResult = TpmKvGet(kvHandle, Arguments[4], &valueSize, value);
+            if (tpmResult == TPM_RC_SUCCESS)
+            {
+                if (WriteOutput(Options, value, valueSize) == false)
+                {
+                    fprintf(stderr, "Failed to write data to output\n");
+                    goto Exit;
+                }
+                DumpHex(Options, value, valueSize);
+            }
+        }
+    }
 
     //
-    // Print data to STDOUT and dump to STDERR
+    // Say what happened
     //
-    if (_isatty(_fileno(stdout)) == false)
+    if (tpmResult == TPM_RC_VALUE)
     {
-        printf("%.*s", dataSize, data);
+        fprintf(stderr, "Key %s not found!\n", Arguments[4]);
+        goto Exit;
     }
-    DumpHex(data, dataSize);
 
     //
-    // And final result
+    // Values that don't fit are caught before anything is sent to the TPM, so
+    // say which limit was hit rather than just the code.
     //
-    fprintf(stderr, "Read completed!\n");
-    return 0;
+    if ((strcmp(Arguments[3], "put") == 0) &&
+        ((tpmResult == TPM_RC_SIZE) || (tpmResult == TPM_RC_NV_SPACE)))
+    {
+        TpmKvQueryLimits(kvHandle, Arguments[4], &limits);
+        if ((strlen(Arguments[4]) == 0) || (limits.MaximumValueSize == 0))
+        {
+            fprintf(stderr,
+                    "Key %s can't be stored: keys must be 1 to 255 bytes and fit in a pool!\n",
+                    Arguments[4]);
+        }
+        else if (tpmResult == TPM_RC_SIZE)
+        {
+            fprintf(stderr,
+                    "Value of 0x%04x bytes is too large for key %s, which can hold at most 0x%04x bytes!\n",
+                    static_cast<uint32_t>(sizeRead),
+                    Arguments[4],
+                    limits.MaximumValueSize);
+        }
+        else if ((limits.Replacing == false) && (limits.EntryCount == limits.EntryCapacity))
+        {
+            fprintf(stderr,
+                    "Key %s can't be added, the store already holds its maximum of %d keys!\n",
+                    Arguments[4],
+                    limits.EntryCapacity);
+        }
+        else
+        {
+            fprintf(stderr,
+                    "Value of 0x%04x bytes does not fit for key %s, the pools only have room for 0x%04x bytes!\n",
+                    static_cast<uint32_t>(sizeRead),
+                    Arguments[4],
+                    limits.FreeValueSize);
+        }
+        goto Exit;
+    }
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        fprintf(stderr, "Operation failed with code 0x%02x\n", tpmResult);
+        goto Exit;
+    }
+    fprintf(stderr, "Operation completed!\n");
+    res = 0;
+
+Exit:
+    free(value);
+    TpmKvClose(kvHandle);
+    return res;
 }
 
 int32_t
-CreateSpace (
+RecordRing (
     int32_t ArgumentCount,
     char* Arguments[],
     uintptr_t TpmHandle,
-    TPM_NV_INDEX Index
+    TPM_NV_INDEX Index,
+    const TPM_TOOL_OPTIONS* Options
     )
 {
-    uint8_t ownerRights;
-    uint8_t authRights;
-    uint16_t dataSize;
     uint8_t* password;
     uint16_t passwordSize;
-    uint8_t attributes;
+    int32_t passwordArgument;
+    uint16_t segmentCount;
+    uint16_t segmentSize;
+    uintptr_t ringHandle;
+    uint8_t* record;
+    size_t sizeRead;
+    uint16_t recordSize;
+    uint32_t sequence;
     TPM_RC tpmResult;
+    int32_t res;
 
     //
-    // We need at least 7 arguments, and no more than 8
+    // The number of spaces in the ring comes first, then the operation and
+    // its own arguments, followed by an optional password.
     //
-    if ((ArgumentCount < 7) || (ArgumentCount > 8))
+    if (ArgumentCount < 5)
     {
         PrintUsage();
         return -1;
     }
-
-    //
-    // Validate owner rights
-    //
-    ownerRights = TpmToolNoAccess;
-    if (strcmp(Arguments[3], "R") == 0)
-    {
-        ownerRights |= TpmToolReadAccess;
-    }
-    else if (strcmp(Arguments[3], "RW") == 0)
+    if (strcmp(Arguments[4], "format") == 0)
     {
-        ownerRights |= TpmToolReadWriteAccess;
+        passwordArgument = 6;
     }
-    else if (strcmp(Arguments[3], "NA") == 0)
+    else if ((strcmp(Arguments[4], "put") == 0) ||
+             (strcmp(Arguments[4], "get") == 0))
     {
-        ownerRights = TpmToolNoAccess;
+        passwordArgument = 5;
     }
     else
     {
-        fprintf(stderr, "Invalid owner rights value: %s\n", Arguments[3]);
+        PrintUsage();
         return -1;
     }
-
-    //
-    // Validate auth rights
-    //
-    authRights = TpmToolNoAccess;
-    if (strcmp(Arguments[4], "R") == 0)
-    {
-        authRights |= TpmToolReadAccess;
-    }
-    else if (strcmp(Arguments[4], "RW") == 0)
-    {
-        authRights |= TpmToolReadWriteAccess;
-    }
-    else if (strcmp(Arguments[4], "NA") == 0)
-    {
-        authRights = TpmToolNoAccess;
-    }
-    else
+    if ((ArgumentCount < passwordArgument) || (ArgumentCount > (passwordArgument + 1)))
     {
-        fprintf(stderr, "Invalid auth rights value: %s\n", Arguments[4]);
+        PrintUsage();
         return -1;
     }
-
-    //
-    // Validate attributes
-    //
-    attributes = 0;
-    if (strstr(Arguments[5], "RL") != nullptr)
-    {
-        attributes |= TpmToolReadLockable;
-    }
-    if (strstr(Arguments[5], "WL") != nullptr)
-    {
-        attributes |= TpmToolWriteLockable;
-    }
-    if (strstr(Arguments[5], "WO") != nullptr)
-    {
-        attributes |= TpmToolWriteOnce;
-    }
-    if (strstr(Arguments[5], "WA") != nullptr)
-    {
-        attributes |= TpmToolWriteAll;
-    }
-    if (strstr(Arguments[5], "NP") != nullptr)
-    {
-        attributes |= TpmToolNonProtected;
-    }
-    if (strstr(Arguments[5], "CH") != nullptr)
-    {
-        attributes |= TpmToolCached;
-    }
-    if (strstr(Arguments[5], "VL") != nullptr)
-    {
-        attributes |= TpmToolWriteLocked;
-    }
-    if (strstr(Arguments[5], "PT") != nullptr)
-    {
-        attributes |= TpmToolPermanent;
-    }
-
-    //
-    // Get the data size and validate
-    //
-    dataSize = static_cast<uint16_t>(strtoul(Arguments[6], nullptr, 0));
-    if (dataSize == 0)
+    segmentCount = static_cast<uint16_t>(strtoul(Arguments[3], nullptr, 0));
+    if (segmentCount < 2)
     {
-        fprintf(stderr, "Space of %s bytes not permitted!\n", Arguments[5]);
+        fprintf(stderr, "Ring of %s spaces not permitted!\n", Arguments[3]);
         return -1;
     }
 
     //
     // Check if a password was entered
     //
-    if (ArgumentCount == 8)
+    if (ArgumentCount == (passwordArgument + 1))
     {
         //
         // Read it and calculate its size
         //
-        password = reinterpret_cast<uint8_t*>(Arguments[7]);
-        passwordSize = static_cast<uint16_t>(strlen(Arguments[7]));
+        password = reinterpret_cast<uint8_t*>(Arguments[passwordArgument]);
+        passwordSize = static_cast<uint16_t>(strlen(Arguments[passwordArgument]));
         if (passwordSize == 0)
         {
-            fprintf(stderr, "Password %s not valid!\n", Arguments[7]);
+            fprintf(stderr, "Password %s not valid!\n", Arguments[passwordArgument]);
             return -1;
         }
     }
@@ -611,330 +1210,1943 @@ CreateSpace (
     }
 
     //
-    // Define the space
+    // Formatting creates the spaces of the ring, starting at the given index
     //
-    fprintf(stderr,
-            "Creating NV space with index 0x%08x, attributes 0x%02x "
-            "and data size 0x%04x...\n\n",
-            Index.Value,
-            attributes,
-            dataSize);
-    tpmResult = TpmDefineSpace2(TpmHandle,
-                                Index,
-                                dataSize,
-                                attributes,
-                                ownerRights,
-                                authRights,
-                                passwordSize,
-                                password);
-    if (tpmResult != TPM_RC_SUCCESS)
+    if (strcmp(Arguments[4], "format") == 0)
     {
-        fprintf(stderr, "Create failed with code 0x%02x\n", tpmResult);
-        return -1;
+        segmentSize = static_cast<uint16_t>(strtoul(Arguments[5], nullptr, 0));
+        fprintf(stderr,
+                "Creating record ring at index 0x%08x with %d spaces of 0x%04x bytes...\n\n",
+                Index.Value,
+                segmentCount,
+                segmentSize);
+        tpmResult = TpmRingFormat(TpmHandle,
+                                  Index,
+                                  segmentCount,
+                                  segmentSize,
+                                  passwordSize,
+                                  password);
+        if (tpmResult != TPM_RC_SUCCESS)
+        {
+            fprintf(stderr, "Create failed with code 0x%02x\n", tpmResult);
+            return -1;
+        }
+        fprintf(stderr, "Create completed!\n");
+        return 0;
     }
-    fprintf(stderr, "Create completed!\n");
-    return 0;
-}
-
-TPM_RC
-QuerySpaceInternal (
-    uintptr_t TpmHandle,
-    TPM_NV_INDEX Index,
-    uint16_t* DataSize,
-    char* Attributes,
-    char* OwnerRights,
-    char* AuthRights,
-    char* AttributeBuffer
-    )
-{
-    uint16_t attributes;
-    uint8_t ownerRights;
-    uint8_t authRights;
-    TPM_RC tpmResult;
 
     //
-    // Query information on the given space
+    // Opening the ring finds its newest record
     //
-    tpmResult = TpmReadPublic2(TpmHandle,
-                               Index,
-                               &attributes,
-                               &ownerRights,
-                               &authRights,
-                               DataSize);
-
+    tpmResult = TpmRingOpen(TpmHandle,
+                            Index,
+                            segmentCount,
+                            passwordSize,
+                            password,
+                            &ringHandle);
     if (tpmResult != TPM_RC_SUCCESS)
     {
-        return tpmResult;
+        fprintf(stderr,
+                "Opening record ring at index 0x%08x failed with code 0x%02x\n",
+                Index.Value,
+                tpmResult);
+        return -1;
     }
 
-    strcpy(Attributes, (attributes & TpmToolWritten) ? "dirty" : "unwritten");
-
-    if ((ownerRights & TpmToolReadWriteAccess) == TpmToolReadWriteAccess)
-    {
-        strcpy(OwnerRights, "RW");
-    }
-    else if((ownerRights & TpmToolReadAccess) == TpmToolReadAccess)
-    {
-        strcpy(OwnerRights, "R");
-    }
-    else
+    //
+    // Records are read and written whole, so allocate for the largest one
+    //
+    res = -1;
+    record = static_cast<uint8_t*>(malloc(UINT16_MAX));
+    if (record == nullptr)
     {
-        strcpy(OwnerRights, "NA");
+        fprintf(stderr, "Out of memory allocating %d bytes\n", UINT16_MAX);
+        goto Exit;
     }
 
-    if ((authRights & TpmToolReadWriteAccess) == TpmToolReadWriteAccess)
-    {
-        strcpy(AuthRights, "RW");
-    }
-    else if ((authRights & TpmToolReadAccess) == TpmToolReadAccess)
+    if (strcmp(Arguments[4], "put") == 0)
     {
-        strcpy(AuthRights, "R");
+        sizeRead = fread(record, 1, UINT16_MAX, stdin);
+        fprintf(stderr,
+                "Appending 0x%04x bytes to ring at index 0x%08x...\n\n",
+                static_cast<uint32_t>(sizeRead),
+                Index.Value);
+        DumpHex(Options, record, static_cast<int32_t>(sizeRead));
+        tpmResult = TpmRingAppend(ringHandle, static_cast<uint16_t>(sizeRead), record);
     }
     else
     {
-        strcpy(AuthRights, "NA");
-    }
-
-    strcpy(AttributeBuffer, " ");
-    if (attributes & TpmToolReadLockable)
-    {
-        strcat(AttributeBuffer, "RL+");
-    }
-    if (attributes & TpmToolWriteLockable)
-    {
-        strcat(AttributeBuffer, "WL+");
-    }
-    if (attributes & TpmToolWriteOnce)
-    {
-        strcat(AttributeBuffer, "WO+");
-    }
-    if (attributes & TpmToolWriteAll)
-    {
-        strcat(AttributeBuffer, "WA+");
-    }
-    if (attributes & TpmToolNonProtected)
-    {
-        strcat(AttributeBuffer, "NP+");
-    }
-    if (attributes & TpmToolCached)
-    {
-        strcat(AttributeBuffer, "CH+");
-    }
-    if (attributes & TpmToolVolatileDirtyFlag)
-    {
-        strcat(AttributeBuffer, "VL+");
-    }
-    if (attributes & TpmToolPermanent)
-    {
-        strcat(AttributeBuffer, "PT+");
+        fprintf(stderr, "Reading newest record of ring at index 0x%08x...\n\n", Index.Value);
+        recordSize = UINT16_MAX;
+        tpmResult = TpmRingRead(ringHandle, &recordSize, record, &sequence);
+        if (tpmResult == TPM_RC_SUCCESS)
+        {
+            fprintf(stderr, "Record 0x%08x holds 0x%04x bytes\n\n", sequence, recordSize);
+            if (WriteOutput(Options, record, recordSize) == false)
+            {
+                fprintf(stderr, "Failed to write data to output\n");
+                goto Exit;
+            }
+            DumpHex(Options, record, recordSize);
+        }
     }
 
     //
-    // Next, the status attributes
+    // Say what happened
     //
-    if (attributes & TpmToolReadLocked)
-    {
-        strcat(AttributeBuffer, "LR+");
-    }
-    if (attributes & TpmToolWriteLocked)
+    if (tpmResult == TPM_RC_NV_UNINITIALIZED)
     {
-        strcat(AttributeBuffer, "LW+");
+        fprintf(stderr, "Ring at index 0x%08x holds no records!\n", Index.Value);
+        goto Exit;
     }
-    if (attributes & TpmToolPlatformOwned)
+    if (tpmResult != TPM_RC_SUCCESS)
     {
-        strcat(AttributeBuffer, "PO+");
+        fprintf(stderr, "Operation failed with code 0x%02x\n", tpmResult);
+        goto Exit;
     }
+    fprintf(stderr, "Operation completed!\n");
+    res = 0;
 
-    return TPM_RC_SUCCESS;
+Exit:
+    free(record);
+    TpmRingClose(ringHandle);
+    return res;
 }
 
 int32_t
-QuerySpaceMinimalOutput (
+DeleteSpace (
+    int32_t ArgumentCount,
     uintptr_t TpmHandle,
     TPM_NV_INDEX Index
     )
 {
-    uint16_t dataSize;
     TPM_RC tpmResult;
-    char attributes[sizeof("unwritten")];
-    char ownerRights[sizeof("NA")];
-    char authRights[sizeof("NA")];
-    char attributeBuffer[(12 * 3) + 1];
 
-    tpmResult = QuerySpaceInternal(TpmHandle,
-                                   Index,
-                                   &dataSize,
-                                   attributes,
-                                   ownerRights,
-                                   authRights,
-                                   attributeBuffer);
+    //
+    // We should only have 3 arguments
+    //
+    if (ArgumentCount != 3)
+    {
+        PrintUsage();
+        return -1;
+    }
+
+    //
+    // Undefine it
+    //
+    fprintf(stderr, "Deleting NV space with index 0x%08x...\n\n", Index.Value);
+    tpmResult = TpmUndefineSpace2(TpmHandle, Index);
     if (tpmResult != TPM_RC_SUCCESS)
     {
+        fprintf(stderr, "Undefine failed with code 0x%02x\n", tpmResult);
         return -1;
     }
+    fprintf(stderr, "Undefine completed!\n");
+    return 0;
+}
 
-    attributeBuffer[strlen(attributeBuffer) - 1] = '\0';
-    printf("0x%04x, %s, owner rights: %s, auth rights: %s, attributes:%s",
-           dataSize,
-           attributes,
-           ownerRights,
-           authRights,
-           attributeBuffer);
+bool
+WriteSpaceChunk (
+    void* Context,
+    uint16_t DataSize,
+    const uint8_t** Data
+    )
+{
+    PTPM_TOOL_STREAM_CONTEXT context;
+    uint8_t* buffer;
+    size_t sizeRead;
+
+    //
+    // Alternate between the two buffers, as the previous chunk is still being
+    // written from the other one.
+    //
+    context = static_cast<PTPM_TOOL_STREAM_CONTEXT>(Context);
+    buffer = context->Buffers[context->Current];
+    context->Current ^= 1;
+
+    //
+    // Read input, padding it with zeroes if it ran out early
+    //
+    sizeRead = ReadInput(context->Options, context->SizeRead, buffer, DataSize, Data);
+    if ((sizeRead == 0) && (context->SizeRead == 0))
+    {
+        fprintf(stderr,
+                "Could not read from %s\n",
+                (context->Options->InputPath != nullptr) ? context->Options->InputPath : "STDIN");
+        return false;
+    }
+    if (sizeRead != DataSize)
+    {
+        memset(&buffer[sizeRead], 0, DataSize - sizeRead);
+    }
+    context->SizeRead += sizeRead;
+
+    //
+    // Dump it before it gets written
+    //
+    DumpHexStream(context, *Data, DataSize);
+    return true;
+}
+
+int32_t
+WriteSpaceDifferential (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX Index,
+    uint16_t PasswordSize,
+    uint8_t* Password,
+    uint16_t Offset,
+    uint16_t DataSize,
+    const TPM_TOOL_OPTIONS* Options
+    )
+{
+    TPM_NV_WRITE_STATISTICS statistics;
+    uint8_t* data;
+    const uint8_t* input;
+    size_t sizeRead;
+    TPM_RC tpmResult;
+
+    //
+    // The whole input is needed up front, so that it can be compared with what
+    // the index already has. Pad it with zeroes if the input ran out early.
+    //
+    data = static_cast<uint8_t*>(calloc(1, DataSize));
+    if (data == nullptr)
+    {
+        fprintf(stderr, "Out of memory allocating %d bytes\n", DataSize);
+        return -1;
+    }
+    sizeRead = ReadInput(Options, 0, data, DataSize, &input);
+    if (sizeRead == 0)
+    {
+        fprintf(stderr,
+                "Could not read from %s\n",
+                (Options->InputPath != nullptr) ? Options->InputPath : "STDIN");
+        free(data);
+        return -1;
+    }
+
+    //
+    // Only write the bytes that changed
+    //
+    fprintf(stderr,
+            "Writing changes to NV space with index 0x%08x at offset 0x%04x...\n\n",
+            Index.Value,
+            Offset);
+    DumpHex(Options, input, DataSize);
+    tpmResult = TpmNvWriteDifferential(TpmHandle,
+                                       Index,
+                                       PasswordSize,
+                                       Password,
+                                       Offset,
+                                       DataSize,
+                                       input,
+                                       &statistics);
+    free(data);
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        fprintf(stderr, "Write failed with code 0x%02x\n", tpmResult);
+        return -1;
+    }
+
+    //
+    // Say how much was saved compared to writing everything
+    //
+    fprintf(stderr,
+            "Wrote 0x%04x bytes in %u commands, saving 0x%04x bytes and %u commands\n",
+            statistics.BytesWritten,
+            statistics.WritesIssued,
+            statistics.BytesSkipped,
+            statistics.WritesAvoided);
+    fprintf(stderr, "Write completed!\n");
     return 0;
 }
 
 int32_t
-QuerySpace (
+WriteSpaceCompressed (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX Index,
+    uint16_t PasswordSize,
+    uint8_t* Password,
+    uint16_t Offset,
+    uint16_t DataSize,
+    const TPM_TOOL_OPTIONS* Options
+    )
+{
+    uint8_t* data;
+    const uint8_t* input;
+    size_t sizeRead;
+    uint16_t storedSize;
+    TPM_RC tpmResult;
+
+    //
+    // The whole input is needed up front, so that it can be compressed. Only
+    // what was read is stored, so that reading it back returns the same data.
+    //
+    data = static_cast<uint8_t*>(malloc(DataSize));
+    if (data == nullptr)
+    {
+        fprintf(stderr, "Out of memory allocating %d bytes\n", DataSize);
+        return -1;
+    }
+    sizeRead = ReadInput(Options, 0, data, DataSize, &input);
+    if (sizeRead == 0)
+    {
+        fprintf(stderr,
+                "Could not read from %s\n",
+                (Options->InputPath != nullptr) ? Options->InputPath : "STDIN");
+        free(data);
+        return -1;
+    }
+
+    //
+    // Compress it and write it, along with its header
+    //
+    fprintf(stderr,
+            "Writing 0x%04x compressed bytes to NV space with index 0x%08x at offset 0x%04x...\n\n",
+            static_cast<uint32_t>(sizeRead),
+            Index.Value,
+            Offset);
+    DumpHex(Options, input, static_cast<int32_t>(sizeRead));
+    tpmResult = TpmNvWriteCompressed(TpmHandle,
+                                     Index,
+                                     PasswordSize,
+                                     Password,
+                                     Offset,
+                                     static_cast<uint16_t>(sizeRead),
+                                     input,
+                                     &storedSize);
+    free(data);
+    if (tpmResult == TPM_RC_NV_RANGE)
+    {
+        fprintf(stderr,
+                "Data does not fit in NV space with index 0x%08x at offset 0x%04x "
+                "(needs 0x%04x bytes, including its header)\n",
+                Index.Value,
+                Offset,
+                storedSize);
+        return -1;
+    }
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        fprintf(stderr, "Write failed with code 0x%02x\n", tpmResult);
+        return -1;
+    }
+    fprintf(stderr,
+            "Stored 0x%04x bytes in 0x%04x bytes\n",
+            static_cast<uint32_t>(sizeRead),
+            storedSize);
+    fprintf(stderr, "Write completed!\n");
+    return 0;
+}
+
+int32_t
+WriteSpace (
     int32_t ArgumentCount,
+    char* Arguments[],
     uintptr_t TpmHandle,
-    TPM_NV_INDEX Index
+    TPM_NV_INDEX Index,
+    const TPM_TOOL_OPTIONS* Options
+    )
+{
+    uint16_t dataSize;
+    uint16_t offset;
+    TPM_TOOL_STREAM_CONTEXT writeContext;
+    uint16_t chunkSize;
+    uint16_t attributes;
+    uint8_t ownerRights;
+    uint8_t authRights;
+    uint16_t spaceSize;
+    uint8_t* password;
+    uint16_t passwordSize;
+    TPM_RC tpmResult;
+
+    //
+    // We need at least 5 arguments, and no more than 6
+    //
+    if ((ArgumentCount < 5) || (ArgumentCount > 6))
+    {
+        PrintUsage();
+        return -1;
+    }
+
+    //
+    // Read the offset and make sure it's valid
+    //
+    offset = static_cast<uint16_t>(strtoul(Arguments[3], nullptr, 0));
+    if ((offset == 0) && (Arguments[3][0] != '0'))
+    {
+        fprintf(stderr, "Offset of %s bytes not permitted!\n", Arguments[3]);
+        return -1;
+    }
+
+    //
+    // Read the size and make sure it's valid
+    //
+    dataSize = static_cast<uint16_t>(strtoul(Arguments[4], nullptr, 0));
+    if (dataSize == 0)
+    {
+        fprintf(stderr, "Size of %s bytes not permitted!\n", Arguments[4]);
+        return -1;
+    }
+    else if (dataSize > USHRT_MAX)
+    {
+        fprintf(stderr, "Size of %d bytes is too large!\n", dataSize);
+        return -1;
+    }
+
+    //
+    // Check if a password was entered
+    //
+    if (ArgumentCount == 6)
+    {
+        //
+        // Read it and calculate its size
+        //
+        password = reinterpret_cast<uint8_t*>(Arguments[5]);
+        passwordSize = static_cast<uint16_t>(strlen(Arguments[5]));
+        if (passwordSize == 0)
+        {
+            fprintf(stderr, "Password %s not valid!\n", Arguments[5]);
+            return -1;
+        }
+    }
+    else
+    {
+        //
+        // We'll use owner auth
+        //
+        password = nullptr;
+        passwordSize = 0;
+    }
+
+    //
+    // Compressed data is written whole, once its final size is known
+    //
+    if (Options->Compressed)
+    {
+        return WriteSpaceCompressed(TpmHandle,
+                                    Index,
+                                    passwordSize,
+                                    password,
+                                    offset,
+                                    dataSize,
+                                    Options);
+    }
+
+    //
+    // Each chunk is read from STDIN in one of two buffers, so that the next
+    // one is read while the previous one is written. If the index must be
+    // written all at once, it can't be split over several writes.
+    //
+    chunkSize = TpmNvWriteChunkSize(TpmHandle, passwordSize);
+    if (dataSize > chunkSize)
+    {
+        tpmResult = TpmReadPublicCached(TpmHandle,
+                                        Index,
+                                        &attributes,
+                                        &ownerRights,
+                                        &authRights,
+                                        &spaceSize);
+        if ((tpmResult == TPM_RC_SUCCESS) && ((attributes & TpmToolWriteAll) != 0))
+        {
+            fprintf(stderr,
+                    "Index requires all 0x%04x bytes to be written at once, "
+                    "but the TPM only accepts 0x%04x bytes per write\n",
+                    spaceSize,
+                    chunkSize);
+            return -1;
+        }
+    }
+    else
+    {
+        chunkSize = dataSize;
+    }
+
+    //
+    // A differential write only sends the bytes that changed
+    //
+    if (Options->Differential)
+    {
+        return WriteSpaceDifferential(TpmHandle,
+                                      Index,
+                                      passwordSize,
+                                      password,
+                                      offset,
+                                      dataSize,
+                                      Options);
+    }
+
+    //
+    // Allocate space for the data
+    //
+    writeContext.Buffers[0] = static_cast<uint8_t*>(calloc(2, chunkSize));
+    if (writeContext.Buffers[0] == nullptr)
+    {
+        fprintf(stderr, "Out of memory allocating %d bytes\n", chunkSize * 2);
+        return -1;
+    }
+    writeContext.Buffers[1] = writeContext.Buffers[0] + chunkSize;
+    writeContext.Current = 0;
+    writeContext.SizeRead = 0;
+    writeContext.WriteOutput = false;
+    writeContext.LineSize = 0;
+    writeContext.Options = Options;
+
+    //
+    // Go and do the write, which is split in as many chunks as the TPM needs.
+    // Each chunk is read from the input and dumped to STDERR right before it
+    // is written.
+    //
+    fprintf(stderr,
+            "Writing to NV space with index 0x%08x at offset 0x%04x...\n\n",
+            Index.Value,
+            offset);
+    tpmResult = TpmNvWriteStream(TpmHandle,
+                                 Index,
+                                 passwordSize,
+                                 password,
+                                 offset,
+                                 dataSize,
+                                 WriteSpaceChunk,
+                                 &writeContext);
+    free(writeContext.Buffers[0]);
+    if (tpmResult == TPM_RC_CANCELED)
+    {
+        return -1;
+    }
+    DumpHex(Options, writeContext.Line, writeContext.LineSize);
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        fprintf(stderr, "Write failed with code 0x%02x\n", tpmResult);
+        return -1;
+    }
+    fprintf(stderr, "Write completed!\n");
+    return 0;
+}
+
+bool
+ReadSpaceChunk (
+    void* Context,
+    const uint8_t* Data,
+    uint16_t DataSize
+    )
+{
+    PTPM_TOOL_STREAM_CONTEXT context;
+
+    //
+    // Copy the raw data into the output file, or write it to STDOUT, as-is,
+    // as soon as it arrives
+    //
+    context = static_cast<PTPM_TOOL_STREAM_CONTEXT>(Context);
+    if (context->Output != nullptr)
+    {
+        memcpy(&context->Output[context->SizeRead], Data, DataSize);
+        context->SizeRead += DataSize;
+    }
+    else if ((context->WriteOutput) &&
+             (OsWriteFile(_fileno(stdout), Data, DataSize) == false))
+    {
+        fprintf(stderr, "Failed to write data to output\n");
+        return false;
+    }
+
+    //
+    // And dump it as well
+    //
+    DumpHexStream(context, Data, DataSize);
+    return true;
+}
+
+int32_t
+ReadSpaceCompressed (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX Index,
+    uint16_t PasswordSize,
+    uint8_t* Password,
+    uint16_t Offset,
+    uint16_t MaximumSize,
+    const TPM_TOOL_OPTIONS* Options
     )
 {
+    uint8_t* data;
     uint16_t dataSize;
+    uint16_t storedSize;
     TPM_RC tpmResult;
-    char attributes[sizeof("unwritten")];
-    char ownerRights[sizeof("NA")];
-    char authRights[sizeof("NA")];
-    char attributeBuffer[(12 * 3) + 1];
+    int32_t res;
+
+    //
+    // The original data can be as large as an NV index can address
+    //
+    data = static_cast<uint8_t*>(malloc(UINT16_MAX));
+    if (data == nullptr)
+    {
+        fprintf(stderr, "Out of memory allocating %d bytes\n", UINT16_MAX);
+        return -1;
+    }
+
+    //
+    // Read as much of the range as the compressed data needs, and expand it
+    //
+    fprintf(stderr,
+            "Reading compressed data from NV space with index "
+            "0x%08x at offset 0x%04x...\n\n",
+            Index.Value,
+            Offset);
+    res = -1;
+    dataSize = UINT16_MAX;
+    tpmResult = TpmNvReadCompressed(TpmHandle,
+                                    Index,
+                                    PasswordSize,
+                                    Password,
+                                    Offset,
+                                    MaximumSize,
+                                    &dataSize,
+                                    data,
+                                    &storedSize);
+    if (tpmResult == TPM_RC_INTEGRITY)
+    {
+        fprintf(stderr, "No valid compressed data found at offset 0x%04x\n", Offset);
+        goto Exit;
+    }
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        fprintf(stderr, "Read failed with code 0x%02x\n", tpmResult);
+        goto Exit;
+    }
+
+    //
+    // Write it to the output and dump it
+    //
+    if (WriteOutput(Options, data, dataSize) == false)
+    {
+        fprintf(stderr, "Failed to write data to output\n");
+        goto Exit;
+    }
+    DumpHex(Options, data, dataSize);
+    fprintf(stderr, "Expanded 0x%04x bytes from 0x%04x bytes\n", dataSize, storedSize);
+    fprintf(stderr, "Read completed!\n");
+    res = 0;
+
+Exit:
+    free(data);
+    return res;
+}
+
+int32_t
+ReadSpace (
+    int32_t ArgumentCount,
+    char* Arguments[],
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX Index,
+    const TPM_TOOL_OPTIONS* Options
+    )
+{
+    uint16_t dataSize;
+    uint16_t offset;
+    TPM_TOOL_STREAM_CONTEXT readContext;
+    uintptr_t mapHandle;
+    void* output;
+    size_t outputSize;
+    uint8_t* password;
+    uint16_t passwordSize;
+    TPM_RC tpmResult;
+
+    //
+    // We need at least 5 arguments, and no more than 6
+    //
+    if ((ArgumentCount < 5) || (ArgumentCount > 6))
+    {
+        PrintUsage();
+        return -1;
+    }
+
+    //
+    // Read the offset and make sure it's valid
+    //
+    offset = static_cast<uint16_t>(strtoul(Arguments[3], nullptr, 0));
+    if ((offset == 0) && (Arguments[3][0] != '0'))
+    {
+        fprintf(stderr, "Offset of %s bytes not permitted!\n", Arguments[3]);
+        return -1;
+    }
+
+    //
+    // Read the size and make sure it's valid
+    //
+    dataSize = static_cast<uint16_t>(strtoul(Arguments[4], nullptr, 0));
+    if (dataSize == 0)
+    {
+        fprintf(stderr, "Size of %s bytes not permitted!\n", Arguments[4]);
+        return -1;
+    }
+    else if (dataSize > USHRT_MAX)
+    {
+        fprintf(stderr, "Size of %d bytes is too large!\n", dataSize);
+        return -1;
+    }
+
+    //
+    // Check if a password was entered
+    //
+    if (ArgumentCount == 6)
+    {
+        //
+        // Read it and calculate its size
+        //
+        password = reinterpret_cast<uint8_t*>(Arguments[5]);
+        passwordSize = static_cast<uint16_t>(strlen(Arguments[5]));
+        if (passwordSize == 0)
+        {
+            fprintf(stderr, "Password %s not valid!\n", Arguments[5]);
+            return -1;
+        }
+    }
+    else
+    {
+        //
+        // We'll use owner auth
+        //
+        password = nullptr;
+        passwordSize = 0;
+    }
+
+    //
+    // The size of compressed data is only known once its header is read
+    //
+    if (Options->Compressed)
+    {
+        return ReadSpaceCompressed(TpmHandle,
+                                   Index,
+                                   passwordSize,
+                                   password,
+                                   offset,
+                                   dataSize,
+                                   Options);
+    }
+
+    //
+    // An output file is created with the size of the read, and mapped so that
+    // each chunk is copied straight into it.
+    //
+    output = nullptr;
+    outputSize = dataSize;
+    mapHandle = 0;
+    if ((Options->OutputPath != nullptr) &&
+        (OsMapFile(Options->OutputPath, true, &outputSize, &output, &mapHandle) == false))
+    {
+        fprintf(stderr, "Unable to create output file %s\n", Options->OutputPath);
+        return -1;
+    }
+
+    //
+    // Go and do the read, which is split in as many chunks as the TPM needs.
+    // Each chunk is written to the output and dumped to STDERR as soon as it
+    // is received.
+    //
+    fprintf(stderr,
+            "Reading 0x%04x bytes from NV space with index "
+            "0x%08x at offset 0x%04x...\n\n",
+            dataSize,
+            Index.Value,
+            offset);
+    readContext.WriteOutput = (_isatty(_fileno(stdout)) == false);
+    readContext.LineSize = 0;
+    readContext.SizeRead = 0;
+    readContext.Options = Options;
+    readContext.Output = static_cast<uint8_t*>(output);
+    fflush(stdout);
+    tpmResult = TpmNvReadStream(TpmHandle,
+                                Index,
+                                passwordSize,
+                                password,
+                                offset,
+                                dataSize,
+                                ReadSpaceChunk,
+                                &readContext);
+    if ((Options->OutputPath != nullptr) &&
+        (OsUnmapFile(output, outputSize, mapHandle) == false) &&
+        (tpmResult == TPM_RC_SUCCESS))
+    {
+        fprintf(stderr, "Failed to write data to output\n");
+        return -1;
+    }
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        fprintf(stderr, "Read failed with code 0x%02x\n", tpmResult);
+        return -1;
+    }
+    DumpHex(Options, readContext.Line, readContext.LineSize);
+
+    //
+    // And final result
+    //
+    fprintf(stderr, "Read completed!\n");
+    return 0;
+}
+
+bool
+ParseRights (
+    const char* Value,
+    uint8_t* Rights
+    )
+{
+    //
+    // Rights are either read, read-write or none
+    //
+    if (strcmp(Value, "R") == 0)
+    {
+        *Rights = TpmToolReadAccess;
+    }
+    else if (strcmp(Value, "RW") == 0)
+    {
+        *Rights = TpmToolReadWriteAccess;
+    }
+    else if (strcmp(Value, "NA") == 0)
+    {
+        *Rights = TpmToolNoAccess;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+uint16_t
+ParseAttributes (
+    const char* Value
+    )
+{
+    uint16_t attributes;
+
+    //
+    // Validate attributes
+    //
+    attributes = 0;
+    if (strstr(Value, "RL") != nullptr)
+    {
+        attributes |= TpmToolReadLockable;
+    }
+    if (strstr(Value, "WL") != nullptr)
+    {
+        attributes |= TpmToolWriteLockable;
+    }
+    if (strstr(Value, "WO") != nullptr)
+    {
+        attributes |= TpmToolWriteOnce;
+    }
+    if (strstr(Value, "WA") != nullptr)
+    {
+        attributes |= TpmToolWriteAll;
+    }
+    if (strstr(Value, "NP") != nullptr)
+    {
+        attributes |= TpmToolNonProtected;
+    }
+    if (strstr(Value, "CH") != nullptr)
+    {
+        attributes |= TpmToolCached;
+    }
+    if (strstr(Value, "VL") != nullptr)
+    {
+        attributes |= TpmToolVolatileDirtyFlag;
+    }
+    if (strstr(Value, "PT") != nullptr)
+    {
+        attributes |= TpmToolPermanent;
+    }
+
+    //
+    // Validate the type, which is ordinary unless one is given
+    //
+    if (strstr(Value, "CT") != nullptr)
+    {
+        attributes |= TpmToolCounter;
+    }
+    else if (strstr(Value, "BT") != nullptr)
+    {
+        attributes |= TpmToolBits;
+    }
+    else if (strstr(Value, "EX") != nullptr)
+    {
+        attributes |= TpmToolExtend;
+    }
+    return attributes;
+}
+
+bool
+ValidateSpaceSize (
+    uint16_t Attributes,
+    uint16_t DataSize
+    )
+{
+    //
+    // Counters and bit fields hold a 64-bit value, and extend spaces a digest
+    //
+    if (DataSize == 0)
+    {
+        fprintf(stderr, "Space of 0 bytes not permitted!\n");
+        return false;
+    }
+    if ((Attributes & (TpmToolCounter | TpmToolBits)) && (DataSize != sizeof(uint64_t)))
+    {
+        fprintf(stderr, "Counter and bit field spaces must be %d bytes!\n",
+                static_cast<int32_t>(sizeof(uint64_t)));
+        return false;
+    }
+    if ((Attributes & TpmToolExtend) && (DataSize != TPM_TOOL_EXTEND_SIZE))
+    {
+        fprintf(stderr, "Extend spaces must be %d bytes!\n", TPM_TOOL_EXTEND_SIZE);
+        return false;
+    }
+    return true;
+}
+
+int32_t
+CreateSpace (
+    int32_t ArgumentCount,
+    char* Arguments[],
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX Index
+    )
+{
+    uint8_t ownerRights;
+    uint8_t authRights;
+    uint16_t dataSize;
+    uint8_t* password;
+    uint16_t passwordSize;
+    uint16_t attributes;
+    TPM_RC tpmResult;
+
+    //
+    // We need at least 7 arguments, and no more than 8
+    //
+    if ((ArgumentCount < 7) || (ArgumentCount > 8))
+    {
+        PrintUsage();
+        return -1;
+    }
+
+    //
+    // Validate owner and auth rights
+    //
+    if (ParseRights(Arguments[3], &ownerRights) == false)
+    {
+        fprintf(stderr, "Invalid owner rights value: %s\n", Arguments[3]);
+        return -1;
+    }
+    if (ParseRights(Arguments[4], &authRights) == false)
+    {
+        fprintf(stderr, "Invalid auth rights value: %s\n", Arguments[4]);
+        return -1;
+    }
+
+    //
+    // Get the attributes, and the data size that they allow
+    //
+    attributes = ParseAttributes(Arguments[5]);
+    dataSize = static_cast<uint16_t>(strtoul(Arguments[6], nullptr, 0));
+    if (ValidateSpaceSize(attributes, dataSize) == false)
+    {
+        return -1;
+    }
+
+    //
+    // Check if a password was entered
+    //
+    if (ArgumentCount == 8)
+    {
+        //
+        // Read it and calculate its size
+        //
+        password = reinterpret_cast<uint8_t*>(Arguments[7]);
+        passwordSize = static_cast<uint16_t>(strlen(Arguments[7]));
+        if (passwordSize == 0)
+        {
+            fprintf(stderr, "Password %s not valid!\n", Arguments[7]);
+            return -1;
+        }
+    }
+    else
+    {
+        //
+        // We'll use owner auth
+        //
+        password = nullptr;
+        passwordSize = 0;
+    }
+
+    //
+    // Define the space
+    //
+    fprintf(stderr,
+            "Creating NV space with index 0x%08x, attributes 0x%04x "
+            "and data size 0x%04x...\n\n",
+            Index.Value,
+            attributes,
+            dataSize);
+    tpmResult = TpmDefineSpace2(TpmHandle,
+                                Index,
+                                dataSize,
+                                attributes,
+                                ownerRights,
+                                authRights,
+                                passwordSize,
+                                password);
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        fprintf(stderr, "Create failed with code 0x%02x\n", tpmResult);
+        return -1;
+    }
+    fprintf(stderr, "Create completed!\n");
+    return 0;
+}
+
+const char*
+FormatRights (
+    uint8_t Rights
+    )
+{
+    if ((Rights & TpmToolReadWriteAccess) == TpmToolReadWriteAccess)
+    {
+        return "RW";
+    }
+    else if ((Rights & TpmToolReadAccess) == TpmToolReadAccess)
+    {
+        return "R";
+    }
+    return "NA";
+}
+
+void
+FormatSpaceInfo (
+    uint16_t Attributes,
+    uint8_t OwnerRights,
+    uint8_t AuthRights,
+    uint16_t DataSize,
+    PTPM_TOOL_SPACE_INFO Info
+    )
+{
+    uint32_t length;
+    uint32_t i;
+
+    //
+    // Return the size and if it's been modified yet
+    //
+    Info->DataSize = DataSize;
+    Info->Written = (Attributes & TpmToolWritten) ? "dirty" : "unwritten";
+
+    //
+    // Return the owner and authorization rights
+    //
+    Info->OwnerRights = FormatRights(OwnerRights);
+    Info->AuthRights = FormatRights(AuthRights);
+
+    //
+    // Build the list of attributes, first with the ones set at creation, and
+    // then the status attributes, separated by a plus. It is empty if none of
+    // them are set, and otherwise starts with a space.
+    //
+    length = 0;
+    for (i = 0; i < (sizeof(TpmToolAttributeNames) / sizeof(TpmToolAttributeNames[0])); i++)
+    {
+        if ((Attributes & TpmToolAttributeNames[i].Attribute) == 0)
+        {
+            continue;
+        }
+        Info->Attributes[length] = (length == 0) ? ' ' : '+';
+        length++;
+        Info->Attributes[length++] = TpmToolAttributeNames[i].Name[0];
+        Info->Attributes[length++] = TpmToolAttributeNames[i].Name[1];
+    }
+    Info->Attributes[length] = '\0';
+}
+
+void
+WriteSpaceInfo (
+    const TPM_TOOL_OPTIONS* Options,
+    uint16_t Attributes,
+    uint8_t OwnerRights,
+    uint8_t AuthRights,
+    uint16_t DataSize
+    )
+{
+    uint32_t i;
+
+    //
+    // Write the size and if it's been modified yet
+    //
+    TpmFormatInteger(Options->Writer, TpmFormatDataSize, DataSize);
+    TpmFormatBoolean(Options->Writer,
+                     TpmFormatWritten,
+                     (Attributes & TpmToolWritten) != 0);
+
+    //
+    // TLV keeps the rights and attributes as bits, which JSON turns into the
+    // same names as the text output, with one string for each attribute.
+    //
+    if (Options->Format == TpmFormatTlv)
+    {
+        TpmFormatInteger(Options->Writer, TpmFormatOwnerRights, OwnerRights);
+        TpmFormatInteger(Options->Writer, TpmFormatAuthRights, AuthRights);
+        TpmFormatInteger(Options->Writer, TpmFormatAttributes, Attributes);
+        return;
+    }
+    TpmFormatString(Options->Writer, TpmFormatOwnerRights, FormatRights(OwnerRights));
+    TpmFormatString(Options->Writer, TpmFormatAuthRights, FormatRights(AuthRights));
+    TpmFormatBeginArray(Options->Writer, TpmFormatAttributes);
+    for (i = 0; i < (sizeof(TpmToolAttributeNames) / sizeof(TpmToolAttributeNames[0])); i++)
+    {
+        if ((Attributes & TpmToolAttributeNames[i].Attribute) != 0)
+        {
+            TpmFormatString(Options->Writer, TpmFormatNone, TpmToolAttributeNames[i].Name);
+        }
+    }
+    TpmFormatEnd(Options->Writer);
+}
+
+void
+QuerySpaceMinimalOutput (
+    const TPM_TOOL_SPACE_INFO* Info
+    )
+{
+    printf("0x%04x, %s, owner rights: %s, auth rights: %s, attributes:%s",
+           Info->DataSize,
+           Info->Written,
+           Info->OwnerRights,
+           Info->AuthRights,
+           Info->Attributes);
+}
+
+int32_t
+QuerySpace (
+    int32_t ArgumentCount,
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX Index,
+    const TPM_TOOL_OPTIONS* Options
+    )
+{
+    TPM_TOOL_SPACE_INFO info;
+    uint16_t attributes;
+    uint8_t ownerRights;
+    uint8_t authRights;
+    uint16_t dataSize;
+    TPM_RC tpmResult;
+
+    //
+    // This one only takes 3 arguments
+    //
+    if (ArgumentCount != 3)
+    {
+        PrintUsage();
+        return -1;
+    }
+
+    //
+    // Query information on the given space
+    //
+    fprintf(stderr, "Querying NV space with index 0x%08x...\n\n", Index.Value);
+    tpmResult = TpmReadPublic2(TpmHandle,
+                               Index,
+                               &attributes,
+                               &ownerRights,
+                               &authRights,
+                               &dataSize);
+    if (Options->Format != TpmFormatText)
+    {
+        TpmFormatInteger(Options->Writer, TpmFormatIndex, Index.Value);
+        if (tpmResult != TPM_RC_SUCCESS)
+        {
+            TpmFormatInteger(Options->Writer, TpmFormatResult, tpmResult);
+        }
+    }
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        fprintf(stderr, "Query failed with code 0x%02x\n", tpmResult);
+        return -1;
+    }
+
+    //
+    // Write the fields into the document when one is being produced
+    //
+    if (Options->Format != TpmFormatText)
+    {
+        WriteSpaceInfo(Options, attributes, ownerRights, authRights, dataSize);
+        fprintf(stderr, "Query completed!\n");
+        return 0;
+    }
+
+    //
+    // Dump the size and if it's been modified yet
+    //
+    FormatSpaceInfo(attributes, ownerRights, authRights, dataSize, &info);
+    printf("NV_PUBLIC\n");
+    printf("=========\n");
+    printf("Data Size    : 0x%04x [%s]\n",
+            info.DataSize,
+            info.Written);
+
+    //
+    // Dump the owner and authorization rights
+    //
+    printf("Owner Rights : %s\n",
+            info.OwnerRights);
+    printf("Auth Rights  : %s\n",
+            info.AuthRights);
+
+    //
+    // Dump the attributes
+    //
+    printf("Attributes   :%s\n\n", info.Attributes);
+
+    //
+    // And final result
+    //
+    fprintf(stderr, "Query completed!\n");
+    return 0;
+}
+
+bool
+EnumerateHandle (
+    void* Context,
+    uint32_t Handle
+    )
+{
+    PTPM_TOOL_ENUMERATE_CONTEXT context;
+
+    //
+    // Print the handle to STDOUT, or add it to the document
+    //
+    context = static_cast<PTPM_TOOL_ENUMERATE_CONTEXT>(Context);
+    if (context->Options->Format == TpmFormatText)
+    {
+        printf("%s: 0x%08x\n", context->Range->Label, Handle);
+        return true;
+    }
+    TpmFormatBeginObject(context->Options->Writer, TpmFormatNone);
+    TpmFormatString(context->Options->Writer, TpmFormatRange, context->Range->Name);
+    TpmFormatInteger(context->Options->Writer, TpmFormatHandle, Handle);
+    TpmFormatEnd(context->Options->Writer);
+    return true;
+}
+
+bool
+QueryIndexCompleted (
+    void* Context,
+    uint32_t Position,
+    TPM_RC Result,
+    uint16_t Attributes,
+    uint8_t OwnerRights,
+    uint8_t AuthRights,
+    uint16_t DataSize
+    )
+{
+    PTPM_TOOL_QUERY_CONTEXT context;
+    PTPM_TOOL_QUERY_RESULT result;
+
+    //
+    // Save the result and wake up the output thread, which does the rest
+    //
+    context = static_cast<PTPM_TOOL_QUERY_CONTEXT>(Context);
+    result = &context->Results[Position];
+    {
+        std::lock_guard<std::mutex> guard(context->Lock);
+        result->Result = Result;
+        result->Attributes = Attributes;
+        result->OwnerRights = OwnerRights;
+        result->AuthRights = AuthRights;
+        result->DataSize = DataSize;
+        result->Completed = true;
+    }
+    context->Changed.notify_one();
+    return true;
+}
+
+void
+PrintQueryResults (
+    PTPM_TOOL_QUERY_CONTEXT Context
+    )
+{
+    TPM_TOOL_SPACE_INFO info;
+    PTPM_TOOL_QUERY_RESULT result;
+    uint32_t i;
+
+    //
+    // Print each index in order, as soon as its result is in, until the batch
+    // is over. In a document, each one is an object in the array of indices.
+    //
+    for (i = 0; i < Context->Count; i++)
+    {
+        result = &Context->Results[i];
+        {
+            std::unique_lock<std::mutex> guard(Context->Lock);
+            Context->Changed.wait(guard, [&] { return result->Completed || Context->Finished; });
+            if (result->Completed == false)
+            {
+                break;
+            }
+        }
+
+        if (Context->Options->Format != TpmFormatText)
+        {
+            TpmFormatBeginObject(Context->Options->Writer, TpmFormatNone);
+            TpmFormatInteger(Context->Options->Writer, TpmFormatIndex, Context->Indices[i].Value);
+            if (result->Result == TPM_RC_SUCCESS)
+            {
+                WriteSpaceInfo(Context->Options,
+                               result->Attributes,
+                               result->OwnerRights,
+                               result->AuthRights,
+                               result->DataSize);
+            }
+            else
+            {
+                TpmFormatInteger(Context->Options->Writer, TpmFormatResult, result->Result);
+            }
+            TpmFormatEnd(Context->Options->Writer);
+            continue;
+        }
+
+        printf("NV index: 0x%08x [", Context->Indices[i].Value);
+        if (result->Result == TPM_RC_SUCCESS)
+        {
+            FormatSpaceInfo(result->Attributes,
+                            result->OwnerRights,
+                            result->AuthRights,
+                            result->DataSize,
+                            &info);
+            QuerySpaceMinimalOutput(&info);
+        }
+        else
+        {
+            printf("Failed to query");
+        }
+        printf("]\n");
+    }
+}
+
+int32_t
+QueryAllSpaces (
+    uintptr_t TpmHandle,
+    const TPM_TOOL_OPTIONS* Options
+    )
+{
+    TPM_TOOL_QUERY_CONTEXT context;
+    TPM_RC tpmResult;
+    int32_t result;
+
+    //
+    // Get all the NV indices first, as they need to be known up front for all
+    // of the queries to be sent back to back.
+    //
+    result = -1;
+    context.Indices = nullptr;
+    context.Results = nullptr;
+    context.Count = 0;
+    context.Options = Options;
+    context.Finished = false;
+    if (Options->Format != TpmFormatText)
+    {
+        TpmFormatBeginArray(Options->Writer, TpmFormatIndices);
+    }
+    tpmResult = TpmNvEnumerateAll(TpmHandle, &context.Count, &context.Indices);
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        fprintf(stderr, "Enumeration failed with code 0x%02x\n", tpmResult);
+        goto Exit;
+    }
+    if (context.Count == 0)
+    {
+        result = 0;
+        goto Exit;
+    }
+    context.Results = static_cast<PTPM_TOOL_QUERY_RESULT>(
+        calloc(context.Count, sizeof(*context.Results)));
+    if (context.Results == nullptr)
+    {
+        fprintf(stderr, "Out of memory allocating %u results\n", context.Count);
+        goto Exit;
+    }
+
+    //
+    // Query all of them while the results are printed by another thread, in
+    // the order of the indices.
+    //
+    {
+        std::thread outputThread(PrintQueryResults, &context);
+        tpmResult = TpmReadPublicBatch(TpmHandle,
+                                       context.Count,
+                                       context.Indices,
+                                       QueryIndexCompleted,
+                                       &context);
+        {
+            std::lock_guard<std::mutex> guard(context.Lock);
+            context.Finished = true;
+        }
+        context.Changed.notify_one();
+        outputThread.join();
+    }
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        fprintf(stderr, "Query failed with code 0x%02x\n", tpmResult);
+        goto Exit;
+    }
+    result = 0;
+
+Exit:
+    if (Options->Format != TpmFormatText)
+    {
+        TpmFormatEnd(Options->Writer);
+    }
+    free(context.Results);
+    free(context.Indices);
+    return result;
+}
+
+int32_t
+EnumerateSpaces (
+    int32_t ArgumentCount,
+    char** Arguments,
+    uintptr_t TpmHandle,
+    bool QuerySpaces,
+    const TPM_TOOL_OPTIONS* Options
+    )
+{
+    TPM_TOOL_ENUMERATE_CONTEXT context;
+    const char* rangeName;
+    uint32_t i;
+    bool found;
+    TPM_RC tpmResult;
+    int32_t result;
+
+    //
+    // This one is special and only takes the optional handle range, which
+    // defaults to NV indices and can't be given when querying them.
+    //
+    if ((ArgumentCount != 2) && ((ArgumentCount != 3) || (QuerySpaces)))
+    {
+        PrintUsage();
+        return -1;
+    }
+    if (QuerySpaces)
+    {
+        return QueryAllSpaces(TpmHandle, Options);
+    }
+    rangeName = (ArgumentCount == 3) ? Arguments[2] : "nv";
+
+    //
+    // Walk each matching range, printing the handles as the TPM returns them,
+    // one page at a time. In a document, they all go in the same array.
+    //
+    result = -1;
+    found = false;
+    context.Options = Options;
+    if (Options->Format != TpmFormatText)
+    {
+        TpmFormatBeginArray(Options->Writer, TpmFormatHandles);
+    }
+    for (i = 0; i < (sizeof(TpmToolHandleRanges) / sizeof(TpmToolHandleRanges[0])); i++)
+    {
+        if ((strcmp(rangeName, "all") != 0) &&
+            (strcmp(rangeName, TpmToolHandleRanges[i].Name) != 0))
+        {
+            continue;
+        }
+        found = true;
+
+        context.Range = &TpmToolHandleRanges[i];
+        tpmResult = TpmEnumerateHandles(TpmHandle,
+                                        TpmToolHandleRanges[i].Type,
+                                        EnumerateHandle,
+                                        &context);
+        if (tpmResult != TPM_RC_SUCCESS)
+        {
+            fprintf(stderr, "Enumeration failed with code 0x%02x\n", tpmResult);
+            goto Exit;
+        }
+    }
+
+    //
+    // Make sure the range was valid
+    //
+    if (found == false)
+    {
+        PrintUsage();
+        goto Exit;
+    }
+    result = 0;
+
+Exit:
+    if (Options->Format != TpmFormatText)
+    {
+        TpmFormatEnd(Options->Writer);
+    }
+    return result;
+}
+
+bool
+PrintNotRestorable (
+    void* Context,
+    uint32_t Handle
+    )
+{
+    (void)Context;
+
+    //
+    // Say which indices kept whatever value they have
+    //
+    fprintf(stderr,
+            "NV space with index 0x%08x is a counter or extend index, its value was not restored\n",
+            Handle);
+    return true;
+}
+
+int32_t
+ArchiveSpaces (
+    uintptr_t TpmHandle,
+    const char* Path,
+    bool Restore
+    )
+{
+    TPM_SNAPSHOT_STATISTICS statistics;
+    TPM_RC tpmResult;
+
+    //
+    // Restore the NV spaces from the archive, after checking that it is whole
+    //
+    if (Restore)
+    {
+        fprintf(stderr, "Restoring NV spaces from snapshot %s...\n\n", Path);
+        tpmResult = TpmSnapshotRestore(TpmHandle,
+                                       Path,
+                                       PrintNotRestorable,
+                                       nullptr,
+                                       &statistics);
+        if (tpmResult == TPM_RC_INTEGRITY)
+        {
+            fprintf(stderr, "Snapshot %s is not valid or was modified!\n", Path);
+            return -1;
+        }
+        if (tpmResult != TPM_RC_SUCCESS)
+        {
+            fprintf(stderr, "Restore failed with code 0x%02x\n", tpmResult);
+            return -1;
+        }
+        fprintf(stderr,
+                "Restored %u NV spaces: %u defined, %u written, %u already matched, "
+                "%u skipped (contents could not be set by the owner), "
+                "%u skipped (counter/extend, not restorable)\n",
+                statistics.IndexCount,
+                statistics.Defined,
+                statistics.Written,
+                statistics.Unchanged,
+                statistics.Skipped,
+                statistics.NotRestorable);
+        return 0;
+    }
+    else
+    {
+        //
+        // Or save all of them into the archive
+        //
+        fprintf(stderr, "Saving NV spaces into snapshot %s...\n\n", Path);
+        tpmResult = TpmSnapshotCreate(TpmHandle, Path, &statistics);
+        if (tpmResult != TPM_RC_SUCCESS)
+        {
+            fprintf(stderr, "Snapshot failed with code 0x%02x\n", tpmResult);
+            return -1;
+        }
+        fprintf(stderr,
+                "Saved %u NV spaces, with the contents of %u of them\n",
+                statistics.IndexCount,
+                statistics.ContentCount);
+    }
+
+    //
+    // Let the user know about the contents that were left out
+    //
+    if (statistics.Skipped != 0)
+    {
+        fprintf(stderr,
+                "The contents of %u NV spaces could not be read by the owner\n",
+                statistics.Skipped);
+    }
+    return 0;
+}
+
+//
+// Manifest Apply Context
+//
+typedef struct _TPM_TOOL_APPLY_CONTEXT
+{
+    const TPM_NV_DESIRED_STATE* States;
+    FILE* Output;
+} TPM_TOOL_APPLY_CONTEXT, *PTPM_TOOL_APPLY_CONTEXT;
+
+bool
+PrintPlanOperation (
+    void* Context,
+    uint32_t Position,
+    TPM_PLAN_OPERATION Operation,
+    uint16_t DataSize
+    )
+{
+    PTPM_TOOL_APPLY_CONTEXT context;
+    uint32_t index;
+
+    //
+    // Print each step of the plan as a line of a diff against the TPM
+    //
+    context = static_cast<PTPM_TOOL_APPLY_CONTEXT>(Context);
+    index = context->States[Position].Index.Value;
+    switch (Operation)
+    {
+    case TpmPlanKeep:
+        fprintf(context->Output, "= 0x%08x unchanged\n", index);
+        break;
+    case TpmPlanUndefine:
+        fprintf(context->Output, "- 0x%08x undefine 0x%04x bytes\n", index, DataSize);
+        break;
+    case TpmPlanDefine:
+        fprintf(context->Output, "+ 0x%08x define 0x%04x bytes\n", index, DataSize);
+        break;
+    case TpmPlanWrite:
+        fprintf(context->Output, "~ 0x%08x write 0x%04x bytes that differ\n", index, DataSize);
+        break;
+    case TpmPlanSkip:
+        fprintf(context->Output, "! 0x%08x contents can't be written\n", index);
+        break;
+    }
+    return true;
+}
+
+int32_t
+ParseManifestLine (
+    char* Line,
+    PTPM_NV_DESIRED_STATE State
+    )
+{
+    char* tokens[7];
+    uint32_t tokenCount;
+    uint8_t* content;
+    size_t contentSize;
+    const char* hex;
+    char digits[3];
+    void* mapping;
+    uintptr_t mapHandle;
+    uint32_t i;
+
+    //
+    // Split the line into its fields, ignoring comments and blank lines
+    //
+    tokenCount = 0;
+    while (*Line != '\0')
+    {
+        while ((*Line == ' ') || (*Line == '\t'))
+        {
+            *Line++ = '\0';
+        }
+        if ((*Line == '\0') || (*Line == '#'))
+        {
+            break;
+        }
+        if (tokenCount == (sizeof(tokens) / sizeof(tokens[0])))
+        {
+            return -1;
+        }
+        tokens[tokenCount++] = Line;
+        while ((*Line != '\0') && (*Line != ' ') && (*Line != '\t'))
+        {
+            Line++;
+        }
+    }
+    *Line = '\0';
+    if (tokenCount == 0)
+    {
+        return 0;
+    }
 
     //
-    // This one only takes 3 arguments
+    // The index always comes first, and can be all that is needed to delete it
     //
-    if (ArgumentCount != 3)
+    State->Index.Value = strtoul(tokens[0], nullptr, 16);
+    if (State->Index.Type != TPM_HT_NV_INDEX)
     {
-        PrintUsage();
         return -1;
     }
+    if ((tokenCount == 2) && (strcmp(tokens[1], "delete") == 0))
+    {
+        State->Delete = true;
+        return 1;
+    }
 
     //
-    // Query information on the given space
+    // Otherwise it is described the same way it would be created
     //
-    fprintf(stderr, "Querying NV space with index 0x%08x...\n\n", Index.Value);
-    tpmResult = QuerySpaceInternal(TpmHandle,
-                                   Index,
-                                   &dataSize,
-                                   attributes,
-                                   ownerRights,
-                                   authRights,
-                                   attributeBuffer);
-    if (tpmResult != TPM_RC_SUCCESS)
+    if ((tokenCount < 5) ||
+        (ParseRights(tokens[1], &State->OwnerRights) == false) ||
+        (ParseRights(tokens[2], &State->AuthRights) == false))
     {
-        fprintf(stderr, "Query failed with code 0x%02x\n", tpmResult);
         return -1;
     }
+    State->Attributes = ParseAttributes(tokens[3]);
+    State->DataSize = static_cast<uint16_t>(strtoul(tokens[4], nullptr, 0));
+    if (ValidateSpaceSize(State->Attributes, State->DataSize) == false)
+    {
+        return -1;
+    }
+    if (tokenCount == 7)
+    {
+        State->AuthorizationData = reinterpret_cast<uint8_t*>(tokens[6]);
+        State->AuthorizationSize = static_cast<uint16_t>(strlen(tokens[6]));
+    }
 
     //
-    // Dump the size and if it's been modified yet
-    //
-    printf("NV_PUBLIC\n");
-    printf("=========\n");
-    printf("Data Size    : 0x%04x [%s]\n",
-            dataSize,
-            attributes);
-
-    //
-    // Dump the owner and authorization rights
-    //
-    printf("Owner Rights : %s\n",
-            ownerRights);
-    printf("Auth Rights  : %s\n",
-            authRights);
-
-    //
-    // Do the attributes, first with the ones set at creation
-    //
-    printf("Attributes   :");
-
-    //
-    // This is dirty... converts the last plus into a newline *g*
+    // Contents are optional, and given either in hex or as a file to read
     //
-    attributeBuffer[strlen(attributeBuffer) - 1] = '\n';
-    printf("%s\n", attributeBuffer);
+    if ((tokenCount < 6) || (strcmp(tokens[5], "-") == 0))
+    {
+        return 1;
+    }
+    if (strncmp(tokens[5], "hex:", 4) == 0)
+    {
+        hex = &tokens[5][4];
+        contentSize = strlen(hex) / 2;
+        if ((contentSize == 0) ||
+            ((strlen(hex) % 2) != 0) ||
+            (contentSize > State->DataSize))
+        {
+            return -1;
+        }
+        content = static_cast<uint8_t*>(malloc(contentSize));
+        if (content == nullptr)
+        {
+            return -1;
+        }
+        digits[2] = '\0';
+        for (i = 0; i < contentSize; i++)
+        {
+            digits[0] = hex[i * 2];
+            digits[1] = hex[(i * 2) + 1];
+            if ((isxdigit(static_cast<uint8_t>(digits[0])) == 0) ||
+                (isxdigit(static_cast<uint8_t>(digits[1])) == 0))
+            {
+                free(content);
+                return -1;
+            }
+            content[i] = static_cast<uint8_t>(strtoul(digits, nullptr, 16));
+        }
+    }
+    else if (strncmp(tokens[5], "file:", 5) == 0)
+    {
+        if (OsMapFile(&tokens[5][5], false, &contentSize, &mapping, &mapHandle) == false)
+        {
+            fprintf(stderr, "Unable to map contents file %s\n", &tokens[5][5]);
+            return -1;
+        }
+        content = nullptr;
+        if ((contentSize != 0) && (contentSize <= State->DataSize))
+        {
+            content = static_cast<uint8_t*>(malloc(contentSize));
+            if (content != nullptr)
+            {
+                memcpy(content, mapping, contentSize);
+            }
+        }
+        OsUnmapFile(mapping, contentSize, mapHandle);
+        if (content == nullptr)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        return -1;
+    }
+    State->Content = content;
+    State->ContentSize = static_cast<uint16_t>(contentSize);
 
     //
-    // And final result
+    // Spaces that must be written all at once need all of their contents, and
+    // bit fields need their whole value.
     //
-    fprintf(stderr, "Query completed!\n");
-    return 0;
+    if ((((State->Attributes & TpmToolWriteAll) != 0) ||
+         ((State->Attributes & TpmToolBits) != 0)) &&
+        (State->ContentSize != State->DataSize))
+    {
+        return -1;
+    }
+    if ((State->Attributes & (TpmToolCounter | TpmToolExtend)) != 0)
+    {
+        return -1;
+    }
+    return 1;
 }
 
 int32_t
-EnumerateSpaces (
-    int32_t ArgumentCount,
+ApplyManifest (
     uintptr_t TpmHandle,
-    bool QuerySpaces
+    const char* Path,
+    bool DryRun
     )
 {
-    uint32_t handleCount;
+    TPM_TOOL_APPLY_CONTEXT context;
+    TPM_PLAN_STATISTICS statistics;
+    PTPM_NV_DESIRED_STATE states;
+    PTPM_NV_DESIRED_STATE newStates;
+    uint32_t stateCount;
+    uint32_t stateCapacity;
+    char* manifest;
+    char* line;
+    char* lineEnd;
+    size_t manifestSize;
+    void* mapping;
+    uintptr_t mapHandle;
+    uint32_t lineNumber;
     uint32_t i;
-    uint32_t arraySize;
-    TPM_NV_INDEX* handleArray;
+    int32_t result;
     TPM_RC tpmResult;
 
     //
-    // This one is special and takes no other arguments
+    // Map the manifest and copy it, as its lines are split in place, and the
+    // passwords are used from there.
     //
-    if (ArgumentCount != 2)
+    if (OsMapFile(Path, false, &manifestSize, &mapping, &mapHandle) == false)
     {
-        PrintUsage();
+        fprintf(stderr, "Unable to map manifest file %s\n", Path);
         return -1;
     }
-
-    //
-    // Enumerate the NV Indices that are defined on the chip, querying only the
-    // count for now.
-    //
-    handleCount = 0;
-    tpmResult = TpmNvEnumerate2(TpmHandle, &handleCount, nullptr);
-    if (tpmResult != TPM_RC_SUCCESS)
+    manifest = static_cast<char*>(malloc(manifestSize + 1));
+    if (manifest == nullptr)
     {
-        fprintf(stderr, "Enumeration failed with code 0x%02x\n", tpmResult);
+        fprintf(stderr, "Out of memory reading the manifest\n");
+        OsUnmapFile(mapping, manifestSize, mapHandle);
         return -1;
     }
-
-    //
-    // Now that we know how many there are, allocate a big enough array.
-    // Note that there is technically a race here, and we'll just fail if so.
-    //
-    arraySize = handleCount * sizeof(*handleArray);
-    handleArray = reinterpret_cast<decltype(handleArray)>(alloca(arraySize));
-
-    //
-    // Do the second query, which will now return the actual NV index values
-    //
-    tpmResult = TpmNvEnumerate2(TpmHandle, &handleCount, handleArray);
-    if (tpmResult != TPM_RC_SUCCESS)
+    if (manifestSize != 0)
     {
-        fprintf(stderr, "Enumeration failed with code 0x%02x\n", tpmResult);
-        return -1;
+        memcpy(manifest, mapping, manifestSize);
     }
+    manifest[manifestSize] = '\0';
+    OsUnmapFile(mapping, manifestSize, mapHandle);
 
     //
-    // For each NV index, print its value to STDOUT
+    // Parse the desired state of each NV space, one per line
     //
-    for (i = 0; i < handleCount; i++)
+    result = -1;
+    states = nullptr;
+    stateCount = 0;
+    stateCapacity = 0;
+    lineNumber = 0;
+    line = manifest;
+    while (*line != '\0')
     {
-        if (QuerySpaces)
+        lineNumber++;
+        lineEnd = strchr(line, '\n');
+        if (lineEnd != nullptr)
+        {
+            *lineEnd = '\0';
+        }
+        if ((strlen(line) != 0) && (line[strlen(line) - 1] == '\r'))
+        {
+            line[strlen(line) - 1] = '\0';
+        }
+        if (stateCount == stateCapacity)
         {
-            printf("NV index: 0x%08x [", handleArray[i].Value);
-            if (QuerySpaceMinimalOutput(TpmHandle, handleArray[i]) == -1)
+            newStates = static_cast<PTPM_NV_DESIRED_STATE>(
+                realloc(states, (stateCapacity + 16) * sizeof(*states)));
+            if (newStates == nullptr)
             {
-                printf("Failed to query");
+                fprintf(stderr, "Out of memory reading the manifest\n");
+                goto Exit;
             }
-            printf("]\n");
+            states = newStates;
+            stateCapacity += 16;
         }
-        else
+        memset(&states[stateCount], 0, sizeof(states[stateCount]));
+        switch (ParseManifestLine(line, &states[stateCount]))
+        {
+        case 0:
+            break;
+        case 1:
+            for (i = 0; i < stateCount; i++)
+            {
+                if (states[i].Index.Value == states[stateCount].Index.Value)
+                {
+                    fprintf(stderr,
+                            "NV space 0x%08x appears twice in manifest line %u\n",
+                            states[i].Index.Value,
+                            lineNumber);
+                    stateCount++;
+                    goto Exit;
+                }
+            }
+            stateCount++;
+            break;
+        default:
+            fprintf(stderr, "Invalid manifest line %u\n", lineNumber);
+            stateCount++;
+            goto Exit;
+        }
+        if (lineEnd == nullptr)
         {
-            printf("NV index: 0x%08x\n", handleArray[i].Value);
+            break;
         }
+        line = lineEnd + 1;
     }
-    return 0;
+
+    //
+    // Compare it with the TPM, and carry out the plan unless only asked for it
+    //
+    fprintf(stderr,
+            "%s %u NV spaces from manifest %s...\n\n",
+            DryRun ? "Planning" : "Applying",
+            stateCount,
+            Path);
+    context.States = states;
+    context.Output = DryRun ? stdout : stderr;
+    tpmResult = TpmApplyState(TpmHandle,
+                              stateCount,
+                              states,
+                              DryRun,
+                              PrintPlanOperation,
+                              &context,
+                              &statistics);
+    if (tpmResult != TPM_RC_SUCCESS)
+    {
+        fprintf(stderr, "Apply failed with code 0x%02x\n", tpmResult);
+        goto Exit;
+    }
+    fprintf(stderr,
+            "\n%s %u undefined, %u defined, %u written, %u already matched\n",
+            DryRun ? "Would have" : "Applied manifest:",
+            statistics.Undefined,
+            statistics.Defined,
+            statistics.Written,
+            statistics.Unchanged);
+    if (statistics.Skipped != 0)
+    {
+        fprintf(stderr,
+                "The contents of %u NV spaces could not be set\n",
+                statistics.Skipped);
+    }
+    result = 0;
+
+Exit:
+    for (i = 0; i < stateCount; i++)
+    {
+        free(const_cast<uint8_t*>(states[i].Content));
+    }
+    free(states);
+    free(manifest);
+    return result;
 }
 
 int32_t
 ReadClock (
     int32_t ArgumentCount,
-    uintptr_t TpmHandle
+    uintptr_t TpmHandle,
+    const TPM_TOOL_OPTIONS* Options
     )
 {
     uint64_t timeValue;
@@ -969,7 +3181,20 @@ ReadClock (
     }
 
     //
-    // Output the result back to the user
+    // Add the result to the document when one is being produced
+    //
+    if (Options->Format != TpmFormatText)
+    {
+        TpmFormatInteger(Options->Writer, TpmFormatClock, clockValue);
+        TpmFormatInteger(Options->Writer, TpmFormatTime, timeValue);
+        TpmFormatInteger(Options->Writer, TpmFormatResets, resetCount);
+        TpmFormatInteger(Options->Writer, TpmFormatRestarts, restartCount);
+        TpmFormatBoolean(Options->Writer, TpmFormatSafe, isSafe == 1);
+        return 0;
+    }
+
+    //
+    // Otherwise, output the result back to the user
     //
     printf("Clock: %016lld\t"
             "Time: %016lld\t"
@@ -988,7 +3213,8 @@ int32_t
 GetRandom (
     int32_t ArgumentCount,
     char* Arguments[],
-    uintptr_t TpmHandle
+    uintptr_t TpmHandle,
+    const TPM_TOOL_OPTIONS* Options
     )
 {
     TPM_RC tpmResult;
@@ -1019,7 +3245,12 @@ GetRandom (
     // Allocate the output buffer
     //
     requestedBytes = static_cast<uint16_t>(userInput);
-    randomBytes = static_cast<uint8_t*>(_malloca(requestedBytes));
+    randomBytes = static_cast<uint8_t*>(malloc(requestedBytes));
+    if (randomBytes == nullptr)
+    {
+        fprintf(stderr, "Out of memory allocating %d bytes\n", requestedBytes);
+        return -1;
+    }
 
     //
     // Send the TPM command to read the information
@@ -1028,18 +3259,28 @@ GetRandom (
     if (tpmResult != TPM_RC_SUCCESS)
     {
         fprintf(stderr, "Random bytes failed with code 0x%02x\n", tpmResult);
+        free(randomBytes);
         return -1;
     }
 
     //
-    // Print the random bytes
-    //
-    printf("Received %d random bytes back...\n", requestedBytes);
-    DumpHex(randomBytes, requestedBytes);
-
-    //
-    // Output the result back to the user
+    // Write the random bytes to the output and print them. STDOUT holds the
+    // document when one is being produced, so they go in there instead.
     //
+    fprintf(stderr, "Received %d random bytes back...\n\n", requestedBytes);
+    if (Options->Format != TpmFormatText)
+    {
+        TpmFormatBytes(Options->Writer, TpmFormatRandom, randomBytes, requestedBytes);
+    }
+    if (((Options->Format == TpmFormatText) || (Options->OutputPath != nullptr)) &&
+        (WriteOutput(Options, randomBytes, requestedBytes) == false))
+    {
+        fprintf(stderr, "Failed to write data to output\n");
+        free(randomBytes);
+        return -1;
+    }
+    DumpHex(Options, randomBytes, requestedBytes);
+    free(randomBytes);
     return 0;
 }
 
@@ -1047,13 +3288,14 @@ int32_t
 GetHash (
     int32_t ArgumentCount,
     char* Arguments[],
-    uintptr_t TpmHandle
+    uintptr_t TpmHandle,
+    const TPM_TOOL_OPTIONS* Options
     )
 {
     TPM_RC tpmResult;
     uint32_t userInput;
-    uint16_t requestedBytes;
     uint8_t* data;
+    const uint8_t* input;
     uint8_t hash[32];
     size_t sizeRead;
 
@@ -1067,35 +3309,52 @@ GetHash (
     }
 
     //
-    // Check how many random bytes the user wants
+    // Check how many bytes the user wants hashed. A mapped input file is used
+    // in place, so it is only limited by what the TPM can hash in a sequence.
     //
     userInput = strtoul(Arguments[2], NULL, 0);
-    if (userInput >= USHRT_MAX)
+    if ((Options->InputPath == nullptr) && (userInput >= USHRT_MAX))
     {
         fprintf(stderr, "Bytes requested over 64KB\n");
         return -1;
     }
 
     //
-    // Allocate space for the data
+    // Allocate space for the data, unless it comes from the mapped input
     //
-    requestedBytes = static_cast<uint16_t>(userInput);
-    data = reinterpret_cast<uint8_t*>(_malloca(requestedBytes));
+    if ((Options->InputPath != nullptr) && (userInput > Options->InputSize))
+    {
+        userInput = static_cast<uint32_t>(Options->InputSize);
+    }
+    data = nullptr;
+    if (Options->InputPath == nullptr)
+    {
+        data = static_cast<uint8_t*>(malloc(userInput));
+        if (data == nullptr)
+        {
+            fprintf(stderr, "Out of memory allocating %d bytes\n", userInput);
+            return -1;
+        }
+    }
 
     //
-    // Read input
+    // Read input, and only hash what was actually there
     //
-    sizeRead = fread(data, 1, requestedBytes, stdin);
+    sizeRead = ReadInput(Options, 0, data, userInput, &input);
     if (sizeRead == 0)
     {
-        fprintf(stderr, "Could not read from STDIN\n");
+        fprintf(stderr,
+                "Could not read from %s\n",
+                (Options->InputPath != nullptr) ? Options->InputPath : "STDIN");
+        free(data);
         return -1;
     }
 
     //
-    // Send the TPM command to read the information
+    // Send the TPM command(s) to hash it
     //
-    tpmResult = TpmHash(TpmHandle, requestedBytes, data, hash);
+    tpmResult = TpmHash(TpmHandle, static_cast<uint32_t>(sizeRead), input, hash);
+    free(data);
     if (tpmResult != TPM_RC_SUCCESS)
     {
         fprintf(stderr, "Hash failed with code 0x%02x\n", tpmResult);
@@ -1103,14 +3362,14 @@ GetHash (
     }
 
     //
-    // Print the random bytes
-    //
-    DumpHex(hash, 32);
-
-    //
-    // Output the result back to the user
+    // Write the hash to the output and print it
     //
-
+    if (WriteOutput(Options, hash, sizeof(hash)) == false)
+    {
+        fprintf(stderr, "Failed to write data to output\n");
+        return -1;
+    }
+    DumpHex(Options, hash, sizeof(hash));
     return 0;
 }
 
@@ -1124,6 +3383,17 @@ main (
     bool osResult;
     TPM_NV_INDEX index;
     int32_t res;
+    const char* transport;
+    const char* recordPath;
+    TPM_TOOL_OPTIONS options;
+    int32_t optionCount;
+    void* input;
+    uintptr_t inputHandle;
+    bool structured;
+    const char* archivePath;
+    bool restore;
+    const char* manifestPath;
+    bool dryRun;
 
     //
     // Banner time!
@@ -1131,21 +3401,215 @@ main (
     fprintf(stderr, "\nTpmTool v1.2.0 - Access TPM2.0 NV Spaces\n");
     fprintf(stderr, "Copyright (C) 2020-2021 Alex Ionescu\n");
     fprintf(stderr, "@aionescu -- www.windows-internals.com\n\n");
-    if (ArgumentCount < 2)
+
+#ifdef _WIN32
+    //
+    // Data read from STDIN and written to STDOUT is raw binary, which the CRT
+    // would otherwise translate line endings in.
+    //
+    _setmode(_fileno(stdin), _O_BINARY);
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+    //
+    // Consume the global options, which come before the command itself
+    //
+    transport = nullptr;
+    recordPath = nullptr;
+    archivePath = nullptr;
+    restore = false;
+    manifestPath = nullptr;
+    dryRun = false;
+    options.Differential = false;
+    options.Compressed = false;
+    options.Quiet = false;
+    options.InputPath = nullptr;
+    options.Input = nullptr;
+    options.InputSize = 0;
+    options.OutputPath = nullptr;
+    options.Format = TpmFormatText;
+    options.Writer = 0;
+    optionCount = 0;
+    while (((optionCount + 1) < ArgumentCount) &&
+           ((strncmp(Arguments[optionCount + 1], "--", 2) == 0) ||
+            (strcmp(Arguments[optionCount + 1], "-i") == 0) ||
+            (strcmp(Arguments[optionCount + 1], "-o") == 0)))
+    {
+        if ((strcmp(Arguments[optionCount + 1], "--transport") == 0) &&
+            ((optionCount + 2) < ArgumentCount))
+        {
+            transport = Arguments[optionCount + 2];
+            optionCount += 2;
+        }
+        else if ((strcmp(Arguments[optionCount + 1], "--record") == 0) &&
+                 ((optionCount + 2) < ArgumentCount))
+        {
+            recordPath = Arguments[optionCount + 2];
+            optionCount += 2;
+        }
+        else if (((strcmp(Arguments[optionCount + 1], "--snapshot") == 0) ||
+                  (strcmp(Arguments[optionCount + 1], "--restore") == 0)) &&
+                 ((optionCount + 2) < ArgumentCount) &&
+                 (archivePath == nullptr))
+        {
+            restore = (strcmp(Arguments[optionCount + 1], "--restore") == 0);
+            archivePath = Arguments[optionCount + 2];
+            optionCount += 2;
+        }
+        else if ((strcmp(Arguments[optionCount + 1], "--apply") == 0) &&
+                 ((optionCount + 2) < ArgumentCount))
+        {
+            manifestPath = Arguments[optionCount + 2];
+            optionCount += 2;
+        }
+        else if (strcmp(Arguments[optionCount + 1], "--dry-run") == 0)
+        {
+            dryRun = true;
+            optionCount += 1;
+        }
+        else if ((strcmp(Arguments[optionCount + 1], "-i") == 0) &&
+                 ((optionCount + 2) < ArgumentCount))
+        {
+            options.InputPath = Arguments[optionCount + 2];
+            optionCount += 2;
+        }
+        else if ((strcmp(Arguments[optionCount + 1], "-o") == 0) &&
+                 ((optionCount + 2) < ArgumentCount))
+        {
+            options.OutputPath = Arguments[optionCount + 2];
+            optionCount += 2;
+        }
+        else if ((strcmp(Arguments[optionCount + 1], "--quiet") == 0) ||
+                 (strcmp(Arguments[optionCount + 1], "--no-dump") == 0))
+        {
+            options.Quiet = true;
+            optionCount += 1;
+        }
+        else if (strcmp(Arguments[optionCount + 1], "--json") == 0)
+        {
+            options.Format = TpmFormatJson;
+            optionCount += 1;
+        }
+        else if (strcmp(Arguments[optionCount + 1], "--tlv") == 0)
+        {
+            options.Format = TpmFormatTlv;
+            optionCount += 1;
+        }
+        else if (strcmp(Arguments[optionCount + 1], "--diff") == 0)
+        {
+            options.Differential = true;
+            optionCount += 1;
+        }
+        else if (strcmp(Arguments[optionCount + 1], "--compress") == 0)
+        {
+            options.Compressed = true;
+            optionCount += 1;
+        }
+        else
+        {
+            PrintUsage();
+            return -1;
+        }
+    }
+
+    //
+    // Compressed data changes entirely when its input does, so there is little
+    // left for a differential write to skip.
+    //
+    if ((options.Differential) && (options.Compressed))
+    {
+        fprintf(stderr, "--diff and --compress can't be used together\n");
+        return -1;
+    }
+
+    //
+    // Shift them out so that each command sees its arguments where it expects
+    //
+    Arguments[optionCount] = Arguments[0];
+    Arguments += optionCount;
+    ArgumentCount -= optionCount;
+    if (((ArgumentCount < 2) != ((archivePath != nullptr) || (manifestPath != nullptr))) ||
+        ((archivePath != nullptr) && (manifestPath != nullptr)) ||
+        ((dryRun) && (manifestPath == nullptr)))
     {
         PrintUsage();
         return -1;
     }
 
+    //
+    // Only the commands that report information can produce a document, as
+    // the others can write raw data to STDOUT.
+    //
+    if (options.Format != TpmFormatText)
+    {
+        structured = (archivePath == nullptr) &&
+                     (manifestPath == nullptr) &&
+                     ((strcmp(Arguments[1], "-e") == 0) ||
+                     (strcmp(Arguments[1], "-qa") == 0) ||
+                     (strcmp(Arguments[1], "-t") == 0) ||
+                     (strcmp(Arguments[1], "-r") == 0) ||
+                     ((ArgumentCount > 2) && (strcmp(Arguments[2], "-q") == 0)));
+        if (structured == false)
+        {
+            fprintf(stderr, "--json and --tlv can only be used with -q, -qa, -e, -t and -r\n");
+            return -1;
+        }
+    }
+
+    //
+    // Map the whole input file, which is then used in place
+    //
+    input = nullptr;
+    inputHandle = 0;
+    if (options.InputPath != nullptr)
+    {
+        if (OsMapFile(options.InputPath, false, &options.InputSize, &input, &inputHandle) == false)
+        {
+            fprintf(stderr, "Unable to map input file %s\n", options.InputPath);
+            return -1;
+        }
+        options.Input = static_cast<const uint8_t*>(input);
+    }
+
     //
     // First, try to get access to the chip
     //
-    osResult = TpmOsOpen(&tpmHandle);
+    osResult = (transport != nullptr) ? TpmOpenTransport(transport, &tpmHandle) :
+                                        TpmOsOpen(&tpmHandle);
     if (osResult == false)
     {
-        fprintf(stderr, "Unable to open TPM Base Stack or Resource Manager\n");
+        fprintf(stderr, "Unable to open TPM Base Stack, Resource Manager or transport\n");
+        OsUnmapFile(input, options.InputSize, inputHandle);
+        return -1;
+    }
+
+    //
+    // Capture every command and response if asked to
+    //
+    if ((recordPath != nullptr) &&
+        (TpmRecordTransport(tpmHandle, recordPath) == false))
+    {
+        fprintf(stderr, "Unable to create capture file %s\n", recordPath);
+        TpmOsClose(tpmHandle);
+        OsUnmapFile(input, options.InputSize, inputHandle);
+        return -1;
+    }
+
+    //
+    // Start the document, which every command adds its fields to
+    //
+    if ((options.Format != TpmFormatText) &&
+        (TpmFormatOpen(options.Format, _fileno(stdout), &options.Writer) == false))
+    {
+        fprintf(stderr, "Out of memory allocating the output writer\n");
+        TpmOsClose(tpmHandle);
+        OsUnmapFile(input, options.InputSize, inputHandle);
         return -1;
     }
+    if (options.Writer != 0)
+    {
+        TpmFormatBeginObject(options.Writer, TpmFormatNone);
+    }
 
     //
     // Assume failure until a valid command is found and executed
@@ -1155,34 +3619,42 @@ main (
     //
     // Check for options with no other arguments
     //
-    if (strcmp(Arguments[1], "-e") == 0)
+    if (archivePath != nullptr)
+    {
+        res = ArchiveSpaces(tpmHandle, archivePath, restore);
+    }
+    else if (manifestPath != nullptr)
+    {
+        res = ApplyManifest(tpmHandle, manifestPath, dryRun);
+    }
+    else if (strcmp(Arguments[1], "-e") == 0)
     {
-        res = EnumerateSpaces(ArgumentCount, tpmHandle, false);
+        res = EnumerateSpaces(ArgumentCount, Arguments, tpmHandle, false, &options);
     }
     else if (strcmp(Arguments[1], "-qa") == 0)
     {
-        res = EnumerateSpaces(ArgumentCount, tpmHandle, true);
+        res = EnumerateSpaces(ArgumentCount, Arguments, tpmHandle, true, &options);
     }
     else if (strcmp(Arguments[1], "-t") == 0)
     {
         //
         // Get time info
         //
-        res = ReadClock(ArgumentCount, tpmHandle);
+        res = ReadClock(ArgumentCount, tpmHandle, &options);
     }
     else if (strcmp(Arguments[1], "-r") == 0)
     {
         //
         // Get random bytes
         //
-        res = GetRandom(ArgumentCount, Arguments, tpmHandle);
+        res = GetRandom(ArgumentCount, Arguments, tpmHandle, &options);
     }
     else if (strcmp(Arguments[1], "-h") == 0)
     {
         //
         // Get hash
         //
-        res = GetHash(ArgumentCount, Arguments, tpmHandle);
+        res = GetHash(ArgumentCount, Arguments, tpmHandle, &options);
     }
     else
     {
@@ -1214,11 +3686,11 @@ main (
         }
         else if (strcmp(Arguments[2], "-w") == 0)
         {
-            res = WriteSpace(ArgumentCount, Arguments, tpmHandle, index);
+            res = WriteSpace(ArgumentCount, Arguments, tpmHandle, index, &options);
         }
         else if (strcmp(Arguments[2], "-r") == 0)
         {
-            res = ReadSpace(ArgumentCount, Arguments, tpmHandle, index);
+            res = ReadSpace(ArgumentCount, Arguments, tpmHandle, index, &options);
         }
         else if (strcmp(Arguments[2], "-d") == 0)
         {
@@ -1234,7 +3706,31 @@ main (
         }
         else if (strcmp(Arguments[2], "-q") == 0)
         {
-            res = QuerySpace(ArgumentCount, tpmHandle, index);
+            res = QuerySpace(ArgumentCount, tpmHandle, index, &options);
+        }
+        else if (strcmp(Arguments[2], "-inc") == 0)
+        {
+            res = UpdateSpace(ArgumentCount, Arguments, tpmHandle, index, false);
+        }
+        else if (strcmp(Arguments[2], "-sb") == 0)
+        {
+            res = UpdateSpace(ArgumentCount, Arguments, tpmHandle, index, true);
+        }
+        else if (strcmp(Arguments[2], "-kv") == 0)
+        {
+            res = KeyValueStore(ArgumentCount, Arguments, tpmHandle, index, &options);
+        }
+        else if (strcmp(Arguments[2], "-ring") == 0)
+        {
+            res = RecordRing(ArgumentCount, Arguments, tpmHandle, index, &options);
+        }
+        else if (strcmp(Arguments[2], "-log") == 0)
+        {
+            res = LogEvents(ArgumentCount, Arguments, tpmHandle, index);
+        }
+        else if (strcmp(Arguments[2], "-vl") == 0)
+        {
+            res = VerifyLog(ArgumentCount, Arguments, tpmHandle, index);
         }
         else
         {
@@ -1247,8 +3743,22 @@ main (
     }
 Exit:
     //
-    // Close the handle and return
+    // Finish the document, which must have been written whole
+    //
+    if (options.Writer != 0)
+    {
+        TpmFormatEnd(options.Writer);
+        if (TpmFormatClose(options.Writer) == false)
+        {
+            fprintf(stderr, "Failed to write the output document\n");
+            res = -1;
+        }
+    }
+
+    //
+    // Close the handle, release the input and return
     //
     TpmOsClose(tpmHandle);
+    OsUnmapFile(input, options.InputSize, inputHandle);
     return res;
 }
@@ -71,8 +71,241 @@ typedef enum _TPM_TOOL_ATTRIBUTES : uint16_t
     TpmToolWriteLocked = (1 << 9),
     TpmToolWritten = (1 << 10),
     TpmToolPlatformOwned = (1 << 11),
+    //
+    // Index types, ordinary unless one is set
+    //
+    TpmToolCounter = (1 << 12),
+    TpmToolBits = (1 << 13),
+    TpmToolExtend = (1 << 14),
 } TPM_TOOL_ATTRIBUTES;
 
+//
+// Machine-readable output formats, and the fields that can be written in them.
+// Field values are also their tag in the TLV format, so they must not change.
+//
+typedef enum _TPM_FORMAT_TYPE
+{
+    TpmFormatText,
+    TpmFormatJson,
+    TpmFormatTlv
+} TPM_FORMAT_TYPE;
+
+typedef enum _TPM_FORMAT_FIELD : uint8_t
+{
+    TpmFormatNone,
+    TpmFormatIndex,
+    TpmFormatResult,
+    TpmFormatDataSize,
+    TpmFormatWritten,
+    TpmFormatOwnerRights,
+    TpmFormatAuthRights,
+    TpmFormatAttributes,
+    TpmFormatIndices,
+    TpmFormatHandles,
+    TpmFormatRange,
+    TpmFormatHandle,
+    TpmFormatClock,
+    TpmFormatTime,
+    TpmFormatResets,
+    TpmFormatRestarts,
+    TpmFormatSafe,
+    TpmFormatRandom
+} TPM_FORMAT_FIELD;
+
+//
+// Savings of a differential write compared to writing all of the data
+//
+typedef struct _TPM_NV_WRITE_STATISTICS
+{
+    uint16_t BytesWritten;
+    uint16_t BytesSkipped;
+    uint32_t WritesIssued;
+    uint32_t WritesAvoided;
+} TPM_NV_WRITE_STATISTICS, *PTPM_NV_WRITE_STATISTICS;
+
+//
+// Progress of an audit log. Events are pending until the batch that holds
+// them has been extended into the NV index of the log.
+//
+typedef struct _TPM_AUDIT_STATISTICS
+{
+    uint32_t EventCount;
+    uint32_t BatchCount;
+    uint32_t PendingCount;
+} TPM_AUDIT_STATISTICS, *PTPM_AUDIT_STATISTICS;
+
+//
+// Outcome of a snapshot of the NV indices of the owner, or of its restore.
+// Contents are skipped when they can't be read or written by the owner.
+// Each restored index is counted once, and counters and extend indices are
+// always counted as not restorable, as their value can't be set.
+//
+typedef struct _TPM_SNAPSHOT_STATISTICS
+{
+    uint32_t IndexCount;
+    uint32_t ContentCount;
+    uint32_t Defined;
+    uint32_t Written;
+    uint32_t Unchanged;
+    uint32_t Skipped;
+    uint32_t NotRestorable;
+} TPM_SNAPSHOT_STATISTICS, *PTPM_SNAPSHOT_STATISTICS;
+
+//
+// Room that a key-value store has for a given key. The largest value is what
+// a pool could hold for it if it were empty, and the free value is what the
+// pools can hold for it right now, once compacted and without its old value.
+//
+typedef struct _TPM_KV_LIMITS
+{
+    uint16_t MaximumValueSize;
+    uint16_t FreeValueSize;
+    uint16_t EntryCount;
+    uint16_t EntryCapacity;
+    bool Replacing;
+} TPM_KV_LIMITS, *PTPM_KV_LIMITS;
+
+//
+// Desired state of an NV index, as applied by a plan. The password is only
+// used to define the index, and to write its contents when the owner can't.
+// Contents are written from the start of the index, and are left alone when
+// there are none.
+//
+typedef struct _TPM_NV_DESIRED_STATE
+{
+    TPM_NV_INDEX Index;
+    bool Delete;
+    uint16_t DataSize;
+    uint16_t Attributes;
+    uint8_t OwnerRights;
+    uint8_t AuthRights;
+    uint16_t AuthorizationSize;
+    uint8_t* AuthorizationData;
+    uint16_t ContentSize;
+    const uint8_t* Content;
+} TPM_NV_DESIRED_STATE, *PTPM_NV_DESIRED_STATE;
+
+//
+// Operations that make up a plan, and how many of each were needed
+//
+typedef enum _TPM_PLAN_OPERATION
+{
+    TpmPlanKeep,
+    TpmPlanUndefine,
+    TpmPlanDefine,
+    TpmPlanWrite,
+    TpmPlanSkip
+} TPM_PLAN_OPERATION;
+
+typedef struct _TPM_PLAN_STATISTICS
+{
+    uint32_t Undefined;
+    uint32_t Defined;
+    uint32_t Written;
+    uint32_t Unchanged;
+    uint32_t Skipped;
+} TPM_PLAN_STATISTICS, *PTPM_PLAN_STATISTICS;
+
+//
+// Receives each piece of data as it is read from an NV index, in order. The
+// data is only valid during the call, and returning false stops the read.
+//
+typedef
+bool
+(*PTPM_NV_READ_CALLBACK) (
+    void* Context,
+    const uint8_t* Data,
+    uint16_t DataSize
+    );
+
+//
+// Provides the data for each piece written to an NV index, in order. The data
+// must remain valid until the callback is called twice more, or the write is
+// over, as one piece is being written while the next one is prepared.
+// Returning false stops the write.
+//
+typedef
+bool
+(*PTPM_NV_WRITE_CALLBACK) (
+    void* Context,
+    uint16_t DataSize,
+    const uint8_t** Data
+    );
+
+//
+// Receives each handle found by an enumeration, in ascending order. Commands
+// may be issued from within the callback. Returning false stops the
+// enumeration.
+//
+typedef
+bool
+(*PTPM_HANDLE_CALLBACK) (
+    void* Context,
+    uint32_t Handle
+    );
+
+//
+// Receives each key of a key-value store along with the size of its value,
+// grouped by the pool index that holds them. Returning false stops the list.
+//
+typedef
+bool
+(*PTPM_KV_LIST_CALLBACK) (
+    void* Context,
+    const char* Key,
+    uint16_t ValueSize
+    );
+
+//
+// Receives the public area of each NV index read by a batch, along with its
+// position in the batch. Indices are not returned in order, as several of
+// them can be in flight at once. Returning false stops the batch.
+//
+typedef
+bool
+(*PTPM_READ_PUBLIC_CALLBACK) (
+    void* Context,
+    uint32_t Position,
+    TPM_RC Result,
+    uint16_t Attributes,
+    uint8_t OwnerRights,
+    uint8_t AuthRights,
+    uint16_t DataSize
+    );
+
+//
+// Receives each piece of data read from the NV indices of a batch, in order,
+// along with the position of the index in the batch and the offset of the
+// data. An index that can't be read is handed out once with the result and
+// no data, and the rest of it is skipped. The data is only valid during the
+// call, and returning false stops the batch.
+//
+typedef
+bool
+(*PTPM_NV_READ_BATCH_CALLBACK) (
+    void* Context,
+    uint32_t Position,
+    TPM_RC Result,
+    uint16_t Offset,
+    const uint8_t* Data,
+    uint16_t DataSize
+    );
+
+//
+// Receives each operation of a plan before it is carried out, along with the
+// position of its index in the desired state. The size is that of the index
+// for definitions, and the number of bytes that change for writes. Returning
+// false stops the plan.
+//
+typedef
+bool
+(*PTPM_PLAN_CALLBACK) (
+    void* Context,
+    uint32_t Position,
+    TPM_PLAN_OPERATION Operation,
+    uint16_t DataSize
+    );
+
 //
 // TpmTool API
 //
@@ -81,6 +314,18 @@ TpmOsOpen (
     uintptr_t* TpmHandle
     );
 
+bool
+TpmOpenTransport (
+    const char* Transport,
+    uintptr_t* TpmHandle
+    );
+
+bool
+TpmRecordTransport (
+    uintptr_t TpmHandle,
+    const char* Path
+    );
+
 bool
 TpmOsClose (
     uintptr_t TpmHandle
@@ -91,7 +336,7 @@ TpmDefineSpace2 (
     uintptr_t TpmHandle,
     TPM_NV_INDEX HandleIndex,
     uint16_t SpaceSize,
-    uint8_t Attributes,
+    uint16_t Attributes,
     uint8_t OwnerRights,
     uint8_t AuthRights,
     uint16_t AuthorizationSize,
@@ -106,7 +351,62 @@ TpmNvWrite2 (
     uint8_t* AuthorizationData,
     uint16_t Offset,
     uint16_t DataSize,
-    uint8_t* Data
+    const uint8_t* Data
+    );
+
+TPM_RC
+TpmNvWriteDifferential (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX HandleIndex,
+    uint16_t AuthorizationSize,
+    uint8_t* AuthorizationData,
+    uint16_t Offset,
+    uint16_t DataSize,
+    const uint8_t* Data,
+    PTPM_NV_WRITE_STATISTICS Statistics
+    );
+
+TPM_RC
+TpmNvWriteChanges (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX HandleIndex,
+    uint16_t AuthorizationSize,
+    uint8_t* AuthorizationData,
+    uint16_t Offset,
+    uint16_t DataSize,
+    const uint8_t* Current,
+    const uint8_t* Data,
+    PTPM_NV_WRITE_STATISTICS Statistics
+    );
+
+TPM_RC
+TpmNvWriteCompressed (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX HandleIndex,
+    uint16_t AuthorizationSize,
+    uint8_t* AuthorizationData,
+    uint16_t Offset,
+    uint16_t DataSize,
+    const uint8_t* Data,
+    uint16_t* StoredSize
+    );
+
+TPM_RC
+TpmNvWriteStream (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX HandleIndex,
+    uint16_t AuthorizationSize,
+    uint8_t* AuthorizationData,
+    uint16_t Offset,
+    uint16_t DataSize,
+    PTPM_NV_WRITE_CALLBACK Callback,
+    void* CallbackContext
+    );
+
+uint16_t
+TpmNvWriteChunkSize (
+    uintptr_t TpmHandle,
+    uint16_t AuthorizationSize
     );
 
 TPM_RC
@@ -120,6 +420,52 @@ TpmNvRead2 (
     uint8_t* Data
     );
 
+TPM_RC
+TpmNvReadCompressed (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX HandleIndex,
+    uint16_t AuthorizationSize,
+    uint8_t* AuthorizationData,
+    uint16_t Offset,
+    uint16_t MaximumSize,
+    uint16_t* DataSize,
+    uint8_t* Data,
+    uint16_t* StoredSize
+    );
+
+TPM_RC
+TpmNvReadView (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX HandleIndex,
+    uint16_t AuthorizationSize,
+    uint8_t* AuthorizationData,
+    uint16_t Offset,
+    uint16_t DataSize,
+    const uint8_t** Data
+    );
+
+TPM_RC
+TpmNvReadStream (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX HandleIndex,
+    uint16_t AuthorizationSize,
+    uint8_t* AuthorizationData,
+    uint16_t Offset,
+    uint16_t DataSize,
+    PTPM_NV_READ_CALLBACK Callback,
+    void* CallbackContext
+    );
+
+TPM_RC
+TpmNvReadBatch (
+    uintptr_t TpmHandle,
+    uint32_t IndexCount,
+    const TPM_NV_INDEX* IndexArray,
+    const uint16_t* DataSizes,
+    PTPM_NV_READ_BATCH_CALLBACK Callback,
+    void* CallbackContext
+    );
+
 TPM_RC
 TpmUndefineSpace2 (
     uintptr_t TpmHandle,
@@ -142,6 +488,33 @@ TpmWriteLock2 (
     uint8_t* AuthorizationData
     );
 
+TPM_RC
+TpmNvIncrement2 (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX HandleIndex,
+    uint16_t AuthorizationSize,
+    uint8_t* AuthorizationData
+    );
+
+TPM_RC
+TpmNvSetBits2 (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX HandleIndex,
+    uint16_t AuthorizationSize,
+    uint8_t* AuthorizationData,
+    uint64_t Bits
+    );
+
+TPM_RC
+TpmNvExtend2 (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX HandleIndex,
+    uint16_t AuthorizationSize,
+    uint8_t* AuthorizationData,
+    uint16_t DataSize,
+    uint8_t* Data
+    );
+
 TPM_RC
 TpmReadPublic2 (
     uintptr_t TpmHandle,
@@ -152,6 +525,33 @@ TpmReadPublic2 (
     uint16_t* DataSize
     );
 
+TPM_RC
+TpmReadPublicCached (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX HandleIndex,
+    uint16_t* Attributes,
+    uint8_t* OwnerRights,
+    uint8_t* AuthRights,
+    uint16_t* DataSize
+    );
+
+TPM_RC
+TpmReadPublicBatch (
+    uintptr_t TpmHandle,
+    uint32_t IndexCount,
+    const TPM_NV_INDEX* IndexArray,
+    PTPM_READ_PUBLIC_CALLBACK Callback,
+    void* CallbackContext
+    );
+
+TPM_RC
+TpmEnumerateHandles (
+    uintptr_t TpmHandle,
+    TPM_HT HandleType,
+    PTPM_HANDLE_CALLBACK Callback,
+    void* CallbackContext
+    );
+
 TPM_RC
 TpmNvEnumerate2 (
     uintptr_t TpmHandle,
@@ -159,6 +559,13 @@ TpmNvEnumerate2 (
     TPM_NV_INDEX* IndexArray
     );
 
+TPM_RC
+TpmNvEnumerateAll (
+    uintptr_t TpmHandle,
+    uint32_t* IndexCount,
+    TPM_NV_INDEX** IndexArray
+    );
+
 TPM_RC
 TpmReadClock (
     uintptr_t TpmHandle,
@@ -179,7 +586,264 @@ TpmGetRandom (
 TPM_RC
 TpmHash (
     uintptr_t TpmHandle,
-    uint16_t InputSize,
-    uint8_t* InputData,
+    uint32_t InputSize,
+    const uint8_t* InputData,
     uint8_t* OutputData
+    );
+
+TPM_RC
+TpmGetProperties (
+    uintptr_t TpmHandle,
+    TPM_PT Property,
+    uint32_t PropertyCount,
+    uint32_t* Values
+    );
+
+TPM_RC
+TpmAuditOpen (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX HandleIndex,
+    uint16_t AuthorizationSize,
+    uint8_t* AuthorizationData,
+    const char* Path,
+    uint32_t WindowEvents,
+    uint32_t WindowMilliseconds,
+    uintptr_t* AuditHandle
+    );
+
+TPM_RC
+TpmAuditAppend (
+    uintptr_t AuditHandle,
+    const uint8_t* Event,
+    uint32_t EventSize
+    );
+
+TPM_RC
+TpmAuditFlush (
+    uintptr_t AuditHandle
+    );
+
+TPM_RC
+TpmAuditClose (
+    uintptr_t AuditHandle,
+    PTPM_AUDIT_STATISTICS Statistics
+    );
+
+TPM_RC
+TpmAuditVerify (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX HandleIndex,
+    uint16_t AuthorizationSize,
+    uint8_t* AuthorizationData,
+    const char* Path,
+    PTPM_AUDIT_STATISTICS Statistics
+    );
+
+TPM_RC
+TpmKvFormat (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX DirectoryIndex,
+    uint16_t PoolCount,
+    uint16_t PoolSize,
+    uint16_t EntryCapacity,
+    uint16_t AuthorizationSize,
+    uint8_t* AuthorizationData
+    );
+
+TPM_RC
+TpmKvOpen (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX DirectoryIndex,
+    uint16_t AuthorizationSize,
+    uint8_t* AuthorizationData,
+    uintptr_t* KvHandle
+    );
+
+TPM_RC
+TpmKvGet (
+    uintptr_t KvHandle,
+    const char* Key,
+    uint16_t* ValueSize,
+    uint8_t* Value
+    );
+
+TPM_RC
+TpmKvPut (
+    uintptr_t KvHandle,
+    const char* Key,
+    uint16_t ValueSize,
+    const uint8_t* Value
+    );
+
+void
+TpmKvQueryLimits (
+    uintptr_t KvHandle,
+    const char* Key,
+    PTPM_KV_LIMITS Limits
+    );
+
+TPM_RC
+TpmKvDelete (
+    uintptr_t KvHandle,
+    const char* Key
+    );
+
+TPM_RC
+TpmKvList (
+    uintptr_t KvHandle,
+    PTPM_KV_LIST_CALLBACK Callback,
+    void* CallbackContext
+    );
+
+void
+TpmKvClose (
+    uintptr_t KvHandle
+    );
+
+TPM_RC
+TpmRingFormat (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX BaseIndex,
+    uint16_t SegmentCount,
+    uint16_t SegmentSize,
+    uint16_t AuthorizationSize,
+    uint8_t* AuthorizationData
+    );
+
+TPM_RC
+TpmRingOpen (
+    uintptr_t TpmHandle,
+    TPM_NV_INDEX BaseIndex,
+    uint16_t SegmentCount,
+    uint16_t AuthorizationSize,
+    uint8_t* AuthorizationData,
+    uintptr_t* RingHandle
+    );
+
+TPM_RC
+TpmRingAppend (
+    uintptr_t RingHandle,
+    uint16_t DataSize,
+    const uint8_t* Data
+    );
+
+TPM_RC
+TpmRingRead (
+    uintptr_t RingHandle,
+    uint16_t* DataSize,
+    uint8_t* Data,
+    uint32_t* Sequence
+    );
+
+void
+TpmRingClose (
+    uintptr_t RingHandle
+    );
+
+TPM_RC
+TpmSnapshotCreate (
+    uintptr_t TpmHandle,
+    const char* Path,
+    PTPM_SNAPSHOT_STATISTICS Statistics
+    );
+
+TPM_RC
+TpmSnapshotRestore (
+    uintptr_t TpmHandle,
+    const char* Path,
+    PTPM_HANDLE_CALLBACK NotRestorableCallback,
+    void* CallbackContext,
+    PTPM_SNAPSHOT_STATISTICS Statistics
+    );
+
+TPM_RC
+TpmApplyState (
+    uintptr_t TpmHandle,
+    uint32_t StateCount,
+    const TPM_NV_DESIRED_STATE* States,
+    bool DryRun,
+    PTPM_PLAN_CALLBACK Callback,
+    void* CallbackContext,
+    PTPM_PLAN_STATISTICS Statistics
+    );
+
+bool
+TpmFormatOpen (
+    TPM_FORMAT_TYPE Type,
+    int FileDescriptor,
+    uintptr_t* FormatHandle
+    );
+
+void
+TpmFormatBeginObject (
+    uintptr_t FormatHandle,
+    TPM_FORMAT_FIELD Field
+    );
+
+void
+TpmFormatBeginArray (
+    uintptr_t FormatHandle,
+    TPM_FORMAT_FIELD Field
+    );
+
+void
+TpmFormatEnd (
+    uintptr_t FormatHandle
+    );
+
+void
+TpmFormatInteger (
+    uintptr_t FormatHandle,
+    TPM_FORMAT_FIELD Field,
+    uint64_t Value
+    );
+
+void
+TpmFormatBoolean (
+    uintptr_t FormatHandle,
+    TPM_FORMAT_FIELD Field,
+    bool Value
+    );
+
+void
+TpmFormatString (
+    uintptr_t FormatHandle,
+    TPM_FORMAT_FIELD Field,
+    const char* Value
+    );
+
+void
+TpmFormatBytes (
+    uintptr_t FormatHandle,
+    TPM_FORMAT_FIELD Field,
+    const uint8_t* Data,
+    size_t DataSize
+    );
+
+bool
+TpmFormatClose (
+    uintptr_t FormatHandle
+    );
+
+bool
+OsMapFile (
+    const char* Path,
+    bool Write,
+    size_t* Size,
+    void** Base,
+    uintptr_t* MapHandle
+    );
+
+bool
+OsUnmapFile (
+    void* Base,
+    size_t Size,
+    uintptr_t MapHandle
+    );
+
+bool
+OsWriteFile (
+    int FileDescriptor,
+    const uint8_t* Buffer,
+    size_t Size
     );
\ No newline at end of file
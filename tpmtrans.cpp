@@ -0,0 +1,777 @@
+/*++
+
+Copyright (c) Alex Ionescu.  All rights reserved.
+
+Module Name:
+
+    tpmtrans.cpp
+
+Abstract:
+
+    This module implements the selection of the transport that TPM2.0 commands
+    are sent through, such as the OS TPM stack or a TPM simulator, and the
+    dispatching of each command to it.
+
+Author:
+
+    Alex Ionescu (@aionescu) 16-Oct-2026 - Initial version
+
+Environment:
+
+    Portable to any environment.
+
+--*/
+
+#ifdef _MSC_VER
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include "tpmtool.hpp"
+#include "tpmcmd.hpp"
+
+//
+// List of transports which can be selected by name
+//
+static const TPM_TRANSPORT* TpmpTransports[] =
+{
+    &TpmOsTransport,
+    &TpmSimTransport,
+    &TpmSwtpmTransport,
+    &TpmEmuTransport,
+    &TpmReplayTransport
+};
+
+bool
+TpmpAllocateArena (
+    PTPM_CONTEXT Context,
+    uint32_t CommandBufferSize,
+    uint32_t ResponseBufferSize
+    )
+{
+    size_t commandArea;
+    size_t responseArea;
+    uint8_t* arena;
+
+    //
+    // Round each buffer up to whole pages, so that both start page-aligned
+    //
+    commandArea = (CommandBufferSize + TPM_ARENA_PAGE_SIZE - 1) &
+                  ~static_cast<size_t>(TPM_ARENA_PAGE_SIZE - 1);
+    responseArea = (ResponseBufferSize + TPM_ARENA_PAGE_SIZE - 1) &
+                   ~static_cast<size_t>(TPM_ARENA_PAGE_SIZE - 1);
+    arena = static_cast<uint8_t*>(OsAllocatePages(commandArea + responseArea));
+    if (arena == nullptr)
+    {
+        return false;
+    }
+
+    //
+    // Replace the previous arena, if any
+    //
+    if (Context->CommandBuffer != nullptr)
+    {
+        OsFreePages(Context->CommandBuffer, Context->ArenaSize);
+    }
+    Context->CommandBuffer = arena;
+    Context->CommandBufferSize = CommandBufferSize;
+    Context->ResponseBuffer = arena + commandArea;
+    Context->ResponseBufferSize = ResponseBufferSize;
+    Context->ArenaSize = commandArea + responseArea;
+    return true;
+}
+
+void
+TpmpQueryLimits (
+    PTPM_CONTEXT Context,
+    bool UseCache
+    )
+{
+    uint32_t commandSize;
+    uint32_t responseSize;
+
+    //
+    // Discover the properties of the TPM, which include the largest command,
+    // response and NV buffer it supports. Transports that cannot answer (such
+    // as a replayed capture which did not record the discovery) keep the
+    // default arena and NV buffer size.
+    //
+    Context->NvBufferMax = TPM_NV_BUFFER_DEFAULT;
+    if (TpmPropDiscover(Context, UseCache) == false)
+    {
+        return;
+    }
+    if (TpmPropGet(Context, TPM_PT_NV_BUFFER_MAX) != 0)
+    {
+        Context->NvBufferMax = TpmPropGet(Context, TPM_PT_NV_BUFFER_MAX);
+    }
+
+    //
+    // Resize the arena if the TPM supports larger buffers than the default
+    //
+    commandSize = TpmPropGet(Context, TPM_PT_MAX_COMMAND_SIZE);
+    responseSize = TpmPropGet(Context, TPM_PT_MAX_RESPONSE_SIZE);
+    if ((commandSize < TPM_ARENA_DEFAULT_SIZE) || (commandSize > TPM_ARENA_MAXIMUM_SIZE) ||
+        (responseSize < TPM_ARENA_DEFAULT_SIZE) || (responseSize > TPM_ARENA_MAXIMUM_SIZE))
+    {
+        return;
+    }
+    if ((commandSize != Context->CommandBufferSize) ||
+        (responseSize != Context->ResponseBufferSize))
+    {
+        TpmpAllocateArena(Context, commandSize, responseSize);
+    }
+}
+
+const TPM_TRANSPORT*
+TpmpLookupTransport (
+    const char* Specification,
+    const char** Parameters
+    )
+{
+    const char* separator;
+    size_t nameLength;
+    uint32_t i;
+
+    //
+    // The specification is "name[:parameters]", where the parameters are only
+    // interpreted by the transport itself.
+    //
+    separator = strchr(Specification, ':');
+    if (separator != nullptr)
+    {
+        nameLength = static_cast<size_t>(separator - Specification);
+        *Parameters = separator + 1;
+    }
+    else
+    {
+        nameLength = strlen(Specification);
+        *Parameters = nullptr;
+    }
+
+    //
+    // Find the transport with a matching name
+    //
+    for (i = 0; i < (sizeof(TpmpTransports) / sizeof(TpmpTransports[0])); i++)
+    {
+        if ((strlen(TpmpTransports[i]->Name) == nameLength) &&
+            (strncmp(TpmpTransports[i]->Name, Specification, nameLength) == 0))
+        {
+            return TpmpTransports[i];
+        }
+    }
+    return nullptr;
+}
+
+char*
+TpmpCopyParameters (
+    const char* Parameters
+    )
+{
+    size_t length;
+    char* copy;
+
+    //
+    // Keep our own copy of the transport parameters, which are needed again
+    // when opening another handle on the same transport.
+    //
+    length = strlen(Parameters) + 1;
+    copy = static_cast<char*>(malloc(length));
+    if (copy != nullptr)
+    {
+        memcpy(copy, Parameters, length);
+    }
+    return copy;
+}
+
+bool
+TpmOpenTransport (
+    const char* Transport,
+    uintptr_t* TpmHandle
+    )
+{
+    const TPM_TRANSPORT* transport;
+    const char* parameters;
+    uint8_t transportKey[TPM_SHA256_DIGEST_SIZE];
+    const char* recordPath;
+    PTPM_CONTEXT context;
+
+    //
+    // Initialize for failure
+    //
+    *TpmHandle = 0;
+
+    //
+    // Use the OS TPM stack unless a transport was specified
+    //
+    if ((Transport == nullptr) || (Transport[0] == '\0'))
+    {
+        transport = &TpmOsTransport;
+        parameters = nullptr;
+    }
+    else
+    {
+        transport = TpmpLookupTransport(Transport, &parameters);
+        if (transport == nullptr)
+        {
+            return false;
+        }
+    }
+
+    //
+    // Allocate the context that will back the handle
+    //
+    context = static_cast<PTPM_CONTEXT>(calloc(1, sizeof(*context)));
+    if (context == nullptr)
+    {
+        return false;
+    }
+
+    //
+    // Open the transport itself, and remember which one it was, such that the
+    // properties cached for another transport are never used for this one.
+    //
+    if (Transport == nullptr)
+    {
+        Transport = "";
+    }
+    TpmSha256(reinterpret_cast<const uint8_t*>(Transport), strlen(Transport), transportKey);
+    memcpy(&context->TransportKey, transportKey, sizeof(context->TransportKey));
+    context->Transport = transport;
+    if (parameters != nullptr)
+    {
+        context->Parameters = TpmpCopyParameters(parameters);
+        if (context->Parameters == nullptr)
+        {
+            free(context);
+            return false;
+        }
+    }
+    if (transport->Open(parameters, &context->TransportHandle) == false)
+    {
+        free(context->Parameters);
+        free(context);
+        return false;
+    }
+
+    //
+    // Allocate a default-sized arena, which is enough to query the TPM
+    //
+    if (TpmpAllocateArena(context,
+                          TPM_ARENA_DEFAULT_SIZE,
+                          TPM_ARENA_DEFAULT_SIZE) == false)
+    {
+        transport->Close(context->TransportHandle);
+        free(context->Parameters);
+        free(context);
+        return false;
+    }
+
+    //
+    // Return a handle that can be used for further commands
+    //
+    *TpmHandle = reinterpret_cast<uintptr_t>(context);
+
+    //
+    // Start recording right away if the environment asks for it, which also
+    // queries the limits of the TPM. Otherwise, query them now in order to
+    // size the arena to what the TPM can actually handle. A replayed capture
+    // only answers the commands it recorded, so it never uses the cache.
+    //
+    recordPath = getenv(TPM_RECORD_VARIABLE);
+    if ((recordPath != nullptr) && (recordPath[0] != '\0'))
+    {
+        if (TpmRecordTransport(*TpmHandle, recordPath) == false)
+        {
+            TpmOsClose(*TpmHandle);
+            *TpmHandle = 0;
+            return false;
+        }
+    }
+    else
+    {
+        TpmpQueryLimits(context, (transport != &TpmReplayTransport));
+    }
+    return true;
+}
+
+bool
+TpmRecordTransport (
+    uintptr_t TpmHandle,
+    const char* Path
+    )
+{
+    PTPM_CONTEXT context;
+
+    //
+    // Replace any capture that was already in progress
+    //
+    context = reinterpret_cast<PTPM_CONTEXT>(TpmHandle);
+    if (context->Recorder != 0)
+    {
+        TpmTapClose(context->Recorder);
+        context->Recorder = 0;
+    }
+    if (TpmTapOpen(Path, &context->Recorder) == false)
+    {
+        return false;
+    }
+
+    //
+    // Query the limits of the TPM again, without the cache, so that the capture
+    // has the whole discovery too and a replay of it sizes its commands the
+    // same way.
+    //
+    TpmpQueryLimits(context, false);
+    return true;
+}
+
+bool
+TpmOsOpenSibling (
+    PTPM_CONTEXT Context,
+    uintptr_t* TpmHandle
+    )
+{
+    PTPM_CONTEXT context;
+
+    //
+    // Initialize for failure
+    //
+    *TpmHandle = 0;
+
+    //
+    // Open the same transport again, with the same parameters
+    //
+    context = static_cast<PTPM_CONTEXT>(calloc(1, sizeof(*context)));
+    if (context == nullptr)
+    {
+        return false;
+    }
+    context->Transport = Context->Transport;
+    if (Context->Parameters != nullptr)
+    {
+        context->Parameters = TpmpCopyParameters(Context->Parameters);
+        if (context->Parameters == nullptr)
+        {
+            free(context);
+            return false;
+        }
+    }
+    if (context->Transport->Open(context->Parameters, &context->TransportHandle) == false)
+    {
+        free(context->Parameters);
+        free(context);
+        return false;
+    }
+
+    //
+    // It talks to the same TPM, so it has the same limits and properties. It
+    // does not have a cache of its own, which stays with the original handle.
+    //
+    if (TpmpAllocateArena(context,
+                          Context->CommandBufferSize,
+                          Context->ResponseBufferSize) == false)
+    {
+        context->Transport->Close(context->TransportHandle);
+        free(context->Parameters);
+        free(context);
+        return false;
+    }
+    context->NvBufferMax = Context->NvBufferMax;
+    context->TransportKey = Context->TransportKey;
+    context->PropertiesValid = Context->PropertiesValid;
+    context->Properties = Context->Properties;
+
+    //
+    // Return a handle that can be used for further commands
+    //
+    *TpmHandle = reinterpret_cast<uintptr_t>(context);
+    return true;
+}
+
+bool
+TpmOsOpen (
+    uintptr_t* TpmHandle
+    )
+{
+    //
+    // Use whichever transport the environment selects, if any
+    //
+    return TpmOpenTransport(getenv(TPM_TRANSPORT_VARIABLE), TpmHandle);
+}
+
+bool
+TpmpGatherSegments (
+    PTPM_CONTEXT Context,
+    const TPM_COMMAND_SEGMENT* Segments,
+    uint32_t SegmentCount,
+    uint8_t** Command,
+    uint32_t* CommandSize
+    )
+{
+    uint8_t* command;
+    uint32_t capacity;
+    uint32_t offset;
+    uint32_t i;
+
+    //
+    // A command built further along the command buffer is gathered where it
+    // starts, so that any other command already built in front of it is left
+    // alone.
+    //
+    command = Context->CommandBuffer;
+    if ((Segments[0].Buffer > Context->CommandBuffer) &&
+        (Segments[0].Buffer < (Context->CommandBuffer + Context->CommandBufferSize)))
+    {
+        command = const_cast<uint8_t*>(Segments[0].Buffer);
+    }
+    capacity = static_cast<uint32_t>(Context->CommandBuffer +
+                                     Context->CommandBufferSize -
+                                     command);
+
+    //
+    // The whole command must fit in what is left of the command buffer
+    //
+    offset = 0;
+    for (i = 0; i < SegmentCount; i++)
+    {
+        if (Segments[i].Length > (capacity - offset))
+        {
+            return false;
+        }
+        offset += Segments[i].Length;
+    }
+    *Command = command;
+    *CommandSize = offset;
+
+    //
+    // Segments coming from the command buffer are in order, and can only move
+    // further along it, so place each one starting from the last.
+    //
+    for (i = SegmentCount; i-- != 0; )
+    {
+        offset -= Segments[i].Length;
+        memmove(&command[offset], Segments[i].Buffer, Segments[i].Length);
+    }
+    return true;
+}
+
+bool
+TpmpDispatchCommand (
+    PTPM_CONTEXT Context,
+    const TPM_COMMAND_SEGMENT* Segments,
+    uint32_t SegmentCount,
+    uint8_t* Out,
+    uint32_t OutLength,
+    uint32_t* OsResult
+    )
+{
+    uint32_t commandSize;
+    uint8_t* command;
+
+    //
+    // Use the segments as-is if the transport can send them at once
+    //
+    if (Context->Transport->IssueCommandV != nullptr)
+    {
+        return Context->Transport->IssueCommandV(Context->TransportHandle,
+                                                 Segments,
+                                                 SegmentCount,
+                                                 Out,
+                                                 OutLength,
+                                                 OsResult);
+    }
+
+    //
+    // Otherwise, the command must be in a single buffer
+    //
+    if (SegmentCount == 1)
+    {
+        return Context->Transport->IssueCommand(Context->TransportHandle,
+                                                const_cast<uint8_t*>(Segments[0].Buffer),
+                                                Segments[0].Length,
+                                                Out,
+                                                OutLength,
+                                                OsResult);
+    }
+    if (TpmpGatherSegments(Context, Segments, SegmentCount, &command, &commandSize) == false)
+    {
+        if (OsResult != nullptr)
+        {
+            *OsResult = ERANGE;
+        }
+        return false;
+    }
+    return Context->Transport->IssueCommand(Context->TransportHandle,
+                                            command,
+                                            commandSize,
+                                            Out,
+                                            OutLength,
+                                            OsResult);
+}
+
+void
+TpmpRecordPending (
+    PTPM_CONTEXT Context,
+    uint8_t* Out,
+    uint32_t OutLength,
+    bool Result,
+    uint32_t OsResult
+    )
+{
+    uint64_t roundTrip;
+
+    //
+    // Save the command that was pending, its response, and how long it took
+    //
+    roundTrip = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count()) -
+        Context->PendingStartTime;
+    TpmTapRecord(Context->Recorder,
+                 Context->PendingTimestamp,
+                 static_cast<uint32_t>(roundTrip),
+                 Context->PendingSegments,
+                 Context->PendingCount,
+                 Out,
+                 OutLength,
+                 Result,
+                 OsResult);
+}
+
+bool
+TpmOsSubmitCommand (
+    uintptr_t TpmHandle,
+    const TPM_COMMAND_SEGMENT* Segments,
+    uint32_t SegmentCount,
+    uint32_t* OsResult
+    )
+{
+    const TPM_COMMAND_SEGMENT* segments;
+    TPM_COMMAND_SEGMENT segment;
+    PTPM_CONTEXT context;
+    uint32_t osResult;
+    uint8_t* command;
+    bool result;
+    uint32_t i;
+
+    //
+    // Only one command can be in flight at a time
+    //
+    context = reinterpret_cast<PTPM_CONTEXT>(TpmHandle);
+    if ((context->PendingCount != 0) ||
+        (SegmentCount == 0) ||
+        (SegmentCount > TPM_MAX_COMMAND_SEGMENTS))
+    {
+        if (OsResult != nullptr)
+        {
+            *OsResult = EBUSY;
+        }
+        return false;
+    }
+
+    //
+    // Remember the command until its response is received. The segments must
+    // stay valid until then.
+    //
+    for (i = 0; i < SegmentCount; i++)
+    {
+        context->PendingSegments[i] = Segments[i];
+    }
+    context->PendingCount = SegmentCount;
+    if (context->Recorder != 0)
+    {
+        context->PendingTimestamp = static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count());
+        context->PendingStartTime = static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+
+    //
+    // Transports that cannot queue commands will execute it once the response
+    // is asked for.
+    //
+    if (context->Transport->Submit == nullptr)
+    {
+        return true;
+    }
+
+    //
+    // Otherwise, send it right away, gathering the segments first if needed
+    //
+    segments = Segments;
+    if ((SegmentCount > 1) && (context->Transport->IssueCommandV == nullptr))
+    {
+        if (TpmpGatherSegments(context,
+                               Segments,
+                               SegmentCount,
+                               &command,
+                               &segment.Length) == false)
+        {
+            osResult = ERANGE;
+            result = false;
+            goto Exit;
+        }
+        segment.Buffer = command;
+        segments = &segment;
+        SegmentCount = 1;
+    }
+    osResult = 0;
+    result = context->Transport->Submit(context->TransportHandle,
+                                        segments,
+                                        SegmentCount,
+                                        &osResult);
+
+Exit:
+    //
+    // A command that could not be sent has no response to wait for
+    //
+    if (result == false)
+    {
+        if (context->Recorder != 0)
+        {
+            TpmpRecordPending(context, nullptr, 0, result, osResult);
+        }
+        context->PendingCount = 0;
+    }
+    if (OsResult != nullptr)
+    {
+        *OsResult = osResult;
+    }
+    return result;
+}
+
+bool
+TpmOsReceiveResponse (
+    uintptr_t TpmHandle,
+    uint8_t* Out,
+    uint32_t OutLength,
+    uint32_t* OsResult
+    )
+{
+    PTPM_CONTEXT context;
+    uint32_t osResult;
+    bool result;
+
+    //
+    // There must be a command in flight
+    //
+    context = reinterpret_cast<PTPM_CONTEXT>(TpmHandle);
+    if (context->PendingCount == 0)
+    {
+        if (OsResult != nullptr)
+        {
+            *OsResult = EINVAL;
+        }
+        return false;
+    }
+
+    //
+    // Either wait for the response of the queued command, or execute it now
+    //
+    osResult = 0;
+    if (context->Transport->Receive != nullptr)
+    {
+        result = context->Transport->Receive(context->TransportHandle,
+                                             Out,
+                                             OutLength,
+                                             &osResult);
+    }
+    else
+    {
+        result = TpmpDispatchCommand(context,
+                                     context->PendingSegments,
+                                     context->PendingCount,
+                                     Out,
+                                     OutLength,
+                                     &osResult);
+    }
+
+    //
+    // When recording, save the command and response
+    //
+    if (context->Recorder != 0)
+    {
+        TpmpRecordPending(context, Out, OutLength, result, osResult);
+    }
+    context->PendingCount = 0;
+    if (OsResult != nullptr)
+    {
+        *OsResult = osResult;
+    }
+    return result;
+}
+
+bool
+TpmOsIssueCommandV (
+    uintptr_t TpmHandle,
+    const TPM_COMMAND_SEGMENT* Segments,
+    uint32_t SegmentCount,
+    uint8_t* Out,
+    uint32_t OutLength,
+    uint32_t* OsResult
+    )
+{
+    //
+    // Send the command through the transport backing this handle, and wait
+    // for its response
+    //
+    if (TpmOsSubmitCommand(TpmHandle, Segments, SegmentCount, OsResult) == false)
+    {
+        return false;
+    }
+    return TpmOsReceiveResponse(TpmHandle, Out, OutLength, OsResult);
+}
+
+bool
+TpmOsIssueCommand (
+    uintptr_t TpmHandle,
+    uint8_t* In,
+    uint32_t InLength,
+    uint8_t* Out,
+    uint32_t OutLength,
+    uint32_t* OsResult
+    )
+{
+    TPM_COMMAND_SEGMENT segment;
+
+    //
+    // A contiguous command is simply made up of a single segment
+    //
+    segment.Buffer = In;
+    segment.Length = InLength;
+    return TpmOsIssueCommandV(TpmHandle, &segment, 1, Out, OutLength, OsResult);
+}
+
+bool
+TpmOsClose (
+    uintptr_t TpmHandle
+    )
+{
+    PTPM_CONTEXT context;
+    bool result;
+
+    //
+    // Save the NV public areas that changed, finish any capture, then close
+    // the transport and free the context.
+    //
+    context = reinterpret_cast<PTPM_CONTEXT>(TpmHandle);
+    if (context->NvCacheDirty != false)
+    {
+        TpmPropSave(context);
+    }
+    result = true;
+    if (context->Recorder != 0)
+    {
+        result = TpmTapClose(context->Recorder);
+    }
+    result = context->Transport->Close(context->TransportHandle) && result;
+    OsFreePages(context->CommandBuffer, context->ArenaSize);
+    free(context->Parameters);
+    free(context);
+    return result;
+}